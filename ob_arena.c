@@ -0,0 +1,202 @@
+/*****************************************************************************
+ *
+ *     ob_arena.c
+ *
+ *   Description: Per thread memory for new users.  Every thread that creates
+ *                users gets its own arena and carves the users out of big
+ *                chunks, so threads signing users up at the same time never
+ *                meet in malloc.  Arena memory lives until the book goes away.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Every piece handed out is a multiple of this, so it is aligned for anything.
+#define ARENA_ALIGN 16
+//_____________________________________________________________________________
+//                                                            Private Functions
+static ob_arena *arena_owner(obsess_book_cb *cb);
+static void arena_owner_exit(void *arg);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_arena_init
+ *
+ * Description:   Set up the arenas of a book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       int 0 - arenas set up, non zero on error.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+int ob_arena_init(obsess_book_cb *cb)
+{
+   cb->arenas = NULL;
+   if(pthread_key_create(&cb->arena_key,arena_owner_exit) != 0)
+   {
+      return 1;
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      ob_arena_free
+ *
+ * Description:   Free the arenas of a book and everything carved out of them.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Nobody may be using the book.
+ *
+ *****************************************************************************/
+void ob_arena_free(obsess_book_cb *cb)
+{
+   ob_arena *a;
+   ob_chunk *c;
+
+   pthread_setspecific(cb->arena_key,NULL);
+   pthread_key_delete(cb->arena_key);
+   while((a = cb->arenas) != NULL)
+   {
+      cb->arenas = a->next;
+      while((c = a->chunks) != NULL)
+      {
+         a->chunks = c->next;
+         free(c);
+      }
+      free(a);
+   }
+}
+
+/******************************************************************************
+ * Function:      ob_arena_alloc
+ *
+ * Description:   Get memory from the arena of the calling thread.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                size_t size - number of bytes.
+ *
+ * Returns:       void* - the memory or NULL if there is no memory.
+ *
+ * Notes:         The memory can not be freed on its own, it goes when the
+ *                book goes.  Pieces bigger than a chunk get a chunk of their
+ *                own.
+ *
+ *****************************************************************************/
+void *ob_arena_alloc(obsess_book_cb *cb, size_t size)
+{
+   ob_arena *a;
+   ob_chunk *c;
+   size_t len;
+   void *ptr;
+
+   a = pthread_getspecific(cb->arena_key);
+   if(a == NULL)
+   {
+      a = arena_owner(cb);
+      if(a == NULL)
+      {
+         return NULL;
+      }
+   }
+
+   size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+   if(a->pos == NULL || (size_t)(a->end - a->pos) < size)
+   {//Chunk is used up, start a new one.
+      len = size > cb->arena_chunk ? size : cb->arena_chunk;
+      c = malloc(sizeof(ob_chunk) + len);
+      if(c == NULL)
+      {
+         return NULL;
+      }
+      c->next = a->chunks;
+      c->size = len;
+      a->chunks = c;
+      a->pos = c->data;
+      a->end = c->data + len;
+   }
+   ptr = a->pos;
+   a->pos += size;
+
+   return ptr;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      arena_owner
+ *
+ * Description:   Get an arena for the calling thread.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       ob_arena* - the arena or NULL if there is no memory.
+ *
+ * Notes:         Arenas of threads that exited are taken over, what is left
+ *                of their last chunk is used up first.
+ *
+ *****************************************************************************/
+static ob_arena *arena_owner(obsess_book_cb *cb)
+{
+   ob_arena *a;
+
+   //Try to take over the arena of a thread that exited.
+   for(a = __atomic_load_n(&cb->arenas,__ATOMIC_ACQUIRE); a != NULL; a = a->next)
+   {
+      if(__atomic_load_n(&a->idle,__ATOMIC_RELAXED) &&
+         __sync_bool_compare_and_swap(&a->idle,1,0))
+      {
+         break;
+      }
+   }
+
+   if(a == NULL)
+   {
+      a = calloc(1,sizeof(ob_arena));
+      if(a == NULL)
+      {
+         return NULL;
+      }
+      do
+      {
+         a->next = __atomic_load_n(&cb->arenas,__ATOMIC_ACQUIRE);
+      }while(!__sync_bool_compare_and_swap(&cb->arenas,a->next,a));
+   }
+
+   pthread_setspecific(cb->arena_key,a);
+   return a;
+}
+
+/******************************************************************************
+ * Function:      arena_owner_exit
+ *
+ * Description:   Hand the arena of an exiting thread back.
+ *
+ * Params:        void *arg - pointer to the arena.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Called by pthreads when the thread exits.
+ *
+ *****************************************************************************/
+static void arena_owner_exit(void *arg)
+{
+   ob_arena *a = arg;
+
+   __atomic_store_n(&a->idle,1,__ATOMIC_RELEASE);
+}
@@ -0,0 +1,365 @@
+/*****************************************************************************
+ *
+ *     ob_bloom.c
+ *
+ *   Description: Filter of the names in the book.  Most lookups of names that
+ *                are not in the book are turned away by the filter without
+ *                walking a bucket.  The filter is a blocked Bloom filter, the
+ *                bits of a name all sit in one cache line, so a check costs
+ *                one cache miss.  Names are added as users are created, the
+ *                filter is built again twice as big once it holds more names
+ *                than it was sized for.  Deleted users stay in the filter
+ *                until it is built again.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Fewest names a filter is sized for.
+#define BLOOM_MIN_NAMES 4096
+
+//Most bits a name sets.
+#define BLOOM_MAX_K 16
+//_____________________________________________________________________________
+//                                                            Private Functions
+static ob_bloom *bloom_new(long cap, double rate);
+static int bloom_set(ob_bloom *f, unsigned int hash);
+static user_ret_code bloom_rebuild(obsess_book_cb *cb, double rate);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_name_filter
+ *
+ * Description:   Set the false positive rate of the name filter.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                double rate - share of the names not in the book that get
+ *                              past the filter, between 0 and 1.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - filter built again.
+ *                              USER_INVALID_PARAMER - bad parameter.
+ *                              USER_NO_MEM - no memory, the old filter is
+ *                                            kept.
+ *
+ * Notes:         The rate holds while the filter is full, it is lower until
+ *                then.  A lower rate takes more bits per name, 1% takes about
+ *                10 and 0.1% about 15.
+ *
+ *****************************************************************************/
+user_ret_code ob_name_filter(obsess_book_cb *cb, double rate)
+{
+   user_ret_code rc;
+
+   if(cb == NULL || !(rate > 0.0 && rate < 1.0))
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   pthread_mutex_lock(&cb->bloom_lock);
+   rc = bloom_rebuild(cb,rate);
+   if(rc == USER_SUCCESS)
+   {
+      cb->bloom_rate = rate;
+   }
+   pthread_mutex_unlock(&cb->bloom_lock);
+
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_name_filter_rate
+ *
+ * Description:   Expected false positive rate of the name filter as it is.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       double - share of the names not in the book that get past the
+ *                         filter, -1 on a bad parameter.
+ *
+ * Notes:         The names per block follow a Poisson distribution, the rate
+ *                is averaged over it.  Names of deleted users still count.
+ *
+ *****************************************************************************/
+double ob_name_filter_rate(obsess_book_cb *cb)
+{
+   ob_bloom *f;
+   double load;
+   double pj;
+   double rate = 0.0;
+   long j;
+
+   if(cb == NULL)
+   {
+      return -1.0;
+   }
+   f = __atomic_load_n(&cb->bloom,__ATOMIC_ACQUIRE);
+   load = (double)__atomic_load_n(&f->names,__ATOMIC_RELAXED) / f->blocks;
+
+   //P(j names in the block) times the chance all k bits are set by them.
+   pj = exp(-load);
+   for(j = 0; j < 64 || j < load * 4; j++)
+   {
+      rate += pj * pow(1.0 - pow(1.0 - 1.0 / OB_BLOOM_BITS,(double)f->k * j),
+                       f->k);
+      pj *= load / (j + 1);
+   }
+   return rate;
+}
+
+/******************************************************************************
+ * Function:      ob_bloom_init
+ *
+ * Description:   Set up the name filter of a new book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                long names - names expected, 0 if not known.
+ *
+ * Returns:       int 0 - filter set up, non zero on error.
+ *
+ * Notes:         A filter sized for the names expected does not grow while
+ *                they are added.
+ *
+ *****************************************************************************/
+int ob_bloom_init(obsess_book_cb *cb, long names)
+{
+   cb->bloom_rate = OB_BLOOM_RATE;
+   cb->bloom = bloom_new(names > BLOOM_MIN_NAMES ? names : BLOOM_MIN_NAMES,
+                         cb->bloom_rate);
+   if(cb->bloom == NULL)
+   {
+      return 1;
+   }
+   pthread_mutex_init(&cb->bloom_lock,NULL);
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      ob_bloom_free
+ *
+ * Description:   Free the name filter and the filters it replaced.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Nobody may be using the book.
+ *
+ *****************************************************************************/
+void ob_bloom_free(obsess_book_cb *cb)
+{
+   ob_bloom *f;
+
+   while((f = cb->bloom) != NULL)
+   {
+      cb->bloom = f->old;
+      free(f->bits);
+      free(f);
+   }
+   pthread_mutex_destroy(&cb->bloom_lock);
+}
+
+/******************************************************************************
+ * Function:      ob_bloom_add
+ *
+ * Description:   Add a name to the filter.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                unsigned int hash - ob_name_hash of the name.
+ *
+ * Returns:       int - non zero if the filter is over its size, call
+ *                      ob_bloom_grow once the bucket lock is let go.
+ *
+ * Notes:         Caller holds the lock of the bucket the name goes into and
+ *                adds the name before the user is put in the bucket, so a
+ *                reader that finds the user also finds the name.
+ *
+ *****************************************************************************/
+int ob_bloom_add(obsess_book_cb *cb, unsigned int hash)
+{
+   //The filter only changes under every bucket lock.
+   return bloom_set(cb->bloom,hash);
+}
+
+/******************************************************************************
+ * Function:      ob_bloom_grow
+ *
+ * Description:   Build the filter again, sized for twice the names it holds.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Without memory the filter is kept as it is, it only lets
+ *                more names through.
+ *
+ *****************************************************************************/
+void ob_bloom_grow(obsess_book_cb *cb)
+{
+   ob_bloom *f;
+
+   pthread_mutex_lock(&cb->bloom_lock);
+   f = cb->bloom;
+   if(__atomic_load_n(&f->names,__ATOMIC_RELAXED) > f->cap &&
+      bloom_rebuild(cb,cb->bloom_rate) != USER_SUCCESS)
+   {//Try again once it doubled.
+      __atomic_store_n(&f->cap,f->cap * 2,__ATOMIC_RELAXED);
+   }
+   pthread_mutex_unlock(&cb->bloom_lock);
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      bloom_new
+ *
+ * Description:   Allocate an empty filter.
+ *
+ * Params:        long cap - names the filter is sized for.
+ *                double rate - false positive rate once it holds cap names.
+ *
+ * Returns:       ob_bloom* - the filter, NULL if there is no memory.
+ *
+ * Notes:         A name sets k = bits per name * ln 2 bits, the blocks are
+ *                aligned to cache lines.
+ *
+ *****************************************************************************/
+static ob_bloom *bloom_new(long cap, double rate)
+{
+   ob_bloom *f;
+   double bits = -log(rate) / (M_LN2 * M_LN2);
+   void *mem;
+
+   f = malloc(sizeof(ob_bloom));
+   if(f == NULL)
+   {
+      return NULL;
+   }
+   f->old = NULL;
+   f->cap = cap < BLOOM_MIN_NAMES ? BLOOM_MIN_NAMES : cap;
+   f->names = 0;
+   f->k = (int)(bits * M_LN2 + 0.5);
+   f->k = f->k < 1 ? 1 : f->k > BLOOM_MAX_K ? BLOOM_MAX_K : f->k;
+   f->blocks = (unsigned long)(f->cap * bits / OB_BLOOM_BITS) + 1;
+   if(posix_memalign(&mem,OB_BLOOM_WORDS * sizeof(unsigned long long),
+                     f->blocks * OB_BLOOM_WORDS * sizeof(unsigned long long)) != 0)
+   {
+      free(f);
+      return NULL;
+   }
+   f->bits = mem;
+   memset(f->bits,0,f->blocks * OB_BLOOM_WORDS * sizeof(unsigned long long));
+   return f;
+}
+
+/******************************************************************************
+ * Function:      bloom_set
+ *
+ * Description:   Set the bits of a name.
+ *
+ * Params:        ob_bloom *f - the filter.
+ *                unsigned int hash - ob_name_hash of the name.
+ *
+ * Returns:       int - non zero if the filter is over its size.
+ *
+ * Notes:         The k bits are picked inside the block of the name by
+ *                ob_bloom_bit, the same way ob_bloom_maybe checks them.
+ *
+ *****************************************************************************/
+static int bloom_set(ob_bloom *f, unsigned int hash)
+{
+   unsigned long long *block;
+   unsigned long long h = ob_bloom_mix(hash);
+   unsigned int bit;
+   int i;
+
+   block = f->bits + ob_bloom_block(f,h) * OB_BLOOM_WORDS;
+   for(i = 0; i < f->k; i++)
+   {
+      bit = ob_bloom_bit(&h);
+      __atomic_fetch_or(&block[bit / 64],1ULL << (bit % 64),__ATOMIC_RELAXED);
+   }
+   return __atomic_add_fetch(&f->names,1,__ATOMIC_RELAXED) >
+          __atomic_load_n(&f->cap,__ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+ * Function:      bloom_rebuild
+ *
+ * Description:   Build a new filter of every name in the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                double rate - false positive rate of the new filter.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - new filter in use.
+ *                              USER_NO_MEM - no memory, the old one is kept.
+ *
+ * Notes:         Caller holds the bloom lock.  Every bucket lock is taken so
+ *                no user is created while the names are gathered, readers go
+ *                on with the old filter until the new one is published.  The
+ *                names are taken from the user directory, a user waiting for
+ *                its bucket lock is not in it yet and adds itself after.  The
+ *                old filter is freed with the book since readers never say
+ *                when they are done with it, the old ones add up to less than
+ *                the new one.
+ *
+ *****************************************************************************/
+static user_ret_code bloom_rebuild(obsess_book_cb *cb, double rate)
+{
+   user_ret_code rc = USER_SUCCESS;
+   ob_bloom *f;
+   user *usr;
+   long users;
+   long names = 0;
+   long id;
+   int i;
+
+   for(i = 0; i < OB_BUCKET_LOCKS; i++)
+   {
+      pthread_mutex_lock(&cb->bucket_lock[i]);
+   }
+
+   //Users only go into the directory under their bucket lock.
+   users = ob_user_count(cb);
+   for(id = 0; id < users; id++)
+   {
+      names += ob_user_at(cb,id) != NULL;
+   }
+   f = bloom_new(names * 2,rate);
+   if(f == NULL)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_rebuild_0;
+   }
+   for(id = 0; id < users; id++)
+   {
+      usr = ob_user_at(cb,id);
+      if(usr != NULL)
+      {
+         bloom_set(f,usr->node->hash);
+      }
+   }
+
+   //Readers that pick up the new filter see every bit of it.
+   f->old = cb->bloom;
+   __atomic_store_n(&cb->bloom,f,__ATOMIC_RELEASE);
+
+EXIT_rebuild_0:
+   for(i = OB_BUCKET_LOCKS - 1; i >= 0; i--)
+   {
+      pthread_mutex_unlock(&cb->bucket_lock[i]);
+   }
+   return rc;
+}
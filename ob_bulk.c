@@ -0,0 +1,703 @@
+/*****************************************************************************
+ *
+ *     ob_bulk.c
+ *
+ *   Description: Bulk load of users and BFFs.  Filling a fresh book one
+ *                ob_new_user and one ob_add_BFF at a time runs on a single
+ *                core and scans a BFF list for every pair.  The load here is
+ *                staged instead:
+ *                1. The users are created by all the threads at once.
+ *                2. The BFF pairs are looked up by name and bucketed by the
+ *                   user_ID range of each end, every chunk of pairs writing
+ *                   its own slice of the buckets.
+ *                3. Every range is merged into the BFF lists of its users,
+ *                   sorted and without duplicates, one range per thread.
+ *                Pairs come in batches, and stage 3 of one batch runs on a
+ *                thread of its own while stage 2 of the next one runs.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Number of users created at a time by a thread.
+#define BULK_USER_GRAIN 1024
+
+//Number of pairs looked up at a time by a thread.
+#define BULK_GRAIN 4096
+
+//Number of pairs whose names are looked up in one ob_find_users batch.
+#define BULK_FIND 256
+
+//Number of pairs in a batch.
+#define BULK_BATCH (1L << 22)
+
+//Fewest user_IDs in a range.
+#define BULK_MIN_SPAN 1024
+
+//Number of ranges per thread, more ranges balance skewed BFF counts better.
+#define BULK_RANGES_PER_THREAD 8
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Stage 1, the users to create.
+typedef struct _bulk_users
+{
+   obsess_book_cb     *cb;
+   const ob_bulk_user *users;
+   int                 rc;       //Code of the first user that could not be
+                                 //created, USER_SUCCESS if none.
+}bulk_users;
+
+//Stage 2 and 3, one batch of pairs.
+typedef struct _bulk_batch
+{
+   obsess_book_cb     *cb;
+   const ob_bulk_edge *edges;    //Pairs of the batch.
+   long                n;        //Number of pairs.
+   long                chunks;   //Number of BULK_GRAIN chunks of pairs.
+   long                span;     //Number of user_IDs per range.
+   int                 ranges;   //Number of ranges, the last one is open ended.
+   int                *pair;     //user_IDs of each pair, -1 if not found.
+   long               *slot;     //Next slot of each chunk in each range.
+   long               *start;    //First slot of each range.
+   int                *src;      //User each slot adds a BFF to.
+   int                *dst;      //The BFF each slot adds.
+   long                added;    //Pairs that were not BFFs before.
+   int                 failed;   //Non zero if a BFF list could not be grown.
+   pthread_t           thread;   //Thread running stage 3.
+}bulk_batch;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static void bulk_create(void *ctx, long begin, long end);
+static user_ret_code bulk_split(bulk_batch *b);
+static void bulk_resolve(void *ctx, long begin, long end);
+static void bulk_scatter(void *ctx, long begin, long end);
+static void *bulk_build(void *arg);
+static void bulk_merge(void *ctx, long begin, long end);
+static int bulk_range(bulk_batch *b, int id);
+static int bulk_cmp(const void *a, const void *b);
+static void bulk_batch_free(bulk_batch *b);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_bulk_load
+ *
+ * Description:   Add a lot of users and BFF pairs to the book at once.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const ob_bulk_user *users - users to create, may be NULL.
+ *                long n_users - number of users.
+ *                const ob_bulk_edge *edges - BFF pairs to add by name, may be
+ *                                            NULL.  The names can be users
+ *                                            of this load or users already in
+ *                                            the book.
+ *                long n_edges - number of pairs.
+ *
+ * Returns:       long >= 0 - number of BFF pairs added.
+ *                -USER_INVALID_PARAMER - bad parameter, or a user without a
+ *                                        name or account handle or with one
+ *                                        longer than OB_NAME_MAX, the other
+ *                                        users are created, no pair is added.
+ *                -USER_NO_MEM - not enough memory, the load is partly done.
+ *                -USER_IO_ERROR - loaded, but the journal could not write it.
+ *
+ * Notes:         Pairs that are already BFFs, pairs of a user with itself
+ *                and pairs with a name that is not in the book are skipped
+ *                without a message.  Readers can keep reading the book while
+ *                it loads.  With a journal that waits, the load waits for
+ *                the journal once at the end.
+ *
+ *****************************************************************************/
+long ob_bulk_load(obsess_book_cb *cb, const ob_bulk_user *users, long n_users,
+                  const ob_bulk_edge *edges, long n_edges)
+{
+   bulk_users stage1;
+   bulk_batch *b;
+   bulk_batch *prev = NULL;      //Batch still in stage 3.
+   long added = 0;
+   long first;
+   int rc = USER_SUCCESS;
+
+   if(cb == NULL || n_users < 0 || n_edges < 0 ||
+      (users == NULL && n_users > 0) || (edges == NULL && n_edges > 0))
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   //Stage 1, create the users.
+   stage1.cb = cb;
+   stage1.users = users;
+   stage1.rc = USER_SUCCESS;
+   ob_parallel_for(cb,n_users,BULK_USER_GRAIN,bulk_create,&stage1);
+   if(stage1.rc != USER_SUCCESS)
+   {
+      return stage1.rc;
+   }
+
+   for(first = 0; first < n_edges && rc == USER_SUCCESS; first += BULK_BATCH)
+   {
+      b = calloc(1,sizeof(bulk_batch));
+      if(b == NULL)
+      {
+         rc = -USER_NO_MEM;
+         break;
+      }
+      b->cb = cb;
+      b->edges = edges + first;
+      b->n = n_edges - first < BULK_BATCH ? n_edges - first : BULK_BATCH;
+
+      //Stage 2, look the pairs up while the batch before is merged.
+      rc = bulk_split(b);
+
+      //Only one batch is merged at a time.
+      if(prev != NULL)
+      {
+         pthread_join(prev->thread,NULL);
+         added += prev->added;
+         if(prev->failed)
+         {
+            rc = -USER_NO_MEM;
+         }
+         bulk_batch_free(prev);
+         prev = NULL;
+      }
+      if(rc != USER_SUCCESS)
+      {
+         bulk_batch_free(b);
+         break;
+      }
+
+      //Stage 3, merge the batch on a thread of its own.
+      if(pthread_create(&b->thread,NULL,bulk_build,b) == 0)
+      {
+         prev = b;
+      }
+      else
+      {
+         bulk_build(b);
+         added += b->added;
+         if(b->failed)
+         {
+            rc = -USER_NO_MEM;
+         }
+         bulk_batch_free(b);
+      }
+   }
+
+   if(prev != NULL)
+   {
+      pthread_join(prev->thread,NULL);
+      added += prev->added;
+      if(prev->failed)
+      {
+         rc = -USER_NO_MEM;
+      }
+      bulk_batch_free(prev);
+   }
+   if(rc == USER_SUCCESS)
+   {
+      rc = ob_journal_wait(cb,ob_journal_position(cb));
+   }
+
+   return rc == USER_SUCCESS ? added : rc;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      bulk_create
+ *
+ * Description:   Stage 1, create a range of the users.
+ *
+ * Params:        void *ctx - the bulk_users.
+ *                long begin - first user.
+ *                long end - one past the last user.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Each thread carves its users out of its own arena.  Nobody
+ *                waits for the journal here, ob_bulk_load waits once at the
+ *                end.  The code of the first user that fails is kept.
+ *
+ *****************************************************************************/
+static void bulk_create(void *ctx, long begin, long end)
+{
+   bulk_users *s = ctx;
+   unsigned long ticket;
+   user_ret_code rc;
+   long i;
+
+   for(i = begin; i < end; i++)
+   {
+      if(ob_user_create(s->cb,s->users[i].name,s->users[i].account_handle,
+                        &ticket,&rc) == NULL)
+      {
+         __sync_bool_compare_and_swap(&s->rc,USER_SUCCESS,rc);
+      }
+   }
+}
+
+/******************************************************************************
+ * Function:      bulk_split
+ *
+ * Description:   Stage 2, look up the pairs of a batch and bucket them by
+ *                user_ID range.
+ *
+ * Params:        bulk_batch *b - the batch.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - batch bucketed.
+ *                              USER_NO_MEM - not enough memory.
+ *
+ * Notes:         Every pair adds a BFF to both of its users, so it goes into
+ *                the range of each end.  Chunks count their slots first and
+ *                then write them, so no two threads write the same slot.
+ *
+ *****************************************************************************/
+static user_ret_code bulk_split(bulk_batch *b)
+{
+   obsess_book_cb *cb = b->cb;
+   long users = ob_user_count(cb);
+   long total;
+   long next;
+   long c;
+   int r;
+
+   //Ranges are sized so every thread gets a few of them.
+   b->span = users / ((long)cb->threads * BULK_RANGES_PER_THREAD) + 1;
+   if(b->span < BULK_MIN_SPAN)
+   {
+      b->span = BULK_MIN_SPAN;
+   }
+   b->ranges = (int)((users + b->span - 1) / b->span);
+   if(b->ranges < 1)
+   {
+      b->ranges = 1;
+   }
+   b->chunks = (b->n + BULK_GRAIN - 1) / BULK_GRAIN;
+
+   b->pair = malloc(sizeof(int) * 2 * (b->n ? b->n : 1));
+   b->slot = calloc((size_t)b->chunks * b->ranges + 1,sizeof(long));
+   b->start = malloc(sizeof(long) * (b->ranges + 1));
+   if(b->pair == NULL || b->slot == NULL || b->start == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+
+   //Look the names up and count the slots of each chunk in each range.
+   ob_parallel_for(cb,b->chunks,1,bulk_resolve,b);
+
+   //Turn the counts into the first slot of each chunk in each range.
+   next = 0;
+   for(r = 0; r < b->ranges; r++)
+   {
+      b->start[r] = next;
+      for(c = 0; c < b->chunks; c++)
+      {
+         total = b->slot[c * b->ranges + r];
+         b->slot[c * b->ranges + r] = next;
+         next += total;
+      }
+   }
+   b->start[b->ranges] = next;
+
+   b->src = malloc(sizeof(int) * (next ? next : 1));
+   b->dst = malloc(sizeof(int) * (next ? next : 1));
+   if(b->src == NULL || b->dst == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   ob_parallel_for(cb,b->chunks,1,bulk_scatter,b);
+
+   //The names are no longer needed, unless the pairs are logged.
+   if(cb->journal == NULL)
+   {
+      free(b->pair);
+      b->pair = NULL;
+   }
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      bulk_resolve
+ *
+ * Description:   Look up the users of some chunks of pairs.
+ *
+ * Params:        void *ctx - the batch.
+ *                long begin - first chunk.
+ *                long end - one past the last chunk.
+ *
+ * Returns:       None.
+ *
+ * Notes:         The names are looked up BULK_FIND pairs at a time with
+ *                ob_find_users.
+ *
+ *****************************************************************************/
+static void bulk_resolve(void *ctx, long begin, long end)
+{
+   bulk_batch *b = ctx;
+   char *names[2 * BULK_FIND];   //Names of the pairs being looked up.
+   user *found[2 * BULK_FIND];   //Users of the names.
+   long *slot;
+   long last;
+   long c;
+   long e;
+   int m;
+   int i;
+   user *x;
+   user *y;
+
+   for(c = begin; c < end; c++)
+   {
+      slot = b->slot + c * b->ranges;
+      last = (c + 1) * BULK_GRAIN < b->n ? (c + 1) * BULK_GRAIN : b->n;
+      for(e = c * BULK_GRAIN; e < last; e += m)
+      {
+         m = last - e < BULK_FIND ? (int)(last - e) : BULK_FIND;
+         for(i = 0; i < m; i++)
+         {
+            names[2 * i] = b->edges[e + i].who;
+            names[2 * i + 1] = b->edges[e + i].bff;
+         }
+         ob_find_users(b->cb,names,2 * m,found);
+         for(i = 0; i < m; i++)
+         {
+            x = found[2 * i];
+            y = found[2 * i + 1];
+            if(x == NULL || y == NULL || x == y)
+            {
+               b->pair[2 * (e + i)] = -1;
+               continue;
+            }
+            b->pair[2 * (e + i)] = x->user_ID;
+            b->pair[2 * (e + i) + 1] = y->user_ID;
+            slot[bulk_range(b,x->user_ID)]++;
+            slot[bulk_range(b,y->user_ID)]++;
+         }
+      }
+   }
+}
+
+/******************************************************************************
+ * Function:      bulk_scatter
+ *
+ * Description:   Write the slots of some chunks of pairs.
+ *
+ * Params:        void *ctx - the batch.
+ *                long begin - first chunk.
+ *                long end - one past the last chunk.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void bulk_scatter(void *ctx, long begin, long end)
+{
+   bulk_batch *b = ctx;
+   long *slot;
+   long last;
+   long c;
+   long e;
+   long i;
+   int x;
+   int y;
+
+   for(c = begin; c < end; c++)
+   {
+      slot = b->slot + c * b->ranges;
+      last = (c + 1) * BULK_GRAIN < b->n ? (c + 1) * BULK_GRAIN : b->n;
+      for(e = c * BULK_GRAIN; e < last; e++)
+      {
+         x = b->pair[2 * e];
+         if(x < 0)
+         {
+            continue;
+         }
+         y = b->pair[2 * e + 1];
+         i = slot[bulk_range(b,x)]++;
+         b->src[i] = x;
+         b->dst[i] = y;
+         i = slot[bulk_range(b,y)]++;
+         b->src[i] = y;
+         b->dst[i] = x;
+      }
+   }
+}
+
+/******************************************************************************
+ * Function:      bulk_build
+ *
+ * Description:   Stage 3, merge a bucketed batch into the BFF lists.
+ *
+ * Params:        void *arg - the batch.
+ *
+ * Returns:       NULL.
+ *
+ * Notes:         Runs as a writer, the BFF lists are published the same way
+ *                ob_add_BFF publishes them.  The pairs are logged under the
+ *                write lock, in order with the other changes.
+ *
+ *****************************************************************************/
+static void *bulk_build(void *arg)
+{
+   bulk_batch *b = arg;
+   obsess_book_cb *cb = b->cb;
+
+   pthread_mutex_lock(&cb->write_lock);
+   ob_parallel_for(cb,b->ranges,1,bulk_merge,b);
+   if(b->pair != NULL)
+   {
+      ob_journal_log_edges(cb,b->edges,b->pair,b->n);
+   }
+   if(b->added > 0)
+   {
+      __atomic_store_n(&cb->bff_pairs,cb->bff_pairs + b->added,__ATOMIC_RELAXED);
+      //Too many pairs to fold into the sketches one at a time.
+      if(cb->reach != NULL)
+      {
+         ob_reach_invalidate(cb,b->added);
+      }
+      if(cb->oracle != NULL)
+      {
+         ob_landmark_add_BFF(cb,b->added,0);
+      }
+   }
+   pthread_mutex_unlock(&cb->write_lock);
+
+   return NULL;
+}
+
+/******************************************************************************
+ * Function:      bulk_merge
+ *
+ * Description:   Merge some ranges of a batch into the BFF lists.
+ *
+ * Params:        void *ctx - the batch.
+ *                long begin - first range.
+ *                long end - one past the last range.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Algorithm:
+ *                The slots of the range are counting sorted by user, then
+ *                every user with new BFFs gets a new list made of its old
+ *                BFFs and its new ones, sorted with duplicates dropped.  Only
+ *                this thread touches the users of the range.  A packed list
+ *                comes out plain, ob_pack_BFFs packs it again.
+ *
+ *****************************************************************************/
+static void bulk_merge(void *ctx, long begin, long end)
+{
+   bulk_batch *b = ctx;
+   ob_adj *old;
+   ob_adj *grown;
+   user *usr;
+   long *count = NULL;           //First new BFF of each user of the range.
+   int *bff = NULL;              //New BFFs of the range, by user.
+   ob_adj_iter it;               //Walk over the old BFFs of a user.
+   long added = 0;
+   long above;                   //Old BFFs of a user above the user.
+   long lo;
+   long hi;
+   long i;
+   long m;
+   long r;
+   int n;
+   int k;
+   int j;
+   int v;
+   int w;
+
+   for(r = begin; r < end; r++)
+   {
+      m = b->start[r + 1] - b->start[r];
+      if(m == 0)
+      {
+         continue;
+      }
+
+      //The last range also holds users added after the ranges were made.
+      lo = r * b->span;
+      hi = lo + b->span;
+      for(i = b->start[r]; i < b->start[r + 1]; i++)
+      {
+         if(b->src[i] >= hi)
+         {
+            hi = b->src[i] + 1;
+         }
+      }
+
+      count = calloc(hi - lo + 1,sizeof(long));
+      bff = malloc(sizeof(int) * m);
+      if(count == NULL || bff == NULL)
+      {
+         goto EXIT_bulk_merge_1;
+      }
+      for(i = b->start[r]; i < b->start[r + 1]; i++)
+      {
+         count[b->src[i] - lo + 1]++;
+      }
+      for(v = 0; v < hi - lo; v++)
+      {
+         count[v + 1] += count[v];
+      }
+      for(i = b->start[r]; i < b->start[r + 1]; i++)
+      {
+         bff[count[b->src[i] - lo]++] = b->dst[i];
+      }
+      //count[v] is now one past the new BFFs of lo + v, shift it back.
+      memmove(count + 1,count,sizeof(long) * (hi - lo));
+      count[0] = 0;
+
+      for(v = 0; v < hi - lo; v++)
+      {
+         k = (int)(count[v + 1] - count[v]);
+         if(k == 0)
+         {
+            continue;
+         }
+         usr = ob_user_at(b->cb,lo + v);
+         if(usr == NULL)
+         {//Deleted during the load.
+            continue;
+         }
+         old = *ob_adj_slot(usr);
+         grown = malloc(sizeof(ob_adj) + sizeof(int) * (ob_adj_live(old) + k));
+         if(grown == NULL)
+         {
+            goto EXIT_bulk_merge_1;
+         }
+         //The old BFFs, packed ones unpacked, then the new ones.
+         n = 0;
+         above = 0;
+         ob_adj_begin(&it,old);
+         while((w = ob_adj_next(&it)) >= 0)
+         {
+            grown->bff[n++] = w;
+            above += w > lo + v;
+         }
+         memcpy(grown->bff + n,bff + count[v],sizeof(int) * k);
+         qsort(grown->bff,n + k,sizeof(int),bulk_cmp);
+
+         //Drop the duplicates, the removed BFFs and the users deleted during
+         //the load, whatever is left past the old BFFs is new.
+         m = 0;
+         for(j = 0; j < n + k; j++)
+         {
+            if((m == 0 || grown->bff[m - 1] != grown->bff[j]) &&
+               ob_user_at(b->cb,grown->bff[j]) != NULL)
+            {
+               grown->bff[m++] = grown->bff[j];
+            }
+         }
+         if(m == n)
+         {//Nothing new.
+            free(grown);
+            continue;
+         }
+         added -= above;
+         for(j = 0; j < m; j++)
+         {//Every pair is counted at its lower end.
+            added += grown->bff[j] > lo + v;
+         }
+         grown->cap = n + k;
+         grown->count = (int)m;
+         grown->dead = 0;
+         grown->pack = NULL;
+         ob_snap_touch(b->cb,lo + v);
+         __atomic_store_n(ob_adj_slot(usr),grown,__ATOMIC_RELEASE);
+         if(old != NULL)
+         {
+            ob_pack_retire(b->cb,old->pack);
+         }
+         ob_epoch_retire(b->cb,old);
+      }
+      free(count);
+      free(bff);
+      count = NULL;
+      bff = NULL;
+   }
+   goto EXIT_bulk_merge_0;
+
+EXIT_bulk_merge_1:
+   free(count);
+   free(bff);
+   __atomic_store_n(&b->failed,1,__ATOMIC_RELAXED);
+EXIT_bulk_merge_0:
+   __sync_fetch_and_add(&b->added,added);
+}
+
+/******************************************************************************
+ * Function:      bulk_range
+ *
+ * Description:   Range of a user_ID.
+ *
+ * Params:        bulk_batch *b - the batch.
+ *                int id - the user_ID.
+ *
+ * Returns:       int - the range.
+ *
+ * Notes:         Users newer than the ranges go into the last one.
+ *
+ *****************************************************************************/
+static int bulk_range(bulk_batch *b, int id)
+{
+   long r = id / b->span;
+
+   return r < b->ranges ? (int)r : b->ranges - 1;
+}
+
+/******************************************************************************
+ * Function:      bulk_cmp
+ *
+ * Description:   qsort compare of 2 user_IDs.
+ *
+ * Params:        const void *a - first user_ID.
+ *                const void *b - second user_ID.
+ *
+ * Returns:       int - <0, 0 or >0 as a is below, equal to or above b.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int bulk_cmp(const void *a, const void *b)
+{
+   int x = *(const int*)a;
+   int y = *(const int*)b;
+
+   return (x > y) - (x < y);
+}
+
+/******************************************************************************
+ * Function:      bulk_batch_free
+ *
+ * Description:   Free a batch.
+ *
+ * Params:        bulk_batch *b - the batch.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void bulk_batch_free(bulk_batch *b)
+{
+   free(b->pair);
+   free(b->slot);
+   free(b->start);
+   free(b->src);
+   free(b->dst);
+   free(b);
+}
@@ -0,0 +1,117 @@
+/*****************************************************************************
+ *
+ *     ob_csr.c
+ *
+ *   Description: Compact copy of the BFF graph.  The BFFs of every user are
+ *                packed back to back into one array of user_IDs with an
+ *                offset per user, so kernels that run away from the book
+ *                (background threads, whole graph passes) have a private
+ *                and cache friendly copy to work on.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <stdlib.h>
+#include <string.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_csr_build
+ *
+ * Description:   Copy the BFF graph of the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       ob_csr* - the copy or NULL if there is no memory.
+ *
+ * Notes:         The BFFs of user v are adj[off[v]] to adj[off[v + 1] - 1].
+ *                Caller holds the write lock so the BFF lists hold still
+ *                while they are counted and copied.  Users added during the
+ *                copy have no BFFs yet and are left out, removed BFFs are
+ *                left out too.
+ *
+ *****************************************************************************/
+ob_csr *ob_csr_build(obsess_book_cb *cb)
+{
+   ob_csr *g;
+   ob_adj_iter it;
+   long edges = 0;
+   long id;
+   int w;
+
+   g = malloc(sizeof(ob_csr));
+   if(g == NULL)
+   {
+      goto EXIT_csr_build_0;
+   }
+   g->users = ob_user_count(cb);
+
+   //Count the BFFs to size the arrays.
+   for(id = 0; id < g->users; id++)
+   {
+      edges += ob_adj_live(ob_adj_of(cb,id));
+   }
+
+   g->off = malloc(sizeof(long) * (g->users + 1));
+   if(g->off == NULL)
+   {
+      goto EXIT_csr_build_1;
+   }
+   g->adj = malloc(sizeof(int) * (edges ? edges : 1));
+   if(g->adj == NULL)
+   {
+      goto EXIT_csr_build_2;
+   }
+
+   //Pack the BFFs.
+   edges = 0;
+   for(id = 0; id < g->users; id++)
+   {
+      ob_adj_begin(&it,ob_adj_of(cb,id));
+      g->off[id] = edges;
+      while((w = ob_adj_next(&it)) >= 0)
+      {
+         g->adj[edges++] = w;
+      }
+   }
+   g->off[g->users] = edges;
+
+   goto EXIT_csr_build_0;
+
+EXIT_csr_build_2:
+   free(g->off);
+EXIT_csr_build_1:
+   free(g);
+   g = NULL;
+EXIT_csr_build_0:
+   return g;
+}
+
+/******************************************************************************
+ * Function:      ob_csr_free
+ *
+ * Description:   Free a copy of the BFF graph.
+ *
+ * Params:        ob_csr *g - the copy, may be NULL.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+void ob_csr_free(ob_csr *g)
+{
+   if(g != NULL)
+   {
+      free(g->off);
+      free(g->adj);
+      free(g);
+   }
+}
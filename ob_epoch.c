@@ -0,0 +1,383 @@
+/*****************************************************************************
+ *
+ *     ob_epoch.c
+ *
+ *   Description: Epoch based reclamation.  Readers of the book never take a
+ *                lock, so memory a writer replaces (a BFF list that grew, a
+ *                removed user) can still be in use by a reader.  Each reading
+ *                thread announces the epoch it started reading in, retired
+ *                memory is tagged with the epoch it was retired in, and it is
+ *                only freed once every reader has moved 2 epochs past it.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                            Private Functions
+static ob_epoch_rec *epoch_reader(obsess_book_cb *cb);
+static void epoch_reader_exit(void *arg);
+static void epoch_advance(obsess_book_cb *cb);
+static void limbo_free(ob_limbo *l);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_epoch_init
+ *
+ * Description:   Set up the epochs of a book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       int 0 - epochs set up, non zero on error.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+int ob_epoch_init(obsess_book_cb *cb)
+{
+   cb->epoch = 1;
+   cb->readers = NULL;
+   cb->limbo[0] = cb->limbo[1] = cb->limbo[2] = NULL;
+   if(pthread_key_create(&cb->reader_key,epoch_reader_exit) != 0)
+   {
+      return 1;
+   }
+   pthread_mutex_init(&cb->limbo_lock,NULL);
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      ob_epoch_free
+ *
+ * Description:   Free the epochs of a book and all the retired memory.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Nobody may be reading the book.
+ *
+ *****************************************************************************/
+void ob_epoch_free(obsess_book_cb *cb)
+{
+   ob_epoch_rec *rec;
+   int i;
+
+   for(i = 0; i < 3; i++)
+   {
+      limbo_free(cb->limbo[i]);
+      cb->limbo[i] = NULL;
+   }
+
+   //Threads that never exited still point at their record, forget it.
+   pthread_setspecific(cb->reader_key,NULL);
+   pthread_key_delete(cb->reader_key);
+   while((rec = cb->readers) != NULL)
+   {
+      cb->readers = rec->next;
+      free(rec);
+   }
+   pthread_mutex_destroy(&cb->limbo_lock);
+}
+
+/******************************************************************************
+ * Function:      ob_epoch_enter
+ *
+ * Description:   Start reading the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Anything loaded from the book stays valid until the matching
+ *                ob_epoch_exit.  Reads nest.  Threads started by the reader to
+ *                help with the read are covered by the reader's epoch.
+ *
+ *****************************************************************************/
+void ob_epoch_enter(obsess_book_cb *cb)
+{
+   ob_epoch_rec *rec;
+
+   rec = pthread_getspecific(cb->reader_key);
+   if(rec == NULL)
+   {
+      rec = epoch_reader(cb);
+   }
+   if(rec->depth++ == 0)
+   {
+      __atomic_store_n(&rec->epoch,__atomic_load_n(&cb->epoch,__ATOMIC_SEQ_CST),
+                       __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   }
+}
+
+/******************************************************************************
+ * Function:      ob_epoch_exit
+ *
+ * Description:   Stop reading the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+void ob_epoch_exit(obsess_book_cb *cb)
+{
+   ob_epoch_rec *rec;
+
+   rec = pthread_getspecific(cb->reader_key);
+   if(--rec->depth == 0)
+   {
+      __atomic_store_n(&rec->epoch,0,__ATOMIC_RELEASE);
+   }
+}
+
+/******************************************************************************
+ * Function:      ob_epoch_retire
+ *
+ * Description:   Free memory once no reader can be looking at it.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                void *ptr - memory allocated with malloc that readers can no
+ *                            longer reach from the book.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Each retire tries to move the epoch on, which frees the
+ *                memory retired 2 epochs ago.
+ *
+ *****************************************************************************/
+void ob_epoch_retire(obsess_book_cb *cb, void *ptr)
+{
+   ob_limbo *l;
+   unsigned long e;
+
+   if(ptr == NULL)
+   {
+      return;
+   }
+   l = malloc(sizeof(ob_limbo));
+
+   pthread_mutex_lock(&cb->limbo_lock);
+   if(l == NULL)
+   {//No memory to wait with, wait for the readers right here.
+      while(l == NULL)
+      {
+         e = cb->epoch;
+         epoch_advance(cb);
+         if(cb->epoch >= e + 2)
+         {
+            free(ptr);
+            break;
+         }
+         pthread_mutex_unlock(&cb->limbo_lock);
+         sched_yield();
+         pthread_mutex_lock(&cb->limbo_lock);
+      }
+   }
+   else
+   {
+      l->ptr = ptr;
+      l->next = cb->limbo[cb->epoch % 3];
+      cb->limbo[cb->epoch % 3] = l;
+      epoch_advance(cb);
+   }
+   pthread_mutex_unlock(&cb->limbo_lock);
+}
+
+/******************************************************************************
+ * Function:      ob_epoch_now
+ *
+ * Description:   Get the current epoch.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       unsigned long - the epoch.
+ *
+ * Notes:         For things that are not memory but can not be reused while
+ *                a reader might still see them, like user_IDs.
+ *
+ *****************************************************************************/
+unsigned long ob_epoch_now(obsess_book_cb *cb)
+{
+   return __atomic_load_n(&cb->epoch,__ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+ * Function:      ob_epoch_passed
+ *
+ * Description:   Check if no reader can still see what was let go of in an
+ *                epoch.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                unsigned long epoch - epoch from ob_epoch_now.
+ *
+ * Returns:       int - non zero once every reader moved 2 epochs past it.
+ *
+ * Notes:         Tries to move the epoch on, never waits.
+ *
+ *****************************************************************************/
+int ob_epoch_passed(obsess_book_cb *cb, unsigned long epoch)
+{
+   int passed;
+
+   if(ob_epoch_now(cb) >= epoch + 2)
+   {
+      return 1;
+   }
+   pthread_mutex_lock(&cb->limbo_lock);
+   if(cb->epoch < epoch + 2)
+   {
+      epoch_advance(cb);
+   }
+   if(cb->epoch < epoch + 2)
+   {
+      epoch_advance(cb);
+   }
+   passed = cb->epoch >= epoch + 2;
+   pthread_mutex_unlock(&cb->limbo_lock);
+
+   return passed;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      epoch_reader
+ *
+ * Description:   Get a reader record for the calling thread.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       ob_epoch_rec* - the record.
+ *
+ * Notes:         Records of threads that exited are reused.  Records are
+ *                never unlinked, so the list can be walked without a lock.
+ *
+ *****************************************************************************/
+static ob_epoch_rec *epoch_reader(obsess_book_cb *cb)
+{
+   ob_epoch_rec *rec;
+
+   //Try to take over the record of a thread that exited.
+   for(rec = __atomic_load_n(&cb->readers,__ATOMIC_ACQUIRE); rec != NULL;
+       rec = rec->next)
+   {
+      if(__atomic_load_n(&rec->idle,__ATOMIC_RELAXED) &&
+         __sync_bool_compare_and_swap(&rec->idle,1,0))
+      {
+         break;
+      }
+   }
+
+   if(rec == NULL)
+   {
+      rec = calloc(1,sizeof(ob_epoch_rec));
+      if(rec == NULL)
+      {//A reader without a record can not be kept safe.
+         abort();
+      }
+      do
+      {
+         rec->next = __atomic_load_n(&cb->readers,__ATOMIC_ACQUIRE);
+      }while(!__sync_bool_compare_and_swap(&cb->readers,rec->next,rec));
+   }
+
+   pthread_setspecific(cb->reader_key,rec);
+   return rec;
+}
+
+/******************************************************************************
+ * Function:      epoch_reader_exit
+ *
+ * Description:   Hand the record of an exiting thread back.
+ *
+ * Params:        void *arg - pointer to the record.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Called by pthreads when the thread exits.
+ *
+ *****************************************************************************/
+static void epoch_reader_exit(void *arg)
+{
+   ob_epoch_rec *rec = arg;
+
+   rec->depth = 0;
+   __atomic_store_n(&rec->epoch,0,__ATOMIC_RELEASE);
+   __atomic_store_n(&rec->idle,1,__ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * Function:      epoch_advance
+ *
+ * Description:   Move to the next epoch if every reader is in this one.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds limbo_lock.  Moving to epoch e + 1 means every
+ *                reader started at e or later, so what was retired at e - 2
+ *                is out of everybody's sight and is freed.
+ *
+ *****************************************************************************/
+static void epoch_advance(obsess_book_cb *cb)
+{
+   ob_epoch_rec *rec;
+   unsigned long e = cb->epoch;
+   unsigned long r;
+
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   for(rec = __atomic_load_n(&cb->readers,__ATOMIC_ACQUIRE); rec != NULL;
+       rec = rec->next)
+   {
+      r = __atomic_load_n(&rec->epoch,__ATOMIC_SEQ_CST);
+      if(r != 0 && r != e)
+      {//Still reading in an older epoch.
+         return;
+      }
+   }
+
+   //Bag e + 1 holds what was retired at e - 2.
+   limbo_free(cb->limbo[(e + 1) % 3]);
+   cb->limbo[(e + 1) % 3] = NULL;
+   __atomic_store_n(&cb->epoch,e + 1,__ATOMIC_SEQ_CST);
+}
+
+/******************************************************************************
+ * Function:      limbo_free
+ *
+ * Description:   Free a list of retired memory.
+ *
+ * Params:        ob_limbo *l - the list.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void limbo_free(ob_limbo *l)
+{
+   ob_limbo *next;
+
+   while(l != NULL)
+   {
+      next = l->next;
+      free(l->ptr);
+      free(l);
+      l = next;
+   }
+}
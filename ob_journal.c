@@ -0,0 +1,1188 @@
+/*****************************************************************************
+ *
+ *     ob_journal.c
+ *
+ *   Description: Journal of the changes to a book.  Every new user, BFF pair
+ *                added or removed and user deleted is logged as a record
+ *                naming the users, user_IDs change when the book is loaded
+ *                again.  Writers only copy their record into a buffer, a
+ *                flusher thread writes what piled up as one frame with one
+ *                fdatasync, so a burst of writers shares the cost of a sync.
+ *                A frame is its length, a checksum and the records, a frame
+ *                cut short by a crash fails the checksum and is dropped.
+ *                ob_recover loads the latest snapshot and replays the records
+ *                logged after it through ob_bulk_load.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//First bytes of a journal file, the position the journal starts at follows.
+#define JOURNAL_MAGIC     "OBJRNL01"
+#define JOURNAL_MAGIC_LEN 8
+#define JOURNAL_HEAD      (JOURNAL_MAGIC_LEN + sizeof(unsigned long))
+
+//Bytes in front of the records of a frame, their length and checksum.
+#define JOURNAL_FRAME 8
+
+//Most bytes of a record besides its names, the type and two lengths.
+#define JOURNAL_REC_MAX 11
+
+//Bytes each record buffer starts with.
+#define JOURNAL_BUF (64L * 1024)
+//_____________________________________________________________________________
+//                                                            Private Functions
+static void *journal_flusher(void *arg);
+static int journal_write(int fd, char *buf, size_t len);
+static unsigned int journal_sum(const char *records, unsigned int len);
+static int journal_append(ob_journal *j, int type, const char *a, int a_len,
+                          const char *b, int b_len);
+static user_ret_code journal_wait(ob_journal *j, unsigned long ticket);
+static user_ret_code journal_read(int fd, unsigned char **data, size_t *valid,
+                                  unsigned long *base, unsigned long *end);
+static long journal_replay(obsess_book_cb *cb, const unsigned char *data,
+                           size_t valid, unsigned long at, unsigned long from);
+static int journal_flush(obsess_book_cb *cb, ob_bulk_user *users,
+                         long *n_users, ob_bulk_edge *edges, long *n_edges);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_journal_open
+ *
+ * Description:   Start logging the changes to the book to a journal file.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const char *path - the journal file, created if it is not
+ *                                   there.
+ *                long delay_usec - microseconds the flusher waits for more
+ *                                  records before it writes a frame, 0 to
+ *                                  write as soon as there are records.
+ *                int wait - non zero if a change only returns once its
+ *                           record is on disk, otherwise the last delay of
+ *                           changes can be lost in a crash.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - changes are logged.
+ *                              USER_INVALID_PARAMER - bad parameter, a
+ *                                journal is already open, or the file is not
+ *                                a journal or does not end where the book is.
+ *                              USER_NO_MEM - no memory.
+ *                              USER_IO_ERROR - the file could not be set up.
+ *
+ * Notes:         Call ob_recover with the journal first, a journal holding
+ *                changes the book does not have is refused.  A new journal
+ *                starts at the position the book is at, so one can be
+ *                started after each ob_snapshot and the old one dropped.
+ *                The longer the delay, the more changes share a sync and the
+ *                longer a waiting writer waits.
+ *
+ *****************************************************************************/
+user_ret_code ob_journal_open(obsess_book_cb *cb, const char *path,
+                              long delay_usec, int wait)
+{
+   user_ret_code rc;
+   ob_journal *j;
+   unsigned char *data = NULL;
+   char head[JOURNAL_HEAD];
+   unsigned long base;
+   unsigned long end;
+   size_t valid;
+
+   if(cb == NULL || path == NULL || delay_usec < 0 || cb->journal != NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   j = calloc(1,sizeof(ob_journal));
+   if(j == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   j->fd = open(path,O_RDWR | O_CREAT | O_APPEND,0644);
+   if(j->fd < 0)
+   {
+      rc = -USER_IO_ERROR;
+      goto EXIT_journal_open_1;
+   }
+
+   rc = journal_read(j->fd,&data,&valid,&base,&end);
+   if(rc != USER_SUCCESS)
+   {
+      goto EXIT_journal_open_2;
+   }
+   if(valid == 0)
+   {//New journal, it goes on from where the book is.
+      memcpy(head,JOURNAL_MAGIC,JOURNAL_MAGIC_LEN);
+      memcpy(head + JOURNAL_MAGIC_LEN,&cb->journal_pos,sizeof(unsigned long));
+      if(ftruncate(j->fd,0) != 0 ||
+         ob_file_write(j->fd,head,JOURNAL_HEAD) != 0 ||
+         fdatasync(j->fd) != 0 || ob_sync_dir(path) != 0)
+      {
+         rc = -USER_IO_ERROR;
+         goto EXIT_journal_open_2;
+      }
+      end = cb->journal_pos;
+   }
+   else if(end != cb->journal_pos)
+   {//Logging on top would leave records out of the book or replay them twice.
+      rc = -USER_INVALID_PARAMER;
+      goto EXIT_journal_open_2;
+   }
+   else if(ftruncate(j->fd,valid) != 0)
+   {//Drop a frame cut short, new frames go right after the good ones.
+      rc = -USER_IO_ERROR;
+      goto EXIT_journal_open_2;
+   }
+   j->logged = end;
+   j->durable = end;
+   j->delay = delay_usec;
+   j->wait = wait != 0;
+
+   j->cap = JOURNAL_BUF;
+   j->spare_cap = JOURNAL_BUF;
+   j->buf = malloc(j->cap);
+   j->spare = malloc(j->spare_cap);
+   if(j->buf == NULL || j->spare == NULL)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_journal_open_3;
+   }
+   pthread_mutex_init(&j->lock,NULL);
+   pthread_cond_init(&j->wake,NULL);
+   pthread_cond_init(&j->flushed,NULL);
+   if(pthread_create(&j->flusher,NULL,journal_flusher,j) != 0)
+   {
+      pthread_cond_destroy(&j->flushed);
+      pthread_cond_destroy(&j->wake);
+      pthread_mutex_destroy(&j->lock);
+      rc = -USER_NO_MEM;
+      goto EXIT_journal_open_3;
+   }
+   cb->journal = j;
+   free(data);
+   return USER_SUCCESS;
+
+EXIT_journal_open_3:
+   free(j->buf);
+   free(j->spare);
+EXIT_journal_open_2:
+   free(data);
+   close(j->fd);
+EXIT_journal_open_1:
+   free(j);
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_journal_sync
+ *
+ * Description:   Wait until every change logged so far is on disk.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - changes on disk, or there is no
+ *                                             journal.
+ *                              USER_INVALID_PARAMER - bad parameter.
+ *                              USER_IO_ERROR - a record was lost, the journal
+ *                                              logs nothing more.
+ *
+ * Notes:         For a journal opened without wait, a change is only safe
+ *                once this returns.  After an error close the journal, take a
+ *                snapshot and open a new one.
+ *
+ *****************************************************************************/
+user_ret_code ob_journal_sync(obsess_book_cb *cb)
+{
+   if(cb == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   return ob_journal_durable(cb,ob_journal_position(cb));
+}
+
+/******************************************************************************
+ * Function:      ob_journal_close
+ *
+ * Description:   Write out the records left and stop logging.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - journal closed, every record is
+ *                                             on disk.
+ *                              USER_INVALID_PARAMER - bad parameter.
+ *                              USER_IO_ERROR - closed, but records were lost.
+ *
+ * Notes:         No change may be made while it closes.  Waits for the
+ *                snapshot being written first.  ob_exit closes the journal.
+ *
+ *****************************************************************************/
+user_ret_code ob_journal_close(obsess_book_cb *cb)
+{
+   user_ret_code rc;
+   ob_journal *j;
+
+   if(cb == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   //A snapshot being written waits for the journal.
+   ob_snapshot_wait(cb);
+   j = cb->journal;
+   if(j == NULL)
+   {
+      return USER_SUCCESS;
+   }
+
+   pthread_mutex_lock(&j->lock);
+   j->stop = 1;
+   pthread_cond_signal(&j->wake);
+   pthread_mutex_unlock(&j->lock);
+   pthread_join(j->flusher,NULL);
+
+   rc = j->failed ? -USER_IO_ERROR : USER_SUCCESS;
+   if(close(j->fd) != 0)
+   {
+      rc = -USER_IO_ERROR;
+   }
+   cb->journal_pos = j->logged;
+   cb->journal = NULL;
+   pthread_cond_destroy(&j->flushed);
+   pthread_cond_destroy(&j->wake);
+   pthread_mutex_destroy(&j->lock);
+   free(j->buf);
+   free(j->spare);
+   free(j);
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_recover
+ *
+ * Description:   Load a book from its latest snapshot and journal.
+ *
+ * Params:        obsess_book_cb *cb - pointer to a new obsess book control
+ *                                     block.
+ *                const char *snapshot - file written by ob_snapshot, NULL if
+ *                                       there is none.
+ *                const char *journal - journal file, NULL or a missing file
+ *                                      if there is none.
+ *
+ * Returns:       long >= 0 - number of journal records replayed.
+ *                -USER_INVALID_PARAMER - bad parameter, a journal is open, a
+ *                                        file is damaged or the journal does
+ *                                        not go on from the snapshot.
+ *                -USER_NO_MEM - no memory, the book is partly loaded.
+ *                -USER_IO_ERROR - a file could not be read.
+ *
+ * Notes:         Only the records logged after the snapshot are replayed, so
+ *                the time taken follows the changes since the snapshot.  New
+ *                users and BFF pairs are gathered and added with ob_bulk_load,
+ *                the batch is added before each removal or deletion so they
+ *                apply in order.  A frame cut short at the end of the
+ *                journal is cut off the file, open the journal again with
+ *                ob_journal_open to go on logging.
+ *
+ *****************************************************************************/
+long ob_recover(obsess_book_cb *cb, const char *snapshot, const char *journal)
+{
+   unsigned char *data = NULL;
+   unsigned long pos = 0;
+   unsigned long base;
+   unsigned long end;
+   size_t valid;
+   long replayed;
+   int fd;
+
+   if(cb == NULL || cb->journal != NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   if(snapshot != NULL)
+   {
+      replayed = ob_snapshot_load(cb,snapshot,&pos);
+      if(replayed < 0)
+      {
+         return replayed;
+      }
+      cb->journal_pos = pos;
+   }
+   if(journal == NULL)
+   {
+      return 0;
+   }
+   fd = open(journal,O_RDWR);
+   if(fd < 0)
+   {//No journal, nothing changed since the snapshot.
+      return errno == ENOENT ? 0 : -USER_IO_ERROR;
+   }
+
+   replayed = journal_read(fd,&data,&valid,&base,&end);
+   if(replayed != USER_SUCCESS || valid == 0)
+   {
+      goto EXIT_recover_0;
+   }
+   if(snapshot == NULL)
+   {
+      pos = base;
+   }
+   if(pos < base || pos > end || (snapshot == NULL && base != 0))
+   {//Changes between the snapshot and the journal are missing.
+      replayed = -USER_INVALID_PARAMER;
+      goto EXIT_recover_0;
+   }
+   replayed = journal_replay(cb,data,valid,base,pos);
+   if(replayed >= 0)
+   {
+      cb->journal_pos = end;
+      if(ftruncate(fd,valid) != 0)
+      {
+         replayed = -USER_IO_ERROR;
+      }
+   }
+
+EXIT_recover_0:
+   free(data);
+   close(fd);
+   return replayed;
+}
+
+/******************************************************************************
+ * Function:      ob_journal_log
+ *
+ * Description:   Log a change to the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                int type - OB_JOURNAL_USER, ADD, REMOVE or DELETE.
+ *                const char *a - name of the user.
+ *                int a_len - length of the name.
+ *                const char *b - account handle of a new user, NULL if it is
+ *                                the name, or the name of the BFF.
+ *                int b_len - length of b.
+ *
+ * Returns:       unsigned long - ticket to pass to ob_journal_wait, 0 when
+ *                                there is no journal.
+ *
+ * Notes:         Caller holds the lock that orders the change, the bucket
+ *                lock of a new user and the write lock for the rest, so the
+ *                records are in the order the changes were made.
+ *
+ *****************************************************************************/
+unsigned long ob_journal_log(obsess_book_cb *cb, int type, const char *a,
+                             int a_len, const char *b, int b_len)
+{
+   ob_journal *j = cb->journal;
+   unsigned long ticket;
+
+   if(j == NULL)
+   {
+      return 0;
+   }
+   pthread_mutex_lock(&j->lock);
+   journal_append(j,type,a,a_len,b,b_len);
+   ticket = j->logged;
+   pthread_mutex_unlock(&j->lock);
+   return ticket;
+}
+
+/******************************************************************************
+ * Function:      ob_journal_log_edges
+ *
+ * Description:   Log the BFF pairs of a bulk load batch.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const ob_bulk_edge *edges - pairs of the batch.
+ *                const int *pair - user_IDs of each pair, -1 if the pair is
+ *                                  skipped.
+ *                long n - number of pairs.
+ *
+ * Returns:       unsigned long - ticket to pass to ob_journal_wait, 0 when
+ *                                there is no journal.
+ *
+ * Notes:         Caller holds the write lock.  Pairs that are already BFFs
+ *                are logged too, replaying them adds nothing.
+ *
+ *****************************************************************************/
+unsigned long ob_journal_log_edges(obsess_book_cb *cb,
+                                   const ob_bulk_edge *edges,
+                                   const int *pair, long n)
+{
+   ob_journal *j = cb->journal;
+   unsigned long ticket;
+   long i;
+
+   if(j == NULL)
+   {
+      return 0;
+   }
+   pthread_mutex_lock(&j->lock);
+   for(i = 0; i < n; i++)
+   {
+      if(pair[2 * i] >= 0 &&
+         journal_append(j,OB_JOURNAL_ADD,edges[i].who,strlen(edges[i].who),
+                        edges[i].bff,strlen(edges[i].bff)) != 0)
+      {
+         break;
+      }
+   }
+   ticket = j->logged;
+   pthread_mutex_unlock(&j->lock);
+   return ticket;
+}
+
+/******************************************************************************
+ * Function:      ob_journal_wait
+ *
+ * Description:   Wait for a record to be on disk, if the journal waits.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                unsigned long ticket - from ob_journal_log.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - on disk, or nobody waits.
+ *                              USER_IO_ERROR - the record was lost.
+ *
+ * Notes:         Call it after letting go of every lock, the writers that
+ *                come in meanwhile share the sync.
+ *
+ *****************************************************************************/
+user_ret_code ob_journal_wait(obsess_book_cb *cb, unsigned long ticket)
+{
+   if(cb->journal == NULL || !cb->journal->wait)
+   {
+      return USER_SUCCESS;
+   }
+   return journal_wait(cb->journal,ticket);
+}
+
+/******************************************************************************
+ * Function:      ob_journal_durable
+ *
+ * Description:   Wait for the records up to a position to be on disk.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                unsigned long pos - from ob_journal_position.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - on disk, or there is no
+ *                                             journal.
+ *                              USER_IO_ERROR - a record was lost.
+ *
+ * Notes:         Waits whether or not the writers wait.
+ *
+ *****************************************************************************/
+user_ret_code ob_journal_durable(obsess_book_cb *cb, unsigned long pos)
+{
+   if(cb->journal == NULL)
+   {
+      return USER_SUCCESS;
+   }
+   return journal_wait(cb->journal,pos);
+}
+
+/******************************************************************************
+ * Function:      ob_journal_position
+ *
+ * Description:   Position of the next record of the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       unsigned long - the position.
+ *
+ * Notes:         A snapshot taken while no change can be made records it,
+ *                recovery replays the records from there on.
+ *
+ *****************************************************************************/
+unsigned long ob_journal_position(obsess_book_cb *cb)
+{
+   ob_journal *j = cb->journal;
+   unsigned long pos;
+
+   if(j == NULL)
+   {
+      return cb->journal_pos;
+   }
+   pthread_mutex_lock(&j->lock);
+   pos = j->logged;
+   pthread_mutex_unlock(&j->lock);
+   return pos;
+}
+
+/******************************************************************************
+ * Function:      ob_get_name
+ *
+ * Description:   Read a name of a journal or snapshot record.
+ *
+ * Params:        const unsigned char *p - the length of the name.
+ *                const unsigned char *end - end of the record bytes.
+ *                int optional - non zero if the length is one more than the
+ *                               name's and 0 means there is no name.
+ *                char **pool - where the name is copied to, moved past it.
+ *                char **out - set to the copy, NULL if there is no name.
+ *
+ * Returns:       const unsigned char* - byte after the name, NULL if the
+ *                                       record is damaged.
+ *
+ * Notes:         The copy ends in '\0', the pool needs one byte more than
+ *                the record bytes for each name.
+ *
+ *****************************************************************************/
+const unsigned char *ob_get_name(const unsigned char *p,
+                                 const unsigned char *end, int optional,
+                                 char **pool, char **out)
+{
+   unsigned long n;
+
+   p = ob_get_varint(p,end,&n);
+   if(p == NULL)
+   {
+      return NULL;
+   }
+   if(optional)
+   {
+      if(n == 0)
+      {
+         *out = NULL;
+         return p;
+      }
+      n--;
+   }
+   if(n > OB_NAME_MAX || n > (unsigned long)(end - p))
+   {
+      return NULL;
+   }
+   *out = *pool;
+   memcpy(*pool,p,n);
+   (*pool)[n] = '\0';
+   *pool += n + 1;
+   return p + n;
+}
+
+/******************************************************************************
+ * Function:      ob_file_read
+ *
+ * Description:   Read bytes of a file at an offset.
+ *
+ * Params:        int fd - the file.
+ *                void *buf - where the bytes go.
+ *                size_t len - number of bytes.
+ *                long off - offset in the file.
+ *
+ * Returns:       int 0 - read, non zero on an error or the end of the file.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+int ob_file_read(int fd, void *buf, size_t len, long off)
+{
+   ssize_t n;
+
+   while(len > 0)
+   {
+      n = pread(fd,buf,len,off);
+      if(n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if(n <= 0)
+      {
+         return 1;
+      }
+      buf = (char*)buf + n;
+      len -= n;
+      off += n;
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      ob_file_write
+ *
+ * Description:   Write bytes at the end of a file.
+ *
+ * Params:        int fd - the file.
+ *                const void *buf - the bytes.
+ *                size_t len - number of bytes.
+ *
+ * Returns:       int 0 - written, non zero on an error.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+int ob_file_write(int fd, const void *buf, size_t len)
+{
+   ssize_t n;
+
+   while(len > 0)
+   {
+      n = write(fd,buf,len);
+      if(n < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if(n <= 0)
+      {
+         return 1;
+      }
+      buf = (const char*)buf + n;
+      len -= n;
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      ob_sync_dir
+ *
+ * Description:   Sync the directory of a file, so a file created or renamed
+ *                in it is still there after a crash.
+ *
+ * Params:        const char *path - the file.
+ *
+ * Returns:       int 0 - synced, non zero on an error.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+int ob_sync_dir(const char *path)
+{
+   const char *slash = strrchr(path,'/');
+   char *dir;
+   int fd;
+   int rc;
+
+   if(slash == NULL)
+   {
+      dir = strdup(".");
+   }
+   else
+   {
+      dir = strndup(path,slash == path ? 1 : slash - path);
+   }
+   if(dir == NULL)
+   {
+      return 1;
+   }
+   fd = open(dir,O_RDONLY);
+   free(dir);
+   if(fd < 0)
+   {
+      return 1;
+   }
+   rc = fsync(fd);
+   close(fd);
+   return rc != 0;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      journal_flusher
+ *
+ * Description:   Thread that writes the records out.
+ *
+ * Params:        void *arg - the journal.
+ *
+ * Returns:       NULL.
+ *
+ * Notes:         Algorithm:
+ *                Once there are records, wait the delay for more, swap the
+ *                buffers so writers go on logging into the other one, write
+ *                the records as one frame and sync, then tell the writers
+ *                how far the journal is on disk.  Exits once it is stopped
+ *                and every record is out.
+ *
+ *****************************************************************************/
+static void *journal_flusher(void *arg)
+{
+   ob_journal *j = arg;
+   struct timespec delay;
+   unsigned long upto;
+   size_t len;
+   size_t cap;
+   char *buf;
+   int ok;
+
+   delay.tv_sec = j->delay / 1000000;
+   delay.tv_nsec = (j->delay % 1000000) * 1000;
+
+   pthread_mutex_lock(&j->lock);
+   for(;;)
+   {
+      while(j->len == 0 && !j->stop)
+      {
+         pthread_cond_wait(&j->wake,&j->lock);
+      }
+      if(j->len == 0)
+      {//Stopped and everything is out.
+         break;
+      }
+      if(j->delay > 0 && !j->stop)
+      {//Let more records come in, they share the sync.
+         pthread_mutex_unlock(&j->lock);
+         nanosleep(&delay,NULL);
+         pthread_mutex_lock(&j->lock);
+      }
+
+      buf = j->buf;
+      cap = j->cap;
+      len = j->len;
+      upto = j->logged;
+      j->buf = j->spare;
+      j->cap = j->spare_cap;
+      j->len = 0;
+      j->spare = buf;
+      j->spare_cap = cap;
+      ok = !j->failed;
+      pthread_mutex_unlock(&j->lock);
+
+      ok = ok && journal_write(j->fd,buf,len) == 0;
+
+      pthread_mutex_lock(&j->lock);
+      if(ok)
+      {
+         j->durable = upto;
+      }
+      else
+      {//Frames after a lost one could not be replayed.
+         j->failed = 1;
+      }
+      pthread_cond_broadcast(&j->flushed);
+   }
+   pthread_mutex_unlock(&j->lock);
+
+   return NULL;
+}
+
+/******************************************************************************
+ * Function:      journal_write
+ *
+ * Description:   Write records as a frame and sync them.
+ *
+ * Params:        int fd - the journal file.
+ *                char *buf - JOURNAL_FRAME free bytes, then the records.
+ *                size_t len - bytes of records.
+ *
+ * Returns:       int 0 - on disk, non zero on an error.
+ *
+ * Notes:         The frame header is filled in in front of the records so
+ *                the frame goes out in one write.
+ *
+ *****************************************************************************/
+static int journal_write(int fd, char *buf, size_t len)
+{
+   unsigned int n = (unsigned int)len;
+   unsigned int sum;
+
+   if(len > 0xFFFFFFFFUL)
+   {
+      return 1;
+   }
+   sum = journal_sum(buf + JOURNAL_FRAME,n);
+   memcpy(buf,&n,4);
+   memcpy(buf + 4,&sum,4);
+   if(ob_file_write(fd,buf,JOURNAL_FRAME + len) != 0)
+   {
+      return 1;
+   }
+   return fdatasync(fd) != 0;
+}
+
+/******************************************************************************
+ * Function:      journal_sum
+ *
+ * Description:   Checksum of the records of a frame.
+ *
+ * Params:        const char *records - the records.
+ *                unsigned int len - their length.
+ *
+ * Returns:       unsigned int - the checksum.
+ *
+ * Notes:         The length goes into the checksum too, zeroed space at the
+ *                end of a file does not pass for an empty frame.
+ *
+ *****************************************************************************/
+static unsigned int journal_sum(const char *records, unsigned int len)
+{
+   return ob_checksum(ob_checksum(2166136261u,&len,4),records,len);
+}
+
+/******************************************************************************
+ * Function:      journal_append
+ *
+ * Description:   Copy a record into the buffer.
+ *
+ * Params:        ob_journal *j - the journal.
+ *                int type, const char *a, int a_len, const char *b,
+ *                int b_len - the record, see ob_journal_log.
+ *
+ * Returns:       int 0 - logged, non zero if the record was lost.
+ *
+ * Notes:         Caller holds the journal lock.  A record that does not fit
+ *                for lack of memory fails the journal, so no later record is
+ *                on disk without it.
+ *
+ *****************************************************************************/
+static int journal_append(ob_journal *j, int type, const char *a, int a_len,
+                          const char *b, int b_len)
+{
+   size_t need = JOURNAL_FRAME + j->len + JOURNAL_REC_MAX + a_len +
+                 (b != NULL ? b_len : 0);
+   size_t cap;
+   char *grown;
+   char *p;
+
+   if(j->failed)
+   {
+      return 1;
+   }
+   if(need > j->cap)
+   {
+      for(cap = j->cap * 2; cap < need; cap *= 2)
+      {
+      }
+      grown = realloc(j->buf,cap);
+      if(grown == NULL)
+      {
+         j->failed = 1;
+         pthread_cond_broadcast(&j->flushed);
+         return 1;
+      }
+      j->buf = grown;
+      j->cap = cap;
+   }
+
+   //Type, name length and name, then length + 1 and the second name or 0.
+   p = j->buf + JOURNAL_FRAME + j->len;
+   *p++ = (char)type;
+   p += ob_put_varint(p,a_len);
+   memcpy(p,a,a_len);
+   p += a_len;
+   p += ob_put_varint(p,b != NULL ? b_len + 1 : 0);
+   if(b != NULL)
+   {
+      memcpy(p,b,b_len);
+      p += b_len;
+   }
+
+   if(j->len == 0)
+   {
+      pthread_cond_signal(&j->wake);
+   }
+   need = p - (j->buf + JOURNAL_FRAME + j->len);
+   j->len += need;
+   j->logged += need;
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      journal_wait
+ *
+ * Description:   Wait for the journal to be on disk up to a position.
+ *
+ * Params:        ob_journal *j - the journal.
+ *                unsigned long ticket - the position.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - on disk.
+ *                              USER_IO_ERROR - a record was lost.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static user_ret_code journal_wait(ob_journal *j, unsigned long ticket)
+{
+   user_ret_code rc;
+
+   pthread_mutex_lock(&j->lock);
+   while(!j->failed && j->durable < ticket)
+   {
+      pthread_cond_wait(&j->flushed,&j->lock);
+   }
+   rc = j->failed ? -USER_IO_ERROR : USER_SUCCESS;
+   pthread_mutex_unlock(&j->lock);
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      journal_read
+ *
+ * Description:   Read a journal file and find where its good frames end.
+ *
+ * Params:        int fd - the journal file.
+ *                unsigned char **data - set to the file, free it.
+ *                size_t *valid - set to the bytes up to the end of the last
+ *                                good frame, 0 for an empty file.
+ *                unsigned long *base - set to the position the journal
+ *                                      starts at.
+ *                unsigned long *end - set to the position after the last
+ *                                     good frame.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - file read.
+ *                              USER_INVALID_PARAMER - not a journal.
+ *                              USER_NO_MEM - no memory.
+ *                              USER_IO_ERROR - the file could not be read.
+ *
+ * Notes:         The frames are checked in order, the first one that is cut
+ *                short or fails its checksum ends the journal.
+ *
+ *****************************************************************************/
+static user_ret_code journal_read(int fd, unsigned char **data, size_t *valid,
+                                  unsigned long *base, unsigned long *end)
+{
+   struct stat st;
+   unsigned int len;
+   unsigned int sum;
+   size_t off;
+
+   *data = NULL;
+   *valid = 0;
+   if(fstat(fd,&st) != 0)
+   {
+      return -USER_IO_ERROR;
+   }
+   if(st.st_size == 0)
+   {
+      return USER_SUCCESS;
+   }
+   if((size_t)st.st_size < JOURNAL_HEAD)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   *data = malloc(st.st_size);
+   if(*data == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   if(ob_file_read(fd,*data,st.st_size,0) != 0)
+   {
+      return -USER_IO_ERROR;
+   }
+   if(memcmp(*data,JOURNAL_MAGIC,JOURNAL_MAGIC_LEN) != 0)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   memcpy(base,*data + JOURNAL_MAGIC_LEN,sizeof(unsigned long));
+
+   *end = *base;
+   for(off = JOURNAL_HEAD; off + JOURNAL_FRAME <= (size_t)st.st_size;
+       off += JOURNAL_FRAME + len)
+   {
+      memcpy(&len,*data + off,4);
+      memcpy(&sum,*data + off + 4,4);
+      if(len == 0 || len > st.st_size - off - JOURNAL_FRAME ||
+         journal_sum((char*)*data + off + JOURNAL_FRAME,len) != sum)
+      {
+         break;
+      }
+      *end += len;
+   }
+   *valid = off;
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      journal_replay
+ *
+ * Description:   Apply the records of a journal from a position on.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const unsigned char *data - the journal file.
+ *                size_t valid - bytes of good frames.
+ *                unsigned long at - position the journal starts at.
+ *                unsigned long from - position to replay from.
+ *
+ * Returns:       long >= 0 - number of records replayed.
+ *                -USER_INVALID_PARAMER - a record is damaged.
+ *                -USER_NO_MEM - no memory.
+ *
+ * Notes:         Frames that end before the position are stepped over
+ *                without reading their records.  New users and pairs wait in
+ *                a batch for ob_bulk_load, a removal or a deletion adds the
+ *                batch first.  The names are copied into one pool, a name
+ *                takes at most one byte more than its record bytes.
+ *
+ *****************************************************************************/
+static long journal_replay(obsess_book_cb *cb, const unsigned char *data,
+                           size_t valid, unsigned long at, unsigned long from)
+{
+   const unsigned char *p = data + JOURNAL_HEAD;
+   const unsigned char *end = data + valid;
+   const unsigned char *frame_end;
+   const unsigned char *rec;
+   ob_bulk_user *users = NULL;
+   ob_bulk_edge *edges = NULL;
+   ob_bulk_user *grown_users;
+   ob_bulk_edge *grown_edges;
+   long n_users = 0;
+   long n_edges = 0;
+   long cap_users = 0;
+   long cap_edges = 0;
+   long replayed = 0;
+   unsigned int len;
+   char *pool_start;
+   char *pool;
+   char *names[2];
+   user *found[2];
+   int type;
+
+   pool_start = malloc(valid * 2 + 1);
+   if(pool_start == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   pool = pool_start;
+
+   while(p < end)
+   {
+      memcpy(&len,p,4);
+      p += JOURNAL_FRAME;
+      frame_end = p + len;
+      if(at + len <= from)
+      {//Every record of the frame is in the snapshot.
+         at += len;
+         p = frame_end;
+         continue;
+      }
+      while(p < frame_end)
+      {
+         rec = p;
+         type = *p++;
+         p = ob_get_name(p,frame_end,0,&pool,&names[0]);
+         if(p != NULL)
+         {
+            p = ob_get_name(p,frame_end,1,&pool,&names[1]);
+         }
+         if(p == NULL)
+         {
+            replayed = -USER_INVALID_PARAMER;
+            goto EXIT_replay_0;
+         }
+         at += p - rec;
+         if(at <= from)
+         {
+            continue;
+         }
+
+         switch(type)
+         {
+         case OB_JOURNAL_USER:
+            if(n_users == cap_users)
+            {
+               cap_users = cap_users ? cap_users * 2 : 1024;
+               grown_users = realloc(users,sizeof(ob_bulk_user) * cap_users);
+               if(grown_users == NULL)
+               {
+                  replayed = -USER_NO_MEM;
+                  goto EXIT_replay_0;
+               }
+               users = grown_users;
+            }
+            users[n_users].name = names[0];
+            users[n_users].account_handle = names[1] != NULL ? names[1] :
+                                                               names[0];
+            n_users++;
+            break;
+         case OB_JOURNAL_ADD:
+            if(names[1] == NULL)
+            {
+               break;
+            }
+            if(n_edges == cap_edges)
+            {
+               cap_edges = cap_edges ? cap_edges * 2 : 1024;
+               grown_edges = realloc(edges,sizeof(ob_bulk_edge) * cap_edges);
+               if(grown_edges == NULL)
+               {
+                  replayed = -USER_NO_MEM;
+                  goto EXIT_replay_0;
+               }
+               edges = grown_edges;
+            }
+            edges[n_edges].who = names[0];
+            edges[n_edges].bff = names[1];
+            n_edges++;
+            break;
+         case OB_JOURNAL_REMOVE:
+         case OB_JOURNAL_DELETE:
+            if(journal_flush(cb,users,&n_users,edges,&n_edges) != 0)
+            {
+               replayed = -USER_NO_MEM;
+               goto EXIT_replay_0;
+            }
+            if(type == OB_JOURNAL_DELETE)
+            {
+               ob_find_users(cb,names,1,found);
+               if(found[0] != NULL)
+               {
+                  ob_delete_user(found[0]);
+               }
+            }
+            else if(names[1] != NULL)
+            {
+               ob_find_users(cb,names,2,found);
+               if(found[0] != NULL && found[1] != NULL)
+               {
+                  ob_remove_BFF(found[0],found[1]);
+               }
+            }
+            break;
+         default:
+            replayed = -USER_INVALID_PARAMER;
+            goto EXIT_replay_0;
+         }
+         replayed++;
+      }
+   }
+   if(journal_flush(cb,users,&n_users,edges,&n_edges) != 0)
+   {
+      replayed = -USER_NO_MEM;
+   }
+
+EXIT_replay_0:
+   free(users);
+   free(edges);
+   free(pool_start);
+   return replayed;
+}
+
+/******************************************************************************
+ * Function:      journal_flush
+ *
+ * Description:   Add a batch of replayed users and pairs to the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_bulk_user *users - the new users.
+ *                long *n_users - number of users, set to 0.
+ *                ob_bulk_edge *edges - the new pairs.
+ *                long *n_edges - number of pairs, set to 0.
+ *
+ * Returns:       int 0 - added, non zero on an error.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int journal_flush(obsess_book_cb *cb, ob_bulk_user *users,
+                         long *n_users, ob_bulk_edge *edges, long *n_edges)
+{
+   long rc = 0;
+
+   if(*n_users > 0 || *n_edges > 0)
+   {
+      rc = ob_bulk_load(cb,users,*n_users,edges,*n_edges);
+   }
+   *n_users = 0;
+   *n_edges = 0;
+   return rc < 0;
+}
@@ -0,0 +1,799 @@
+/*****************************************************************************
+ *
+ *     ob_landmark.c
+ *
+ *   Description: Landmark distance oracle.  A few dozen landmark users are
+ *                picked and the BFF distance from each landmark to every user
+ *                is stored in a byte array per landmark.  The distance between
+ *                two users is then boxed in by the triangle inequality:
+ *
+ *                   |d(l,x) - d(l,y)| <= d(x,y) <= d(l,x) + d(l,y)
+ *
+ *                for every landmark l.  The tables are rebuilt on a
+ *                background thread after enough BFF churn.  Until then an
+ *                added BFF pair drops the lower bounds, a removed one drops
+ *                the upper bounds, and user_IDs handed out again since the
+ *                graph of the tables was copied get no bounds at all.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Distance stored for users a landmark can not reach.
+#define LANDMARK_FAR 255
+
+//Most landmarks a book can have.
+#define LANDMARK_MAX 255
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Distance tables of one set of landmarks.
+typedef struct _ob_landmark_table
+{
+   long           users;      //Number of users in the tables.
+   unsigned int   gen;        //Copy of the graph the tables were built from.
+   int            count;      //Number of landmarks.
+   int           *id;         //user_ID of each landmark.
+   unsigned char *dist;       //count tables of users distances.
+}ob_landmark_table;
+
+//Landmark oracle of a book.
+struct _ob_oracle
+{
+   pthread_mutex_t    lock;       //Guards table.
+   ob_landmark_table *table;      //Current tables.
+   int                count;      //Number of landmarks to pick.
+   ob_landmark_pick   pick;       //How to pick them.
+   long               churn;      //BFF pairs added since the last build.
+   long               churn_limit;//Pairs that start a rebuild, 0 for never.
+   int                running;    //Non zero while a rebuild thread runs.
+   int                joinable;   //Non zero if thread has to be joined.
+   pthread_t          thread;     //Rebuild thread.
+   unsigned int       seed;       //Seed for picking random landmarks.
+   unsigned int       gen;        //Copies of the graph taken, changed under
+                                  //the write lock.
+   unsigned int       added;      //gen when a BFF pair was last added.
+   unsigned int       removed;    //gen when a BFF pair was last removed.
+   long               marks;      //Entries of gone.
+   unsigned int      *gone;       //gen + 1 when each user_ID was last
+                                  //handed out again.
+};
+
+//Work handed to the rebuild thread.
+typedef struct _landmark_job
+{
+   ob_oracle *oracle;
+   ob_csr    *g;
+   unsigned int gen;          //gen of the copy of the graph.
+}landmark_job;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static ob_landmark_table *landmark_table(ob_csr *g, int count,
+                                         ob_landmark_pick pick,
+                                         unsigned int *seed);
+static void landmark_bfs(ob_csr *g, int src, unsigned char *dist, int *queue);
+static void landmark_table_free(ob_landmark_table *t);
+static void landmark_swap(ob_oracle *o, ob_landmark_table *t);
+static void *landmark_worker(void *arg);
+static void landmark_join(ob_oracle *o);
+static int landmark_stale(unsigned int mark, unsigned int gen);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_landmark_build
+ *
+ * Description:   Pick the landmarks and build their distance tables.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                int count - number of landmarks, a few dozen is plenty.
+ *                ob_landmark_pick pick - OB_LANDMARK_DEGREE picks the users
+ *                                        with the most BFFs,
+ *                                        OB_LANDMARK_RANDOM picks at random.
+ *                long churn - number of BFF pairs added before the tables are
+ *                             rebuilt in the background, 0 for never.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - tables built.
+ *                              USER_INVALID_PARAMER - bad count.
+ *                              USER_NO_MEM - not enough memory.
+ *
+ * Notes:         The first build runs on the calling thread.  Calling again
+ *                replaces the landmarks and the churn setting.
+ *
+ *****************************************************************************/
+user_ret_code ob_landmark_build(obsess_book_cb *cb, int count,
+                                ob_landmark_pick pick, long churn)
+{
+   ob_landmark_table *t;
+   ob_oracle *o;
+   ob_csr *g;
+   unsigned int gen;
+
+   if(cb == NULL || count < 1 || count > LANDMARK_MAX || churn < 0)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   //Writers look at the settings and the graph has to hold still while it
+   //is copied.
+   pthread_mutex_lock(&cb->write_lock);
+   o = cb->oracle;
+   if(o == NULL)
+   {//First build, create the oracle.
+      o = calloc(1,sizeof(ob_oracle));
+      if(o == NULL)
+      {
+         pthread_mutex_unlock(&cb->write_lock);
+         return -USER_NO_MEM;
+      }
+      pthread_mutex_init(&o->lock,NULL);
+      o->seed = 0x0b5e55U;
+      __atomic_store_n(&cb->oracle,o,__ATOMIC_RELEASE);
+   }
+   else
+   {//Let a rebuild in flight finish before changing the settings.
+      landmark_join(o);
+   }
+   o->count = count;
+   o->pick = pick;
+   o->churn_limit = churn;
+   o->churn = 0;
+
+   g = ob_csr_build(cb);
+   gen = __atomic_add_fetch(&o->gen,1,__ATOMIC_RELAXED);
+   pthread_mutex_unlock(&cb->write_lock);
+   if(g == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   t = landmark_table(g,count,pick,&o->seed);
+   ob_csr_free(g);
+   if(t == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   t->gen = gen;
+   landmark_swap(o,t);
+
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      ob_derpcon_estimate
+ *
+ * Description:   Estimate the DERPCON between the 2 users from the landmarks.
+ *
+ * Params:        user *x - ptr to user to whom to evaluate the DERPCON
+ *                user *y - ptr to user to whom to evaluate the DERPCON
+ *                int *lower - gets the lowest the DERPCON can be, may be NULL.
+ *                int *upper - gets the highest the DERPCON can be, may be NULL.
+ *
+ * Returns:       0 - max_derpcon the estimated DERPCON, the upper bound.
+ *                -USER_INVALID_PARAMER - bad user.
+ *                -USER_NOT_READY - ob_landmark_build has not been called.
+ *
+ * Notes:         Only when lower equals upper is the estimate exact.  Users
+ *                added after the last build are not in the tables, they get
+ *                the widest bounds, and so does a new user that got the
+ *                user_ID of a deleted one.  A user no landmark can reach
+ *                gets the widest bounds too.  Once a BFF pair is added
+ *                anywhere in the book the lower bound drops to 0, and once
+ *                one is removed the upper bound goes up to max_derpcon,
+ *                until the tables are rebuilt.
+ *
+ *****************************************************************************/
+int ob_derpcon_estimate(user *x, user *y, int *lower, int *upper)
+{
+   ob_landmark_table *t;
+   ob_oracle *o;
+   unsigned char *dist;
+   int lo = 0;                //Lowest distance between x and y.
+   int hi = LANDMARK_FAR;     //Highest distance between x and y.
+   int dx;
+   int dy;
+   int d;
+   int l;
+
+   if(x == NULL || y == NULL || x->cb != y->cb)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   o = __atomic_load_n(&x->cb->oracle,__ATOMIC_ACQUIRE);
+   if(o == NULL)
+   {
+      return -USER_NOT_READY;
+   }
+
+   pthread_mutex_lock(&o->lock);
+   t = o->table;
+   if(x->user_ID < t->users && y->user_ID < t->users &&
+      (x->user_ID >= o->marks || !landmark_stale(o->gone[x->user_ID],t->gen)) &&
+      (y->user_ID >= o->marks || !landmark_stale(o->gone[y->user_ID],t->gen)))
+   {
+      for(l = 0; l < t->count; l++)
+      {
+         dist = t->dist + (long)l * t->users;
+         dx = dist[x->user_ID];
+         dy = dist[y->user_ID];
+         if(dx == LANDMARK_FAR && dy == LANDMARK_FAR)
+         {//Landmark is no help.
+            continue;
+         }
+         if(dx == LANDMARK_FAR || dy == LANDMARK_FAR)
+         {//Landmark reaches only one of them, they are not connected.
+            lo = LANDMARK_FAR;
+            break;
+         }
+         d = dx > dy ? dx - dy : dy - dx;
+         if(d > lo)
+         {
+            lo = d;
+         }
+         if(dx + dy < hi)
+         {
+            hi = dx + dy;
+         }
+      }
+      if(landmark_stale(__atomic_load_n(&o->added,__ATOMIC_RELAXED),t->gen))
+      {//A new pair may be a shortcut, or link users the tables had apart.
+         lo = 0;
+      }
+      if(landmark_stale(__atomic_load_n(&o->removed,__ATOMIC_RELAXED),t->gen))
+      {//The paths the tables know of may be gone.
+         hi = LANDMARK_FAR;
+      }
+   }
+   pthread_mutex_unlock(&o->lock);
+
+   //Distances are BFF hops, the DERPCON of BFFs is 0.
+   lo = lo - 1;
+   hi = hi - 1;
+   lo = lo < 0 ? 0 : (lo > x->cb->max_derpcon ? x->cb->max_derpcon : lo);
+   hi = hi < 0 ? 0 : (hi > x->cb->max_derpcon ? x->cb->max_derpcon : hi);
+   if(lo > hi)
+   {//Not connected.
+      hi = lo;
+   }
+
+   if(lower != NULL)
+   {
+      *lower = lo;
+   }
+   if(upper != NULL)
+   {
+      *upper = hi;
+   }
+   return hi;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      ob_landmark_add_BFF
+ *
+ * Description:   Count changed BFF pairs and rebuild the tables if it is time.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                long pairs - number of BFF pairs added or removed.
+ *                int removed - non zero if the pairs were removed.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds the write lock.  The change is marked before
+ *                the graph is copied, so the tables of the copy are not
+ *                widened by it.  The graph is copied on the calling thread
+ *                so the rebuild thread never looks at BFF lists that are
+ *                being changed.
+ *                If a rebuild is still running the count keeps going and the
+ *                next pair after it finishes starts another one.
+ *
+ *****************************************************************************/
+void ob_landmark_add_BFF(obsess_book_cb *cb, long pairs, int removed)
+{
+   ob_oracle *o = cb->oracle;
+   landmark_job *job;
+
+   __atomic_store_n(removed ? &o->removed : &o->added,
+                    __atomic_load_n(&o->gen,__ATOMIC_RELAXED),__ATOMIC_RELAXED);
+   o->churn += pairs;
+   if(o->churn_limit == 0 || o->churn < o->churn_limit ||
+      __sync_fetch_and_add(&o->running,0) != 0)
+   {
+      return;
+   }
+   landmark_join(o);
+
+   job = malloc(sizeof(landmark_job));
+   if(job == NULL)
+   {
+      return;
+   }
+   job->oracle = o;
+   job->g = ob_csr_build(cb);
+   job->gen = __atomic_add_fetch(&o->gen,1,__ATOMIC_RELAXED);
+   if(job->g == NULL)
+   {
+      free(job);
+      return;
+   }
+
+   o->running = 1;
+   if(pthread_create(&o->thread,NULL,landmark_worker,job) != 0)
+   {
+      o->running = 0;
+      ob_csr_free(job->g);
+      free(job);
+      return;
+   }
+   o->joinable = 1;
+   o->churn = 0;
+}
+
+/******************************************************************************
+ * Function:      ob_landmark_touch
+ *
+ * Description:   Mark a user_ID of a deleted user that is handed out again.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                int id - the user_ID.
+ *
+ * Returns:       None.
+ *
+ * Notes:         A user_ID is handed out without the write lock, a copy of
+ *                the graph may be taken before the new user is in the book,
+ *                so the mark holds for the copies taken up to now and the
+ *                next one.  If there is no memory for the marks the tables
+ *                are emptied, every pair gets the widest bounds until the
+ *                next build.
+ *
+ *****************************************************************************/
+void ob_landmark_touch(obsess_book_cb *cb, int id)
+{
+   ob_oracle *o = cb->oracle;
+   unsigned int *gone;
+   long marks;
+
+   pthread_mutex_lock(&o->lock);
+   if(id >= o->marks)
+   {//Grow the marks.
+      marks = o->marks * 2 > id ? o->marks * 2 : id + 1L;
+      gone = realloc(o->gone,sizeof(unsigned int) * marks);
+      if(gone == NULL)
+      {
+         if(o->table != NULL)
+         {
+            o->table->users = 0;
+         }
+         pthread_mutex_unlock(&o->lock);
+         return;
+      }
+      memset(gone + o->marks,0,sizeof(unsigned int) * (marks - o->marks));
+      o->gone = gone;
+      o->marks = marks;
+   }
+   o->gone[id] = __atomic_load_n(&o->gen,__ATOMIC_RELAXED) + 1;
+   pthread_mutex_unlock(&o->lock);
+}
+
+/******************************************************************************
+ * Function:      ob_landmark_renumber
+ *
+ * Description:   Move the tables over to new user_IDs.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const int *new_id - new user_ID of each old user_ID, -1 for
+ *                                    a user_ID without a user.
+ *                long users - number of old user_IDs.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds the write lock and the BFF lists already use
+ *                the new user_IDs.  The distances do not change, so the
+ *                columns of the tables are just moved.  Users that were not
+ *                in the tables could land anywhere, the tables are rebuilt
+ *                then.  The marks of the users move with them.  If there is
+ *                no memory the tables are emptied, every pair gets the
+ *                widest bounds until the next build.
+ *
+ *****************************************************************************/
+void ob_landmark_renumber(obsess_book_cb *cb, const int *new_id, long users)
+{
+   ob_oracle *o = cb->oracle;
+   ob_landmark_table *t;
+   ob_landmark_table *nt = NULL;
+   ob_csr *g;
+   unsigned int *gone;
+   long live = 0;
+   long v;
+   int l;
+
+   landmark_join(o);
+   t = o->table;
+   for(v = 0; v < users; v++)
+   {
+      if(new_id[v] >= 0)
+      {
+         live++;
+         if(v >= t->users)
+         {//Not in the tables.
+            live = -1;
+            break;
+         }
+      }
+   }
+
+   if(live < 0)
+   {
+      g = ob_csr_build(cb);
+      if(g != NULL)
+      {
+         nt = landmark_table(g,o->count,o->pick,&o->seed);
+         ob_csr_free(g);
+      }
+      if(nt != NULL)
+      {
+         nt->gen = __atomic_add_fetch(&o->gen,1,__ATOMIC_RELAXED);
+      }
+   }
+   else
+   {
+      nt = calloc(1,sizeof(ob_landmark_table));
+      if(nt != NULL)
+      {
+         nt->users = live;
+         nt->gen = t->gen;
+         nt->count = t->count;
+         nt->id = malloc(sizeof(int) * (t->count ? t->count : 1));
+         nt->dist = malloc((size_t)t->count * live + 1);
+         if(nt->id == NULL || nt->dist == NULL)
+         {
+            landmark_table_free(nt);
+            nt = NULL;
+         }
+      }
+      if(nt != NULL)
+      {
+         for(l = 0; l < t->count; l++)
+         {
+            nt->id[l] = t->id[l] >= 0 && t->id[l] < users ?
+                      new_id[t->id[l]] : -1;
+            for(v = 0; v < users; v++)
+            {
+               if(new_id[v] >= 0)
+               {
+                  nt->dist[(long)l * live + new_id[v]] =
+                     t->dist[(long)l * t->users + v];
+               }
+            }
+         }
+      }
+   }
+
+   //Move the marks over to the new user_IDs.
+   gone = calloc(users + 1,sizeof(unsigned int));
+   if(nt == NULL || gone == NULL)
+   {
+      free(gone);
+      landmark_table_free(nt);
+      pthread_mutex_lock(&o->lock);
+      o->table->users = 0;
+      pthread_mutex_unlock(&o->lock);
+      return;
+   }
+   for(v = 0; v < users && v < o->marks; v++)
+   {
+      if(new_id[v] >= 0)
+      {
+         gone[new_id[v]] = o->gone[v];
+      }
+   }
+   pthread_mutex_lock(&o->lock);
+   free(o->gone);
+   o->gone = gone;
+   o->marks = users + 1;
+   pthread_mutex_unlock(&o->lock);
+   landmark_swap(o,nt);
+}
+
+/******************************************************************************
+ * Function:      ob_landmark_free
+ *
+ * Description:   Free the landmark oracle of the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Waits for a rebuild in flight.
+ *
+ *****************************************************************************/
+void ob_landmark_free(obsess_book_cb *cb)
+{
+   ob_oracle *o = cb->oracle;
+
+   if(o != NULL)
+   {
+      landmark_join(o);
+      landmark_table_free(o->table);
+      free(o->gone);
+      pthread_mutex_destroy(&o->lock);
+      free(o);
+      cb->oracle = NULL;
+   }
+}
+
+/******************************************************************************
+ * Function:      landmark_table
+ *
+ * Description:   Pick landmarks and run a BFS from each one.
+ *
+ * Params:        ob_csr *g - copy of the graph.
+ *                int count - number of landmarks.
+ *                ob_landmark_pick pick - how to pick them.
+ *                unsigned int *seed - seed for random picks.
+ *
+ * Returns:       ob_landmark_table* - the tables or NULL if there is no memory.
+ *
+ * Notes:         Picking by degree keeps a small sorted list of the best
+ *                users seen, count is small so insertion is cheap.
+ *
+ *****************************************************************************/
+static ob_landmark_table *landmark_table(ob_csr *g, int count,
+                                         ob_landmark_pick pick,
+                                         unsigned int *seed)
+{
+   ob_landmark_table *t;
+   long degree;
+   long v;
+   int *queue;
+   int n = 0;
+   int i;
+
+   if(count > g->users)
+   {
+      count = (int)g->users;
+   }
+
+   t = calloc(1,sizeof(ob_landmark_table));
+   if(t == NULL)
+   {
+      goto EXIT_landmark_table_0;
+   }
+   t->users = g->users;
+   t->id = malloc(sizeof(int) * (count ? count : 1));
+   t->dist = malloc((size_t)count * g->users + 1);
+   queue = malloc(sizeof(int) * (g->users + 1));
+   if(t->id == NULL || t->dist == NULL || queue == NULL)
+   {
+      goto EXIT_landmark_table_1;
+   }
+
+   if(pick == OB_LANDMARK_RANDOM)
+   {
+      while(n < count)
+      {
+         v = rand_r(seed) % g->users;
+         for(i = 0; i < n && t->id[i] != v; i++)
+         {
+         }
+         if(i == n)
+         {//Not picked yet.
+            t->id[n++] = (int)v;
+         }
+      }
+   }
+   else
+   {
+      for(v = 0; v < g->users; v++)
+      {
+         degree = g->off[v + 1] - g->off[v];
+         if(n == count &&
+            degree <= g->off[t->id[n - 1] + 1] - g->off[t->id[n - 1]])
+         {//Not better than the worst landmark so far.
+            continue;
+         }
+         //Slide the worse landmarks down and insert.
+         i = n < count ? n++ : n - 1;
+         while(i > 0 && degree > g->off[t->id[i - 1] + 1] - g->off[t->id[i - 1]])
+         {
+            t->id[i] = t->id[i - 1];
+            i--;
+         }
+         t->id[i] = (int)v;
+      }
+   }
+   t->count = n;
+
+   for(i = 0; i < n; i++)
+   {
+      landmark_bfs(g,t->id[i],t->dist + (long)i * g->users,queue);
+   }
+   free(queue);
+
+   goto EXIT_landmark_table_0;
+
+EXIT_landmark_table_1:
+   free(queue);
+   landmark_table_free(t);
+   t = NULL;
+EXIT_landmark_table_0:
+   return t;
+}
+
+/******************************************************************************
+ * Function:      landmark_bfs
+ *
+ * Description:   Fill in the distance from one landmark to every user.
+ *
+ * Params:        ob_csr *g - copy of the graph.
+ *                int src - user_ID of the landmark.
+ *                unsigned char *dist - distance table of the landmark.
+ *                int *queue - scratch queue of g->users entries.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Distances stop at LANDMARK_FAR - 1, farther is plenty for
+ *                a DERPCON.
+ *
+ *****************************************************************************/
+static void landmark_bfs(ob_csr *g, int src, unsigned char *dist, int *queue)
+{
+   long head = 0;
+   long tail = 0;
+   long e;
+   int v;
+   int w;
+
+   memset(dist,LANDMARK_FAR,g->users);
+   dist[src] = 0;
+   queue[tail++] = src;
+
+   while(head < tail)
+   {
+      v = queue[head++];
+      if(dist[v] == LANDMARK_FAR - 1)
+      {
+         continue;
+      }
+      for(e = g->off[v]; e < g->off[v + 1]; e++)
+      {
+         w = g->adj[e];
+         if(dist[w] == LANDMARK_FAR)
+         {
+            dist[w] = dist[v] + 1;
+            queue[tail++] = w;
+         }
+      }
+   }
+}
+
+/******************************************************************************
+ * Function:      landmark_table_free
+ *
+ * Description:   Free a set of landmark tables.
+ *
+ * Params:        ob_landmark_table *t - the tables, may be NULL.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void landmark_table_free(ob_landmark_table *t)
+{
+   if(t != NULL)
+   {
+      free(t->id);
+      free(t->dist);
+      free(t);
+   }
+}
+
+/******************************************************************************
+ * Function:      landmark_swap
+ *
+ * Description:   Make new tables the current ones.
+ *
+ * Params:        ob_oracle *o - the oracle.
+ *                ob_landmark_table *t - the new tables.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Readers hold the lock while they look at the tables, so the
+ *                old tables can be freed as soon as they are swapped out.
+ *
+ *****************************************************************************/
+static void landmark_swap(ob_oracle *o, ob_landmark_table *t)
+{
+   ob_landmark_table *old;
+
+   pthread_mutex_lock(&o->lock);
+   old = o->table;
+   o->table = t;
+   pthread_mutex_unlock(&o->lock);
+
+   landmark_table_free(old);
+}
+
+/******************************************************************************
+ * Function:      landmark_worker
+ *
+ * Description:   Rebuild thread, builds tables from a copy of the graph.
+ *
+ * Params:        void *arg - pointer to the landmark_job.
+ *
+ * Returns:       NULL.
+ *
+ * Notes:         Keeps the old tables if there is no memory for new ones.
+ *
+ *****************************************************************************/
+static void *landmark_worker(void *arg)
+{
+   landmark_job *job = arg;
+   ob_oracle *o = job->oracle;
+   ob_landmark_table *t;
+
+   t = landmark_table(job->g,o->count,o->pick,&o->seed);
+   if(t != NULL)
+   {
+      t->gen = job->gen;
+      landmark_swap(o,t);
+   }
+   ob_csr_free(job->g);
+   free(job);
+
+   __sync_lock_release(&o->running);
+   return NULL;
+}
+
+/******************************************************************************
+ * Function:      landmark_join
+ *
+ * Description:   Wait for the rebuild thread if there is one.
+ *
+ * Params:        ob_oracle *o - the oracle.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void landmark_join(ob_oracle *o)
+{
+   if(o->joinable)
+   {
+      pthread_join(o->thread,NULL);
+      o->joinable = 0;
+   }
+}
+
+/******************************************************************************
+ * Function:      landmark_stale
+ *
+ * Description:   Check if a change was made after the graph of a table was
+ *                copied.
+ *
+ * Params:        unsigned int mark - gen marked for the change, 0 for none.
+ *                unsigned int gen - gen of the table.
+ *
+ * Returns:       int - non zero if the table does not know of the change.
+ *
+ * Notes:         A mark made while copy gen was the last one taken happened
+ *                after that copy.
+ *
+ *****************************************************************************/
+static int landmark_stale(unsigned int mark, unsigned int gen)
+{
+   return mark != 0 && mark >= gen;
+}
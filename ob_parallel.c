@@ -0,0 +1,150 @@
+/*****************************************************************************
+ *
+ *     ob_parallel.c
+ *
+ *   Description: Parallel loop used by the kernels that have to visit every
+ *                user of the obsess book.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Most threads a single loop will start.
+#define OB_MAX_THREADS 64
+//_____________________________________________________________________________
+//                                                                        Types
+
+//State shared by all the threads running one loop.
+typedef struct _ob_loop
+{
+   long        n;        //Number of indexes in the loop.
+   long        grain;    //Number of indexes taken at a time.
+   long        next;     //Next index nobody has taken yet.
+   ob_range_fn fn;       //Loop body.
+   void       *ctx;      //Context passed to the loop body.
+}ob_loop;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static void *loop_worker(void *arg);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_parallel_for
+ *
+ * Description:   Run fn over the indexes [0, n) on the threads of the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                long n - number of indexes.
+ *                long grain - number of indexes handed out at a time.
+ *                ob_range_fn fn - loop body, called with [begin, end) ranges.
+ *                void *ctx - context passed to fn.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Ranges are handed out from a shared counter so threads that
+ *                draw cheap users keep drawing instead of waiting on the ones
+ *                that drew the popular users.  The caller runs a share of the
+ *                work and the loop is done when this returns.
+ *
+ *****************************************************************************/
+void ob_parallel_for(obsess_book_cb *cb, long n, long grain,
+                     ob_range_fn fn, void *ctx)
+{
+   pthread_t thread[OB_MAX_THREADS];
+   ob_loop loop;
+   long chunks;
+   int threads;
+   int started;
+   int i;
+
+   if(n <= 0)
+   {
+      return;
+   }
+   if(grain < 1)
+   {
+      grain = 1;
+   }
+
+   loop.n = n;
+   loop.grain = grain;
+   loop.next = 0;
+   loop.fn = fn;
+   loop.ctx = ctx;
+
+   //No more threads than there are ranges to hand out.
+   chunks = (n + grain - 1) / grain;
+   threads = cb->threads;
+   if(threads > OB_MAX_THREADS)
+   {
+      threads = OB_MAX_THREADS;
+   }
+   if(threads > chunks)
+   {
+      threads = (int)chunks;
+   }
+
+   //The calling thread is one of the workers.
+   started = 0;
+   for(i = 1; i < threads; i++)
+   {
+      if(pthread_create(&thread[started],NULL,loop_worker,&loop) == 0)
+      {
+         started++;
+      }
+   }
+   loop_worker(&loop);
+
+   for(i = 0; i < started; i++)
+   {
+      pthread_join(thread[i],NULL);
+   }
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      loop_worker
+ *
+ * Description:   Take ranges from the loop until there are none left.
+ *
+ * Params:        void *arg - pointer to the ob_loop.
+ *
+ * Returns:       NULL.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void *loop_worker(void *arg)
+{
+   ob_loop *loop = arg;
+   long begin;
+   long end;
+
+   for(;;)
+   {
+      begin = __sync_fetch_and_add(&loop->next,loop->grain);
+      if(begin >= loop->n)
+      {
+         break;
+      }
+      end = begin + loop->grain;
+      if(end > loop->n)
+      {
+         end = loop->n;
+      }
+      loop->fn(loop->ctx,begin,end);
+   }
+   return NULL;
+}
@@ -0,0 +1,810 @@
+/*****************************************************************************
+ *
+ *     ob_prefix.c
+ *
+ *   Description: Index of the names and account handles of the users in
+ *                lexicographic order, for type ahead.  The keys of the
+ *                newest users are appended to a small delta that readers
+ *                scan.  A full delta is sorted and merged into a few sorted
+ *                arrays that never change once published, each level holds
+ *                PREFIX_FANOUT times more keys than the one before, so a key
+ *                is copied a handful of times however big the book gets.
+ *                Readers take no lock, they look for the prefix in the delta
+ *                and every array and merge what they find.  Each key carries
+ *                its first 8 characters, so searches and merges seldom go to
+ *                the strings, and big arrays keep the offset of the first
+ *                key of each first character.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Keys in the delta, readers scan all of them.
+#define PREFIX_DELTA 256
+
+//How much bigger each level of sorted arrays is than the one before.
+#define PREFIX_FANOUT 8
+
+//Arrays this big or bigger get the offsets of their first characters.
+#define PREFIX_INDEXED 4096
+
+//Most arrays made by one change of the index.
+#define PREFIX_MADE (OB_PREFIX_LEVELS + 2)
+//_____________________________________________________________________________
+//                                                                        Types
+//Prefix being looked for.
+typedef struct _prefix_want
+{
+   const char   *str;
+   int           len;
+   unsigned long head;        //First 8 characters, like a key.
+   unsigned long mask;        //Bits of head the prefix covers.
+}prefix_want;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static unsigned long prefix_head(const char *s);
+static long prefix_cap(int level);
+static ob_prefix_run *prefix_run_new(long n);
+static ob_prefix *prefix_flush(obsess_book_cb *cb);
+static ob_prefix_run *prefix_merge(obsess_book_cb *cb, const ob_prefix_run *a,
+                                   const ob_prefix_run *b, int drop);
+static void prefix_index(ob_prefix_run *r);
+static long prefix_lower(const ob_prefix_run *r, const prefix_want *w);
+static int prefix_match(const ob_prefix_key *k, const prefix_want *w);
+static int prefix_cmp(const ob_prefix_key *a, const ob_prefix_key *b);
+static int prefix_qcmp(const void *a, const void *b);
+static void prefix_publish(obsess_book_cb *cb, ob_prefix *set,
+                           ob_prefix_run **made, int n_made);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_find_prefix
+ *
+ * Description:   Find the users whose name or account handle starts with a
+ *                prefix.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const char *prefix - the prefix, "" for every user.
+ *                user **out - gets the users.
+ *                int max - number of entries in out.
+ *
+ * Returns:       int >= 0 - number of users put in out.
+ *                -USER_INVALID_PARAMER - bad parameter.
+ *
+ * Notes:         The users come in the order of the name or account handle
+ *                that starts with the prefix, the name when both do, and
+ *                each user once.  Never takes a lock, a user shows up once
+ *                ob_new_user returns it.  Costs a scan of the delta, a search
+ *                per array of the index and a step per user returned.
+ *
+ *****************************************************************************/
+int ob_find_prefix(obsess_book_cb *cb, const char *prefix, user **out, int max)
+{
+   ob_prefix_key fresh[PREFIX_DELTA];
+   const ob_prefix_key *src[OB_PREFIX_LEVELS + 1];
+   const ob_prefix_key *best;
+   const ob_prefix_key *k;
+   const ob_prefix_run *r;
+   ob_prefix *set;
+   prefix_want w;
+   long pos[OB_PREFIX_LEVELS + 1];
+   long end[OB_PREFIX_LEVELS + 1];
+   long n_fresh = 0;
+   long i;
+   int n = 0;
+   int pick;
+   int s;
+
+   if(cb == NULL || prefix == NULL || max < 0 || (out == NULL && max > 0))
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   w.str = prefix;
+   w.len = strlen(prefix);
+   w.head = prefix_head(prefix);
+   w.mask = w.len >= 8 ? ~0UL : ~(~0UL >> (8 * w.len));
+
+   ob_epoch_enter(cb);
+   set = __atomic_load_n(&cb->prefix,__ATOMIC_ACQUIRE);
+   if(set == NULL)
+   {
+      goto EXIT_find_prefix_0;
+   }
+
+   //The delta is in no order, its keys with the prefix are sorted here.
+   r = set->delta;
+   end[0] = __atomic_load_n(&r->n,__ATOMIC_ACQUIRE);
+   for(i = 0; i < end[0]; i++)
+   {
+      if(prefix_match(&r->key[i],&w))
+      {
+         fresh[n_fresh++] = r->key[i];
+      }
+   }
+   qsort(fresh,n_fresh,sizeof(ob_prefix_key),prefix_qcmp);
+   src[0] = fresh;
+   pos[0] = 0;
+   end[0] = n_fresh;
+   for(s = 0; s < OB_PREFIX_LEVELS; s++)
+   {
+      r = set->run[s];
+      src[s + 1] = r != NULL ? r->key : NULL;
+      pos[s + 1] = r != NULL ? prefix_lower(r,&w) : 0;
+      end[s + 1] = r != NULL ? r->n : 0;
+   }
+
+   while(n < max)
+   {
+      //Smallest key that still starts with the prefix.
+      best = NULL;
+      pick = -1;
+      for(s = 0; s <= OB_PREFIX_LEVELS; s++)
+      {
+         if(pos[s] >= end[s])
+         {
+            continue;
+         }
+         k = &src[s][pos[s]];
+         if(!prefix_match(k,&w))
+         {//Past the keys with the prefix.
+            end[s] = pos[s];
+            continue;
+         }
+         if(best == NULL || prefix_cmp(k,best) < 0)
+         {
+            best = k;
+            pick = s;
+         }
+      }
+      if(best == NULL)
+      {
+         break;
+      }
+      pos[pick]++;
+
+      if(ob_user_at(cb,best->usr->user_ID) != best->usr)
+      {//Deleted.
+         continue;
+      }
+      if(best->key != ob_user_name(best->usr) &&
+         strncmp(ob_user_name(best->usr),prefix,w.len) == 0)
+      {//The name starts with the prefix too and gives the user.
+         continue;
+      }
+      out[n++] = best->usr;
+   }
+
+EXIT_find_prefix_0:
+   ob_epoch_exit(cb);
+   return n;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      ob_prefix_add
+ *
+ * Description:   Put the name and account handle of a new user in the index.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                user *usr - the user, already in the book.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - user added.
+ *                              USER_NO_MEM - not enough memory, the index is
+ *                                            as it was.
+ *
+ * Notes:         Takes the prefix lock, which no other lock is taken under.
+ *                Once every PREFIX_DELTA keys the delta is merged into the
+ *                sorted arrays while the lock is held, now and then into a
+ *                big one, and the other users signing up wait for it.
+ *
+ *****************************************************************************/
+user_ret_code ob_prefix_add(obsess_book_cb *cb, user *usr)
+{
+   ob_prefix_run *delta;
+   ob_prefix *set;
+   long n;
+
+   pthread_mutex_lock(&cb->prefix_lock);
+   set = cb->prefix;
+   if(set == NULL || set->delta->n + 2 > PREFIX_DELTA)
+   {
+      set = prefix_flush(cb);
+      if(set == NULL)
+      {
+         pthread_mutex_unlock(&cb->prefix_lock);
+         return -USER_NO_MEM;
+      }
+   }
+
+   //Readers only look at the keys below n.
+   delta = set->delta;
+   n = delta->n;
+   delta->key[n].head = prefix_head(ob_user_name(usr));
+   delta->key[n].key = ob_user_name(usr);
+   delta->key[n++].usr = usr;
+   if(usr->handle_off != 0)
+   {
+      delta->key[n].head = prefix_head(ob_user_handle(usr));
+      delta->key[n].key = ob_user_handle(usr);
+      delta->key[n++].usr = usr;
+   }
+   __atomic_store_n(&delta->n,n,__ATOMIC_RELEASE);
+   pthread_mutex_unlock(&cb->prefix_lock);
+
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      ob_prefix_compact
+ *
+ * Description:   Merge the index into one array without the deleted users.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - index merged.
+ *                              USER_NO_MEM - not enough memory, the index is
+ *                                            as it was.
+ *
+ * Notes:         Caller holds the write lock, so no user is deleted or gets
+ *                a new user_ID while the keys are checked.  Deleted users
+ *                are skipped by the readers until then.
+ *
+ *****************************************************************************/
+user_ret_code ob_prefix_compact(obsess_book_cb *cb)
+{
+   ob_prefix_run *made[PREFIX_MADE];
+   ob_prefix_run *carry;
+   ob_prefix *old;
+   ob_prefix *set;
+   int n_made = 0;
+   int i;
+
+   pthread_mutex_lock(&cb->prefix_lock);
+   old = cb->prefix;
+   if(old == NULL)
+   {
+      pthread_mutex_unlock(&cb->prefix_lock);
+      return USER_SUCCESS;
+   }
+   set = calloc(1,sizeof(ob_prefix));
+   if(set == NULL)
+   {
+      goto EXIT_prefix_compact_1;
+   }
+   set->delta = prefix_run_new(PREFIX_DELTA);
+   if(set->delta == NULL)
+   {
+      goto EXIT_prefix_compact_1;
+   }
+   set->delta->n = 0;
+
+   //The sorted delta, then every array, merged into one.
+   carry = prefix_run_new(old->delta->n);
+   if(carry == NULL)
+   {
+      goto EXIT_prefix_compact_1;
+   }
+   made[n_made++] = carry;
+   memcpy(carry->key,old->delta->key,sizeof(ob_prefix_key) * carry->n);
+   qsort(carry->key,carry->n,sizeof(ob_prefix_key),prefix_qcmp);
+   for(i = 0; i < OB_PREFIX_LEVELS; i++)
+   {
+      if(old->run[i] == NULL)
+      {
+         continue;
+      }
+      carry = prefix_merge(cb,carry,old->run[i],1);
+      if(carry == NULL)
+      {
+         goto EXIT_prefix_compact_1;
+      }
+      made[n_made++] = carry;
+   }
+   if(n_made == 1)
+   {//Only the delta, which still has the deleted users.
+      carry = prefix_merge(cb,NULL,carry,1);
+      if(carry == NULL)
+      {
+         goto EXIT_prefix_compact_1;
+      }
+      made[n_made++] = carry;
+   }
+
+   //The one array goes to the smallest level it fits in.
+   for(i = 0; i < OB_PREFIX_LEVELS - 1 && carry->n >= prefix_cap(i); i++)
+   {
+   }
+   set->run[i] = carry;
+   prefix_publish(cb,set,made,n_made);
+   pthread_mutex_unlock(&cb->prefix_lock);
+   return USER_SUCCESS;
+
+EXIT_prefix_compact_1:
+   pthread_mutex_unlock(&cb->prefix_lock);
+   for(i = 0; i < n_made; i++)
+   {
+      free(made[i]);
+   }
+   if(set != NULL)
+   {
+      free(set->delta);
+      free(set);
+   }
+   return -USER_NO_MEM;
+}
+
+/******************************************************************************
+ * Function:      ob_prefix_free
+ *
+ * Description:   Free the index.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Called by ob_exit.
+ *
+ *****************************************************************************/
+void ob_prefix_free(obsess_book_cb *cb)
+{
+   int i;
+
+   if(cb->prefix != NULL)
+   {
+      free(cb->prefix->delta);
+      for(i = 0; i < OB_PREFIX_LEVELS; i++)
+      {
+         free(cb->prefix->run[i]);
+      }
+      free(cb->prefix);
+      cb->prefix = NULL;
+   }
+   pthread_mutex_destroy(&cb->prefix_lock);
+}
+
+/******************************************************************************
+ * Function:      prefix_head
+ *
+ * Description:   First 8 characters of a string as a number that orders like
+ *                the string.
+ *
+ * Params:        const char *s - the string.
+ *
+ * Returns:       unsigned long - the characters, the first one on top and
+ *                                zeros past the end of the string.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static unsigned long prefix_head(const char *s)
+{
+   unsigned long head = 0;
+   int i;
+
+   for(i = 0; i < 8; i++)
+   {
+      head <<= 8;
+      if(*s != '\0')
+      {
+         head |= (unsigned char)*s++;
+      }
+   }
+   return head;
+}
+
+/******************************************************************************
+ * Function:      prefix_cap
+ *
+ * Description:   Keys an array of a level holds before it moves up to the
+ *                next one.
+ *
+ * Params:        int level - the level, 0 is the smallest.
+ *
+ * Returns:       long - the number of keys.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static long prefix_cap(int level)
+{
+   long cap = PREFIX_DELTA * PREFIX_FANOUT;
+
+   while(level-- > 0)
+   {
+      cap *= PREFIX_FANOUT;
+   }
+   return cap;
+}
+
+/******************************************************************************
+ * Function:      prefix_run_new
+ *
+ * Description:   Allocate an array of keys.
+ *
+ * Params:        long n - number of keys.
+ *
+ * Returns:       ob_prefix_run* - the array, NULL if there is no memory.
+ *
+ * Notes:         The offsets of the first characters come after the keys
+ *                in big arrays.
+ *
+ *****************************************************************************/
+static ob_prefix_run *prefix_run_new(long n)
+{
+   ob_prefix_run *r;
+   size_t bytes = sizeof(ob_prefix_run) + sizeof(ob_prefix_key) * n;
+
+   if(n >= PREFIX_INDEXED)
+   {
+      bytes += sizeof(long) * 257;
+   }
+   r = malloc(bytes);
+   if(r != NULL)
+   {
+      r->n = n;
+      r->first = n >= PREFIX_INDEXED ? (long*)(r->key + n) : NULL;
+   }
+   return r;
+}
+
+/******************************************************************************
+ * Function:      prefix_flush
+ *
+ * Description:   Merge the delta into the sorted arrays and start an empty
+ *                one.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       ob_prefix* - the new index, NULL if there is no memory.
+ *
+ * Notes:         Caller holds the prefix lock.  The first call makes the
+ *                index.  The sorted delta goes into level 0, an array that
+ *                grows past its level moves up and is merged into the next.
+ *
+ *****************************************************************************/
+static ob_prefix *prefix_flush(obsess_book_cb *cb)
+{
+   ob_prefix_run *made[PREFIX_MADE];
+   ob_prefix_run *carry;
+   ob_prefix_run *merged;
+   ob_prefix *old = cb->prefix;
+   ob_prefix *set;
+   int n_made = 0;
+   int i;
+
+   set = calloc(1,sizeof(ob_prefix));
+   if(set == NULL)
+   {
+      return NULL;
+   }
+   set->delta = prefix_run_new(PREFIX_DELTA);
+   if(set->delta == NULL)
+   {
+      goto EXIT_prefix_flush_1;
+   }
+   set->delta->n = 0;
+   if(old == NULL)
+   {
+      prefix_publish(cb,set,made,0);
+      return set;
+   }
+   memcpy(set->run,old->run,sizeof(set->run));
+
+   carry = prefix_run_new(old->delta->n);
+   if(carry == NULL)
+   {
+      goto EXIT_prefix_flush_1;
+   }
+   made[n_made++] = carry;
+   memcpy(carry->key,old->delta->key,sizeof(ob_prefix_key) * carry->n);
+   qsort(carry->key,carry->n,sizeof(ob_prefix_key),prefix_qcmp);
+   for(i = 0; i < OB_PREFIX_LEVELS; i++)
+   {
+      if(set->run[i] == NULL)
+      {
+         set->run[i] = carry;
+         break;
+      }
+      merged = prefix_merge(cb,set->run[i],carry,0);
+      if(merged == NULL)
+      {
+         goto EXIT_prefix_flush_1;
+      }
+      made[n_made++] = merged;
+      if(merged->n < prefix_cap(i) || i == OB_PREFIX_LEVELS - 1)
+      {
+         set->run[i] = merged;
+         break;
+      }
+      set->run[i] = NULL;
+      carry = merged;
+   }
+   prefix_publish(cb,set,made,n_made);
+   return set;
+
+EXIT_prefix_flush_1:
+   for(i = 0; i < n_made; i++)
+   {
+      free(made[i]);
+   }
+   free(set->delta);
+   free(set);
+   return NULL;
+}
+
+/******************************************************************************
+ * Function:      prefix_merge
+ *
+ * Description:   Merge two sorted arrays of keys into a new one.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const ob_prefix_run *a - one array, may be NULL.
+ *                const ob_prefix_run *b - the other array.
+ *                int drop - non zero to leave out the deleted users.
+ *
+ * Returns:       ob_prefix_run* - the merged array, NULL if there is no
+ *                                 memory.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static ob_prefix_run *prefix_merge(obsess_book_cb *cb, const ob_prefix_run *a,
+                                   const ob_prefix_run *b, int drop)
+{
+   const ob_prefix_key *k;
+   ob_prefix_run *r;
+   long na = a != NULL ? a->n : 0;
+   long i = 0;
+   long j = 0;
+   long n = 0;
+
+   r = prefix_run_new(na + b->n);
+   if(r == NULL)
+   {
+      return NULL;
+   }
+   while(i < na || j < b->n)
+   {
+      if(j >= b->n || (i < na && prefix_cmp(&a->key[i],&b->key[j]) <= 0))
+      {
+         k = &a->key[i++];
+      }
+      else
+      {
+         k = &b->key[j++];
+      }
+      if(drop && ob_user_at(cb,k->usr->user_ID) != k->usr)
+      {
+         continue;
+      }
+      r->key[n++] = *k;
+   }
+   if(n < r->n)
+   {//Smaller than allocated, the offsets go right after the keys.
+      r->first = n >= PREFIX_INDEXED ? (long*)(r->key + n) : NULL;
+      r->n = n;
+   }
+   prefix_index(r);
+   return r;
+}
+
+/******************************************************************************
+ * Function:      prefix_index
+ *
+ * Description:   Fill in the offsets of the first characters of an array.
+ *
+ * Params:        ob_prefix_run *r - the array.
+ *
+ * Returns:       None.
+ *
+ * Notes:         first[c] is the first key whose first character is c or
+ *                more, first[256] the number of keys.
+ *
+ *****************************************************************************/
+static void prefix_index(ob_prefix_run *r)
+{
+   long i = 0;
+   int c;
+
+   if(r->first == NULL)
+   {
+      return;
+   }
+   for(c = 0; c < 256; c++)
+   {
+      while(i < r->n && (long)(r->key[i].head >> 56) < c)
+      {
+         i++;
+      }
+      r->first[c] = i;
+   }
+   r->first[256] = r->n;
+}
+
+/******************************************************************************
+ * Function:      prefix_lower
+ *
+ * Description:   Find the first key of a sorted array that is not less than
+ *                a prefix.
+ *
+ * Params:        const ob_prefix_run *r - the array.
+ *                const prefix_want *w - the prefix.
+ *
+ * Returns:       long - the key, r->n if there is none.
+ *
+ * Notes:         The keys that start with the prefix follow it.
+ *
+ *****************************************************************************/
+static long prefix_lower(const ob_prefix_run *r, const prefix_want *w)
+{
+   const ob_prefix_key *k;
+   long lo = 0;
+   long hi = r->n;
+   long mid;
+   int c;
+
+   if(r->first != NULL && w->len > 0)
+   {
+      c = (unsigned char)w->str[0];
+      lo = r->first[c];
+      hi = r->first[c + 1];
+      if(lo == hi)
+      {//No key starts with the character.
+         return r->n;
+      }
+   }
+   while(lo < hi)
+   {
+      mid = lo + (hi - lo) / 2;
+      k = &r->key[mid];
+      if(k->head < w->head ||
+         (k->head == w->head && w->len > 8 && strcmp(k->key + 8,w->str + 8) < 0))
+      {
+         lo = mid + 1;
+      }
+      else
+      {
+         hi = mid;
+      }
+   }
+   return lo;
+}
+
+/******************************************************************************
+ * Function:      prefix_match
+ *
+ * Description:   Check that a key starts with a prefix.
+ *
+ * Params:        const ob_prefix_key *k - the key.
+ *                const prefix_want *w - the prefix.
+ *
+ * Returns:       int - non zero if it does.
+ *
+ * Notes:         Prefixes of up to 8 characters never go to the string.
+ *
+ *****************************************************************************/
+static int prefix_match(const ob_prefix_key *k, const prefix_want *w)
+{
+   if(((k->head ^ w->head) & w->mask) != 0)
+   {
+      return 0;
+   }
+   return w->len <= 8 || strncmp(k->key + 8,w->str + 8,w->len - 8) == 0;
+}
+
+/******************************************************************************
+ * Function:      prefix_cmp
+ *
+ * Description:   Order of two keys.
+ *
+ * Params:        const ob_prefix_key *a, const ob_prefix_key *b - the keys.
+ *
+ * Returns:       int - <0, 0 or >0.
+ *
+ * Notes:         Equal keys of different users are kept in a fixed order.
+ *
+ *****************************************************************************/
+static int prefix_cmp(const ob_prefix_key *a, const ob_prefix_key *b)
+{
+   int rc;
+
+   if(a->head != b->head)
+   {
+      return a->head < b->head ? -1 : 1;
+   }
+   if((a->head & 0xff) != 0)
+   {//Both go past 8 characters.
+      rc = strcmp(a->key + 8,b->key + 8);
+      if(rc != 0)
+      {
+         return rc;
+      }
+   }
+   return (a->usr > b->usr) - (a->usr < b->usr);
+}
+
+/******************************************************************************
+ * Function:      prefix_qcmp
+ *
+ * Description:   prefix_cmp for qsort.
+ *
+ * Params:        const void *a, const void *b - the keys.
+ *
+ * Returns:       int - <0, 0 or >0.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int prefix_qcmp(const void *a, const void *b)
+{
+   return prefix_cmp(a,b);
+}
+
+/******************************************************************************
+ * Function:      prefix_publish
+ *
+ * Description:   Put a new index in place of the old one.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_prefix *set - the new index.
+ *                ob_prefix_run **made - arrays made for the new index.
+ *                int n_made - number of them.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds the prefix lock.  The old delta and the arrays
+ *                of the old index that are not in the new one are retired,
+ *                arrays made along the way that no reader saw are freed.
+ *
+ *****************************************************************************/
+static void prefix_publish(obsess_book_cb *cb, ob_prefix *set,
+                           ob_prefix_run **made, int n_made)
+{
+   ob_prefix *old = cb->prefix;
+   int kept;
+   int i;
+   int j;
+
+   __atomic_store_n(&cb->prefix,set,__ATOMIC_RELEASE);
+   for(i = 0; i < n_made; i++)
+   {
+      for(j = 0, kept = 0; j < OB_PREFIX_LEVELS && !kept; j++)
+      {
+         kept = set->run[j] == made[i];
+      }
+      if(!kept)
+      {
+         free(made[i]);
+      }
+   }
+   if(old == NULL)
+   {
+      return;
+   }
+   for(i = 0; i < OB_PREFIX_LEVELS; i++)
+   {
+      for(j = 0, kept = 0; j < OB_PREFIX_LEVELS && !kept; j++)
+      {
+         kept = set->run[j] == old->run[i];
+      }
+      if(!kept)
+      {
+         ob_epoch_retire(cb,old->run[i]);
+      }
+   }
+   ob_epoch_retire(cb,old->delta);
+   ob_epoch_retire(cb,old);
+}
@@ -0,0 +1,205 @@
+/*****************************************************************************
+ *
+ *     ob_query.c
+ *
+ *   Description: Batches of read only requests.  The names of a whole batch
+ *                are looked up together with ob_find_users, then the
+ *                requests are spread over the threads of the book.  Used by
+ *                the query server, which gathers the requests of all its
+ *                clients into one batch.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <stdlib.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Requests handed to a thread at a time, a batch smaller than two of these
+//runs on the calling thread alone.
+#define QUERY_GRAIN 16
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Batch being run.
+typedef struct _query_batch
+{
+   ob_query *q;
+   user    **usr;                //Users of x and y of each request.
+}query_batch;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static void query_range(void *ctx, long begin, long end);
+static int query_run(ob_query *q, user *x, user *y);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_query_batch
+ *
+ * Description:   Answer a batch of read only requests.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_query *q - the requests, result and out are filled in.
+ *                int n - number of requests.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - every request answered, see
+ *                                             the result of each.
+ *                              USER_INVALID_PARAMER - bad parameter.
+ *                              USER_NO_MEM - no memory, nothing answered.
+ *
+ * Notes:         Results:
+ *                OB_QUERY_FIND - 1 and the account handle in out[0], 0 if
+ *                                there is no such user.
+ *                OB_QUERY_DERPCON - the DERPCON, max_derpcon if the users
+ *                                   have no link, same as DERPCON.
+ *                OB_QUERY_MUTUAL - number of mutual BFFs, the names of the
+ *                                  first max_len go in out.
+ *                A request naming a user that is not in the book gets
+ *                -USER_INVALID_PARAMER, one that ran out of memory
+ *                -USER_NO_MEM.  The names put in out stay readable until
+ *                ob_exit.  Requests may run in any order and at the same
+ *                time as writers, each sees the book as it is when it runs.
+ *
+ *****************************************************************************/
+user_ret_code ob_query_batch(obsess_book_cb *cb, ob_query *q, int n)
+{
+   query_batch b;
+   char **names;
+   int i;
+
+   if(cb == NULL || q == NULL || n < 0)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   if(n == 0)
+   {
+      return USER_SUCCESS;
+   }
+
+   names = malloc(sizeof(char*) * n * 2);
+   b.usr = malloc(sizeof(user*) * n * 2);
+   if(names == NULL || b.usr == NULL)
+   {
+      free(names);
+      free(b.usr);
+      return -USER_NO_MEM;
+   }
+
+   //Every name of the batch in one go, a missing y looks up x again.
+   for(i = 0; i < n; i++)
+   {
+      names[2 * i] = q[i].x;
+      names[2 * i + 1] = q[i].y != NULL ? q[i].y : q[i].x;
+   }
+   ob_find_users(cb,names,n * 2,b.usr);
+
+   b.q = q;
+   ob_parallel_for(cb,n,QUERY_GRAIN,query_range,&b);
+
+   free(names);
+   free(b.usr);
+   return USER_SUCCESS;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      query_range
+ *
+ * Description:   Answer some requests of a batch.
+ *
+ * Params:        void *ctx - the batch.
+ *                long begin - first request.
+ *                long end - one past the last request.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void query_range(void *ctx, long begin, long end)
+{
+   query_batch *b = ctx;
+   long i;
+
+   for(i = begin; i < end; i++)
+   {
+      b->q[i].result = query_run(&b->q[i],b->usr[2 * i],b->usr[2 * i + 1]);
+   }
+}
+
+/******************************************************************************
+ * Function:      query_run
+ *
+ * Description:   Answer one request.
+ *
+ * Params:        ob_query *q - the request.
+ *                user *x - user named by x, NULL if there is none.
+ *                user *y - user named by y, NULL if there is none.
+ *
+ * Returns:       int - the result, see ob_query_batch.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int query_run(ob_query *q, user *x, user *y)
+{
+   user **mutual;
+   int derpcon;
+   int rc;
+   int i;
+
+   switch(q->op)
+   {
+   case OB_QUERY_FIND:
+      if(x == NULL)
+      {
+         return 0;
+      }
+      if(q->max_len > 0)
+      {
+         q->out[0] = ob_user_handle(x);
+      }
+      return 1;
+
+   case OB_QUERY_DERPCON:
+      if(x == NULL || y == NULL)
+      {
+         return -USER_INVALID_PARAMER;
+      }
+      rc = ob_derpcon_bounded(x,y,x->cb->max_derpcon - 1,NULL,&derpcon);
+      if(rc == OB_DERPCON_WITHIN)
+      {
+         return derpcon;
+      }
+      return rc == OB_DERPCON_BEYOND ? x->cb->max_derpcon : rc;
+
+   case OB_QUERY_MUTUAL:
+      if(x == NULL || y == NULL || q->max_len < 0)
+      {
+         return -USER_INVALID_PARAMER;
+      }
+      mutual = malloc(sizeof(user*) * (q->max_len + 1));
+      if(mutual == NULL)
+      {
+         return -USER_NO_MEM;
+      }
+      rc = ob_mutual_BFFs(x,y,mutual,q->max_len);
+      for(i = 0; i < rc && i < q->max_len; i++)
+      {
+         q->out[i] = ob_user_name(mutual[i]);
+      }
+      free(mutual);
+      return rc;
+
+   default:
+      return -USER_INVALID_PARAMER;
+   }
+}
@@ -0,0 +1,857 @@
+/*****************************************************************************
+ *
+ *     ob_reach.c
+ *
+ *   Description: Approximate neighborhood sizes.  Every user carries a small
+ *                HyperLogLog sketch for each DERPCON level that counts how many
+ *                users can be reached within that level.  The sketches are
+ *                built with the iterative approximate neighborhood function
+ *                (ANF): the sketch of a level is the union of the user's and
+ *                the user's BFFs' sketches of the level below.  The writers
+ *                bring the sketches up to date every REACH_BATCH changed
+ *                pairs and keep an estimate of every sketch where readers
+ *                load it without a lock.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Number of sketches each user has, one per DERPCON level.
+#define REACH_LEVELS MAX_DREPCON
+
+//Number of users handed to a thread at a time while building.
+#define REACH_GRAIN 256
+
+//BFF pairs changed before a writer brings the sketches up to date.
+#define REACH_BATCH 64
+
+//Sketch of level lvl of user id.
+#define SKETCH(r,id,lvl) ((r)->regs + ((long)(id) * REACH_LEVELS + (lvl)) * OB_REACH_REGS)
+
+//Estimate of level lvl of user id in a view.
+#define ESTIMATE(v,id,lvl) ((v)->estimate[(long)(id) * REACH_LEVELS + (lvl)])
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Work list of users whose sketch of one level changed.
+typedef struct _reach_list
+{
+   int  *id;
+   long  len;
+   long  cap;
+}reach_list;
+
+//Context of one level of the parallel build.
+typedef struct _reach_pass
+{
+   obsess_book_cb *cb;
+   ob_reach       *r;
+   int             level;
+}reach_pass;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static void reach_singleton(unsigned char *regs, int id);
+static int reach_merge(unsigned char *dst, unsigned char *src);
+static float reach_count(unsigned char *regs);
+static void reach_level(void *ctx, long begin, long end);
+static void reach_put(ob_reach *r, long id, int lvl, float estimate);
+static void reach_changed(obsess_book_cb *cb, ob_reach *r, long pairs);
+static user_ret_code reach_resize(obsess_book_cb *cb, ob_reach *r, long users);
+static user_ret_code reach_flush(obsess_book_cb *cb, ob_reach *r);
+static user_ret_code reach_rebuild(obsess_book_cb *cb, ob_reach *r);
+static user_ret_code reach_push(reach_list *l, int id);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_reach_build
+ *
+ * Description:   Build the reach sketches of every user in the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - sketches built.
+ *                              USER_NO_MEM - not enough memory.
+ *
+ * Notes:         One pass per DERPCON level, each pass runs over the users in
+ *                parallel.  A pass only reads the level below, so the users of
+ *                a pass do not depend on each other.  Once built, the sketches
+ *                are kept up to date by the writers.  Calling again brings
+ *                them up to date right away.
+ *
+ *****************************************************************************/
+user_ret_code ob_reach_build(obsess_book_cb *cb)
+{
+   user_ret_code rc;
+   ob_reach *r;
+
+   if(cb == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   //The sketches are made once and live as long as the book.
+   pthread_mutex_lock(&cb->write_lock);
+   r = cb->reach;
+   if(r == NULL)
+   {
+      r = calloc(1,sizeof(ob_reach));
+      if(r == NULL)
+      {
+         pthread_mutex_unlock(&cb->write_lock);
+         return -USER_NO_MEM;
+      }
+      pthread_mutex_init(&r->lock,NULL);
+      pthread_mutex_init(&r->pending_lock,NULL);
+      __atomic_store_n(&cb->reach,r,__ATOMIC_RELEASE);
+   }
+   pthread_mutex_unlock(&cb->write_lock);
+
+   pthread_mutex_lock(&r->lock);
+   rc = reach_rebuild(cb,r);
+   pthread_mutex_unlock(&r->lock);
+
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_reach_estimate
+ *
+ * Description:   Estimate the number of users within DERPCON k of user x.
+ *
+ * Params:        user *x - pointer to the user.
+ *                int k - DERPCON level, 0 to MAX_DREPCON - 1.
+ *
+ * Returns:       long >= 0 - estimated number of users, x not included.
+ *                -USER_INVALID_PARAMER - bad user or level.
+ *                -USER_NOT_READY - ob_reach_build has not been called.
+ *
+ * Notes:         Only loads the estimate the writers published, it takes no
+ *                lock and does no work on the sketches.  The estimate is of
+ *                the book as it was up to REACH_BATCH changed BFF pairs ago.
+ *                The relative error of the estimate is given by
+ *                ob_reach_error.
+ *
+ *****************************************************************************/
+long ob_reach_estimate(user *x, int k)
+{
+   ob_reach_view *view;
+   ob_reach *r;
+   long estimate;
+   float e;
+
+   if(x == NULL || k < 0 || k >= REACH_LEVELS)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   r = __atomic_load_n(&x->cb->reach,__ATOMIC_ACQUIRE);
+   if(r == NULL || !__atomic_load_n(&r->ready,__ATOMIC_ACQUIRE))
+   {
+      return -USER_NOT_READY;
+   }
+
+   ob_epoch_enter(x->cb);
+   view = __atomic_load_n(&r->view,__ATOMIC_ACQUIRE);
+   if(x->user_ID >= view->users)
+   {//Newer than the sketches, reaches nobody yet.
+      estimate = 0;
+   }
+   else
+   {//Do not count x.
+      __atomic_load(&ESTIMATE(view,x->user_ID,k),&e,__ATOMIC_RELAXED);
+      estimate = (long)(e + 0.5f) - 1;
+   }
+   ob_epoch_exit(x->cb);
+
+   return estimate;
+}
+
+/******************************************************************************
+ * Function:      ob_reach_error
+ *
+ * Description:   Relative standard error of ob_reach_estimate.
+ *
+ * Params:        None.
+ *
+ * Returns:       double - the standard error, 0.13 means +/- 13%.
+ *
+ * Notes:         The error of a HyperLogLog sketch of m registers is
+ *                1.04 / sqrt(m).
+ *
+ *****************************************************************************/
+double ob_reach_error(void)
+{
+   return 1.04 / sqrt((double)OB_REACH_REGS);
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      ob_reach_add_BFF
+ *
+ * Description:   Remember a new BFF pair so the sketches can be updated.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                user *who - pointer to one of the new BFFs.
+ *                user *bff - pointer to the other new BFF.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds the write lock.  Every REACH_BATCH pairs the
+ *                pending ones are folded into the sketches.  If the pair can
+ *                not be remembered the sketches are rebuilt then instead.
+ *                Pairs are collected even while the sketches are being built,
+ *                folding a pair in twice does no harm.
+ *
+ *****************************************************************************/
+void ob_reach_add_BFF(obsess_book_cb *cb, user *who, user *bff)
+{
+   ob_reach *r = cb->reach;
+   int *pending;
+   long cap;
+
+   pthread_mutex_lock(&r->pending_lock);
+   if(r->pending_len >= 0 && r->pending_len + 2 > r->pending_cap)
+   {
+      cap = r->pending_cap ? r->pending_cap * 2 : 64;
+      pending = realloc(r->pending,sizeof(int) * cap);
+      if(pending == NULL)
+      {//Lost the pair, rebuild on the next read.
+         r->pending_len = -1;
+      }
+      else
+      {
+         r->pending = pending;
+         r->pending_cap = cap;
+      }
+   }
+   if(r->pending_len >= 0)
+   {
+      r->pending[r->pending_len++] = who->user_ID;
+      r->pending[r->pending_len++] = bff->user_ID;
+   }
+   pthread_mutex_unlock(&r->pending_lock);
+
+   reach_changed(cb,r,1);
+}
+
+/******************************************************************************
+ * Function:      ob_reach_invalidate
+ *
+ * Description:   Throw the sketches out after BFFs were removed or too many
+ *                changed at once.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                long pairs - number of BFF pairs changed.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds the write lock.  A sketch can not forget a
+ *                user, and a rebuild is cheaper than remembering every pair
+ *                of a bulk load.  The sketches are rebuilt once REACH_BATCH
+ *                pairs changed, until then readers get the old estimates.
+ *
+ *****************************************************************************/
+void ob_reach_invalidate(obsess_book_cb *cb, long pairs)
+{
+   ob_reach *r = cb->reach;
+
+   pthread_mutex_lock(&r->pending_lock);
+   r->pending_len = -1;
+   pthread_mutex_unlock(&r->pending_lock);
+
+   reach_changed(cb,r,pairs);
+}
+
+/******************************************************************************
+ * Function:      ob_reach_sync
+ *
+ * Description:   Bring the sketches up to date now.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds the write lock.  For ob_reorder, the published
+ *                estimates are of the old user_IDs.  If there is no memory
+ *                the estimates are withdrawn until ob_reach_build.
+ *
+ *****************************************************************************/
+void ob_reach_sync(obsess_book_cb *cb)
+{
+   ob_reach *r = cb->reach;
+
+   pthread_mutex_lock(&r->lock);
+   if(r->ready)
+   {
+      if(reach_flush(cb,r) == USER_SUCCESS)
+      {
+         r->churn = 0;
+      }
+      else
+      {
+         __atomic_store_n(&r->ready,0,__ATOMIC_RELEASE);
+      }
+   }
+   pthread_mutex_unlock(&r->lock);
+}
+
+/******************************************************************************
+ * Function:      ob_reach_free
+ *
+ * Description:   Free the reach sketches of the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Only when the book goes away.  Estimates readers were
+ *                done with are freed with the epochs.
+ *
+ *****************************************************************************/
+void ob_reach_free(obsess_book_cb *cb)
+{
+   ob_reach *r = cb->reach;
+
+   if(r != NULL)
+   {
+      free(r->regs);
+      if(r->view != NULL)
+      {
+         free(r->view->estimate);
+         free(r->view);
+      }
+      free(r->pending);
+      pthread_mutex_destroy(&r->lock);
+      pthread_mutex_destroy(&r->pending_lock);
+      free(r);
+      cb->reach = NULL;
+   }
+}
+
+/******************************************************************************
+ * Function:      reach_rebuild
+ *
+ * Description:   Build the sketches from scratch.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_reach *r - the reach sketches.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - sketches built.
+ *                              USER_NO_MEM - not enough memory.
+ *
+ * Notes:         Caller holds r->lock.  Pairs added from here on are
+ *                collected, so writers can keep going during the build.
+ *                Readers keep loading estimates while they are rebuilt, old
+ *                ones until a user's level is redone.
+ *
+ *****************************************************************************/
+static user_ret_code reach_rebuild(obsess_book_cb *cb, ob_reach *r)
+{
+   reach_pass pass;
+
+   pthread_mutex_lock(&r->pending_lock);
+   r->pending_len = 0;
+   pthread_mutex_unlock(&r->pending_lock);
+
+   //Every level of every user is redone, ob_reorder may have dropped some.
+   if(reach_resize(cb,r,ob_user_count(cb)) != USER_SUCCESS)
+   {
+      return -USER_NO_MEM;
+   }
+
+   //Build the sketches one level at a time.
+   pass.cb = cb;
+   pass.r = r;
+   ob_epoch_enter(cb);
+   for(pass.level = 0; pass.level < REACH_LEVELS; pass.level++)
+   {
+      ob_parallel_for(cb,r->users,REACH_GRAIN,reach_level,&pass);
+   }
+   ob_epoch_exit(cb);
+
+   __atomic_store_n(&r->ready,1,__ATOMIC_RELEASE);
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      reach_singleton
+ *
+ * Description:   Add one user to a sketch.
+ *
+ * Params:        unsigned char *regs - the sketch.
+ *                int id - user_ID of the user.
+ *
+ * Returns:       None.
+ *
+ * Notes:         The top bits of the hash pick the register, the register
+ *                keeps the longest run of leading zeros of the rest.
+ *
+ *****************************************************************************/
+static void reach_singleton(unsigned char *regs, int id)
+{
+   unsigned long long h = (unsigned long long)id;
+   unsigned char rank;
+   int reg;
+
+   //Mix the user_ID so the bits are spread out.
+   h += 0x9e3779b97f4a7c15ULL;
+   h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+   h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+   h ^= h >> 31;
+
+   reg = (int)(h >> (64 - OB_REACH_BITS));
+   h <<= OB_REACH_BITS;
+   rank = h ? (unsigned char)(__builtin_clzll(h) + 1) : (unsigned char)(64 - OB_REACH_BITS + 1);
+   if(rank > regs[reg])
+   {
+      regs[reg] = rank;
+   }
+}
+
+/******************************************************************************
+ * Function:      reach_merge
+ *
+ * Description:   Union one sketch into another.
+ *
+ * Params:        unsigned char *dst - sketch that takes the union.
+ *                unsigned char *src - sketch to add.
+ *
+ * Returns:       int - non zero if dst changed.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int reach_merge(unsigned char *dst, unsigned char *src)
+{
+   int changed = 0;
+   int i;
+
+   for(i = 0; i < OB_REACH_REGS; i++)
+   {
+      if(src[i] > dst[i])
+      {
+         dst[i] = src[i];
+         changed = 1;
+      }
+   }
+   return changed;
+}
+
+/******************************************************************************
+ * Function:      reach_count
+ *
+ * Description:   Estimate the number of users counted by a sketch.
+ *
+ * Params:        unsigned char *regs - the sketch.
+ *
+ * Returns:       float - the estimate.
+ *
+ * Notes:         Standard HyperLogLog estimate with the linear counting
+ *                correction for small sets.
+ *
+ *****************************************************************************/
+static float reach_count(unsigned char *regs)
+{
+   double m = (double)OB_REACH_REGS;
+   double alpha = 0.709;
+   double sum = 0.0;
+   double e;
+   int zeros = 0;
+   int i;
+
+   for(i = 0; i < OB_REACH_REGS; i++)
+   {
+      sum += ldexp(1.0,-regs[i]);
+      if(regs[i] == 0)
+      {
+         zeros++;
+      }
+   }
+
+   e = alpha * m * m / sum;
+   if(e <= 2.5 * m && zeros > 0)
+   {//Small set, linear counting is better.
+      e = m * log(m / zeros);
+   }
+   return (float)e;
+}
+
+/******************************************************************************
+ * Function:      reach_level
+ *
+ * Description:   Build one level of the sketches of a range of users.
+ *
+ * Params:        void *ctx - pointer to the reach_pass.
+ *                long begin - first user_ID.
+ *                long end - one past the last user_ID.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Level 0 holds the user and the user's BFFs, every other level
+ *                is the union of the level below of the user and the BFFs.
+ *                BFFs newer than the sketches are left to the pending pairs.
+ *
+ *****************************************************************************/
+static void reach_level(void *ctx, long begin, long end)
+{
+   reach_pass *pass = ctx;
+   ob_reach *r = pass->r;
+   int lvl = pass->level;
+   unsigned char *dst;
+   ob_adj_iter it;
+   long id;
+   int a;
+
+   for(id = begin; id < end; id++)
+   {
+      ob_adj_begin(&it,ob_adj_of(pass->cb,id));
+      dst = SKETCH(r,id,lvl);
+      if(lvl == 0)
+      {
+         memset(dst,0,OB_REACH_REGS);
+         reach_singleton(dst,(int)id);
+         while((a = ob_adj_next(&it)) >= 0)
+         {
+            if(a < r->users)
+            {
+               reach_singleton(dst,a);
+            }
+         }
+      }
+      else
+      {
+         memcpy(dst,SKETCH(r,id,lvl - 1),OB_REACH_REGS);
+         while((a = ob_adj_next(&it)) >= 0)
+         {
+            if(a < r->users)
+            {
+               reach_merge(dst,SKETCH(r,a,lvl - 1));
+            }
+         }
+      }
+      reach_put(r,id,lvl,reach_count(dst));
+   }
+}
+
+/******************************************************************************
+ * Function:      reach_put
+ *
+ * Description:   Store the estimate of a sketch where readers load it.
+ *
+ * Params:        ob_reach *r - the reach sketches.
+ *                long id - user_ID of the user.
+ *                int lvl - level of the sketch.
+ *                float estimate - the estimate.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds r->lock.
+ *
+ *****************************************************************************/
+static void reach_put(ob_reach *r, long id, int lvl, float estimate)
+{
+   __atomic_store(&ESTIMATE(r->view,id,lvl),&estimate,__ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+ * Function:      reach_changed
+ *
+ * Description:   Count changed BFF pairs and bring the sketches up to date if
+ *                it is time.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_reach *r - the reach sketches.
+ *                long pairs - number of BFF pairs changed.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Caller holds the write lock.  If ob_reach_build has the
+ *                sketches the count keeps going and a later writer does it.
+ *
+ *****************************************************************************/
+static void reach_changed(obsess_book_cb *cb, ob_reach *r, long pairs)
+{
+   r->churn += pairs;
+   if(r->churn < REACH_BATCH || pthread_mutex_trylock(&r->lock) != 0)
+   {
+      return;
+   }
+   if(r->ready && reach_flush(cb,r) == USER_SUCCESS)
+   {
+      r->churn = 0;
+   }
+   pthread_mutex_unlock(&r->lock);
+}
+
+/******************************************************************************
+ * Function:      reach_resize
+ *
+ * Description:   Change the number of users that have sketches.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_reach *r - the reach sketches.
+ *                long users - number of users to have sketches.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - sketches resized.
+ *                              USER_NO_MEM - not enough memory.
+ *
+ * Notes:         Every level of a new user starts out holding only the user.
+ *                Caller holds r->lock.  Readers may still be looking at the
+ *                old estimates, a new view is published and the old one is
+ *                freed with the epochs.
+ *
+ *****************************************************************************/
+static user_ret_code reach_resize(obsess_book_cb *cb, ob_reach *r, long users)
+{
+   ob_reach_view *view;
+   ob_reach_view *old = r->view;
+   unsigned char *regs;
+   float *estimate = old != NULL ? old->estimate : NULL;
+   float one = 1.0f;
+   long cap = r->cap;
+   long id;
+   int lvl;
+
+   if(old != NULL && users == r->users)
+   {
+      return USER_SUCCESS;
+   }
+
+   if(users > r->cap)
+   {//Room for the users, doubled so growing one at a time stays cheap.
+      cap = r->cap * 2 > users ? r->cap * 2 : users;
+      regs = realloc(r->regs,(size_t)cap * REACH_LEVELS * OB_REACH_REGS);
+      if(regs == NULL)
+      {
+         return -USER_NO_MEM;
+      }
+      r->regs = regs;
+      estimate = malloc(sizeof(float) * cap * REACH_LEVELS);
+      if(estimate == NULL)
+      {
+         return -USER_NO_MEM;
+      }
+      if(old != NULL)
+      {
+         memcpy(estimate,old->estimate,sizeof(float) * r->users * REACH_LEVELS);
+      }
+   }
+   view = malloc(sizeof(ob_reach_view));
+   if(view == NULL)
+   {
+      if(old == NULL || estimate != old->estimate)
+      {
+         free(estimate);
+      }
+      return -USER_NO_MEM;
+   }
+   view->users = users;
+   view->estimate = estimate;
+   r->cap = cap;
+
+   for(id = r->users; id < users; id++)
+   {
+      for(lvl = 0; lvl < REACH_LEVELS; lvl++)
+      {
+         memset(SKETCH(r,id,lvl),0,OB_REACH_REGS);
+         reach_singleton(SKETCH(r,id,lvl),(int)id);
+         __atomic_store(&ESTIMATE(view,id,lvl),&one,__ATOMIC_RELAXED);
+      }
+   }
+   r->users = users;
+
+   __atomic_store_n(&r->view,view,__ATOMIC_RELEASE);
+   if(old != NULL)
+   {
+      if(old->estimate != estimate)
+      {
+         ob_epoch_retire(cb,old->estimate);
+      }
+      ob_epoch_retire(cb,old);
+   }
+
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      reach_flush
+ *
+ * Description:   Fold the pending BFF pairs and new users into the sketches.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_reach *r - the reach sketches.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - sketches up to date.
+ *                              USER_NO_MEM - not enough memory.
+ *
+ * Notes:         Algorithm:
+ *                The levels are fixed up from the bottom.  A level of a user
+ *                can change for two reasons, the user has a new BFF whose level
+ *                below is added, or the level below of the user or one of its
+ *                BFFs changed.  The users whose level changed are kept in a
+ *                list so only they are pushed to their BFFs on the next level.
+ *                Sketches stop changing quickly, so a new pair touches far
+ *                fewer users than a rebuild.  Caller holds r->lock and the
+ *                write lock.
+ *
+ *****************************************************************************/
+static user_ret_code reach_flush(obsess_book_cb *cb, ob_reach *r)
+{
+   reach_list changed[2];       //users changed on the level below and this level.
+   int *pending;                //Pairs taken from the writers.
+   long pending_len;
+   ob_adj_iter it;
+   reach_list *below;
+   reach_list *here;
+   unsigned char *dst;
+   user_ret_code rc = USER_SUCCESS;
+   long p;
+   long j;
+   int lvl;
+   int a;
+   int b;
+   int i;
+   int id;
+
+   //Take the pending pairs, writers start a new list.
+   pthread_mutex_lock(&r->pending_lock);
+   pending = r->pending;
+   pending_len = r->pending_len;
+   r->pending = NULL;
+   r->pending_len = 0;
+   r->pending_cap = 0;
+   pthread_mutex_unlock(&r->pending_lock);
+
+   if(pending_len < 0)
+   {//Pairs were lost, only a rebuild will do.
+      free(pending);
+      return reach_rebuild(cb,r);
+   }
+   if(ob_user_count(cb) > r->users &&
+      reach_resize(cb,r,ob_user_count(cb)) != USER_SUCCESS)
+   {
+      free(pending);
+      return -USER_NO_MEM;
+   }
+   memset(changed,0,sizeof(changed));
+   ob_epoch_enter(cb);
+
+   for(lvl = 0; lvl < REACH_LEVELS && rc == USER_SUCCESS; lvl++)
+   {
+      below = &changed[(lvl + 1) & 1];
+      here = &changed[lvl & 1];
+      here->len = 0;
+
+      //New BFFs bring in the level below of each other.
+      for(p = 0; p < pending_len && rc == USER_SUCCESS; p += 2)
+      {
+         for(i = 0; i < 2; i++)
+         {
+            a = pending[p + i];
+            b = pending[p + 1 - i];
+            dst = SKETCH(r,a,lvl);
+            if(lvl == 0)
+            {
+               unsigned char regs[OB_REACH_REGS];
+
+               memcpy(regs,dst,OB_REACH_REGS);
+               reach_singleton(dst,b);
+               if(memcmp(regs,dst,OB_REACH_REGS) != 0)
+               {
+                  rc = reach_push(here,a);
+               }
+            }
+            else if(reach_merge(dst,SKETCH(r,b,lvl - 1)))
+            {
+               rc = reach_push(here,a);
+            }
+         }
+      }
+
+      //Changes on the level below move up to the user and the user's BFFs.
+      for(j = 0; lvl > 0 && j < below->len && rc == USER_SUCCESS; j++)
+      {
+         id = below->id[j];
+         ob_adj_begin(&it,ob_adj_of(cb,id));
+         if(reach_merge(SKETCH(r,id,lvl),SKETCH(r,id,lvl - 1)))
+         {
+            rc = reach_push(here,id);
+         }
+         while(rc == USER_SUCCESS && (a = ob_adj_next(&it)) >= 0)
+         {
+            if(a >= r->users)
+            {//Newer than the sketches and comes in with its own pair.
+               continue;
+            }
+            if(reach_merge(SKETCH(r,a,lvl),SKETCH(r,id,lvl - 1)))
+            {
+               rc = reach_push(here,a);
+            }
+         }
+      }
+
+      //Refresh the cached estimates of the changed sketches.
+      for(j = 0; j < here->len; j++)
+      {
+         id = here->id[j];
+         reach_put(r,id,lvl,reach_count(SKETCH(r,id,lvl)));
+      }
+   }
+
+   ob_epoch_exit(cb);
+   free(changed[0].id);
+   free(changed[1].id);
+   free(pending);
+
+   if(rc != USER_SUCCESS)
+   {//Could not finish, the sketches are only good after a rebuild.
+      return reach_rebuild(cb,r);
+   }
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      reach_push
+ *
+ * Description:   Add a user to a work list.
+ *
+ * Params:        reach_list *l - the work list.
+ *                int id - user_ID to add.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - added.
+ *                              USER_NO_MEM - not enough memory.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static user_ret_code reach_push(reach_list *l, int id)
+{
+   int *ids;
+   long cap;
+
+   if(l->len == l->cap)
+   {
+      cap = l->cap ? l->cap * 2 : 64;
+      ids = realloc(l->id,sizeof(int) * cap);
+      if(ids == NULL)
+      {
+         return -USER_NO_MEM;
+      }
+      l->id = ids;
+      l->cap = cap;
+   }
+   l->id[l->len++] = id;
+   return USER_SUCCESS;
+}
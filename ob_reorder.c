@@ -0,0 +1,657 @@
+/*****************************************************************************
+ *
+ *     ob_reorder.c
+ *
+ *   Description: Renumbering of the users.  user_IDs are handed out in the
+ *                order users sign up, so the BFFs of a user sit all over the
+ *                directory and every step of a search misses the cache.
+ *                ob_reorder hands the user_IDs out again so that users that
+ *                are searched together sit together:
+ *                - Reverse Cuthill-McKee, BFS order from the user with the
+ *                  fewest BFFs, BFFs taken fewest first, reversed.
+ *                - Degree, the users with the most BFFs first, they are the
+ *                  ones every search goes through.
+ *                - Community, label propagation groups users that are BFFs
+ *                  of each other, the groups are numbered one after another.
+ *                The BFF lists, the directory and the landmark tables are
+ *                moved over to the new user_IDs.  The user_ID a user was
+ *                created with is kept for callers that stored it.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Most rounds of label propagation, it settles in a handful.
+#define REORDER_ROUNDS 10
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Sort key of a user, sorted by major, then minor, then old user_ID.
+typedef struct _reorder_key
+{
+   long major;
+   long minor;
+   int  id;
+}reorder_key;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static long reorder_rcm(ob_csr *g, char *seen, int *perm);
+static long reorder_degree(ob_csr *g, char *seen, int *perm);
+static long reorder_community(ob_csr *g, char *seen, int *perm);
+static long reorder_sort(reorder_key *keys, long n, int *perm);
+static user_ret_code reorder_apply(obsess_book_cb *cb, ob_csr *g, int *perm,
+                                   long live, int *new_id);
+static int reorder_cmp(const void *a, const void *b);
+static int reorder_int_cmp(const void *a, const void *b);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_reorder
+ *
+ * Description:   Hand the user_IDs out again so BFFs get user_IDs close
+ *                together.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_order order - OB_ORDER_RCM, OB_ORDER_DEGREE or
+ *                                 OB_ORDER_COMMUNITY.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - users renumbered.
+ *                              USER_INVALID_PARAMER - bad parameter.
+ *                              USER_NO_MEM - not enough memory, nothing
+ *                                            changed.
+ *                              USER_NOT_READY - a snapshot is being taken,
+ *                                               see ob_snapshot_wait.
+ *
+ * Notes:         Nobody else may use the book while it is reordered, readers
+ *                in the middle of a search hold user_IDs.  The user_IDs of
+ *                deleted users are dropped, the live users get 0 to n - 1.
+ *                The BFFs of every user come out sorted by user_ID and plain,
+ *                ob_pack_BFFs packs them again.  The reach sketches are
+ *                rebuilt.
+ *
+ *****************************************************************************/
+user_ret_code ob_reorder(obsess_book_cb *cb, ob_order order)
+{
+   user_ret_code rc = USER_SUCCESS;
+   ob_csr *g;
+   char *seen;
+   int *perm;
+   int *new_id;
+   long live;
+   long v;
+
+   if(cb == NULL ||
+      (order != OB_ORDER_RCM && order != OB_ORDER_DEGREE &&
+       order != OB_ORDER_COMMUNITY))
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   pthread_mutex_lock(&cb->write_lock);
+   if(cb->snap != NULL)
+   {//The snapshot is copied by user_ID.
+      rc = -USER_NOT_READY;
+      goto EXIT_reorder_0;
+   }
+   g = ob_csr_build(cb);
+   if(g == NULL)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_reorder_0;
+   }
+   seen = malloc(g->users + 1);
+   perm = malloc(sizeof(int) * (g->users + 1));
+   new_id = malloc(sizeof(int) * (g->users + 1));
+   if(seen == NULL || perm == NULL || new_id == NULL)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_reorder_1;
+   }
+
+   //user_IDs without a user are never ordered.
+   for(v = 0; v < g->users; v++)
+   {
+      seen[v] = ob_user_at(cb,v) == NULL;
+   }
+
+   switch(order)
+   {
+   case OB_ORDER_RCM:
+      live = reorder_rcm(g,seen,perm);
+      break;
+   case OB_ORDER_DEGREE:
+      live = reorder_degree(g,seen,perm);
+      break;
+   default:
+      live = reorder_community(g,seen,perm);
+      break;
+   }
+   if(live < 0)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_reorder_1;
+   }
+
+   for(v = 0; v < g->users; v++)
+   {
+      new_id[v] = -1;
+   }
+   for(v = 0; v < live; v++)
+   {
+      new_id[perm[v]] = (int)v;
+   }
+   rc = reorder_apply(cb,g,perm,live,new_id);
+
+EXIT_reorder_1:
+   free(seen);
+   free(perm);
+   free(new_id);
+   ob_csr_free(g);
+EXIT_reorder_0:
+   pthread_mutex_unlock(&cb->write_lock);
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_original_ID
+ *
+ * Description:   Get the user_ID a user was created with.
+ *
+ * Params:        user *usr - pointer to the user.
+ *
+ * Returns:       int - the user_ID before any ob_reorder, -1 for NULL.
+ *
+ * Notes:         Original user_IDs are not unique once users are deleted
+ *                and reordered.  A new user takes the user_ID of a deleted
+ *                user, or the next one after the renumbered users, as its
+ *                original user_ID, and a user moved by ob_reorder may have
+ *                been created with that same user_ID.  Two live users can
+ *                then share an original user_ID, there is no lookup from an
+ *                original user_ID back to a user.
+ *
+ *****************************************************************************/
+int ob_original_ID(user *usr)
+{
+   return usr == NULL ? -1 : usr->orig_ID;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      reorder_rcm
+ *
+ * Description:   Order the users Reverse Cuthill-McKee.
+ *
+ * Params:        ob_csr *g - copy of the graph.
+ *                char *seen - non zero for user_IDs not to order, scribbled.
+ *                int *perm - gets the old user_ID of each new user_ID.
+ *
+ * Returns:       long - number of users ordered, -1 if there is no memory.
+ *
+ * Notes:         Every group of users that are connected gets a BFS of its
+ *                own, started from its user with the fewest BFFs.
+ *
+ *****************************************************************************/
+static long reorder_rcm(ob_csr *g, char *seen, int *perm)
+{
+   reorder_key *keys;
+   reorder_key *next;
+   long most = 0;
+   long head;
+   long first;
+   long n = 0;
+   long m = 0;
+   long e;
+   long i;
+   long v;
+   int w;
+
+   keys = malloc(sizeof(reorder_key) * (g->users + 1));
+   if(keys == NULL)
+   {
+      return -1;
+   }
+
+   //Starting points, fewest BFFs first.
+   for(v = 0; v < g->users; v++)
+   {
+      if(!seen[v])
+      {
+         keys[m].major = g->off[v + 1] - g->off[v];
+         keys[m].minor = 0;
+         keys[m].id = (int)v;
+         most = keys[m].major > most ? keys[m].major : most;
+         m++;
+      }
+   }
+   qsort(keys,m,sizeof(reorder_key),reorder_cmp);
+
+   next = malloc(sizeof(reorder_key) * (most + 1));
+   if(next == NULL)
+   {
+      free(keys);
+      return -1;
+   }
+
+   for(i = 0; i < m; i++)
+   {
+      if(seen[keys[i].id])
+      {
+         continue;
+      }
+      seen[keys[i].id] = 1;
+      perm[n++] = keys[i].id;
+      for(head = n - 1; head < n; head++)
+      {
+         v = perm[head];
+         first = n;
+         for(e = g->off[v]; e < g->off[v + 1]; e++)
+         {
+            w = g->adj[e];
+            if(w < g->users && !seen[w])
+            {
+               seen[w] = 1;
+               next[n - first].major = g->off[w + 1] - g->off[w];
+               next[n - first].minor = 0;
+               next[n - first].id = w;
+               n++;
+            }
+         }
+         //BFFs found from v are queued fewest BFFs first.
+         qsort(next,n - first,sizeof(reorder_key),reorder_cmp);
+         for(e = first; e < n; e++)
+         {
+            perm[e] = next[e - first].id;
+         }
+      }
+   }
+
+   //Reverse it.
+   for(i = 0; i < n / 2; i++)
+   {
+      w = perm[i];
+      perm[i] = perm[n - 1 - i];
+      perm[n - 1 - i] = w;
+   }
+
+   free(next);
+   free(keys);
+   return n;
+}
+
+/******************************************************************************
+ * Function:      reorder_degree
+ *
+ * Description:   Order the users by number of BFFs, most first.
+ *
+ * Params:        ob_csr *g - copy of the graph.
+ *                char *seen - non zero for user_IDs not to order.
+ *                int *perm - gets the old user_ID of each new user_ID.
+ *
+ * Returns:       long - number of users ordered, -1 if there is no memory.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static long reorder_degree(ob_csr *g, char *seen, int *perm)
+{
+   reorder_key *keys;
+   long n = 0;
+   long v;
+
+   keys = malloc(sizeof(reorder_key) * (g->users + 1));
+   if(keys == NULL)
+   {
+      return -1;
+   }
+   for(v = 0; v < g->users; v++)
+   {
+      if(!seen[v])
+      {
+         keys[n].major = -(g->off[v + 1] - g->off[v]);
+         keys[n].minor = 0;
+         keys[n].id = (int)v;
+         n++;
+      }
+   }
+   return reorder_sort(keys,n,perm);
+}
+
+/******************************************************************************
+ * Function:      reorder_community
+ *
+ * Description:   Order the users by community.
+ *
+ * Params:        ob_csr *g - copy of the graph.
+ *                char *seen - non zero for user_IDs not to order.
+ *                int *perm - gets the old user_ID of each new user_ID.
+ *
+ * Returns:       long - number of users ordered, -1 if there is no memory.
+ *
+ * Notes:         Every user starts in a community of its own and joins the
+ *                community most of its BFFs are in, round after round, until
+ *                nobody moves or REORDER_ROUNDS is up.  A user stays put on
+ *                a tie it is part of, otherwise the lowest label wins, so
+ *                the rounds settle.  Users come out community by community,
+ *                most BFFs first inside a community.
+ *
+ *****************************************************************************/
+static long reorder_community(ob_csr *g, char *seen, int *perm)
+{
+   reorder_key *keys;
+   int *label;
+   int *tmp;
+   long most = 0;
+   long moved = 1;
+   long n = 0;
+   long e;
+   long v;
+   int round;
+   int best;
+   int votes;
+   int run;
+   int m;
+   int i;
+
+   label = malloc(sizeof(int) * (g->users + 1));
+   keys = malloc(sizeof(reorder_key) * (g->users + 1));
+   for(v = 0; v < g->users; v++)
+   {
+      most = g->off[v + 1] - g->off[v] > most ? g->off[v + 1] - g->off[v] : most;
+   }
+   tmp = malloc(sizeof(int) * (most + 1));
+   if(label == NULL || keys == NULL || tmp == NULL)
+   {
+      free(label);
+      free(keys);
+      free(tmp);
+      return -1;
+   }
+
+   for(v = 0; v < g->users; v++)
+   {
+      label[v] = (int)v;
+   }
+   for(round = 0; round < REORDER_ROUNDS && moved > 0; round++)
+   {
+      moved = 0;
+      for(v = 0; v < g->users; v++)
+      {
+         if(seen[v] || g->off[v + 1] == g->off[v])
+         {
+            continue;
+         }
+         m = 0;
+         for(e = g->off[v]; e < g->off[v + 1]; e++)
+         {
+            if(g->adj[e] < g->users)
+            {
+               tmp[m++] = label[g->adj[e]];
+            }
+         }
+         qsort(tmp,m,sizeof(int),reorder_int_cmp);
+
+         //Pick the label most BFFs have.
+         best = label[v];
+         votes = 0;
+         for(i = 0; i < m; i += run)
+         {
+            for(run = 1; i + run < m && tmp[i + run] == tmp[i]; run++)
+            {
+            }
+            if(run > votes || (run == votes && tmp[i] == label[v]))
+            {
+               best = tmp[i];
+               votes = run;
+            }
+         }
+         if(best != label[v])
+         {
+            label[v] = best;
+            moved++;
+         }
+      }
+   }
+
+   for(v = 0; v < g->users; v++)
+   {
+      if(!seen[v])
+      {
+         keys[n].major = label[v];
+         keys[n].minor = -(g->off[v + 1] - g->off[v]);
+         keys[n].id = (int)v;
+         n++;
+      }
+   }
+   free(tmp);
+   free(label);
+   return reorder_sort(keys,n,perm);
+}
+
+/******************************************************************************
+ * Function:      reorder_sort
+ *
+ * Description:   Sort the keys and hand the user_IDs out in that order.
+ *
+ * Params:        reorder_key *keys - key of each user, freed.
+ *                long n - number of keys.
+ *                int *perm - gets the old user_ID of each new user_ID.
+ *
+ * Returns:       long - n.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static long reorder_sort(reorder_key *keys, long n, int *perm)
+{
+   long i;
+
+   qsort(keys,n,sizeof(reorder_key),reorder_cmp);
+   for(i = 0; i < n; i++)
+   {
+      perm[i] = keys[i].id;
+   }
+   free(keys);
+   return n;
+}
+
+/******************************************************************************
+ * Function:      reorder_apply
+ *
+ * Description:   Move the book over to the new user_IDs.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_csr *g - copy of the graph.
+ *                int *perm - old user_ID of each new user_ID.
+ *                long live - number of new user_IDs.
+ *                int *new_id - new user_ID of each old user_ID, -1 for none.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - book moved over.
+ *                              USER_NO_MEM - not enough memory, nothing
+ *                                            changed.
+ *
+ * Notes:         Caller holds the write lock.  Every new BFF list is built
+ *                before anything is changed, so running out of memory leaves
+ *                the book as it was.
+ *
+ *****************************************************************************/
+static user_ret_code reorder_apply(obsess_book_cb *cb, ob_csr *g, int *perm,
+                                   long live, int *new_id)
+{
+   user_ret_code rc = USER_SUCCESS;
+   ob_id_queue *q = &cb->free_ids;
+   ob_adj **lists;
+   ob_adj *bffs;
+   user **usrs;
+   ob_dir_page *page;
+   long e;
+   long i;
+   long v;
+   int n;
+
+   lists = calloc(live + 1,sizeof(ob_adj*));
+   usrs = malloc(sizeof(user*) * (live + 1));
+   if(lists == NULL || usrs == NULL)
+   {
+      free(lists);
+      free(usrs);
+      return -USER_NO_MEM;
+   }
+
+   for(i = 0; i < live; i++)
+   {
+      v = perm[i];
+      usrs[i] = ob_user_at(cb,v);
+      if(g->off[v + 1] == g->off[v])
+      {//No BFFs.
+         continue;
+      }
+      bffs = malloc(sizeof(ob_adj) + sizeof(int) * (g->off[v + 1] - g->off[v]));
+      if(bffs == NULL)
+      {
+         goto EXIT_apply_1;
+      }
+      n = 0;
+      for(e = g->off[v]; e < g->off[v + 1]; e++)
+      {
+         if(g->adj[e] < g->users && new_id[g->adj[e]] >= 0)
+         {
+            bffs->bff[n++] = new_id[g->adj[e]];
+         }
+      }
+      qsort(bffs->bff,n,sizeof(int),reorder_int_cmp);
+      bffs->count = n;
+      bffs->cap = (int)(g->off[v + 1] - g->off[v]);
+      bffs->dead = 0;
+      bffs->pack = NULL;
+      lists[i] = bffs;
+   }
+
+   //There are fewer new user_IDs than old ones, but a page may be missing if
+   //its users were never created.
+   for(v = 0; v < live; v += OB_DIR_MASK + 1)
+   {
+      if(cb->user_dir[v >> OB_DIR_SHIFT] == NULL)
+      {
+         page = calloc(1,sizeof(ob_dir_page));
+         if(page == NULL)
+         {
+            goto EXIT_apply_1;
+         }
+         __atomic_store_n(&cb->user_dir[v >> OB_DIR_SHIFT],page,__ATOMIC_RELEASE);
+      }
+   }
+
+   //Empty the directory and fill it in again.
+   for(v = 0; v < g->users; v++)
+   {
+      page = cb->user_dir[v >> OB_DIR_SHIFT];
+      if(page != NULL)
+      {
+         bffs = page->adj[v & OB_DIR_MASK];
+         __atomic_store_n(&page->user[v & OB_DIR_MASK],NULL,__ATOMIC_RELEASE);
+         __atomic_store_n(&page->adj[v & OB_DIR_MASK],NULL,__ATOMIC_RELEASE);
+         page->heat[v & OB_DIR_MASK] = 0;
+         if(bffs != NULL)
+         {
+            ob_pack_retire(cb,bffs->pack);
+         }
+         ob_epoch_retire(cb,bffs);
+      }
+   }
+   for(i = 0; i < live; i++)
+   {
+      usrs[i]->user_ID = (int)i;
+      ob_user_dir_add(cb,usrs[i]);
+      __atomic_store_n(ob_adj_slot(usrs[i]),lists[i],__ATOMIC_RELEASE);
+   }
+   __atomic_store_n(&cb->static_id,live,__ATOMIC_RELEASE);
+
+   //The user_IDs of deleted users are gone.
+   pthread_mutex_lock(&q->lock);
+   __atomic_store_n(&q->head,0,__ATOMIC_RELEASE);
+   __atomic_store_n(&q->tail,0,__ATOMIC_RELEASE);
+   pthread_mutex_unlock(&q->lock);
+
+   if(cb->reach != NULL)
+   {//The estimates are of the old user_IDs.
+      ob_reach_invalidate(cb,0);
+      ob_reach_sync(cb);
+   }
+   if(cb->oracle != NULL)
+   {
+      ob_landmark_renumber(cb,new_id,g->users);
+   }
+   goto EXIT_apply_0;
+
+EXIT_apply_1:
+   for(i = 0; i < live; i++)
+   {
+      free(lists[i]);
+   }
+   rc = -USER_NO_MEM;
+EXIT_apply_0:
+   free(lists);
+   free(usrs);
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      reorder_cmp
+ *
+ * Description:   qsort compare of two reorder_keys.
+ *
+ * Params:        const void *a, const void *b - the keys.
+ *
+ * Returns:       int - <0, 0 or >0.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int reorder_cmp(const void *a, const void *b)
+{
+   const reorder_key *x = a;
+   const reorder_key *y = b;
+
+   if(x->major != y->major)
+   {
+      return x->major < y->major ? -1 : 1;
+   }
+   if(x->minor != y->minor)
+   {
+      return x->minor < y->minor ? -1 : 1;
+   }
+   return x->id < y->id ? -1 : (x->id > y->id);
+}
+
+/******************************************************************************
+ * Function:      reorder_int_cmp
+ *
+ * Description:   qsort compare of two ints.
+ *
+ * Params:        const void *a, const void *b - the ints.
+ *
+ * Returns:       int - <0, 0 or >0.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int reorder_int_cmp(const void *a, const void *b)
+{
+   int x = *(const int*)a;
+   int y = *(const int*)b;
+
+   return x < y ? -1 : (x > y);
+}
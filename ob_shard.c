@@ -0,0 +1,1187 @@
+/*****************************************************************************
+ *
+ *     ob_shard.c
+ *
+ *   Description: Sharded DERPCON.  The users of a book are split by a hash
+ *                of their user_ID over worker processes, each worker owns
+ *                the BFF lists of its users.  The calling process is the
+ *                coordinator, a DERPCON search runs one level at a time on
+ *                every worker at once.  The workers send the BFFs they found
+ *                that belong to other workers to the coordinator, which
+ *                merges them, drops the ones found by more than one worker
+ *                and hands each worker its share.  Lists of user_IDs go over
+ *                the wire sorted, as gaps written 7 bits a byte.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Most workers a book can be split over.
+#define OB_SHARDS_MAX 64
+
+//Messages from the coordinator to the workers, the first byte of each.
+#define SHARD_START   'S'     //i32 x, i32 y.  Start a search, no reply.
+#define SHARD_EXPAND  'E'     //u8 side.  Reply u8 met, a list per worker.
+#define SHARD_DELIVER 'D'     //u8 side, list.  Reply u8 met, frontier size.
+
+//Bytes of the length in front of every message.
+#define SHARD_HEAD 4
+
+//Most bytes a user_ID takes in a list.
+#define SHARD_VARINT 5
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Message being built or read.
+typedef struct _shard_buf
+{
+   char   *data;
+   size_t  len;
+   size_t  cap;
+}shard_buf;
+
+//Growing list of user_IDs.
+typedef struct _shard_ids
+{
+   int  *id;
+   long  n;
+   long  cap;
+}shard_ids;
+
+//Users and BFF lists of one worker, only ever seen by the worker.
+typedef struct _shard_worker
+{
+   int           fd;          //Socket to the coordinator.
+   int           me;          //Number of the worker.
+   int           n;           //Number of workers.
+   long          users;       //Number of users it owns.
+   int          *gid;         //user_ID of each of its users.
+   long         *off;         //BFFs of user v are adj[off[v]] to
+   int          *adj;         //adj[off[v + 1] - 1], as user_IDs.
+   int          *key;         //Table of user_IDs to users, -1 when empty.
+   int          *val;
+   unsigned long mask;        //Slots of the table - 1.
+   unsigned int *mark;        //Stamp of the side that found each user.
+   unsigned int  stamp;       //Stamp of side 0 of the search, side 1 is +1.
+   int          *front[2];    //Frontier of each side.
+   long          front_n[2];
+   int          *next;        //Next frontier of the side being expanded.
+   long          next_n;
+   shard_ids     found;       //BFFs other workers found for it.
+   shard_ids     out[OB_SHARDS_MAX];  //BFFs found for each other worker.
+}shard_worker;
+
+//Workers of a book, handed out by ob_shard_start.
+struct _ob_shards
+{
+   int        n;
+   long       users;          //user_IDs handed out when the book was split.
+   int        max_derpcon;    //DERPCON of strangers in the book.
+   pid_t      pid[OB_SHARDS_MAX];
+   int        fd[OB_SHARDS_MAX];
+   shard_buf  in[OB_SHARDS_MAX];  //Last reply of each worker.
+   shard_buf  msg;
+   shard_ids  ids;            //BFFs being merged for one worker.
+   long       sent;           //user_IDs the workers sent.
+   long       kept;           //user_IDs left once merged.
+   long       bytes;          //Bytes the merged lists took.
+};
+//_____________________________________________________________________________
+//                                                            Private Functions
+static int shard_of(long id, int n);
+static void shard_work(obsess_book_cb *cb, long users, int me, int n, int fd);
+static int shard_build(shard_worker *w, obsess_book_cb *cb, long users);
+static long shard_local(shard_worker *w, int id);
+static int shard_visit(shard_worker *w, int a, long v);
+static int shard_expand(shard_worker *w, int a, shard_buf *reply);
+static int shard_deliver(shard_worker *w, int a, const char *p,
+                         const char *end, shard_buf *reply);
+static int shard_search(ob_shards *sh, int x, int y);
+static int shard_merge(ob_shards *sh, long *pos);
+static char *shard_reserve(shard_buf *b, size_t more);
+static int shard_push(shard_ids *s, int id);
+static void shard_unique(shard_ids *s);
+static int shard_put_list(shard_buf *b, const int *id, long n);
+static int shard_get_list(const char **p, const char *end, shard_ids *s);
+static int shard_send(int fd, shard_buf *b);
+static int shard_recv(int fd, shard_buf *b);
+static int shard_cmp(const void *a, const void *b);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_shard_start
+ *
+ * Description:   Split the users of a book over worker processes.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                int n - number of workers, 1 to 64.
+ *
+ * Returns:       ob_shards* - the workers, NULL on error.
+ *
+ * Notes:         Each worker is forked from the caller and copies the BFF
+ *                lists of its users out of the book as it was at the fork.
+ *                Later changes to the book, ob_reorder included, are not
+ *                seen by the workers, stop them and start new ones.  The
+ *                write lock is held over the forks so no BFF list is half
+ *                changed in the copies.
+ *
+ *****************************************************************************/
+ob_shards *ob_shard_start(obsess_book_cb *cb, int n)
+{
+   ob_shards *sh;
+   int sv[2];
+   pid_t pid;
+   int i;
+   int k;
+
+   if(cb == NULL || n < 1 || n > OB_SHARDS_MAX)
+   {
+      return NULL;
+   }
+   sh = calloc(1,sizeof(ob_shards));
+   if(sh == NULL)
+   {
+      return NULL;
+   }
+
+   pthread_mutex_lock(&cb->write_lock);
+   sh->users = ob_user_count(cb);
+   sh->max_derpcon = cb->max_derpcon;
+   for(i = 0; i < n; i++)
+   {
+      if(socketpair(AF_UNIX,SOCK_STREAM,0,sv) != 0)
+      {
+         break;
+      }
+      pid = fork();
+      if(pid == 0)
+      {//Worker, drop the coordinator ends so a dead coordinator is seen.
+         close(sv[0]);
+         for(k = 0; k < i; k++)
+         {
+            close(sh->fd[k]);
+         }
+         shard_work(cb,sh->users,i,n,sv[1]);
+      }
+      close(sv[1]);
+      if(pid < 0)
+      {
+         close(sv[0]);
+         break;
+      }
+      sh->fd[i] = sv[0];
+      sh->pid[i] = pid;
+      sh->n = i + 1;
+   }
+   pthread_mutex_unlock(&cb->write_lock);
+   if(sh->n < n)
+   {
+      goto EXIT_shard_start_1;
+   }
+
+   //Each worker says it is ready once it has its users.
+   for(i = 0; i < n; i++)
+   {
+      if(shard_recv(sh->fd[i],&sh->in[i]) != 0 || sh->in[i].len != 1 ||
+         sh->in[i].data[0] != 1)
+      {
+         goto EXIT_shard_start_1;
+      }
+   }
+   goto EXIT_shard_start_0;
+
+EXIT_shard_start_1:
+   ob_shard_stop(sh);
+   sh = NULL;
+EXIT_shard_start_0:
+   return sh;
+}
+
+/******************************************************************************
+ * Function:      ob_shard_derpcon
+ *
+ * Description:   Evaluate the DERPCON of 2 users on the workers.
+ *
+ * Params:        ob_shards *sh - the workers.
+ *                user *x - ptr to user to whom to evaluate the DERPCON
+ *                user *y - ptr to user to whom to evaluate the DERPCON
+ *
+ * Returns:       int - the DERPCON, max_derpcon if the users have no link.
+ *                      -USER_INVALID_PARAMER - bad parameter or a user that
+ *                                              joined after the split.
+ *                      -USER_NO_MEM - no memory.
+ *                      -USER_IO_ERROR - a worker went away, stop the workers.
+ *
+ * Notes:         Same answer as DERPCON on the book as it was split.  The
+ *                two sides grow one level per round, the smaller one first,
+ *                and a round costs two trips to every worker.  One search
+ *                at a time.
+ *
+ *****************************************************************************/
+int ob_shard_derpcon(ob_shards *sh, user *x, user *y)
+{
+   if(sh == NULL || x == NULL || y == NULL || x->cb != y->cb ||
+      x->user_ID >= sh->users || y->user_ID >= sh->users)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   if(x == y)
+   {
+      return 0;
+   }
+   return shard_search(sh,x->user_ID,y->user_ID);
+}
+
+/******************************************************************************
+ * Function:      ob_shard_traffic
+ *
+ * Description:   Get the number of BFFs the workers swapped.
+ *
+ * Params:        ob_shards *sh - the workers.
+ *                long *sent - gets the user_IDs the workers sent for other
+ *                             workers, NULL if not needed.
+ *                long *kept - gets the ones left once the lists of all the
+ *                             workers were merged, NULL if not needed.
+ *                long *bytes - gets the bytes the merged lists took,
+ *                              NULL if not needed.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Counted since ob_shard_start.
+ *
+ *****************************************************************************/
+void ob_shard_traffic(ob_shards *sh, long *sent, long *kept, long *bytes)
+{
+   if(sh == NULL)
+   {
+      return;
+   }
+   if(sent != NULL)
+   {
+      *sent = sh->sent;
+   }
+   if(kept != NULL)
+   {
+      *kept = sh->kept;
+   }
+   if(bytes != NULL)
+   {
+      *bytes = sh->bytes;
+   }
+}
+
+/******************************************************************************
+ * Function:      ob_shard_stop
+ *
+ * Description:   Stop the workers and free them.
+ *
+ * Params:        ob_shards *sh - the workers, may be NULL.
+ *
+ * Returns:       None.
+ *
+ * Notes:         A worker exits once its socket is closed.
+ *
+ *****************************************************************************/
+void ob_shard_stop(ob_shards *sh)
+{
+   int i;
+
+   if(sh == NULL)
+   {
+      return;
+   }
+   for(i = 0; i < sh->n; i++)
+   {
+      close(sh->fd[i]);
+   }
+   for(i = 0; i < sh->n; i++)
+   {
+      while(waitpid(sh->pid[i],NULL,0) < 0 && errno == EINTR)
+      {
+      }
+   }
+   for(i = 0; i < OB_SHARDS_MAX; i++)
+   {
+      free(sh->in[i].data);
+   }
+   free(sh->msg.data);
+   free(sh->ids.id);
+   free(sh);
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      shard_of
+ *
+ * Description:   Worker that owns a user.
+ *
+ * Params:        long id - user_ID of the user.
+ *                int n - number of workers.
+ *
+ * Returns:       int - the worker.
+ *
+ * Notes:         Multiplicative hash, the top bits pick the worker so user_IDs
+ *                handed out in a row land on different workers.
+ *
+ *****************************************************************************/
+static int shard_of(long id, int n)
+{
+   unsigned int h = (unsigned int)id * 2654435761u;
+
+   return (int)(((unsigned long long)h * n) >> 32);
+}
+
+/******************************************************************************
+ * Function:      shard_work
+ *
+ * Description:   Body of a worker process.
+ *
+ * Params:        obsess_book_cb *cb - the book as it was at the fork.
+ *                long users - user_IDs handed out.
+ *                int me - number of the worker.
+ *                int n - number of workers.
+ *                int fd - socket to the coordinator.
+ *
+ * Returns:       Never, the process exits.
+ *
+ * Notes:         Only the thread that forked is running, the book is read
+ *                without taking any of its locks and never written.
+ *
+ *****************************************************************************/
+static void shard_work(obsess_book_cb *cb, long users, int me, int n, int fd)
+{
+   shard_worker w;
+   shard_buf msg;
+   shard_buf reply;
+   int x;
+   int y;
+   long v;
+
+   memset(&w,0,sizeof(w));
+   memset(&msg,0,sizeof(msg));
+   memset(&reply,0,sizeof(reply));
+   w.fd = fd;
+   w.me = me;
+   w.n = n;
+
+   reply.len = SHARD_HEAD;
+   if(shard_reserve(&reply,1) == NULL)
+   {
+      _exit(1);
+   }
+   reply.data[reply.len++] = shard_build(&w,cb,users) == 0;
+   if(shard_send(fd,&reply) != 0 || !reply.data[SHARD_HEAD])
+   {
+      _exit(1);
+   }
+
+   while(shard_recv(fd,&msg) == 0 && msg.len > 0)
+   {
+      reply.len = SHARD_HEAD;
+      switch(msg.data[0])
+      {
+      case SHARD_START:
+         if(msg.len < 1 + 2 * sizeof(int))
+         {
+            _exit(1);
+         }
+         memcpy(&x,msg.data + 1,sizeof(int));
+         memcpy(&y,msg.data + 1 + sizeof(int),sizeof(int));
+         if(w.stamp == 0 || w.stamp > UINT_MAX - 2)
+         {
+            memset(w.mark,0,sizeof(unsigned int) * w.users);
+            w.stamp = 1;
+         }
+         w.stamp += 2;
+         w.front_n[0] = w.front_n[1] = w.next_n = 0;
+         if((v = shard_local(&w,x)) >= 0)
+         {
+            w.mark[v] = w.stamp;
+            w.front[0][w.front_n[0]++] = (int)v;
+         }
+         if((v = shard_local(&w,y)) >= 0)
+         {
+            w.mark[v] = w.stamp + 1;
+            w.front[1][w.front_n[1]++] = (int)v;
+         }
+         continue;
+
+      case SHARD_EXPAND:
+         if(msg.len < 2 || shard_expand(&w,msg.data[1] & 1,&reply) != 0)
+         {
+            _exit(1);
+         }
+         break;
+
+      case SHARD_DELIVER:
+         if(msg.len < 2 ||
+            shard_deliver(&w,msg.data[1] & 1,msg.data + 2,msg.data + msg.len,
+                          &reply) != 0)
+         {
+            _exit(1);
+         }
+         break;
+
+      default:
+         _exit(1);
+      }
+      if(shard_send(fd,&reply) != 0)
+      {
+         _exit(1);
+      }
+   }
+   _exit(0);
+}
+
+/******************************************************************************
+ * Function:      shard_build
+ *
+ * Description:   Copy the users of a worker and their BFF lists out of the
+ *                book.
+ *
+ * Params:        shard_worker *w - the worker, me and n are set.
+ *                obsess_book_cb *cb - the book.
+ *                long users - user_IDs handed out.
+ *
+ * Returns:       int - 0 on success, -1 if there is no memory.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int shard_build(shard_worker *w, obsess_book_cb *cb, long users)
+{
+   ob_adj_iter it;
+   unsigned long slots = 2;
+   unsigned long h;
+   long edges = 0;
+   long id;
+   long v;
+   int b;
+
+   for(id = 0; id < users; id++)
+   {
+      if(shard_of(id,w->n) == w->me && ob_user_at(cb,id) != NULL)
+      {
+         w->users++;
+         edges += ob_adj_live(ob_adj_of(cb,id));
+      }
+   }
+   while(slots < (unsigned long)w->users * 2)
+   {
+      slots <<= 1;
+   }
+   w->mask = slots - 1;
+
+   w->gid = malloc(sizeof(int) * (w->users + 1));
+   w->off = malloc(sizeof(long) * (w->users + 1));
+   w->adj = malloc(sizeof(int) * (edges + 1));
+   w->key = malloc(sizeof(int) * slots);
+   w->val = malloc(sizeof(int) * slots);
+   w->mark = calloc(w->users + 1,sizeof(unsigned int));
+   w->front[0] = malloc(sizeof(int) * (w->users + 1));
+   w->front[1] = malloc(sizeof(int) * (w->users + 1));
+   w->next = malloc(sizeof(int) * (w->users + 1));
+   if(w->gid == NULL || w->off == NULL || w->adj == NULL || w->key == NULL ||
+      w->val == NULL || w->mark == NULL || w->front[0] == NULL ||
+      w->front[1] == NULL || w->next == NULL)
+   {
+      return -1;
+   }
+   memset(w->key,-1,sizeof(int) * slots);
+
+   v = 0;
+   edges = 0;
+   for(id = 0; id < users; id++)
+   {
+      if(shard_of(id,w->n) != w->me || ob_user_at(cb,id) == NULL)
+      {
+         continue;
+      }
+      w->gid[v] = (int)id;
+      w->off[v] = edges;
+      ob_adj_begin(&it,ob_adj_of(cb,id));
+      while((b = ob_adj_next(&it)) >= 0)
+      {
+         w->adj[edges++] = b;
+      }
+      for(h = ((unsigned long)id * 2654435761u) & w->mask; w->key[h] >= 0;
+          h = (h + 1) & w->mask)
+      {
+      }
+      w->key[h] = (int)id;
+      w->val[h] = (int)v;
+      v++;
+   }
+   w->off[v] = edges;
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_local
+ *
+ * Description:   Look one of the users of a worker up by user_ID.
+ *
+ * Params:        shard_worker *w - the worker.
+ *                int id - user_ID.
+ *
+ * Returns:       long - the user in the worker, -1 if it has no such user.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static long shard_local(shard_worker *w, int id)
+{
+   unsigned long h;
+
+   for(h = ((unsigned long)id * 2654435761u) & w->mask; w->key[h] >= 0;
+       h = (h + 1) & w->mask)
+   {
+      if(w->key[h] == id)
+      {
+         return w->val[h];
+      }
+   }
+   return -1;
+}
+
+/******************************************************************************
+ * Function:      shard_visit
+ *
+ * Description:   Reach one of the users of a worker from a side.
+ *
+ * Params:        shard_worker *w - the worker.
+ *                int a - side reaching the user.
+ *                long v - the user in the worker, -1 for none.
+ *
+ * Returns:       int - non zero if the other side had reached the user.
+ *
+ * Notes:         A user reached for the first time goes in the next frontier.
+ *
+ *****************************************************************************/
+static int shard_visit(shard_worker *w, int a, long v)
+{
+   if(v < 0)
+   {
+      return 0;
+   }
+   if(w->mark[v] == w->stamp + (a ^ 1))
+   {
+      return 1;
+   }
+   if(w->mark[v] != w->stamp + a)
+   {
+      w->mark[v] = w->stamp + a;
+      w->next[w->next_n++] = (int)v;
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_expand
+ *
+ * Description:   Expand the frontier of a side by one level.
+ *
+ * Params:        shard_worker *w - the worker.
+ *                int a - side to expand.
+ *                shard_buf *reply - gets the reply.
+ *
+ * Returns:       int - 0 on success, -1 if there is no memory.
+ *
+ * Notes:         BFFs the worker owns are reached right away, the others
+ *                are listed for their workers.  Stops as soon as the other
+ *                side is met, the rest of the round does not matter then.
+ *
+ *****************************************************************************/
+static int shard_expand(shard_worker *w, int a, shard_buf *reply)
+{
+   long i;
+   long j;
+   int met = 0;
+   int o;
+   int b;
+
+   for(o = 0; o < w->n; o++)
+   {
+      w->out[o].n = 0;
+   }
+   w->next_n = 0;
+   for(i = 0; i < w->front_n[a] && !met; i++)
+   {
+      for(j = w->off[w->front[a][i]]; j < w->off[w->front[a][i] + 1]; j++)
+      {
+         b = w->adj[j];
+         o = shard_of(b,w->n);
+         if(o == w->me)
+         {
+            if(shard_visit(w,a,shard_local(w,b)))
+            {
+               met = 1;
+               break;
+            }
+         }
+         else if(shard_push(&w->out[o],b) != 0)
+         {
+            return -1;
+         }
+      }
+   }
+
+   if(shard_reserve(reply,1) == NULL)
+   {
+      return -1;
+   }
+   reply->data[reply->len++] = (char)met;
+   for(o = 0; o < w->n; o++)
+   {
+      if(met)
+      {
+         w->out[o].n = 0;
+      }
+      shard_unique(&w->out[o]);
+      if(shard_put_list(reply,w->out[o].id,w->out[o].n) != 0)
+      {
+         return -1;
+      }
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_deliver
+ *
+ * Description:   Reach the users other workers found for a side and finish
+ *                its level.
+ *
+ * Params:        shard_worker *w - the worker.
+ *                int a - side being expanded.
+ *                const char *p - list of user_IDs found.
+ *                const char *end - end of the message.
+ *                shard_buf *reply - gets the reply.
+ *
+ * Returns:       int - 0 on success, -1 on a bad list or no memory.
+ *
+ * Notes:         The next frontier becomes the frontier of the side.
+ *
+ *****************************************************************************/
+static int shard_deliver(shard_worker *w, int a, const char *p,
+                         const char *end, shard_buf *reply)
+{
+   int met = 0;
+   int *tmp;
+   long i;
+   char *q;
+
+   w->found.n = 0;
+   if(shard_get_list(&p,end,&w->found) != 0)
+   {
+      return -1;
+   }
+   for(i = 0; i < w->found.n && !met; i++)
+   {
+      met = shard_visit(w,a,shard_local(w,w->found.id[i]));
+   }
+
+   tmp = w->front[a];
+   w->front[a] = w->next;
+   w->front_n[a] = w->next_n;
+   w->next = tmp;
+   w->next_n = 0;
+
+   q = shard_reserve(reply,1 + 10);
+   if(q == NULL)
+   {
+      return -1;
+   }
+   q[0] = (char)met;
+   reply->len += 1 + ob_put_varint(q + 1,(unsigned long)w->front_n[a]);
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_search
+ *
+ * Description:   Run a DERPCON search on the workers.
+ *
+ * Params:        ob_shards *sh - the workers.
+ *                int x - user_ID of one user.
+ *                int y - user_ID of the other user, not x.
+ *
+ * Returns:       int - see ob_shard_derpcon.
+ *
+ * Notes:         Same rounds as search_pair in ob_traverse.c.  The sides
+ *                only meet in a round if neither had met the other before,
+ *                so the first round they meet in gives the DERPCON.
+ *
+ *****************************************************************************/
+static int shard_search(ob_shards *sh, int x, int y)
+{
+   long pos[OB_SHARDS_MAX];
+   long size[2] = {1, 1};
+   int level[2] = {0, 0};
+   unsigned long count;
+   const unsigned char *p;
+   int met;
+   int rc;
+   int a;
+   int i;
+
+   sh->msg.len = SHARD_HEAD;
+   if(shard_reserve(&sh->msg,1 + 2 * sizeof(int)) == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   sh->msg.data[sh->msg.len++] = SHARD_START;
+   memcpy(sh->msg.data + sh->msg.len,&x,sizeof(int));
+   memcpy(sh->msg.data + sh->msg.len + sizeof(int),&y,sizeof(int));
+   sh->msg.len += 2 * sizeof(int);
+   for(i = 0; i < sh->n; i++)
+   {
+      if(shard_send(sh->fd[i],&sh->msg) != 0)
+      {
+         return -USER_IO_ERROR;
+      }
+   }
+
+   //DERPCON k is k + 1 BFF links, max_derpcon means no link.
+   while(level[0] + level[1] < sh->max_derpcon)
+   {
+      //Expand the side with the smaller frontier.
+      a = size[0] <= size[1] ? 0 : 1;
+      if(size[a] == 0)
+      {//Nothing left to find on this side.
+         break;
+      }
+
+      sh->msg.len = SHARD_HEAD;
+      if(shard_reserve(&sh->msg,2) == NULL)
+      {
+         return -USER_NO_MEM;
+      }
+      sh->msg.data[sh->msg.len++] = SHARD_EXPAND;
+      sh->msg.data[sh->msg.len++] = (char)a;
+      for(i = 0; i < sh->n; i++)
+      {
+         if(shard_send(sh->fd[i],&sh->msg) != 0)
+         {
+            return -USER_IO_ERROR;
+         }
+      }
+      met = 0;
+      for(i = 0; i < sh->n; i++)
+      {
+         if(shard_recv(sh->fd[i],&sh->in[i]) != 0 || sh->in[i].len < 1)
+         {
+            return -USER_IO_ERROR;
+         }
+         met |= sh->in[i].data[0];
+         pos[i] = 1;
+      }
+      if(met)
+      {
+         return level[0] + level[1];
+      }
+
+      //Hand each worker the BFFs the others found for it.
+      for(i = 0; i < sh->n; i++)
+      {
+         sh->msg.len = SHARD_HEAD;
+         if(shard_reserve(&sh->msg,2) == NULL)
+         {
+            return -USER_NO_MEM;
+         }
+         sh->msg.data[sh->msg.len++] = SHARD_DELIVER;
+         sh->msg.data[sh->msg.len++] = (char)a;
+         rc = shard_merge(sh,pos);
+         if(rc != 0)
+         {
+            return rc;
+         }
+         if(shard_send(sh->fd[i],&sh->msg) != 0)
+         {
+            return -USER_IO_ERROR;
+         }
+      }
+      size[a] = 0;
+      for(i = 0; i < sh->n; i++)
+      {
+         if(shard_recv(sh->fd[i],&sh->in[i]) != 0 || sh->in[i].len < 2)
+         {
+            return -USER_IO_ERROR;
+         }
+         met |= sh->in[i].data[0];
+         p = (const unsigned char*)sh->in[i].data;
+         p = ob_get_varint(p + 1,p + sh->in[i].len,&count);
+         if(p == NULL)
+         {
+            return -USER_IO_ERROR;
+         }
+         size[a] += (long)count;
+      }
+      if(met)
+      {
+         return level[0] + level[1];
+      }
+      level[a]++;
+   }
+   return sh->max_derpcon;
+}
+
+/******************************************************************************
+ * Function:      shard_merge
+ *
+ * Description:   Merge the lists the workers sent for the next worker into
+ *                the message to it.
+ *
+ * Params:        ob_shards *sh - the workers, the replies are in in.
+ *                long *pos - where the list for the next worker starts in
+ *                            each reply, moved past it.
+ *
+ * Returns:       int - 0 on success.
+ *                      -USER_NO_MEM - no memory.
+ *                      -USER_IO_ERROR - bad reply.
+ *
+ * Notes:         The lists for each worker come in the order of the workers,
+ *                so the replies are read front to back.
+ *
+ *****************************************************************************/
+static int shard_merge(ob_shards *sh, long *pos)
+{
+   const char *p;
+   size_t len;
+   int rc;
+   int i;
+
+   sh->ids.n = 0;
+   for(i = 0; i < sh->n; i++)
+   {
+      p = sh->in[i].data + pos[i];
+      rc = shard_get_list(&p,sh->in[i].data + sh->in[i].len,&sh->ids);
+      if(rc != 0)
+      {
+         return rc;
+      }
+      pos[i] = p - sh->in[i].data;
+   }
+   sh->sent += sh->ids.n;
+   shard_unique(&sh->ids);
+   sh->kept += sh->ids.n;
+
+   len = sh->msg.len;
+   if(shard_put_list(&sh->msg,sh->ids.id,sh->ids.n) != 0)
+   {
+      return -USER_NO_MEM;
+   }
+   sh->bytes += sh->msg.len - len;
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_reserve
+ *
+ * Description:   Make room at the end of a message.
+ *
+ * Params:        shard_buf *b - the message.
+ *                size_t more - bytes needed past len.
+ *
+ * Returns:       char* - where the bytes go, NULL if there is no memory.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static char *shard_reserve(shard_buf *b, size_t more)
+{
+   size_t cap;
+   char *data;
+
+   if(b->len + more > b->cap)
+   {
+      cap = b->cap ? b->cap : 256;
+      while(cap < b->len + more)
+      {
+         cap *= 2;
+      }
+      data = realloc(b->data,cap);
+      if(data == NULL)
+      {
+         return NULL;
+      }
+      b->data = data;
+      b->cap = cap;
+   }
+   return b->data + b->len;
+}
+
+/******************************************************************************
+ * Function:      shard_push
+ *
+ * Description:   Add a user_ID to a list.
+ *
+ * Params:        shard_ids *s - the list.
+ *                int id - the user_ID.
+ *
+ * Returns:       int - 0 on success, -1 if there is no memory.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int shard_push(shard_ids *s, int id)
+{
+   long cap;
+   int *p;
+
+   if(s->n == s->cap)
+   {
+      cap = s->cap ? s->cap * 2 : 256;
+      p = realloc(s->id,sizeof(int) * cap);
+      if(p == NULL)
+      {
+         return -1;
+      }
+      s->id = p;
+      s->cap = cap;
+   }
+   s->id[s->n++] = id;
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_unique
+ *
+ * Description:   Sort a list and drop the repeats.
+ *
+ * Params:        shard_ids *s - the list.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void shard_unique(shard_ids *s)
+{
+   long i;
+   long n;
+
+   if(s->n < 2)
+   {
+      return;
+   }
+   qsort(s->id,s->n,sizeof(int),shard_cmp);
+   for(i = 1, n = 1; i < s->n; i++)
+   {
+      if(s->id[i] != s->id[n - 1])
+      {
+         s->id[n++] = s->id[i];
+      }
+   }
+   s->n = n;
+}
+
+/******************************************************************************
+ * Function:      shard_put_list
+ *
+ * Description:   Write a sorted list of user_IDs without repeats.
+ *
+ * Params:        shard_buf *b - message the list goes on the end of.
+ *                const int *id - the user_IDs.
+ *                long n - number of user_IDs.
+ *
+ * Returns:       int - 0 on success, -1 if there is no memory.
+ *
+ * Notes:         The count, then the gap from each user_ID to the next, the
+ *                first from 0, 7 bits a byte.  BFFs of nearby users are
+ *                close together after ob_reorder and take a byte or two.
+ *
+ *****************************************************************************/
+static int shard_put_list(shard_buf *b, const int *id, long n)
+{
+   char *p;
+   long i;
+   int last = 0;
+
+   p = shard_reserve(b,10 + n * SHARD_VARINT);
+   if(p == NULL)
+   {
+      return -1;
+   }
+   p += ob_put_varint(p,(unsigned long)n);
+   for(i = 0; i < n; i++)
+   {
+      p += ob_put_varint(p,(unsigned long)(id[i] - last));
+      last = id[i];
+   }
+   b->len = p - b->data;
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_get_list
+ *
+ * Description:   Read a list written by shard_put_list.
+ *
+ * Params:        const char **p - start of the list, moved past it.
+ *                const char *end - end of the message.
+ *                shard_ids *s - the user_IDs are added to it.
+ *
+ * Returns:       int - 0 on success.
+ *                      -USER_NO_MEM - no memory.
+ *                      -USER_IO_ERROR - the list runs past end.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int shard_get_list(const char **p, const char *end, shard_ids *s)
+{
+   const unsigned char *q = (const unsigned char*)*p;
+   unsigned long n;
+   unsigned long gap;
+   unsigned long i;
+   long last = 0;
+
+   q = ob_get_varint(q,(const unsigned char*)end,&n);
+   if(q == NULL || n > (unsigned long)(end - *p))
+   {
+      return -USER_IO_ERROR;
+   }
+   for(i = 0; i < n; i++)
+   {
+      q = ob_get_varint(q,(const unsigned char*)end,&gap);
+      if(q == NULL || last + (long)gap > INT_MAX)
+      {
+         return -USER_IO_ERROR;
+      }
+      last += (long)gap;
+      if(shard_push(s,(int)last) != 0)
+      {
+         return -USER_NO_MEM;
+      }
+   }
+   *p = (const char*)q;
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_send
+ *
+ * Description:   Send a message.
+ *
+ * Params:        int fd - the socket.
+ *                shard_buf *b - the message, its first SHARD_HEAD bytes are
+ *                               filled in with the length.
+ *
+ * Returns:       int - 0 on success, -1 if the other end went away.
+ *
+ * Notes:         Blocks until all of it is sent.
+ *
+ *****************************************************************************/
+static int shard_send(int fd, shard_buf *b)
+{
+   unsigned int len = (unsigned int)(b->len - SHARD_HEAD);
+   size_t off = 0;
+   ssize_t n;
+
+   memcpy(b->data,&len,SHARD_HEAD);
+   while(off < b->len)
+   {
+      n = send(fd,b->data + off,b->len - off,MSG_NOSIGNAL);
+      if(n < 0)
+      {
+         if(errno == EINTR)
+         {
+            continue;
+         }
+         return -1;
+      }
+      off += n;
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_recv
+ *
+ * Description:   Receive a message.
+ *
+ * Params:        int fd - the socket.
+ *                shard_buf *b - gets the message without its length.
+ *
+ * Returns:       int - 0 on success, -1 if the other end went away or there
+ *                      is no memory.
+ *
+ * Notes:         Blocks until all of it is in.
+ *
+ *****************************************************************************/
+static int shard_recv(int fd, shard_buf *b)
+{
+   unsigned int len;
+   size_t off = 0;
+   ssize_t n;
+
+   b->len = 0;
+   if(shard_reserve(b,SHARD_HEAD) == NULL)
+   {
+      return -1;
+   }
+   while(off < SHARD_HEAD + b->len)
+   {
+      n = recv(fd,b->data + off,
+               (off < SHARD_HEAD ? SHARD_HEAD : SHARD_HEAD + b->len) - off,0);
+      if(n <= 0)
+      {
+         if(n < 0 && errno == EINTR)
+         {
+            continue;
+         }
+         return -1;
+      }
+      off += n;
+      if(off == SHARD_HEAD && b->len == 0)
+      {
+         memcpy(&len,b->data,SHARD_HEAD);
+         if(shard_reserve(b,SHARD_HEAD + (size_t)len) == NULL)
+         {
+            return -1;
+         }
+         b->len = len;
+      }
+   }
+   memmove(b->data,b->data + SHARD_HEAD,b->len);
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      shard_cmp
+ *
+ * Description:   qsort compare of two user_IDs.
+ *
+ * Params:        const void *a, const void *b - the user_IDs.
+ *
+ * Returns:       int - <0, 0 or >0.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int shard_cmp(const void *a, const void *b)
+{
+   int x = *(const int*)a;
+   int y = *(const int*)b;
+
+   return (x > y) - (x < y);
+}
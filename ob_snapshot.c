@@ -0,0 +1,830 @@
+/*****************************************************************************
+ *
+ *     ob_snapshot.c
+ *
+ *   Description: Snapshots of a book.  A snapshot holds every user and BFF
+ *                pair and the journal position it was taken at, ob_recover
+ *                loads it with ob_bulk_load and replays the journal from
+ *                there.  Taking one only stops the writers while the journal
+ *                position and the number of user_IDs are read, a thread
+ *                copies the book out after that while the writers go on.
+ *                A writer about to change a user the thread has not copied
+ *                yet saves the user as it was first, the thread takes the
+ *                saved copy when it gets there.  The file is written under a
+ *                new name and renamed over the old snapshot once it is on
+ *                disk, so a crash leaves either snapshot whole.
+ *                File layout:
+ *                   magic, journal position, user_IDs, users, pairs,
+ *                   bytes of users, bytes of pairs
+ *                   each user: gap from the user_ID before, name length,
+ *                              name, account handle length + 1 and handle,
+ *                              or 0 if it is the name
+ *                   each pair: gap from the lower user_ID of the pair
+ *                              before, gap to the higher user_ID
+ *                   checksum of everything before it
+ *                The numbers are varints, the user_IDs are the ones the
+ *                users had when the snapshot was taken.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//First bytes of a snapshot file.
+#define SNAP_MAGIC     "OBSNAP02"
+#define SNAP_MAGIC_LEN 8
+
+//Numbers after the magic, see the layout above.
+#define SNAP_FIELDS 6
+#define SNAP_HEAD   (SNAP_MAGIC_LEN + SNAP_FIELDS * sizeof(unsigned long))
+
+//Bytes each buffer of a snapshot starts with.
+#define SNAP_BUF (64L * 1024)
+
+//Most bytes of a user record besides its names, or of a pair record.
+#define SNAP_REC_MAX 30
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Bytes of a snapshot being put together.
+typedef struct _snap_buf
+{
+   char  *data;
+   size_t len;
+   size_t cap;
+}snap_buf;
+
+//User as a writer saved it before changing it.
+struct _ob_snap_user
+{
+   user *usr;
+   int   n;                   //Number of BFFs.
+   int   bff[];               //user_ID of each BFF.
+};
+//_____________________________________________________________________________
+//                                                            Private Functions
+static void *snap_thread(void *arg);
+static int snap_user_put(snap_buf *users, snap_buf *pairs, long *last,
+                         long *last_pair, long *pair_count, long id,
+                         user *usr, ob_adj *adj, const int *bff, int n);
+static void snap_lock_all(obsess_book_cb *cb);
+static void snap_unlock_all(obsess_book_cb *cb);
+static void snap_free(ob_snap *s);
+static char *snap_reserve(snap_buf *b, size_t need);
+static int snap_write(const char *path, const unsigned long *head,
+                      const snap_buf *users, const snap_buf *pairs);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_snapshot
+ *
+ * Description:   Write every user and BFF pair of the book to a file.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const char *path - the snapshot file, replaced once the new
+ *                                   one is on disk.
+ *
+ * Returns:       user_ret_code - see ob_snapshot_start and ob_snapshot_wait.
+ *
+ * Notes:         Same as ob_snapshot_start followed by ob_snapshot_wait, the
+ *                writers go on while it runs.
+ *
+ *****************************************************************************/
+user_ret_code ob_snapshot(obsess_book_cb *cb, const char *path)
+{
+   user_ret_code rc;
+
+   rc = ob_snapshot_start(cb,path);
+   if(rc != USER_SUCCESS)
+   {
+      return rc;
+   }
+   return ob_snapshot_wait(cb);
+}
+
+/******************************************************************************
+ * Function:      ob_snapshot_start
+ *
+ * Description:   Take a snapshot of the book and write it out in the
+ *                background.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const char *path - the snapshot file, replaced once the new
+ *                                   one is on disk.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - snapshot taken, being written.
+ *                              USER_INVALID_PARAMER - bad parameter.
+ *                              USER_NOT_READY - a snapshot is still being
+ *                                               written.
+ *                              USER_NO_MEM - no memory.
+ *
+ * Notes:         The snapshot is of the book as it is when this returns.
+ *                Writers are held up while the journal position and the
+ *                number of user_IDs are read, then each writer saves the
+ *                users it changes the first time until the thread has
+ *                copied the book.  ob_reorder is refused until then.
+ *                Call ob_snapshot_wait to learn if the file was written.
+ *
+ *****************************************************************************/
+user_ret_code ob_snapshot_start(obsess_book_cb *cb, const char *path)
+{
+   user_ret_code rc = USER_SUCCESS;
+   ob_snap *s;
+   long cap;
+
+   if(cb == NULL || path == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   pthread_mutex_lock(&cb->snap_lock);
+   if(cb->snap_job != NULL)
+   {
+      rc = -USER_NOT_READY;
+      goto EXIT_snapshot_start_0;
+   }
+   s = calloc(1,sizeof(ob_snap));
+   if(s == NULL)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_snapshot_start_0;
+   }
+   s->cb = cb;
+   s->path = strdup(path);
+
+   //Size the arrays before the writers are stopped, with room for the users
+   //created meanwhile.
+   for(;;)
+   {
+      cap = ob_user_count(cb);
+      cap += cap / 8 + 1024;
+      s->state = calloc(cap,1);
+      s->saved = calloc(cap,sizeof(ob_snap_user*));
+      if(s->path == NULL || s->state == NULL || s->saved == NULL)
+      {
+         snap_free(s);
+         rc = -USER_NO_MEM;
+         goto EXIT_snapshot_start_0;
+      }
+      snap_lock_all(cb);
+      if(ob_user_count(cb) <= cap)
+      {
+         break;
+      }
+      snap_unlock_all(cb);
+      free(s->state);
+      free(s->saved);
+   }
+   s->users = ob_user_count(cb);
+   s->pos = ob_journal_position(cb);
+   __atomic_store_n(&cb->snap,s,__ATOMIC_RELEASE);
+   snap_unlock_all(cb);
+
+   if(pthread_create(&s->thread,NULL,snap_thread,s) != 0)
+   {
+      snap_lock_all(cb);
+      __atomic_store_n(&cb->snap,NULL,__ATOMIC_RELEASE);
+      snap_unlock_all(cb);
+      snap_free(s);
+      rc = -USER_NO_MEM;
+      goto EXIT_snapshot_start_0;
+   }
+   cb->snap_job = s;
+
+EXIT_snapshot_start_0:
+   pthread_mutex_unlock(&cb->snap_lock);
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_snapshot_wait
+ *
+ * Description:   Wait for the snapshot being written.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - snapshot on disk, or none was
+ *                                             being written.
+ *                              USER_INVALID_PARAMER - bad parameter.
+ *                              USER_NO_MEM - no memory, no snapshot.
+ *                              USER_IO_ERROR - the file could not be written,
+ *                                              or the journal did not reach
+ *                                              the snapshot.
+ *
+ * Notes:         ob_journal_close and ob_exit wait for the snapshot too.
+ *
+ *****************************************************************************/
+user_ret_code ob_snapshot_wait(obsess_book_cb *cb)
+{
+   user_ret_code rc = USER_SUCCESS;
+   ob_snap *s;
+
+   if(cb == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   pthread_mutex_lock(&cb->snap_lock);
+   s = cb->snap_job;
+   if(s != NULL)
+   {
+      pthread_join(s->thread,NULL);
+      rc = s->rc;
+      cb->snap_job = NULL;
+      snap_free(s);
+   }
+   pthread_mutex_unlock(&cb->snap_lock);
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_snap_save
+ *
+ * Description:   Save a user before a writer changes it.
+ *
+ * Params:        ob_snap *s - the snapshot being taken.
+ *                long id - user_ID of the user.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Called by ob_snap_touch.  The caller holds the write lock,
+ *                or the bucket lock for a new user, so nothing else changes
+ *                the user.  Whoever moves the user from TODO to BUSY copies
+ *                it, the others wait for DONE, which takes as long as
+ *                copying one BFF list.
+ *
+ *****************************************************************************/
+void ob_snap_save(ob_snap *s, long id)
+{
+   obsess_book_cb *cb = s->cb;
+   ob_snap_user *rec = NULL;
+   ob_adj_iter it;
+   ob_adj *adj;
+   user *usr;
+   int w;
+
+   if(!__sync_bool_compare_and_swap(&s->state[id],OB_SNAP_TODO,OB_SNAP_BUSY))
+   {
+      while(__atomic_load_n(&s->state[id],__ATOMIC_ACQUIRE) != OB_SNAP_DONE)
+      {
+         sched_yield();
+      }
+      return;
+   }
+
+   usr = ob_user_at(cb,id);
+   if(usr != NULL)
+   {
+      adj = ob_adj_of(cb,id);
+      rec = malloc(sizeof(ob_snap_user) + sizeof(int) * ob_adj_live(adj));
+      if(rec == NULL)
+      {
+         __atomic_store_n(&s->failed,1,__ATOMIC_RELAXED);
+      }
+      else
+      {
+         rec->usr = usr;
+         rec->n = 0;
+         ob_adj_begin(&it,adj);
+         while((w = ob_adj_next(&it)) >= 0)
+         {
+            rec->bff[rec->n++] = w;
+         }
+      }
+   }
+   s->saved[id] = rec;
+   __atomic_store_n(&s->state[id],OB_SNAP_DONE,__ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+ * Function:      ob_snapshot_load
+ *
+ * Description:   Add the users and BFF pairs of a snapshot to the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const char *path - the snapshot file.
+ *                unsigned long *pos - set to the journal position of the
+ *                                     snapshot.
+ *
+ * Returns:       long >= 0 - number of users loaded.
+ *                -USER_INVALID_PARAMER - not a snapshot or damaged.
+ *                -USER_NO_MEM - no memory.
+ *                -USER_IO_ERROR - the file could not be read.
+ *
+ * Notes:         Used by ob_recover.
+ *
+ *****************************************************************************/
+long ob_snapshot_load(obsess_book_cb *cb, const char *path,
+                      unsigned long *pos)
+{
+   struct stat st;
+   unsigned char *data = NULL;
+   const unsigned char *p;
+   const unsigned char *end;
+   unsigned long head[SNAP_FIELDS];
+   unsigned long id = 0;
+   unsigned long a = 0;
+   unsigned long gap;
+   unsigned long b;
+   unsigned int sum;
+   ob_bulk_user *users = NULL;
+   ob_bulk_edge *edges = NULL;
+   long *at = NULL;              //User of each user_ID, -1 if there is none.
+   char *pool = NULL;
+   char *next;
+   long rc = -USER_INVALID_PARAMER;
+   long i;
+   int fd;
+
+   fd = open(path,O_RDONLY);
+   if(fd < 0)
+   {
+      return -USER_IO_ERROR;
+   }
+   if(fstat(fd,&st) != 0)
+   {
+      rc = -USER_IO_ERROR;
+      goto EXIT_snapshot_load_0;
+   }
+   if((size_t)st.st_size < SNAP_HEAD + sizeof(sum))
+   {
+      goto EXIT_snapshot_load_0;
+   }
+   data = malloc(st.st_size);
+   if(data == NULL)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_snapshot_load_0;
+   }
+   if(ob_file_read(fd,data,st.st_size,0) != 0)
+   {
+      rc = -USER_IO_ERROR;
+      goto EXIT_snapshot_load_0;
+   }
+   memcpy(&sum,data + st.st_size - sizeof(sum),sizeof(sum));
+   memcpy(head,data + SNAP_MAGIC_LEN,sizeof(head));
+   if(memcmp(data,SNAP_MAGIC,SNAP_MAGIC_LEN) != 0 ||
+      head[4] + head[5] != st.st_size - SNAP_HEAD - sizeof(sum) ||
+      head[2] > head[1] || head[1] > INT_MAX ||
+      ob_checksum(2166136261u,data,st.st_size - sizeof(sum)) != sum)
+   {
+      goto EXIT_snapshot_load_0;
+   }
+
+   //Every name is one byte longer as a string than in the file.
+   users = malloc(sizeof(ob_bulk_user) * (head[2] ? head[2] : 1));
+   edges = malloc(sizeof(ob_bulk_edge) * (head[3] ? head[3] : 1));
+   pool = malloc(head[4] + 2 * head[2] + 1);
+   at = malloc(sizeof(long) * (head[1] + 1));
+   if(users == NULL || edges == NULL || pool == NULL || at == NULL)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_snapshot_load_0;
+   }
+   next = pool;
+   p = data + SNAP_HEAD;
+   end = p + head[4];
+   for(i = 0; i <= (long)head[1]; i++)
+   {
+      at[i] = -1;
+   }
+   for(i = 0; i < (long)head[2] && p != NULL; i++)
+   {
+      p = ob_get_varint(p,end,&gap);
+      if(p == NULL || gap >= head[1] || (id += gap + (i > 0)) >= head[1])
+      {
+         goto EXIT_snapshot_load_0;
+      }
+      at[id] = i;
+      p = ob_get_name(p,end,0,&next,&users[i].name);
+      if(p != NULL)
+      {
+         p = ob_get_name(p,end,1,&next,&users[i].account_handle);
+      }
+      if(p != NULL && users[i].account_handle == NULL)
+      {
+         users[i].account_handle = users[i].name;
+      }
+   }
+   if(p != end)
+   {
+      goto EXIT_snapshot_load_0;
+   }
+   end = p + head[5];
+   for(i = 0; i < (long)head[3] && p != NULL; i++)
+   {
+      p = ob_get_varint(p,end,&gap);
+      if(p != NULL)
+      {
+         a += gap;
+         p = ob_get_varint(p,end,&gap);
+      }
+      b = a + gap;
+      if(p == NULL || a > id || gap > id || b > id || at[a] < 0 || at[b] < 0)
+      {
+         goto EXIT_snapshot_load_0;
+      }
+      edges[i].who = users[at[a]].name;
+      edges[i].bff = users[at[b]].name;
+   }
+   if(p != end)
+   {
+      goto EXIT_snapshot_load_0;
+   }
+
+   rc = ob_bulk_load(cb,users,head[2],edges,head[3]);
+   if(rc >= 0)
+   {
+      *pos = head[0];
+      rc = head[2];
+   }
+
+EXIT_snapshot_load_0:
+   free(users);
+   free(edges);
+   free(pool);
+   free(at);
+   free(data);
+   close(fd);
+   return rc;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      snap_thread
+ *
+ * Description:   Copy the book out and write the snapshot file.
+ *
+ * Params:        void *arg - the snapshot.
+ *
+ * Returns:       NULL.
+ *
+ * Notes:         Algorithm:
+ *                For each user_ID below the count at the start, move it from
+ *                TODO to BUSY and copy the user and its BFFs as they are, or
+ *                if a writer got there first wait for it and take what it
+ *                saved.  Each pair is written once, at its lower user_ID.
+ *                The BFF lists at the start only hold users there were at
+ *                the start, so every pair has both of its users.  Once all
+ *                are copied the writers stop saving, the journal is synced
+ *                up to the snapshot and the file is written.
+ *
+ *****************************************************************************/
+static void *snap_thread(void *arg)
+{
+   ob_snap *s = arg;
+   obsess_book_cb *cb = s->cb;
+   snap_buf users = {NULL,0,0};
+   snap_buf pairs = {NULL,0,0};
+   unsigned long head[SNAP_FIELDS];
+   ob_snap_user *rec;
+   long last = -1;
+   long last_pair = 0;
+   long pair_count = 0;
+   long count = 0;
+   long id;
+   int failed = 0;
+
+   for(id = 0; id < s->users && !failed; id++)
+   {
+      if(__sync_bool_compare_and_swap(&s->state[id],OB_SNAP_TODO,
+                                      OB_SNAP_BUSY))
+      {//Nobody changed it, it is as it was at the start.
+         ob_epoch_enter(cb);
+         failed = snap_user_put(&users,&pairs,&last,&last_pair,&pair_count,id,
+                                ob_user_at(cb,id),ob_adj_of(cb,id),NULL,0);
+         ob_epoch_exit(cb);
+         __atomic_store_n(&s->state[id],OB_SNAP_DONE,__ATOMIC_RELEASE);
+      }
+      else
+      {
+         while(__atomic_load_n(&s->state[id],__ATOMIC_ACQUIRE) != OB_SNAP_DONE)
+         {
+            sched_yield();
+         }
+         rec = s->saved[id];
+         if(rec != NULL)
+         {
+            failed = snap_user_put(&users,&pairs,&last,&last_pair,&pair_count,
+                                   id,rec->usr,NULL,rec->bff,rec->n);
+         }
+      }
+      count += last == id;
+   }
+
+   //Nobody saves users from here on.
+   snap_lock_all(cb);
+   __atomic_store_n(&cb->snap,NULL,__ATOMIC_RELEASE);
+   snap_unlock_all(cb);
+   if(failed || s->failed)
+   {
+      s->rc = -USER_NO_MEM;
+      goto EXIT_snap_thread_0;
+   }
+
+   //The journal has to reach the snapshot for recovery to go on from it.
+   s->rc = ob_journal_durable(cb,s->pos);
+   if(s->rc != USER_SUCCESS)
+   {
+      goto EXIT_snap_thread_0;
+   }
+   head[0] = s->pos;
+   head[1] = s->users;
+   head[2] = count;
+   head[3] = pair_count;
+   head[4] = users.len;
+   head[5] = pairs.len;
+   if(snap_write(s->path,head,&users,&pairs) != 0)
+   {
+      s->rc = -USER_IO_ERROR;
+   }
+
+EXIT_snap_thread_0:
+   free(users.data);
+   free(pairs.data);
+   return NULL;
+}
+
+/******************************************************************************
+ * Function:      snap_user_put
+ *
+ * Description:   Write a user and the pairs at it.
+ *
+ * Params:        snap_buf *users - the user records.
+ *                snap_buf *pairs - the pair records.
+ *                long *last - user_ID of the last user written.
+ *                long *last_pair - lower user_ID of the last pair written.
+ *                long *pair_count - number of pairs written.
+ *                long id - user_ID of the user.
+ *                user *usr - the user, NULL if there is none.
+ *                ob_adj *adj - BFFs of the user, or
+ *                const int *bff, int n - the BFFs a writer saved.
+ *
+ * Returns:       int 0 - written, non zero if there is no memory.
+ *
+ * Notes:         Only the BFFs above the user are written.
+ *
+ *****************************************************************************/
+static int snap_user_put(snap_buf *users, snap_buf *pairs, long *last,
+                         long *last_pair, long *pair_count, long id,
+                         user *usr, ob_adj *adj, const int *bff, int n)
+{
+   const char *handle;
+   ob_adj_iter it;
+   char *p;
+   int len;
+   int i = 0;
+   int w;
+
+   if(usr == NULL)
+   {
+      return 0;
+   }
+   handle = usr->handle_off ? ob_user_handle(usr) : NULL;
+   len = handle != NULL ? (int)strlen(handle) : 0;
+   p = snap_reserve(users,SNAP_REC_MAX + usr->name_len + len);
+   if(p == NULL)
+   {
+      return 1;
+   }
+   p += ob_put_varint(p,id - *last - 1);
+   p += ob_put_varint(p,usr->name_len);
+   memcpy(p,ob_user_name(usr),usr->name_len);
+   p += usr->name_len;
+   p += ob_put_varint(p,handle != NULL ? len + 1 : 0);
+   if(handle != NULL)
+   {
+      memcpy(p,handle,len);
+      p += len;
+   }
+   users->len = p - users->data;
+   *last = id;
+
+   if(adj != NULL)
+   {
+      ob_adj_begin(&it,adj);
+   }
+   for(;;)
+   {
+      if(adj != NULL)
+      {
+         w = ob_adj_next(&it);
+      }
+      else
+      {
+         w = i < n ? bff[i++] : -1;
+      }
+      if(w < 0)
+      {
+         break;
+      }
+      if(w <= id)
+      {
+         continue;
+      }
+      p = snap_reserve(pairs,SNAP_REC_MAX);
+      if(p == NULL)
+      {
+         return 1;
+      }
+      p += ob_put_varint(p,id - *last_pair);
+      p += ob_put_varint(p,w - id);
+      pairs->len = p - pairs->data;
+      *last_pair = id;
+      (*pair_count)++;
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      snap_lock_all
+ *
+ * Description:   Stop every writer of the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Takes the write lock and every bucket lock, no change is
+ *                made or half logged while they are held.
+ *
+ *****************************************************************************/
+static void snap_lock_all(obsess_book_cb *cb)
+{
+   int i;
+
+   pthread_mutex_lock(&cb->write_lock);
+   for(i = 0; i < OB_BUCKET_LOCKS; i++)
+   {
+      pthread_mutex_lock(&cb->bucket_lock[i]);
+   }
+}
+
+/******************************************************************************
+ * Function:      snap_unlock_all
+ *
+ * Description:   Let the writers go on.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static void snap_unlock_all(obsess_book_cb *cb)
+{
+   int i;
+
+   for(i = OB_BUCKET_LOCKS - 1; i >= 0; i--)
+   {
+      pthread_mutex_unlock(&cb->bucket_lock[i]);
+   }
+   pthread_mutex_unlock(&cb->write_lock);
+}
+
+/******************************************************************************
+ * Function:      snap_free
+ *
+ * Description:   Free a snapshot and the users saved for it.
+ *
+ * Params:        ob_snap *s - the snapshot.
+ *
+ * Returns:       None.
+ *
+ * Notes:         No writer may still see it.
+ *
+ *****************************************************************************/
+static void snap_free(ob_snap *s)
+{
+   long id;
+
+   if(s->saved != NULL)
+   {
+      for(id = 0; id < s->users; id++)
+      {
+         free(s->saved[id]);
+      }
+   }
+   free(s->saved);
+   free(s->state);
+   free(s->path);
+   free(s);
+}
+
+/******************************************************************************
+ * Function:      snap_reserve
+ *
+ * Description:   Make room at the end of a buffer.
+ *
+ * Params:        snap_buf *b - the buffer.
+ *                size_t need - bytes needed.
+ *
+ * Returns:       char* - where to write, NULL if there is no memory.
+ *
+ * Notes:         The caller moves len past what it wrote.
+ *
+ *****************************************************************************/
+static char *snap_reserve(snap_buf *b, size_t need)
+{
+   size_t cap;
+   char *grown;
+
+   if(b->len + need > b->cap)
+   {
+      for(cap = b->cap ? b->cap * 2 : SNAP_BUF; cap < b->len + need; cap *= 2)
+      {
+      }
+      grown = realloc(b->data,cap);
+      if(grown == NULL)
+      {
+         return NULL;
+      }
+      b->data = grown;
+      b->cap = cap;
+   }
+   return b->data + b->len;
+}
+
+/******************************************************************************
+ * Function:      snap_write
+ *
+ * Description:   Write a snapshot file and put it in place.
+ *
+ * Params:        const char *path - the snapshot file.
+ *                const unsigned long *head - numbers of the header.
+ *                const snap_buf *users - the user records.
+ *                const snap_buf *pairs - the pair records.
+ *
+ * Returns:       int 0 - written, non zero on an error.
+ *
+ * Notes:         Written to path.tmp, synced, renamed over path and the
+ *                directory synced.
+ *
+ *****************************************************************************/
+static int snap_write(const char *path, const unsigned long *head,
+                      const snap_buf *users, const snap_buf *pairs)
+{
+   char start[SNAP_HEAD];
+   unsigned int sum;
+   char *tmp;
+   int fd;
+   int rc = 1;
+
+   tmp = malloc(strlen(path) + 5);
+   if(tmp == NULL)
+   {
+      return 1;
+   }
+   sprintf(tmp,"%s.tmp",path);
+   fd = open(tmp,O_WRONLY | O_CREAT | O_TRUNC,0644);
+   if(fd < 0)
+   {
+      free(tmp);
+      return 1;
+   }
+
+   memcpy(start,SNAP_MAGIC,SNAP_MAGIC_LEN);
+   memcpy(start + SNAP_MAGIC_LEN,head,SNAP_FIELDS * sizeof(unsigned long));
+   sum = ob_checksum(2166136261u,start,SNAP_HEAD);
+   sum = ob_checksum(sum,users->data,users->len);
+   sum = ob_checksum(sum,pairs->data,pairs->len);
+   if(ob_file_write(fd,start,SNAP_HEAD) == 0 &&
+      ob_file_write(fd,users->data,users->len) == 0 &&
+      ob_file_write(fd,pairs->data,pairs->len) == 0 &&
+      ob_file_write(fd,&sum,sizeof(sum)) == 0 &&
+      fsync(fd) == 0)
+   {
+      rc = 0;
+   }
+   if(close(fd) != 0)
+   {
+      rc = 1;
+   }
+   if(rc == 0 && (rename(tmp,path) != 0 || ob_sync_dir(path) != 0))
+   {
+      rc = 1;
+   }
+   if(rc != 0)
+   {
+      unlink(tmp);
+   }
+   free(tmp);
+   return rc;
+}
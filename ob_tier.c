@@ -0,0 +1,569 @@
+/*****************************************************************************
+ *
+ *     ob_tier.c
+ *
+ *   Description: Cold tier of the BFF lists.  Most users are not looked at
+ *                for long stretches, their BFF lists do not have to stay in
+ *                memory.  Each user has a heat that DERPCON searches and BFF
+ *                changes of the user raise and every ob_tier_sweep halves.
+ *                A sweep packs the lists of the users that went cold into a
+ *                file mapped read only, the packed list in the file takes the
+ *                place of the one in memory, and brings the lists of cold
+ *                users that got hot again back into memory.  Readers walk a
+ *                list the same way wherever its packed BFFs are, the pages of
+ *                the file are read in as searches touch them and dropped
+ *                again by each sweep, so the memory of the book follows the
+ *                users in use instead of all of them.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Address space kept for the file, the most bytes of lists it can hold.
+#define TIER_SPAN (1L << 36)
+
+//Bytes of packed lists a sweep writes to the file at a time.
+#define TIER_CHUNK (1L << 20)
+
+//Heat that brings the BFFs of a cold user back into memory.
+#define TIER_HOT 4
+
+//Packed lists in the file start on a multiple of this.
+#define TIER_ALIGN 8
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Cold tier of a book.
+struct _ob_tier
+{
+   int   fd;
+   char *base;                //The file, mapped read only.
+   long  len;                 //Bytes written to the file.
+};
+
+//Lists of a sweep waiting to be written to the file.
+typedef struct _tier_stage
+{
+   char *buf;                 //The packed lists.
+   long  len;
+   long  cap;
+   int  *id;                  //user_ID of each list.
+   long *off;                 //Offset of each list in buf.
+   long  n;
+   long  n_cap;
+}tier_stage;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static long tier_pack_bytes(const ob_pack *pack);
+static user_ret_code tier_stage_add(tier_stage *st, long id, ob_adj *bffs);
+static user_ret_code tier_flush(obsess_book_cb *cb, tier_stage *st,
+                                long *cold);
+static user_ret_code tier_promote(obsess_book_cb *cb, long id, ob_adj *bffs);
+static int tier_cmp(const void *a, const void *b);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_tier_open
+ *
+ * Description:   Give a book a cold tier for its BFF lists.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const char *path - file to keep the cold lists in.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - the tier is open.
+ *                              USER_INVALID_PARAMER - bad parameter or the
+ *                                                     book has a tier.
+ *                              USER_NO_MEM - no memory.
+ *                              USER_IO_ERROR - could not make the file.
+ *
+ * Notes:         The file is removed right away, it is only scratch space
+ *                and goes away with the book.  The heat of the users is only
+ *                kept from here on, the first ob_tier_sweep moves every list
+ *                not used since out of memory.
+ *
+ *****************************************************************************/
+user_ret_code ob_tier_open(obsess_book_cb *cb, const char *path)
+{
+   ob_tier *t;
+   user_ret_code rc = -USER_IO_ERROR;
+
+   if(cb == NULL || path == NULL ||
+      __atomic_load_n(&cb->tier,__ATOMIC_ACQUIRE) != NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   t = malloc(sizeof(ob_tier));
+   if(t == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   t->len = 0;
+
+   t->fd = open(path,O_RDWR | O_CREAT | O_TRUNC,0600);
+   if(t->fd < 0)
+   {
+      goto EXIT_tier_open_1;
+   }
+   unlink(path);
+
+   //The whole span is mapped up front so the lists never move, only the
+   //part written to is ever read.
+   t->base = mmap(NULL,TIER_SPAN,PROT_READ,MAP_SHARED | MAP_NORESERVE,t->fd,0);
+   if(t->base == MAP_FAILED)
+   {
+      goto EXIT_tier_open_2;
+   }
+   //Searches hop from list to list, reading ahead is wasted.
+   madvise(t->base,TIER_SPAN,MADV_RANDOM);
+
+   pthread_mutex_lock(&cb->write_lock);
+   if(cb->tier != NULL)
+   {
+      pthread_mutex_unlock(&cb->write_lock);
+      rc = -USER_INVALID_PARAMER;
+      munmap(t->base,TIER_SPAN);
+      goto EXIT_tier_open_2;
+   }
+   __atomic_store_n(&cb->tier,t,__ATOMIC_RELEASE);
+   pthread_mutex_unlock(&cb->write_lock);
+   return USER_SUCCESS;
+
+EXIT_tier_open_2:
+   close(t->fd);
+EXIT_tier_open_1:
+   free(t);
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_tier_sweep
+ *
+ * Description:   Move the BFF lists of cold users to the file and the lists
+ *                of hot users back into memory.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                long *cold - gets the number of lists moved to the file,
+ *                             may be NULL.
+ *                long *hot - gets the number of lists moved back into memory,
+ *                            may be NULL.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - lists moved.
+ *                              USER_INVALID_PARAMER - bad parameter or the
+ *                                                     book has no tier.
+ *                              USER_NO_MEM - no memory or the file is full,
+ *                                            some lists stay where they were.
+ *                              USER_IO_ERROR - could not write the file, some
+ *                                              lists stay in memory.
+ *
+ * Notes:         A user no search or BFF change touched since the last sweep
+ *                is cold, one touched TIER_HOT times is hot.  Writers wait,
+ *                readers keep reading.  The pages of the file mapped in by
+ *                searches are dropped, the next search to need one reads it
+ *                in again, and the heap pages the moved lists leave free go
+ *                back to the system.  The file space of lists that were
+ *                replaced is not used again.  Meant to be called now and then
+ *                by the owner of the book, like ob_compact.
+ *
+ *****************************************************************************/
+user_ret_code ob_tier_sweep(obsess_book_cb *cb, long *cold, long *hot)
+{
+   ob_tier *t;
+   ob_dir_page *page;
+   ob_adj *bffs;
+   tier_stage st;
+   user_ret_code rc = USER_SUCCESS;
+   user_ret_code got;
+   long to_file = 0;
+   long to_memory = 0;
+   long users;
+   long id;
+   int heat;
+   int i;
+
+   if(cb == NULL || (t = __atomic_load_n(&cb->tier,__ATOMIC_ACQUIRE)) == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   memset(&st,0,sizeof(st));
+
+   pthread_mutex_lock(&cb->write_lock);
+   users = ob_user_count(cb);
+   for(id = 0; id < users; id++)
+   {
+      page = cb->user_dir[id >> OB_DIR_SHIFT];
+      if(page == NULL)
+      {
+         id |= OB_DIR_MASK;
+         continue;
+      }
+      i = (int)(id & OB_DIR_MASK);
+      heat = __atomic_load_n(&page->heat[i],__ATOMIC_RELAXED);
+      __atomic_store_n(&page->heat[i],(unsigned char)(heat >> 1),
+                       __ATOMIC_RELAXED);
+      bffs = page->adj[i];
+      if(bffs == NULL)
+      {
+         continue;
+      }
+
+      if(heat == 0 && (bffs->count > bffs->dead ||
+                       (bffs->pack != NULL && !ob_tier_holds(cb,bffs->pack))))
+      {
+         got = tier_stage_add(&st,id,bffs);
+         if(got == USER_SUCCESS && st.len >= TIER_CHUNK)
+         {
+            got = tier_flush(cb,&st,&to_file);
+         }
+      }
+      else if(heat >= TIER_HOT && ob_tier_holds(cb,bffs->pack))
+      {
+         got = tier_promote(cb,id,bffs);
+         to_memory += got == USER_SUCCESS;
+      }
+      else
+      {
+         got = USER_SUCCESS;
+      }
+      if(got != USER_SUCCESS)
+      {
+         rc = got;
+      }
+   }
+   got = tier_flush(cb,&st,&to_file);
+   if(got != USER_SUCCESS)
+   {
+      rc = got;
+   }
+   madvise(t->base,t->len,MADV_DONTNEED);
+   pthread_mutex_unlock(&cb->write_lock);
+
+   //The lists that left memory were small blocks all over the heap, hand the
+   //pages they freed back.
+   malloc_trim(0);
+
+   free(st.buf);
+   free(st.id);
+   free(st.off);
+   if(cold != NULL)
+   {
+      *cold = to_file;
+   }
+   if(hot != NULL)
+   {
+      *hot = to_memory;
+   }
+   return rc;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      ob_tier_holds
+ *
+ * Description:   Check if a packed list is in the file of the cold tier.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                const ob_pack *pack - the packed list, may be NULL.
+ *
+ * Returns:       int - non zero if it is.
+ *
+ * Notes:         A packed list in the file is never freed.
+ *
+ *****************************************************************************/
+int ob_tier_holds(obsess_book_cb *cb, const ob_pack *pack)
+{
+   ob_tier *t = __atomic_load_n(&cb->tier,__ATOMIC_ACQUIRE);
+
+   return t != NULL && pack != NULL && (const char*)pack >= t->base &&
+          (const char*)pack < t->base + TIER_SPAN;
+}
+
+/******************************************************************************
+ * Function:      ob_tier_free
+ *
+ * Description:   Close the cold tier of a book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Called by ob_exit once the BFF lists are freed.
+ *
+ *****************************************************************************/
+void ob_tier_free(obsess_book_cb *cb)
+{
+   ob_tier *t = cb->tier;
+
+   if(t != NULL)
+   {
+      munmap(t->base,TIER_SPAN);
+      close(t->fd);
+      free(t);
+      cb->tier = NULL;
+   }
+}
+
+/******************************************************************************
+ * Function:      tier_pack_bytes
+ *
+ * Description:   Bytes of a packed list.
+ *
+ * Params:        const ob_pack *pack - the packed list.
+ *
+ * Returns:       long - the bytes.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static long tier_pack_bytes(const ob_pack *pack)
+{
+   return sizeof(ob_pack) + sizeof(ob_pack_block) * (long)pack->blocks +
+          pack->size;
+}
+
+/******************************************************************************
+ * Function:      tier_stage_add
+ *
+ * Description:   Pack the BFF list of a cold user for the file.
+ *
+ * Params:        tier_stage *st - lists waiting to be written.
+ *                long id - user_ID of the user.
+ *                ob_adj *bffs - the list, it has live BFFs.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - list packed.
+ *                              USER_NO_MEM - no memory.
+ *
+ * Notes:         Caller holds the write lock.  The BFFs already packed and
+ *                the plain ones go into one packed list.
+ *
+ *****************************************************************************/
+static user_ret_code tier_stage_add(tier_stage *st, long id, ob_adj *bffs)
+{
+   ob_adj_iter it;
+   ob_pack *pack;
+   long bytes;
+   long cap;
+   void *p;
+   int *ids;
+   int n = 0;
+   int w;
+
+   ids = malloc(sizeof(int) * ob_adj_live(bffs));
+   if(ids == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   ob_adj_begin(&it,bffs);
+   while((w = ob_adj_next(&it)) >= 0)
+   {
+      ids[n++] = w;
+   }
+   qsort(ids,n,sizeof(int),tier_cmp);
+   pack = ob_pack_build(ids,n);
+   free(ids);
+   if(pack == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+
+   bytes = (tier_pack_bytes(pack) + TIER_ALIGN - 1) & ~(long)(TIER_ALIGN - 1);
+   if(st->len + bytes > st->cap)
+   {
+      cap = st->cap ? st->cap : TIER_CHUNK;
+      while(cap < st->len + bytes)
+      {
+         cap *= 2;
+      }
+      p = realloc(st->buf,cap);
+      if(p == NULL)
+      {
+         free(pack);
+         return -USER_NO_MEM;
+      }
+      st->buf = p;
+      st->cap = cap;
+   }
+   if(st->n == st->n_cap)
+   {
+      cap = st->n_cap ? st->n_cap * 2 : 1024;
+      p = realloc(st->id,sizeof(int) * cap);
+      if(p == NULL)
+      {
+         free(pack);
+         return -USER_NO_MEM;
+      }
+      st->id = p;
+      p = realloc(st->off,sizeof(long) * cap);
+      if(p == NULL)
+      {
+         free(pack);
+         return -USER_NO_MEM;
+      }
+      st->off = p;
+      st->n_cap = cap;
+   }
+
+   memset(st->buf + st->len,0,bytes);
+   memcpy(st->buf + st->len,pack,tier_pack_bytes(pack));
+   free(pack);
+   st->id[st->n] = (int)id;
+   st->off[st->n] = st->len;
+   st->n++;
+   st->len += bytes;
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      tier_flush
+ *
+ * Description:   Write the packed lists of a sweep to the file and put them
+ *                in place of the lists in memory.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                tier_stage *st - lists waiting to be written, emptied.
+ *                long *cold - number of lists moved, added to.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - lists moved.
+ *                              USER_NO_MEM - no memory or the file is full.
+ *                              USER_IO_ERROR - could not write the file.
+ *
+ * Notes:         Caller holds the write lock.  The lists are written before
+ *                any of them is published, so a reader that finds one in
+ *                the file finds its bytes there.
+ *
+ *****************************************************************************/
+static user_ret_code tier_flush(obsess_book_cb *cb, tier_stage *st,
+                                long *cold)
+{
+   ob_tier *t = cb->tier;
+   user_ret_code rc = USER_SUCCESS;
+   ob_adj **slot;
+   ob_adj *old;
+   ob_adj *bffs;
+   long i;
+
+   if(st->n == 0)
+   {
+      return USER_SUCCESS;
+   }
+   if(t->len + st->len > TIER_SPAN)
+   {
+      rc = -USER_NO_MEM;
+      goto EXIT_tier_flush_0;
+   }
+   if(ob_file_write(t->fd,st->buf,st->len) != 0)
+   {//The file is written at its end, put it back where the lists start.
+      if(ftruncate(t->fd,t->len) != 0 ||
+         lseek(t->fd,t->len,SEEK_SET) != t->len)
+      {
+         t->len = TIER_SPAN;
+      }
+      rc = -USER_IO_ERROR;
+      goto EXIT_tier_flush_0;
+   }
+
+   for(i = 0; i < st->n; i++)
+   {
+      bffs = malloc(sizeof(ob_adj));
+      if(bffs == NULL)
+      {
+         rc = -USER_NO_MEM;
+         continue;
+      }
+      bffs->count = 0;
+      bffs->cap = 0;
+      bffs->dead = 0;
+      bffs->pack = (ob_pack*)(t->base + t->len + st->off[i]);
+
+      ob_snap_touch(cb,st->id[i]);
+      slot = &cb->user_dir[st->id[i] >> OB_DIR_SHIFT]->
+                adj[st->id[i] & OB_DIR_MASK];
+      old = *slot;
+      __atomic_store_n(slot,bffs,__ATOMIC_RELEASE);
+      ob_pack_retire(cb,old->pack);
+      ob_epoch_retire(cb,old);
+      (*cold)++;
+   }
+   t->len += st->len;
+
+EXIT_tier_flush_0:
+   st->len = 0;
+   st->n = 0;
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      tier_promote
+ *
+ * Description:   Bring the packed BFFs of a hot user back into memory.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                long id - user_ID of the user.
+ *                ob_adj *bffs - the list, its packed BFFs are in the file.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - list moved.
+ *                              USER_NO_MEM - no memory.
+ *
+ * Notes:         Caller holds the write lock.  The plain BFFs added since
+ *                the list went cold stay as they are.
+ *
+ *****************************************************************************/
+static user_ret_code tier_promote(obsess_book_cb *cb, long id, ob_adj *bffs)
+{
+   ob_adj *copy;
+   ob_pack *pack;
+
+   pack = malloc(tier_pack_bytes(bffs->pack));
+   copy = malloc(sizeof(ob_adj) + sizeof(int) * bffs->cap);
+   if(pack == NULL || copy == NULL)
+   {
+      free(pack);
+      free(copy);
+      return -USER_NO_MEM;
+   }
+   memcpy(pack,bffs->pack,tier_pack_bytes(bffs->pack));
+   memcpy(copy,bffs,sizeof(ob_adj) + sizeof(int) * bffs->count);
+   copy->pack = pack;
+
+   ob_snap_touch(cb,id);
+   __atomic_store_n(&cb->user_dir[id >> OB_DIR_SHIFT]->adj[id & OB_DIR_MASK],
+                    copy,__ATOMIC_RELEASE);
+   ob_epoch_retire(cb,bffs);
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      tier_cmp
+ *
+ * Description:   qsort compare of two user_IDs.
+ *
+ * Params:        const void *a, const void *b - the user_IDs.
+ *
+ * Returns:       int - <0, 0 or >0.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int tier_cmp(const void *a, const void *b)
+{
+   int x = *(const int*)a;
+   int y = *(const int*)b;
+
+   return x < y ? -1 : (x > y);
+}
@@ -0,0 +1,1059 @@
+/*****************************************************************************
+ *
+ *     ob_traverse.c
+ *
+ *   Description: Breadth first traversals of the BFF graph.  The searches
+ *                between two users grow one BFS from each user and expand
+ *                whichever side has the smaller frontier, so a search to
+ *                depth d only has to go d / 2 deep on each side.  All the
+ *                searches can be bounded by depth, by work and by time.
+ *                A level whose frontier holds a good part of the BFF links
+ *                left is expanded bottom up instead, each user not found yet
+ *                looks for a BFF in a bitmap of the frontier and stops at
+ *                the first, so the BFF lists of the celebrities in the
+ *                frontier are never walked.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Number of edges between looks at the clock.
+#define CLOCK_EDGES 256
+
+//Search result when the users are farther apart than the limit.
+#define SEARCH_BEYOND  -1
+
+//Search result when the budget ran out.
+#define SEARCH_UNKNOWN -2
+
+//Number of users handed to a foreach callback at a time.
+#define FOREACH_BATCH 256
+
+//A level goes bottom up once its frontier has more than 1 / SEARCH_ALPHA of
+//the BFF links not looked at yet.
+#define SEARCH_ALPHA 14
+
+//Back to top down once the frontier has less than 1 / SEARCH_BETA of the
+//users.
+#define SEARCH_BETA 24
+
+//Bits in a word of the frontier bitmap.
+#define FRONT_BITS (8 * (long)sizeof(unsigned long))
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Budget of a running search.
+typedef struct _search_budget
+{
+   long            edges;      //Edges looked at so far.
+   long            max_edges;  //Most edges to look at, 0 for no limit.
+   struct timespec deadline;   //Time to give up.
+   int             timed;      //Non zero if deadline is set.
+   long            next_clock; //Edge count of the next look at the clock.
+}search_budget;
+
+//Direction of one BFS.
+typedef struct _search_mode
+{
+   int             up;         //Non zero while the levels go bottom up.
+   long            seen;       //BFF links of the users expanded top down.
+}search_mode;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static int search_pair(ob_scratch *s, user *x, user *y, int hops,
+                       search_budget *b);
+static int search_spent(search_budget *b);
+static int search_turn(obsess_book_cb *cb, search_mode *m, const int *q,
+                       int step, long start, long end, long users);
+static void search_front(ob_scratch *s, const int *q, int step, long start,
+                         long end);
+static int search_parent(obsess_book_cb *cb, ob_scratch *s, int v,
+                         long *edges);
+static unsigned int scratch_stamp(ob_scratch *s, unsigned int n);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_derpcon_within
+ *
+ * Description:   Find out if the DERPCON between the 2 users is k or less.
+ *
+ * Params:        user *x - ptr to user to whom to evaluate the DERPCON
+ *                user *y - ptr to user to whom to evaluate the DERPCON
+ *                int k - highest DERPCON that counts, 0 to max_derpcon.
+ *
+ * Returns:       1 - DERPCON is k or less.
+ *                0 - DERPCON is more than k.
+ *                -USER_INVALID_PARAMER - bad user or k.
+ *                -USER_NO_MEM - no memory for the search.
+ *
+ * Notes:         The search stops expanding at depth k instead of going all
+ *                the way to max_derpcon.  A user is within any k of itself.
+ *
+ *****************************************************************************/
+int ob_derpcon_within(user *x, user *y, int k)
+{
+   int derpcon;
+   int rc;
+
+   rc = ob_derpcon_bounded(x,y,k,NULL,&derpcon);
+   if(rc < 0)
+   {
+      return rc;
+   }
+   return rc == OB_DERPCON_WITHIN;
+}
+
+/******************************************************************************
+ * Function:      ob_derpcon_bounded
+ *
+ * Description:   Evaluate the DERPCON between the 2 users if it is k or less,
+ *                giving up when the budget runs out.
+ *
+ * Params:        user *x - ptr to user to whom to evaluate the DERPCON
+ *                user *y - ptr to user to whom to evaluate the DERPCON
+ *                int k - highest DERPCON that counts, 0 to max_derpcon.
+ *                const ob_search_budget *budget - most BFF links to look at
+ *                                                 and most microseconds to
+ *                                                 take, 0 for no limit.
+ *                                                 NULL for no budget.
+ *                int *derpcon - gets the DERPCON when it is within k.
+ *
+ * Returns:       OB_DERPCON_WITHIN - DERPCON is k or less, *derpcon is set.
+ *                OB_DERPCON_BEYOND - DERPCON is more than k.
+ *                OB_DERPCON_UNKNOWN - the budget ran out first.
+ *                -USER_INVALID_PARAMER - bad parameter.
+ *                -USER_NO_MEM - no memory for the search.
+ *
+ * Notes:         Meant for callers with a latency budget, the far apart and
+ *                unreachable pairs are the slow ones and they come back as
+ *                unknown instead of taking as long as they take.
+ *
+ *****************************************************************************/
+int ob_derpcon_bounded(user *x, user *y, int k, const ob_search_budget *budget,
+                       int *derpcon)
+{
+   search_budget b;
+   ob_scratch *s;
+   int hops;
+
+   if(x == NULL || y == NULL || x->cb != y->cb || derpcon == NULL ||
+      k < 0 || k > x->cb->max_derpcon)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   //Set up the budget.
+   memset(&b,0,sizeof(b));
+   if(budget != NULL)
+   {
+      b.max_edges = budget->max_edges;
+      if(budget->max_usec > 0)
+      {
+         clock_gettime(CLOCK_MONOTONIC,&b.deadline);
+         b.deadline.tv_sec += budget->max_usec / 1000000L;
+         b.deadline.tv_nsec += (budget->max_usec % 1000000L) * 1000L;
+         if(b.deadline.tv_nsec >= 1000000000L)
+         {
+            b.deadline.tv_sec++;
+            b.deadline.tv_nsec -= 1000000000L;
+         }
+         b.timed = 1;
+      }
+   }
+
+   s = ob_scratch_get(x->cb);
+   if(s == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   //DERPCON k is k + 1 BFF links.
+   ob_tier_touch(x);
+   ob_tier_touch(y);
+   ob_epoch_enter(x->cb);
+   hops = search_pair(s,x,y,k + 1,&b);
+   ob_epoch_exit(x->cb);
+   ob_scratch_put(x->cb,s);
+
+   if(hops == SEARCH_UNKNOWN)
+   {
+      return OB_DERPCON_UNKNOWN;
+   }
+   if(hops == SEARCH_BEYOND)
+   {
+      return OB_DERPCON_BEYOND;
+   }
+   *derpcon = hops > 0 ? hops - 1 : 0;
+   return OB_DERPCON_WITHIN;
+}
+
+/******************************************************************************
+ * Function:      ob_derpcon_path
+ *
+ * Description:   Find the chain of BFFs that links the 2 users.
+ *
+ * Params:        user *x - ptr to the user the chain starts at.
+ *                user *y - ptr to the user the chain ends at.
+ *                user **out_users - gets the users of the chain, x first and
+ *                                   y last.
+ *                int max_len - number of entries in out_users.
+ *
+ * Returns:       int > 0 - number of users in the chain, DERPCON + 2.
+ *                0 - the users are strangers, DERPCON is max_derpcon.
+ *                -USER_INVALID_PARAMER - bad parameter or max_len too small.
+ *                -USER_NO_MEM - no memory for the search.
+ *
+ * Notes:         The chain is a shortest one.  The parent links are recorded
+ *                by the search itself, so walking them back is the only extra
+ *                work.  max_derpcon + 1 entries always fit any chain.
+ *                A chain broken by a user deleted during the search comes
+ *                back as 0.
+ *
+ *****************************************************************************/
+int ob_derpcon_path(user *x, user *y, user **out_users, int max_len)
+{
+   search_budget b;
+   ob_scratch *s;
+   int hops;
+   int len = 0;
+   int half;
+   int v;
+   int i;
+
+   if(x == NULL || y == NULL || x->cb != y->cb || out_users == NULL ||
+      max_len < 1)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   s = ob_scratch_get(x->cb);
+   if(s == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   memset(&b,0,sizeof(b));
+   //DERPCON max_derpcon means no link, so stop one link short of it.
+   ob_tier_touch(x);
+   ob_tier_touch(y);
+   ob_epoch_enter(x->cb);
+   hops = search_pair(s,x,y,x->cb->max_derpcon,&b);
+
+   if(hops >= 0 && hops + 1 > max_len)
+   {
+      len = -USER_INVALID_PARAMER;
+   }
+   else if(hops >= 0)
+   {
+      len = hops + 1;
+
+      //x's half, walked back from the meeting point and filled in backwards.
+      half = 0;
+      for(v = s->meet[0]; v != -1; v = s->parent[v])
+      {
+         half++;
+      }
+      i = half;
+      for(v = s->meet[0]; v != -1; v = s->parent[v])
+      {
+         out_users[--i] = ob_user_at(x->cb,v);
+      }
+
+      //y's half, walked from the meeting point out to y.
+      for(v = s->meet[1]; hops > 0 && v != -1; v = s->parent[v])
+      {
+         out_users[half++] = ob_user_at(x->cb,v);
+      }
+
+      //A user of the chain that was deleted during the search broke it.
+      for(i = 0; i < len; i++)
+      {
+         if(out_users[i] == NULL)
+         {
+            len = 0;
+            break;
+         }
+      }
+   }
+   ob_epoch_exit(x->cb);
+   ob_scratch_put(x->cb,s);
+
+   return len;
+}
+
+/******************************************************************************
+ * Function:      ob_mutual_BFFs
+ *
+ * Description:   Find the users that are BFFs of both users.
+ *
+ * Params:        user *x - ptr to one user.
+ *                user *y - ptr to the other user.
+ *                user **out_users - gets the mutual BFFs, may be NULL.
+ *                int max_len - number of entries in out_users.
+ *
+ * Returns:       int >= 0 - number of mutual BFFs, only the first max_len
+ *                           are put in out_users.
+ *                -USER_INVALID_PARAMER - bad parameter.
+ *                -USER_NO_MEM - no memory for the marks.
+ *
+ * Notes:         The BFFs of x are marked and the BFFs of y are checked
+ *                against the marks, so packed and plain lists mix freely and
+ *                nothing has to be sorted.
+ *
+ *****************************************************************************/
+int ob_mutual_BFFs(user *x, user *y, user **out_users, int max_len)
+{
+   ob_adj_iter it;
+   ob_scratch *s;
+   unsigned int stamp;
+   user *usr;
+   int n = 0;
+   int w;
+
+   if(x == NULL || y == NULL || x->cb != y->cb || max_len < 0 ||
+      (out_users == NULL && max_len > 0))
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   s = ob_scratch_get(x->cb);
+   if(s == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   ob_epoch_enter(x->cb);
+
+   stamp = scratch_stamp(s,1);
+   ob_adj_begin(&it,ob_adj_get(x));
+   while((w = ob_adj_next(&it)) >= 0)
+   {
+      if(w < s->cap)
+      {
+         s->mark[w] = stamp;
+      }
+   }
+   ob_adj_begin(&it,ob_adj_get(y));
+   while((w = ob_adj_next(&it)) >= 0)
+   {
+      if(w < s->cap && s->mark[w] == stamp &&
+         (usr = ob_user_at(x->cb,w)) != NULL)
+      {
+         if(n < max_len)
+         {
+            out_users[n] = usr;
+         }
+         n++;
+      }
+   }
+
+   ob_epoch_exit(x->cb);
+   ob_scratch_put(x->cb,s);
+
+   return n;
+}
+
+/******************************************************************************
+ * Function:      ob_foreach_within
+ *
+ * Description:   Stream every user within DERPCON k of user x to a callback.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                user *x - ptr to the user to start from.
+ *                int k - highest DERPCON to stream, 0 to max_derpcon - 1.
+ *                ob_within_fn fn - callback, gets batches of users and the
+ *                                  DERPCON of each, returns non zero to stop.
+ *                void *ctx - context passed to fn.
+ *
+ * Returns:       long >= 0 - number of users handed to fn.
+ *                -USER_INVALID_PARAMER - bad parameter.
+ *                -USER_NO_MEM - no memory for the search.
+ *
+ * Notes:         Users are streamed level by level as the BFS finds them, so
+ *                all of DERPCON 0 comes before any of DERPCON 1.  x itself is
+ *                not streamed.  Nothing is kept per user streamed, the only
+ *                memory is the pooled scratch and one batch on the stack.
+ *                A level that goes bottom up streams its users in user_ID
+ *                order.
+ *
+ *****************************************************************************/
+long ob_foreach_within(obsess_book_cb *cb, user *x, int k, ob_within_fn fn,
+                       void *ctx)
+{
+   user *batch[FOREACH_BATCH];   //Users waiting to be handed to fn.
+   int level[FOREACH_BATCH];     //DERPCON of each user in the batch.
+   ob_scratch *s;
+   ob_adj_iter it;
+   search_mode mode;
+   unsigned int stamp;
+   long users;
+   long edges = 0;
+   long count = 0;
+   long start = 0;
+   long end = 1;
+   long stop;
+   long j;
+   int n = 0;
+   int stopped = 0;
+   int lvl;
+   int v;
+   int w;
+   user *usr;
+
+   if(cb == NULL || x == NULL || x->cb != cb || fn == NULL ||
+      k < 0 || k >= cb->max_derpcon)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   s = ob_scratch_get(cb);
+   if(s == NULL)
+   {
+      return -USER_NO_MEM;
+   }
+   ob_epoch_enter(cb);
+
+   stamp = scratch_stamp(s,1);
+   s->mark[x->user_ID] = stamp;
+   s->queue[0] = x->user_ID;
+   memset(&mode,0,sizeof(mode));
+   users = ob_user_count(cb) < s->cap ? ob_user_count(cb) : s->cap;
+
+   //Level lvl finds the users of DERPCON lvl.
+   for(lvl = 0; lvl <= k && start < end && !stopped; lvl++)
+   {
+      stop = end;
+      if(search_turn(cb,&mode,s->queue,1,start,stop,users))
+      {//Every user not found yet looks for a BFF in the frontier.
+         search_front(s,s->queue,1,start,stop);
+         for(v = 0; v < users && !stopped; v++)
+         {
+            if(s->mark[v] == stamp || search_parent(cb,s,v,&edges) < 0)
+            {
+               continue;
+            }
+            usr = ob_user_at(cb,v);
+            if(usr == NULL)
+            {
+               continue;
+            }
+            s->mark[v] = stamp;
+            s->queue[end++] = v;
+
+            batch[n] = usr;
+            level[n] = lvl;
+            if(++n == FOREACH_BATCH)
+            {//Batch is full, hand it over.
+               count += n;
+               stopped = fn(ctx,batch,level,n);
+               n = 0;
+            }
+         }
+      }
+      else
+      {
+         for(j = start; j < stop && !stopped; j++)
+         {
+            v = s->queue[j];
+            ob_adj_begin(&it,ob_adj_of(cb,v));
+            while(!stopped && (w = ob_adj_next(&it)) >= 0)
+            {
+               //Users newer than the scratch joined after the search started.
+               if(w >= s->cap || s->mark[w] == stamp)
+               {
+                  continue;
+               }
+               usr = ob_user_at(cb,w);
+               if(usr == NULL)
+               {
+                  continue;
+               }
+               s->mark[w] = stamp;
+               s->queue[end++] = w;
+
+               batch[n] = usr;
+               level[n] = lvl;
+               if(++n == FOREACH_BATCH)
+               {//Batch is full, hand it over.
+                  count += n;
+                  stopped = fn(ctx,batch,level,n);
+                  n = 0;
+               }
+            }
+         }
+      }
+      start = stop;
+   }
+
+   //Hand over what is left.
+   if(n > 0 && !stopped)
+   {
+      count += n;
+      fn(ctx,batch,level,n);
+   }
+   ob_epoch_exit(cb);
+   ob_scratch_put(cb,s);
+
+   return count;
+}
+
+/******************************************************************************
+ * Function:      ob_search_direction
+ *
+ * Description:   Set the direction the searches expand their frontiers in.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_search_dir dir - OB_SEARCH_HYBRID to go bottom up on the
+ *                                    big frontiers, OB_SEARCH_TOP_DOWN to
+ *                                    never do.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - direction set.
+ *                              USER_INVALID_PARAMER - bad parameter.
+ *
+ * Notes:         Searches already running keep the direction they had.
+ *                The answers are the same both ways, only the work changes.
+ *
+ *****************************************************************************/
+user_ret_code ob_search_direction(obsess_book_cb *cb, ob_search_dir dir)
+{
+   if(cb == NULL || (dir != OB_SEARCH_HYBRID && dir != OB_SEARCH_TOP_DOWN))
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   __atomic_store_n(&cb->search_dir,dir,__ATOMIC_RELAXED);
+   return USER_SUCCESS;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      ob_scratch_get
+ *
+ * Description:   Get scratch space for a search.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       ob_scratch* - scratch big enough for every user, or NULL if
+ *                              there is no memory.
+ *
+ * Notes:         Scratch is kept in a pool and reused, so a search does not
+ *                allocate unless the book grew or more threads are searching
+ *                than ever before.
+ *
+ *****************************************************************************/
+ob_scratch *ob_scratch_get(obsess_book_cb *cb)
+{
+   ob_scratch *s;
+   unsigned int *mark;
+   int *queue;
+   int *parent;
+   unsigned long *front;
+   long users;
+   long cap;
+
+   pthread_mutex_lock(&cb->scratch_lock);
+   s = cb->scratch_pool;
+   if(s != NULL)
+   {
+      cb->scratch_pool = s->next;
+   }
+   pthread_mutex_unlock(&cb->scratch_lock);
+
+   if(s == NULL)
+   {
+      s = calloc(1,sizeof(ob_scratch));
+      if(s == NULL)
+      {
+         return NULL;
+      }
+   }
+
+   users = ob_user_count(cb);
+   if(s->cap < users)
+   {//Book grew, grow the scratch to match.
+      cap = users * 2;
+      mark = realloc(s->mark,sizeof(unsigned int) * cap);
+      if(mark != NULL)
+      {
+         memset(mark + s->cap,0,sizeof(unsigned int) * (cap - s->cap));
+         s->mark = mark;
+      }
+      queue = realloc(s->queue,sizeof(int) * cap);
+      if(queue != NULL)
+      {
+         s->queue = queue;
+      }
+      parent = realloc(s->parent,sizeof(int) * cap);
+      if(parent != NULL)
+      {
+         s->parent = parent;
+      }
+      front = realloc(s->front,sizeof(unsigned long) *
+                               ((cap + FRONT_BITS - 1) / FRONT_BITS));
+      if(front != NULL)
+      {
+         s->front = front;
+      }
+      if(mark == NULL || queue == NULL || parent == NULL || front == NULL)
+      {
+         ob_scratch_put(cb,s);
+         return NULL;
+      }
+      s->cap = cap;
+   }
+   return s;
+}
+
+/******************************************************************************
+ * Function:      ob_scratch_put
+ *
+ * Description:   Give scratch space back to the pool.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_scratch *s - the scratch.
+ *
+ * Returns:       None.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+void ob_scratch_put(obsess_book_cb *cb, ob_scratch *s)
+{
+   pthread_mutex_lock(&cb->scratch_lock);
+   s->next = cb->scratch_pool;
+   cb->scratch_pool = s;
+   pthread_mutex_unlock(&cb->scratch_lock);
+}
+
+/******************************************************************************
+ * Function:      ob_scratch_reserve
+ *
+ * Description:   Fill the scratch pool ahead of the searches.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                int n - number of searches to have scratch for.
+ *                long users - number of users each scratch holds.
+ *
+ * Returns:       int 0 - pool filled, non zero if there is no memory.
+ *
+ * Notes:         n searches at a time then start without allocating until
+ *                the book grows past users.  Scratch already allocated is
+ *                kept in the pool on error.
+ *
+ *****************************************************************************/
+int ob_scratch_reserve(obsess_book_cb *cb, int n, long users)
+{
+   ob_scratch *s;
+   int i;
+
+   for(i = 0; i < n; i++)
+   {
+      s = calloc(1,sizeof(ob_scratch));
+      if(s == NULL)
+      {
+         return 1;
+      }
+      s->mark = calloc(users,sizeof(unsigned int));
+      s->queue = malloc(sizeof(int) * users);
+      s->parent = malloc(sizeof(int) * users);
+      s->front = malloc(sizeof(unsigned long) *
+                        ((users + FRONT_BITS - 1) / FRONT_BITS));
+      if(s->mark != NULL && s->queue != NULL && s->parent != NULL &&
+         s->front != NULL)
+      {
+         s->cap = users;
+      }
+      ob_scratch_put(cb,s);
+      if(s->cap == 0)
+      {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      ob_scratch_free
+ *
+ * Description:   Free the scratch pool of the book.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       None.
+ *
+ * Notes:         No search may be running.
+ *
+ *****************************************************************************/
+void ob_scratch_free(obsess_book_cb *cb)
+{
+   ob_scratch *s;
+
+   while((s = cb->scratch_pool) != NULL)
+   {
+      cb->scratch_pool = s->next;
+      free(s->mark);
+      free(s->queue);
+      free(s->parent);
+      free(s->front);
+      free(s);
+   }
+}
+
+/******************************************************************************
+ * Function:      search_pair
+ *
+ * Description:   Bidirectional BFS between two users.
+ *
+ * Params:        ob_scratch *s - scratch for the search.
+ *                user *x - user to start one side from.
+ *                user *y - user to start the other side from.
+ *                int hops - most BFF links to search.
+ *                search_budget *b - budget of the search.
+ *
+ * Returns:       int >= 0 - number of BFF links between x and y.
+ *                SEARCH_BEYOND - more than hops apart.
+ *                SEARCH_UNKNOWN - budget ran out.
+ *
+ * Notes:         Algorithm:
+ *                The x side lives at the front of the queue and the y side at
+ *                the back, a user is only ever found by one side.  Each round
+ *                expands one whole level of the side with the smaller
+ *                frontier.  The first BFF link that reaches a user found by
+ *                the other side joins the two and, as neither side had met
+ *                the other before the round, it is on a shortest path.
+ *                s->meet holds the two users of that link and s->parent the
+ *                user each user was found from, so the path can be walked
+ *                back to both ends.
+ *                Each side turns bottom up on its own, see search_turn.  A
+ *                bottom up round walks the users the side has not found, a
+ *                user with a BFF in the frontier is found from that BFF, or
+ *                joins the two sides if the other side found it.
+ *
+ *****************************************************************************/
+static int search_pair(ob_scratch *s, user *x, user *y, int hops,
+                       search_budget *b)
+{
+   obsess_book_cb *cb = x->cb;
+   unsigned int side[2];      //Stamp of each side.
+   long start[2];             //First entry of the frontier of each side.
+   long end[2];               //One past the last entry of each side.
+   int level[2];              //Levels expanded by each side.
+   int *q[2];                 //Queue of each side, y's runs backwards.
+   int dir_q[2];              //Step to the next entry of each queue.
+   search_mode mode[2];       //Direction of each side.
+   ob_adj_iter it;
+   long users;
+   long j;
+   long stop;
+   int a;
+   int n;
+   int v;
+   int w;
+   int i;
+
+   s->meet[0] = s->meet[1] = -1;
+   side[0] = scratch_stamp(s,2);
+   side[1] = side[0] + 1;
+
+   s->mark[x->user_ID] = side[0];
+   s->parent[x->user_ID] = -1;
+   if(x == y)
+   {
+      s->meet[0] = s->meet[1] = x->user_ID;
+      return 0;
+   }
+   s->mark[y->user_ID] = side[1];
+   s->parent[y->user_ID] = -1;
+
+   q[0] = s->queue;
+   q[1] = s->queue + s->cap - 1;
+   dir_q[0] = 1;
+   dir_q[1] = -1;
+   q[0][0] = x->user_ID;
+   q[1][0] = y->user_ID;
+   for(i = 0; i < 2; i++)
+   {
+      start[i] = 0;
+      end[i] = 1;
+      level[i] = 0;
+   }
+   memset(mode,0,sizeof(mode));
+   users = ob_user_count(cb) < s->cap ? ob_user_count(cb) : s->cap;
+
+   while(level[0] + level[1] < hops)
+   {
+      //Expand the side with the smaller frontier.
+      a = (end[0] - start[0]) <= (end[1] - start[1]) ? 0 : 1;
+      if(start[a] == end[a])
+      {//Nothing left to find on this side.
+         return SEARCH_BEYOND;
+      }
+
+      stop = end[a];
+      if(search_turn(cb,&mode[a],q[a],dir_q[a],start[a],stop,users))
+      {//Every user this side has not found looks for a BFF in the frontier.
+         search_front(s,q[a],dir_q[a],start[a],stop);
+         for(v = 0; v < users; v++)
+         {
+            if(s->mark[v] == side[a])
+            {
+               continue;
+            }
+            w = search_parent(cb,s,v,&b->edges);
+            if(w >= 0 && s->mark[v] == side[a ^ 1])
+            {//Met the other side.
+               s->meet[a] = w;
+               s->meet[a ^ 1] = v;
+               return level[0] + level[1] + 1;
+            }
+            if(w >= 0)
+            {
+               s->mark[v] = side[a];
+               s->parent[v] = w;
+               q[a][end[a] * dir_q[a]] = v;
+               end[a]++;
+            }
+            if(search_spent(b))
+            {
+               return SEARCH_UNKNOWN;
+            }
+         }
+      }
+      else
+      {
+         for(j = start[a]; j < stop; j++)
+         {
+            v = q[a][j * dir_q[a]];
+            ob_adj_begin(&it,ob_adj_of(cb,v));
+            n = 0;
+            while((w = ob_adj_next(&it)) >= 0)
+            {
+               n++;
+               if(w >= s->cap)
+               {//Joined after the search started.
+                  continue;
+               }
+               if(s->mark[w] == side[a ^ 1])
+               {//Met the other side.
+                  s->meet[a] = v;
+                  s->meet[a ^ 1] = w;
+                  return level[0] + level[1] + 1;
+               }
+               if(s->mark[w] != side[a])
+               {
+                  s->mark[w] = side[a];
+                  s->parent[w] = v;
+                  q[a][end[a] * dir_q[a]] = w;
+                  end[a]++;
+               }
+            }
+            b->edges += n;
+            if(search_spent(b))
+            {
+               return SEARCH_UNKNOWN;
+            }
+         }
+      }
+      start[a] = stop;
+      level[a]++;
+   }
+   return SEARCH_BEYOND;
+}
+
+/******************************************************************************
+ * Function:      search_spent
+ *
+ * Description:   Check if a search ran out of budget.
+ *
+ * Params:        search_budget *b - budget of the search.
+ *
+ * Returns:       int - non zero if the budget is spent.
+ *
+ * Notes:         The clock is only read every CLOCK_EDGES edges.
+ *
+ *****************************************************************************/
+static int search_spent(search_budget *b)
+{
+   struct timespec now;
+
+   if(b->max_edges > 0 && b->edges > b->max_edges)
+   {
+      return 1;
+   }
+   if(b->timed && b->edges >= b->next_clock)
+   {
+      b->next_clock = b->edges + CLOCK_EDGES;
+      clock_gettime(CLOCK_MONOTONIC,&now);
+      if(now.tv_sec > b->deadline.tv_sec ||
+         (now.tv_sec == b->deadline.tv_sec && now.tv_nsec >= b->deadline.tv_nsec))
+      {
+         return 1;
+      }
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      search_turn
+ *
+ * Description:   Pick the direction of the next level of a BFS.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                search_mode *m - direction of the BFS.
+ *                const int *q - queue of the BFS.
+ *                int step - step to the next entry of the queue.
+ *                long start - first entry of the frontier.
+ *                long end - one past the last entry of the frontier.
+ *                long users - users the search looks at.
+ *
+ * Returns:       int - non zero to expand the level bottom up.
+ *
+ * Notes:         Algorithm:
+ *                Top down looks at every BFF link of the frontier, bottom up
+ *                at the links of the users not found yet until each finds a
+ *                BFF in the frontier.  Go bottom up once the frontier has
+ *                more than 1 / SEARCH_ALPHA of the links left, and back once
+ *                it has less than 1 / SEARCH_BETA of the users.  The links
+ *                left are the BFF links of the book less the ones of the
+ *                users expanded top down.  Adding up the links of the
+ *                frontier stops at the limit, and the lists it loads are the
+ *                ones a top down level walks next.
+ *
+ *****************************************************************************/
+static int search_turn(obsess_book_cb *cb, search_mode *m, const int *q,
+                       int step, long start, long end, long users)
+{
+   ob_adj *adj;
+   long limit;
+   long links = 0;
+   long j;
+
+   if(__atomic_load_n(&cb->search_dir,__ATOMIC_RELAXED) == OB_SEARCH_TOP_DOWN)
+   {
+      m->up = 0;
+   }
+   else if(m->up)
+   {
+      m->up = end - start >= users / SEARCH_BETA;
+   }
+   else
+   {
+      limit = (2 * __atomic_load_n(&cb->bff_pairs,__ATOMIC_RELAXED) - m->seen) /
+              SEARCH_ALPHA;
+      for(j = start; j < end && links <= limit; j++)
+      {
+         adj = ob_adj_of(cb,q[j * step]);
+         if(adj != NULL)
+         {
+            links += ob_adj_count(adj) + (adj->pack ? adj->pack->count : 0);
+         }
+      }
+      m->seen += links;
+      m->up = links > limit;
+   }
+   return m->up;
+}
+
+/******************************************************************************
+ * Function:      search_front
+ *
+ * Description:   Set the frontier bitmap of a bottom up level.
+ *
+ * Params:        ob_scratch *s - scratch of the search.
+ *                const int *q - queue of the BFS.
+ *                int step - step to the next entry of the queue.
+ *                long start - first entry of the frontier.
+ *                long end - one past the last entry of the frontier.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Only the users of the frontier are set.
+ *
+ *****************************************************************************/
+static void search_front(ob_scratch *s, const int *q, int step, long start,
+                         long end)
+{
+   long j;
+   int v;
+
+   memset(s->front,0,sizeof(unsigned long) *
+                     ((s->cap + FRONT_BITS - 1) / FRONT_BITS));
+   for(j = start; j < end; j++)
+   {
+      v = q[j * step];
+      s->front[v / FRONT_BITS] |= 1UL << (v % FRONT_BITS);
+   }
+}
+
+/******************************************************************************
+ * Function:      search_parent
+ *
+ * Description:   Find a BFF of a user in the frontier of a bottom up level.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_scratch *s - scratch of the search, s->front is set.
+ *                int v - user_ID of the user.
+ *                long *edges - gets the BFF links looked at added.
+ *
+ * Returns:       int >= 0 - user_ID of the first BFF in the frontier.
+ *                -1 - no BFF of the user is in the frontier.
+ *
+ * Notes:         Stops at the first BFF in the frontier, any of them is on a
+ *                shortest path.
+ *
+ *****************************************************************************/
+static int search_parent(obsess_book_cb *cb, ob_scratch *s, int v,
+                         long *edges)
+{
+   ob_adj_iter it;
+   int n = 0;
+   int w;
+
+   ob_adj_begin(&it,ob_adj_of(cb,v));
+   while((w = ob_adj_next(&it)) >= 0)
+   {
+      n++;
+      //Users newer than the scratch joined after the search started.
+      if(w < s->cap && (s->front[w / FRONT_BITS] >> (w % FRONT_BITS) & 1))
+      {
+         break;
+      }
+   }
+   *edges += n;
+   return w;
+}
+
+/******************************************************************************
+ * Function:      scratch_stamp
+ *
+ * Description:   Get fresh stamps to mark users with.
+ *
+ * Params:        ob_scratch *s - the scratch.
+ *                unsigned int n - number of stamps needed.
+ *
+ * Returns:       unsigned int - the first of the n stamps.
+ *
+ * Notes:         Using a new stamp per search saves clearing the marks, they
+ *                are only cleared when the stamps wrap around.
+ *
+ *****************************************************************************/
+static unsigned int scratch_stamp(ob_scratch *s, unsigned int n)
+{
+   if(s->stamp == 0 || s->stamp > UINT_MAX - n)
+   {
+      memset(s->mark,0,sizeof(unsigned int) * s->cap);
+      s->stamp = 1;
+   }
+   s->stamp += n;
+   return s->stamp - n;
+}
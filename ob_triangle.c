@@ -0,0 +1,414 @@
+/*****************************************************************************
+ *
+ *     ob_triangle.c
+ *
+ *   Description: Triangle counting and local clustering.  Every BFF pair is
+ *                pointed from the user with fewer BFFs to the one with more,
+ *                so each triangle is found once, from its least popular
+ *                user, and nobody has more than about sqrt(2 * pairs) BFFs
+ *                pointed away.  The triangles over a pair (v,u) are the
+ *                meeting of the pointed lists of v and u, sorted by user_ID
+ *                and met 4 by 4 with SSE2 compares.  The users are handed
+ *                out to the threads a few at a time, so the ones drawing
+ *                popular users do not hold up the others.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include <stdlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "obsess_book_int.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Users handed to a thread at a time.
+#define TRIANGLE_GRAIN 64
+
+//Users handed to the callback at a time.
+#define TRIANGLE_BATCH 256
+//_____________________________________________________________________________
+//                                                                        Types
+//State shared by the threads counting the triangles.
+typedef struct _triangle_pass
+{
+   ob_csr *g;                 //Copy of the graph.
+   long   *off;               //Pointed BFFs of v are adj[off[v]] and on.
+   int    *adj;
+   long   *tri;               //Triangles each user is in.
+   long    total;             //Triangles in the book.
+}triangle_pass;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static void triangle_degree(void *ctx, long begin, long end);
+static void triangle_point(void *ctx, long begin, long end);
+static void triangle_count(void *ctx, long begin, long end);
+static long triangle_meet(const int *a, long na, const int *b, long nb,
+                          long *tri);
+static int triangle_above(const ob_csr *g, int v, int u);
+static int triangle_id_cmp(const void *a, const void *b);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:      ob_triangles
+ *
+ * Description:   Count the triangles of BFFs of every user.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                ob_triangle_fn fn - callback, gets batches of users with
+ *                                    the triangles each is in and its
+ *                                    clustering coefficient, may be NULL.
+ *                void *ctx - context passed to fn.
+ *
+ * Returns:       long >= 0 - number of triangles in the book.
+ *                -USER_INVALID_PARAMER - bad parameter.
+ *                -USER_NO_MEM - not enough memory.
+ *
+ * Notes:         The clustering coefficient of a user is the share of the
+ *                pairs of the user's BFFs that are BFFs of each other, 0 for
+ *                users with fewer than 2 BFFs.  Every user is handed to fn,
+ *                in user_ID order.  Runs on all the threads and holds the
+ *                write lock until it returns, so fn must not change BFFs.
+ *                Readers keep reading.
+ *
+ *****************************************************************************/
+long ob_triangles(obsess_book_cb *cb, ob_triangle_fn fn, void *ctx)
+{
+   user *batch[TRIANGLE_BATCH];
+   long tri[TRIANGLE_BATCH];
+   double coef[TRIANGLE_BATCH];
+   triangle_pass pass;
+   long total;
+   long deg;
+   long v;
+   int n = 0;
+
+   if(cb == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+
+   pthread_mutex_lock(&cb->write_lock);
+   pass.off = NULL;
+   pass.adj = NULL;
+   pass.tri = NULL;
+   pass.total = 0;
+   pass.g = ob_csr_build(cb);
+   if(pass.g == NULL)
+   {
+      total = -USER_NO_MEM;
+      goto EXIT_triangles_0;
+   }
+   pass.off = malloc(sizeof(long) * (pass.g->users + 1));
+   pass.tri = calloc(pass.g->users + 1,sizeof(long));
+   if(pass.off == NULL || pass.tri == NULL)
+   {
+      total = -USER_NO_MEM;
+      goto EXIT_triangles_1;
+   }
+
+   //Point the pairs, count first, then fill the lists in.
+   pass.off[0] = 0;
+   ob_parallel_for(cb,pass.g->users,4096,triangle_degree,&pass);
+   for(v = 0; v < pass.g->users; v++)
+   {
+      pass.off[v + 1] += pass.off[v];
+   }
+   pass.adj = malloc(sizeof(int) * (pass.off[pass.g->users] + 1));
+   if(pass.adj == NULL)
+   {
+      total = -USER_NO_MEM;
+      goto EXIT_triangles_1;
+   }
+   ob_parallel_for(cb,pass.g->users,1024,triangle_point,&pass);
+   ob_parallel_for(cb,pass.g->users,TRIANGLE_GRAIN,triangle_count,&pass);
+   total = pass.total;
+
+   for(v = 0; fn != NULL && v < pass.g->users; v++)
+   {
+      batch[n] = ob_user_at(cb,v);
+      if(batch[n] == NULL)
+      {
+         continue;
+      }
+      deg = pass.g->off[v + 1] - pass.g->off[v];
+      tri[n] = pass.tri[v];
+      coef[n] = deg < 2 ? 0.0 : 2.0 * pass.tri[v] / ((double)deg * (deg - 1));
+      if(++n == TRIANGLE_BATCH)
+      {
+         if(fn(ctx,batch,tri,coef,n) != 0)
+         {
+            fn = NULL;
+         }
+         n = 0;
+      }
+   }
+   if(fn != NULL && n > 0)
+   {
+      fn(ctx,batch,tri,coef,n);
+   }
+
+EXIT_triangles_1:
+   free(pass.off);
+   free(pass.adj);
+   free(pass.tri);
+   ob_csr_free(pass.g);
+EXIT_triangles_0:
+   pthread_mutex_unlock(&cb->write_lock);
+   return total;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:      triangle_degree
+ *
+ * Description:   Count the BFFs pointed away from a range of users.
+ *
+ * Params:        void *ctx - the triangle_pass.
+ *                long begin, end - range of user_IDs.
+ *
+ * Returns:       None.
+ *
+ * Notes:         The count of v goes in off[v + 1], ready to be summed.
+ *
+ *****************************************************************************/
+static void triangle_degree(void *ctx, long begin, long end)
+{
+   triangle_pass *pass = ctx;
+   const ob_csr *g = pass->g;
+   long out;
+   long e;
+   long v;
+
+   for(v = begin; v < end; v++)
+   {
+      out = 0;
+      for(e = g->off[v]; e < g->off[v + 1]; e++)
+      {
+         out += triangle_above(g,(int)v,g->adj[e]);
+      }
+      pass->off[v + 1] = out;
+   }
+}
+
+/******************************************************************************
+ * Function:      triangle_point
+ *
+ * Description:   Fill in the BFFs pointed away from a range of users.
+ *
+ * Params:        void *ctx - the triangle_pass.
+ *                long begin, end - range of user_IDs.
+ *
+ * Returns:       None.
+ *
+ * Notes:         Each list is sorted by user_ID for triangle_meet.
+ *
+ *****************************************************************************/
+static void triangle_point(void *ctx, long begin, long end)
+{
+   triangle_pass *pass = ctx;
+   const ob_csr *g = pass->g;
+   long n;
+   long e;
+   long v;
+
+   for(v = begin; v < end; v++)
+   {
+      n = pass->off[v];
+      for(e = g->off[v]; e < g->off[v + 1]; e++)
+      {
+         if(triangle_above(g,(int)v,g->adj[e]))
+         {
+            pass->adj[n++] = g->adj[e];
+         }
+      }
+      qsort(pass->adj + pass->off[v],n - pass->off[v],sizeof(int),
+            triangle_id_cmp);
+   }
+}
+
+/******************************************************************************
+ * Function:      triangle_count
+ *
+ * Description:   Count the triangles found from a range of users.
+ *
+ * Params:        void *ctx - the triangle_pass.
+ *                long begin, end - range of user_IDs.
+ *
+ * Returns:       None.
+ *
+ * Notes:         A triangle v, u, w with u and w pointed away from v and w
+ *                pointed away from u is found once, from v.  The counts of
+ *                the other users are added atomically.
+ *
+ *****************************************************************************/
+static void triangle_count(void *ctx, long begin, long end)
+{
+   triangle_pass *pass = ctx;
+   const int *a;
+   long total = 0;
+   long mine;
+   long na;
+   long hits;
+   long e;
+   long v;
+   int u;
+
+   for(v = begin; v < end; v++)
+   {
+      a = pass->adj + pass->off[v];
+      na = pass->off[v + 1] - pass->off[v];
+      mine = 0;
+      for(e = 0; e < na; e++)
+      {
+         u = a[e];
+         hits = triangle_meet(a,na,pass->adj + pass->off[u],
+                              pass->off[u + 1] - pass->off[u],pass->tri);
+         if(hits > 0)
+         {
+            __atomic_fetch_add(&pass->tri[u],hits,__ATOMIC_RELAXED);
+            mine += hits;
+         }
+      }
+      if(mine > 0)
+      {
+         __atomic_fetch_add(&pass->tri[v],mine,__ATOMIC_RELAXED);
+         total += mine;
+      }
+   }
+   __atomic_fetch_add(&pass->total,total,__ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+ * Function:      triangle_meet
+ *
+ * Description:   Count the user_IDs two sorted lists have in common.
+ *
+ * Params:        const int *a, long na - one list.
+ *                const int *b, long nb - the other list.
+ *                long *tri - triangle counts, each user_ID in both lists
+ *                            gets one more.
+ *
+ * Returns:       long - number of user_IDs in both lists.
+ *
+ * Notes:         With SSE2, 4 user_IDs of a are compared with 4 of b and
+ *                their 3 rotations at once, then the block with the smaller
+ *                last user_ID is stepped over, both when they are equal.
+ *                The ends are met one by one.
+ *
+ *****************************************************************************/
+static long triangle_meet(const int *a, long na, const int *b, long nb,
+                          long *tri)
+{
+   long i = 0;
+   long j = 0;
+   long n = 0;
+#ifdef __SSE2__
+   __m128i va;
+   __m128i vb;
+   __m128i eq;
+   int last_a;
+   int last_b;
+   int mask;
+
+   while(i + 4 <= na && j + 4 <= nb)
+   {
+      va = _mm_loadu_si128((const __m128i*)(a + i));
+      vb = _mm_loadu_si128((const __m128i*)(b + j));
+      eq = _mm_cmpeq_epi32(va,vb);
+      vb = _mm_shuffle_epi32(vb,_MM_SHUFFLE(0,3,2,1));
+      eq = _mm_or_si128(eq,_mm_cmpeq_epi32(va,vb));
+      vb = _mm_shuffle_epi32(vb,_MM_SHUFFLE(0,3,2,1));
+      eq = _mm_or_si128(eq,_mm_cmpeq_epi32(va,vb));
+      vb = _mm_shuffle_epi32(vb,_MM_SHUFFLE(0,3,2,1));
+      eq = _mm_or_si128(eq,_mm_cmpeq_epi32(va,vb));
+      mask = _mm_movemask_ps(_mm_castsi128_ps(eq));
+      while(mask != 0)
+      {
+         __atomic_fetch_add(&tri[a[i + __builtin_ctz(mask)]],1,__ATOMIC_RELAXED);
+         mask &= mask - 1;
+         n++;
+      }
+      last_a = a[i + 3];
+      last_b = b[j + 3];
+      if(last_a <= last_b)
+      {
+         i += 4;
+      }
+      if(last_b <= last_a)
+      {
+         j += 4;
+      }
+   }
+#endif
+   while(i < na && j < nb)
+   {
+      if(a[i] < b[j])
+      {
+         i++;
+      }
+      else if(a[i] > b[j])
+      {
+         j++;
+      }
+      else
+      {
+         __atomic_fetch_add(&tri[a[i]],1,__ATOMIC_RELAXED);
+         n++;
+         i++;
+         j++;
+      }
+   }
+   return n;
+}
+
+/******************************************************************************
+ * Function:      triangle_above
+ *
+ * Description:   Check that a BFF pair is pointed from v to u.
+ *
+ * Params:        const ob_csr *g - copy of the graph.
+ *                int v, u - the users.
+ *
+ * Returns:       int - non zero if u has more BFFs than v, or as many and a
+ *                      bigger user_ID.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int triangle_above(const ob_csr *g, int v, int u)
+{
+   long dv = g->off[v + 1] - g->off[v];
+   long du = g->off[u + 1] - g->off[u];
+
+   return du > dv || (du == dv && u > v);
+}
+
+/******************************************************************************
+ * Function:      triangle_id_cmp
+ *
+ * Description:   Order of two user_IDs for qsort.
+ *
+ * Params:        const void *a, const void *b - the user_IDs.
+ *
+ * Returns:       int - <0, 0 or >0.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int triangle_id_cmp(const void *a, const void *b)
+{
+   int x = *(const int*)a;
+   int y = *(const int*)b;
+
+   return (x > y) - (x < y);
+}
@@ -18,72 +18,59 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include "obsess_book.h"
+#include <unistd.h>
+#include "obsess_book_int.h"
 //_____________________________________________________________________________
 //                                                                      Defines
-//Number of buckets to put users into.
-#define BUCKET_LEN 575
-
-//Maximum number of edges that can seperate BFFs until users are considerd strangers.
-#define MAX_DREPCON 5
-
-//A Prime number used to calculate the bucket hash.
-#define HASH_PRIME  13
-
-//Filter number used to calculate the bucket hash.
-#define HASH_FILTER 6
-
 //Check the user X parameter to make sure the User X parameter is valid and it's
 //hash_value is sane.
-#define CHECK_USER_PARAM_X (!(x &&  x->scratch < BUCKET_LEN))
+#define CHECK_USER_PARAM_X (!(x && x->scratch < x->cb->buckets))
 
 //Check the user Y parameter to make sure the User Y parameter is valid and it's
 //hash_value is sane.
-#define CHECK_USER_PARAM_Y ((!y && y->scratch < BUCKET_LEN))
+#define CHECK_USER_PARAM_Y (!(y && y->scratch < y->cb->buckets))
+
+//Number of names ob_find_users hashes at a time.
+#define FIND_CHUNK 64
+
+//Number of bucket walks ob_find_users interleaves.
+#define FIND_INFLIGHT 8
 //_____________________________________________________________________________
 //                                                                        Types
 
-//Structure to define a user. Explicitly part of the contest, i would use a linked
-//list for the BFFs so as to not do so many reallocs.  Probably implement a free list.
-struct user_struct {
-  int user_ID;
-  char * name;
-  char * account_handle;
-  int number_of_BFFs;
-  user **BFF_list;
-  int scratch;
-};
-
-//Structure used to define a user node.
-typedef struct _user_list_node
+//One lookup of ob_find_users.
+typedef struct _find_probe
 {
-   struct _user_list_node *prev;
-   struct _user_list_node *next;
-   user                   *data;
-}user_list_node;
+   user_list_node *ul;        //Next node of the bucket to check.
+   unsigned int    hash;      //Hash of the name.
+   int             len;       //Length of the name.
+   int             bucket;    //Bucket of the name, -1 for a NULL name.
+   int             i;         //Index of the name.
+}find_probe;
 
-//control block structure used to hold all the special data of the obsess book app.
-struct _obsess_book_cb
+//State of an ob_compact pass.
+typedef struct _compact_pass
 {
-   //unique id to give to each user.
-   long static_id;
-   //Array of bucket Lists to put each user into.  The list the user is put into
-   //is determined by a hash function.  
-   user_list_node *user_list[BUCKET_LEN];
-   //Padding to ensure future structure fit in the same memory footprint.
-   long padding[16];
-};
+   obsess_book_cb *cb;
+   int             failed;    //Non zero if a list could not be copied.
+}compact_pass;
 //_____________________________________________________________________________
 //                                                                       Static
 //_____________________________________________________________________________
 //                                                                      Globals 
 //_____________________________________________________________________________
 //                                                            Private Functions
-static int DERPCON_helper(user *x, user *y, int depth);
-static int generate_hash(char *name, int name_size);
+static int generate_hash(obsess_book_cb *cb, unsigned int name_hash);
 static void print_bucket(user_list_node *ul);
 static void delete_user(user *usr);
 static user_ret_code ob_add_BFF_helper(user *who, user *bff);
+static user_ret_code ob_remove_BFF_helper(user *who, user *bff);
+static ob_adj *adj_copy(ob_adj *bffs, int cap);
+static user_ret_code adj_compact(user *usr);
+static user_ret_code adj_repack(user *usr, int id);
+static void adj_compact_range(void *ctx, long begin, long end);
+static int user_id_take(obsess_book_cb *cb);
+static void user_id_free(obsess_book_cb *cb, int id);
 //_____________________________________________________________________________
 //                                                             Public Functions 
 
@@ -96,13 +83,56 @@ static user_ret_code ob_add_BFF_helper(user *who, user *bff);
  *
  * Returns:     obsess_book_cb* - pointer to the Obsess book cb.
  *
- * Notes:       None.
+ * Notes:       Same as ob_init_ex with the defaults.
  *
  *****************************************************************************/
 obsess_book_cb* ob_init(void)
+{
+   return ob_init_ex(NULL);
+}
+
+/******************************************************************************
+ * Function:    ob_init_ex
+ *
+ * Description: initialize the control block sized for the book to come.
+ *
+ * Params:      const ob_init_opts *opts - users and BFF pairs expected, the
+ *                                         DERPCON of strangers, threads and
+ *                                         arena chunk size, NULL or 0 for
+ *                                         the defaults.
+ *
+ * Returns:     obsess_book_cb* - pointer to the Obsess book cb, NULL on a
+ *                                bad option or no memory.
+ *
+ * Notes:       Expected users get a bucket each, their directory pages, a
+ *              name filter that holds them and search scratch for every
+ *              thread, so loading them never grows any of it.  Expected
+ *              BFF pairs set the room of the first BFF list of a user to
+ *              the average BFFs per user.  The book still takes more than
+ *              it was sized for, the bucket count just stays as it is.
+ *
+ *****************************************************************************/
+obsess_book_cb* ob_init_ex(const ob_init_opts *opts)
 {
    obsess_book_cb *cb;
-   int i;
+   ob_init_opts o;
+   long pages;
+   long i;
+
+   if(opts != NULL)
+   {
+      o = *opts;
+   }
+   else
+   {
+      memset(&o,0,sizeof(o));
+   }
+   if(o.users < 0 || o.pairs < 0 || o.threads < 0 || o.arena_chunk < 0 ||
+      o.max_derpcon < 0 || o.max_derpcon > OB_DERPCON_LIMIT)
+   {
+      return NULL;
+   }
+
    //allocate a new cb structure
    cb = (obsess_book_cb*)malloc((int)sizeof(struct _obsess_book_cb) * sizeof(char));
    
@@ -110,11 +140,97 @@ obsess_book_cb* ob_init(void)
    if(cb != NULL)
    {
       cb->static_id = 0L;
-      for(i = 0;i< BUCKET_LEN;i++)
+      cb->buckets = o.users > BUCKET_LEN ? o.users : BUCKET_LEN;
+      if(cb->buckets > OB_BUCKETS_MAX)
+      {
+         cb->buckets = OB_BUCKETS_MAX;
+      }
+      cb->user_list = calloc(cb->buckets,sizeof(user_list_node*));
+      if(cb->user_list == NULL)
       {
-         cb->user_list[i] = NULL;
+         free(cb);
+         return NULL;
+      }
+      cb->max_derpcon = o.max_derpcon > 0 ? o.max_derpcon : MAX_DREPCON;
+      cb->adj_first = OB_ADJ_FIRST;
+      if(o.users > 0 && o.pairs / o.users * 2 > OB_ADJ_FIRST)
+      {//Each pair is in two lists.
+         cb->adj_first = o.pairs / o.users * 2 > OB_ADJ_FIRST_MAX ?
+                         OB_ADJ_FIRST_MAX : (int)(o.pairs / o.users * 2);
+      }
+      cb->arena_chunk = o.arena_chunk > 0 ? (size_t)o.arena_chunk : OB_ARENA_CHUNK;
+      cb->reach = NULL;
+      cb->oracle = NULL;
+      cb->scratch_pool = NULL;
+      cb->bff_pairs = 0;
+      cb->search_dir = OB_SEARCH_HYBRID;
+      cb->journal = NULL;
+      cb->journal_pos = 0;
+      cb->snap = NULL;
+      cb->snap_job = NULL;
+      cb->tier = NULL;
+      cb->prefix = NULL;
+      pthread_mutex_init(&cb->prefix_lock,NULL);
+      pthread_mutex_init(&cb->snap_lock,NULL);
+      pthread_mutex_init(&cb->scratch_lock,NULL);
+      pthread_mutex_init(&cb->write_lock,NULL);
+      for(i = 0; i < OB_BUCKET_LOCKS; i++)
+      {
+         pthread_mutex_init(&cb->bucket_lock[i],NULL);
+      }
+      memset(&cb->free_ids,0,sizeof(cb->free_ids));
+      pthread_mutex_init(&cb->free_ids.lock,NULL);
+
+      //The directory pages are allocated as users are added.
+      cb->user_dir = calloc(OB_DIR_PAGES,sizeof(ob_dir_page*));
+      if(cb->user_dir == NULL || ob_epoch_init(cb) != 0)
+      {
+         free(cb->user_dir);
+         free(cb->user_list);
+         free(cb);
+         return NULL;
+      }
+      if(ob_arena_init(cb) != 0)
+      {
+         ob_epoch_free(cb);
+         free(cb->user_dir);
+         free(cb->user_list);
+         free(cb);
+         return NULL;
+      }
+      if(ob_bloom_init(cb,o.users) != 0)
+      {
+         ob_arena_free(cb);
+         ob_epoch_free(cb);
+         free(cb->user_dir);
+         free(cb->user_list);
+         free(cb);
+         return NULL;
+      }
+
+      //Use every online processor for the parallel kernels.
+      cb->threads = o.threads > 0 ? o.threads : (int)sysconf(_SC_NPROCESSORS_ONLN);
+      if(cb->threads < 1)
+      {
+         cb->threads = 1;
+      }
+
+      //Directory pages and search scratch for the users expected.
+      pages = (o.users + OB_DIR_MASK) >> OB_DIR_SHIFT;
+      for(i = 0; i < pages && i < OB_DIR_PAGES; i++)
+      {
+         cb->user_dir[i] = calloc(1,sizeof(ob_dir_page));
+         if(cb->user_dir[i] == NULL)
+         {
+            ob_exit(cb);
+            return NULL;
+         }
+      }
+      if(o.users > 0 && ob_scratch_reserve(cb,cb->threads,o.users) != 0)
+      {
+         ob_exit(cb);
+         return NULL;
       }
-      memset(cb->padding,0L,sizeof(cb->padding));
    }
    return cb;
 }
@@ -133,31 +249,53 @@ obsess_book_cb* ob_init(void)
 void ob_exit(obsess_book_cb *cb)
 {
    user_list_node *un;
-   user_list_node *un_next;
    int i;
 
+   //A snapshot being written still reads the users.
+   ob_snapshot_wait(cb);
+
    //Look at each bucket and delete the user for each user.
-   for(i = 0;i< BUCKET_LEN;i++)
+   for(i = 0;i< cb->buckets;i++)
    {
       un = cb->user_list[i];
-      //each user in the bucket shall be deleted.
+      //each user in the bucket shall be deleted, the users and the nodes
+      //themselves go with the arenas.
       while(un != NULL)
       {
          if(un->data != NULL)
          {
             delete_user(un->data);
          }
-
-         //save the next pointer.
-         un_next = un->next;
-         //free the node
-         free(un);
-         //go to next.
-         un = un_next;
+         un = un->next;
       }
    }
    if(cb != NULL)
    {
+      ob_journal_close(cb);
+      pthread_mutex_destroy(&cb->snap_lock);
+      ob_reach_free(cb);
+      ob_landmark_free(cb);
+      ob_scratch_free(cb);
+      ob_epoch_free(cb);
+      ob_tier_free(cb);
+      ob_prefix_free(cb);
+      ob_arena_free(cb);
+      ob_bloom_free(cb);
+      pthread_mutex_destroy(&cb->scratch_lock);
+      pthread_mutex_destroy(&cb->write_lock);
+      for(i = 0; i < OB_BUCKET_LOCKS; i++)
+      {
+         pthread_mutex_destroy(&cb->bucket_lock[i]);
+      }
+      pthread_mutex_destroy(&cb->free_ids.lock);
+      free(cb->free_ids.id);
+      free(cb->free_ids.epoch);
+      for(i = 0; i < OB_DIR_PAGES; i++)
+      {
+         free(cb->user_dir[i]);
+      }
+      free(cb->user_dir);
+      free(cb->user_list);
       free(cb);
    }
 }
@@ -179,15 +317,59 @@ void ob_exit(obsess_book_cb *cb)
  *              on error.  This makes the code more readable, less indented, and
  *              more efficient.  Also, it make it more likely that the cleanup will 
  *              happen on error.
+ *              Names and account handles longer than OB_NAME_MAX are refused.
+ *              With a journal that waits, returns once the user is on disk,
+ *              ob_journal_sync tells if it could not be written.
+ *              The name and account handle go into the prefix index, see
+ *              ob_find_prefix.
  *
  *****************************************************************************/
 user* ob_new_user(obsess_book_cb *cb,char *name, char *ah)
+{
+   unsigned long ticket = 0;     //Journal record of the user.
+   user *new_user;
+
+   new_user = ob_user_create(cb,name,ah,&ticket,NULL);
+   if(new_user != NULL)
+   {
+      ob_journal_wait(cb,ticket);
+   }
+   return new_user;
+}
+
+/******************************************************************************
+ * Function:    ob_user_create
+ *
+ * Description: Create a user without waiting for the journal.
+ *
+ * Params:      obsess_book_cb *cb - pointer to the obsess book control block.
+ *              char *name - pointer to the name of the new user.
+ *              char *ah - pointer to the account handle of the new user.
+ *              unsigned long *ticket - set to the journal record of the user.
+ *              user_ret_code *rc - gets USER_SUCCESS, USER_INVALID_PARAMER
+ *                                  for a missing or too long name or
+ *                                  account handle, or USER_NO_MEM.  May be
+ *                                  NULL.
+ *
+ * Returns:     pointer to the newly created user or NULL if there is a problem.
+ *
+ * Notes:       See ob_new_user.  The user is logged as it goes into its
+ *              bucket, under the bucket lock, so a snapshot holding every
+ *              bucket lock sees users and records agree.
+ *
+ *****************************************************************************/
+user* ob_user_create(obsess_book_cb *cb, char *name, char *ah,
+                     unsigned long *ticket, user_ret_code *rc)
 {
    user *new_user = NULL;        //Pointer to the new user.
    user_list_node *user_node = NULL;   //Pointer to the user node.
+   pthread_mutex_t *lock;        //Lock of the bucket the user goes into.
    int   name_size = 0;          //number of characters in the name.
    int   ah_size = 0;            //number of characters in the account handle.
    int   hash_val = 0;           //Value to hash
+   int   grow;                   //Non zero if the name filter is full.
+   char *chars;                  //Characters of the name and account handle.
+   user_ret_code ret = -USER_INVALID_PARAMER;
 
    //Parameter Checking.
    if(name == NULL)
@@ -200,76 +382,111 @@ user* ob_new_user(obsess_book_cb *cb,char *name, char *ah)
       goto EXIT_add_user_0;
    }
    
-   //Allocate a new User structure.
-   new_user = (user*)malloc(sizeof(struct user_struct)*sizeof(char));
+   //Allocate the User structure, its node and its strings in one piece from
+   //the arena of this thread.  An account handle that is the same as the name
+   //shares its characters.
+   name_size = strlen(name);
+   ah_size = strlen(ah);
+   if(name_size > OB_NAME_MAX || ah_size > OB_NAME_MAX)
+   {
+      goto EXIT_add_user_0;
+   }
+   if(ah_size == name_size && memcmp(name,ah,name_size) == 0)
+   {
+      ah_size = -1;
+   }
+   ret = -USER_NO_MEM;
+   new_user = ob_arena_alloc(cb,sizeof(struct user_struct) +
+                                sizeof(user_list_node) + name_size + ah_size + 2);
    if(new_user == NULL)
    {//NO MEM.
       goto EXIT_add_user_0;
    }
+   user_node = (user_list_node*)(new_user + 1);
+   new_user->node = user_node;
 
    //Fill in name
-   name_size = strlen(name);
-   new_user->name = malloc(name_size+1);
-   if(new_user->name == NULL)
-   {//no Mem
-      goto EXIT_add_user_1;
-   }
-   //Safely copy the new user's name into the structure.
-   strncpy(new_user->name,name,name_size);
-   new_user->name[name_size] = '\0';
-   
+   chars = (char*)(user_node + 1);
+   memcpy(chars,name,name_size);
+   chars[name_size] = '\0';
+   new_user->name_len = name_size;
+   user_node->hash = ob_name_hash(name,name_size);
+
    //Fill in Account Handle
-   ah_size = strlen(ah);
-   new_user->account_handle = malloc(ah_size);
-   if(new_user->account_handle == NULL)
+   new_user->handle_off = 0;
+   if(ah_size >= 0)
    {
-      goto EXIT_add_user_2;
+      new_user->handle_off = name_size + 1;
+      memcpy(chars + name_size + 1,ah,ah_size);
+      chars[name_size + 1 + ah_size] = '\0';
    }
-   //Safely copy the new user's account handle into the structure.
-   strncpy(new_user->account_handle,name,ah_size);
-   new_user->name[ah_size] = '\0';
-
-   //Initilaize BFFs
-   new_user->number_of_BFFs = 0;
-   new_user->BFF_list = NULL;
-
-   //Initialize User_ID;
-   new_user->user_ID = cb->static_id++;
 
    //Generate a new hash value and put it in a bucket.
-   hash_val = generate_hash(new_user->name,name_size);
+   hash_val = generate_hash(cb,user_node->hash);
 
    //initialize scratch
    new_user->scratch = hash_val;
    
    //Put it in a bucket and make it unique.
-   user_node = malloc(sizeof(cb->user_list));
    user_node->data = new_user;
 
-   //Just insert at at the head.
-   if(cb->user_list[hash_val] == NULL)
-   {
-      user_node->prev = NULL;
-      user_node->next = NULL;
+   //Initialize User_ID and remember which book the user is in.  Readers walk
+   //the buckets and the directory without a lock, so the user is filled in
+   //before it is published.
+   new_user->cb = cb;
+   new_user->user_ID = user_id_take(cb);
+   new_user->orig_ID = new_user->user_ID;
+
+   //Just insert at at the head.  Only the stripe of the bucket is locked, so
+   //users going into other buckets are added at the same time.  The user goes
+   //into the directory under the lock too, a snapshot holding every bucket
+   //lock sees the same users in both, and a reused user_ID is saved for it
+   //first.  The name goes into the name filter first.
+   lock = &cb->bucket_lock[hash_val % OB_BUCKET_LOCKS];
+   pthread_mutex_lock(lock);
+   ob_snap_touch(cb,new_user->user_ID);
+   if(ob_user_dir_add(cb,new_user) != USER_SUCCESS)
+   {//no Mem, the memory stays in the arena.
+      pthread_mutex_unlock(lock);
+      goto EXIT_add_user_1;
    }
-   else
+   grow = ob_bloom_add(cb,user_node->hash);
+   *ticket = ob_journal_log(cb,OB_JOURNAL_USER,chars,name_size,
+                            ah_size >= 0 ? chars + name_size + 1 : NULL,ah_size);
+   user_node->prev = NULL;
+   user_node->next = cb->user_list[hash_val];
+   if(user_node->next != NULL)
    {
-      cb->user_list[hash_val]->prev = user_node;
-      user_node->next = cb->user_list[hash_val];
+      user_node->next->prev = user_node;
    }
    //Set the user data in the node.
-   cb->user_list[hash_val] = user_node;
+   __atomic_store_n(&cb->user_list[hash_val],user_node,__ATOMIC_RELEASE);
+   pthread_mutex_unlock(lock);
+   if(grow)
+   {
+      ob_bloom_grow(cb);
+   }
+
+   //The user is in the book, put the name and account handle in the prefix
+   //index.  Without the memory for it the user is taken out again.
+   if(ob_prefix_add(cb,new_user) != USER_SUCCESS)
+   {
+      ob_delete_user(new_user);
+      goto EXIT_add_user_1;
+   }
 
    //jump over the error processing code and 
    //return a pointer to the new user.
+   ret = USER_SUCCESS;
    goto EXIT_add_user_0;
 
-EXIT_add_user_2:
-   free(new_user->name);
 EXIT_add_user_1:
-   free(new_user);
    new_user = NULL;
 EXIT_add_user_0:
+   if(rc != NULL)
+   {
+      *rc = ret;
+   }
    return new_user;
 }
 
@@ -283,26 +500,270 @@ EXIT_add_user_0:
  *
  * Returns:       user_ret_code USER_SUCCESS - bff added
  *                              USER_ALREADY_BFF - bff already a bff.
+ *                              USER_IO_ERROR - bff added, but the journal
+ *                                              could not write it.
  *
- * Notes:         Just call the helper function to create Bffs.
+ * Notes:         Just call the helper function to create Bffs.  Writers take
+ *                the write lock, readers see the new BFF once it is published.
  *
  *****************************************************************************/
 user_ret_code ob_add_BFF(user *who, user *bff)
 {
    user_ret_code rc;
+   unsigned long ticket = 0;
+
+   pthread_mutex_lock(&who->cb->write_lock);
 
    //Pair bffs as the request came from outside the obsess book system.
-   rc = ob_add_BFF_helper(who, bff);
+   if(!ob_user_live(who) || !ob_user_live(bff))
+   {//Deleted users get no BFFs.
+      rc = -USER_INVALID_PARAMER;
+   }
+   else
+   {
+      rc = ob_add_BFF_helper(who, bff);
+   }
    if(rc == USER_SUCCESS)
    {
       //Add me as my BFF's BFF
       ob_add_BFF_helper(bff, who);
+      ob_tier_touch(who);
+      ob_tier_touch(bff);
+      __atomic_store_n(&who->cb->bff_pairs,who->cb->bff_pairs + 1,__ATOMIC_RELAXED);
+
+      //Let the reach sketches know about the new pair.
+      if(who->cb->reach != NULL)
+      {
+         ob_reach_add_BFF(who->cb, who, bff);
+      }
+
+      //Count the churn of the landmark tables.
+      if(who->cb->oracle != NULL)
+      {
+         ob_landmark_add_BFF(who->cb,1,0);
+      }
+      ticket = ob_journal_log(who->cb,OB_JOURNAL_ADD,ob_user_name(who),
+                              who->name_len,ob_user_name(bff),bff->name_len);
    }
+   pthread_mutex_unlock(&who->cb->write_lock);
 
+   if(rc == USER_SUCCESS)
+   {
+      rc = ob_journal_wait(who->cb,ticket);
+   }
    return rc;
 }
 
 
+/******************************************************************************
+ * Function:      ob_remove_BFF
+ *
+ * Description:   Remove a BFF from the user's list of BFFs.
+ *
+ * Params:        user *who - pointer to the user to whom the BFF is to be removed.
+ *                user *bff - pointer to the user who is no longer a BFF.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - bff removed
+ *                              USER_NOT_BFF - bff was not a bff.
+ *                              USER_INVALID_PARAMER - bad or deleted user.
+ *                              USER_IO_ERROR - bff removed, but the journal
+ *                                              could not write it.
+ *
+ * Notes:         Both sides of the pair are removed, like ob_add_BFF adds
+ *                both.  The entries are marked dead where they are so readers
+ *                walking the lists are not disturbed, it costs the same scan
+ *                an add does.  Reach sketches only ever grow, so they are
+ *                rebuilt on the next read.
+ *
+ *****************************************************************************/
+user_ret_code ob_remove_BFF(user *who, user *bff)
+{
+   obsess_book_cb *cb;
+   user_ret_code rc;
+   unsigned long ticket = 0;
+
+   if(who == NULL || bff == NULL || who->cb != bff->cb)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   cb = who->cb;
+
+   pthread_mutex_lock(&cb->write_lock);
+   if(!ob_user_live(who) || !ob_user_live(bff))
+   {
+      rc = -USER_INVALID_PARAMER;
+   }
+   else
+   {
+      rc = ob_remove_BFF_helper(who, bff);
+   }
+   if(rc == USER_SUCCESS)
+   {
+      ob_remove_BFF_helper(bff, who);
+      ob_tier_touch(who);
+      ob_tier_touch(bff);
+      __atomic_store_n(&cb->bff_pairs,cb->bff_pairs - 1,__ATOMIC_RELAXED);
+      if(cb->reach != NULL)
+      {
+         ob_reach_invalidate(cb,1);
+      }
+      if(cb->oracle != NULL)
+      {
+         ob_landmark_add_BFF(cb,1,1);
+      }
+      ticket = ob_journal_log(cb,OB_JOURNAL_REMOVE,ob_user_name(who),
+                              who->name_len,ob_user_name(bff),bff->name_len);
+   }
+   pthread_mutex_unlock(&cb->write_lock);
+
+   if(rc == USER_SUCCESS)
+   {
+      rc = ob_journal_wait(cb,ticket);
+   }
+   return rc;
+}
+
+/******************************************************************************
+ * Function:      ob_delete_user
+ *
+ * Description:   Delete a user and all of the user's BFF pairs.
+ *
+ * Params:        user *usr - pointer to the user to delete.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - user deleted
+ *                              USER_INVALID_PARAMER - bad or deleted user.
+ *                              USER_IO_ERROR - user deleted, but the journal
+ *                                              could not write it.
+ *
+ * Notes:         Costs one ob_remove_BFF per BFF.  The user leaves the
+ *                directory and its bucket at once, the user_ID is handed out
+ *                again once no reader can still be looking at it.  The user
+ *                structure lives on in the arena so readers that are running
+ *                stay safe, but usr must not be passed to the API again.
+ *
+ *****************************************************************************/
+user_ret_code ob_delete_user(user *usr)
+{
+   obsess_book_cb *cb;
+   pthread_mutex_t *lock;
+   user_list_node *node;
+   ob_adj *bffs;
+   ob_adj_iter it;
+   ob_dir_page *page;
+   unsigned long ticket;
+   long pairs = 0;
+   int id;
+
+   if(usr == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   cb = usr->cb;
+
+   pthread_mutex_lock(&cb->write_lock);
+   if(!ob_user_live(usr))
+   {
+      pthread_mutex_unlock(&cb->write_lock);
+      return -USER_INVALID_PARAMER;
+   }
+
+   //Take the user out of the BFF lists of the user's BFFs.
+   ob_snap_touch(cb,usr->user_ID);
+   bffs = *ob_adj_slot(usr);
+   ob_adj_begin(&it,bffs);
+   while((id = ob_adj_next(&it)) >= 0)
+   {
+      if(ob_remove_BFF_helper(ob_user_at(cb,id),usr) == USER_SUCCESS)
+      {
+         pairs++;
+      }
+   }
+   __atomic_store_n(ob_adj_slot(usr),NULL,__ATOMIC_RELEASE);
+   if(bffs != NULL)
+   {
+      ob_pack_retire(cb,bffs->pack);
+   }
+   ob_epoch_retire(cb,bffs);
+
+   //Take the user out of the directory and its bucket.  Readers already on
+   //the node keep walking from its next pointer.
+   page = cb->user_dir[usr->user_ID >> OB_DIR_SHIFT];
+   __atomic_store_n(&page->user[usr->user_ID & OB_DIR_MASK],NULL,__ATOMIC_RELEASE);
+   page->heat[usr->user_ID & OB_DIR_MASK] = 0;
+   node = usr->node;
+   lock = &cb->bucket_lock[usr->scratch % OB_BUCKET_LOCKS];
+   pthread_mutex_lock(lock);
+   if(node->prev != NULL)
+   {
+      __atomic_store_n(&node->prev->next,node->next,__ATOMIC_RELEASE);
+   }
+   else
+   {
+      __atomic_store_n(&cb->user_list[usr->scratch],node->next,__ATOMIC_RELEASE);
+   }
+   if(node->next != NULL)
+   {
+      node->next->prev = node->prev;
+   }
+   pthread_mutex_unlock(lock);
+
+   if(pairs > 0)
+   {
+      __atomic_store_n(&cb->bff_pairs,cb->bff_pairs - pairs,__ATOMIC_RELAXED);
+      if(cb->reach != NULL)
+      {
+         ob_reach_invalidate(cb,pairs);
+      }
+      if(cb->oracle != NULL)
+      {
+         ob_landmark_add_BFF(cb,pairs,1);
+      }
+   }
+   ticket = ob_journal_log(cb,OB_JOURNAL_DELETE,ob_user_name(usr),
+                           usr->name_len,NULL,0);
+   user_id_free(cb,usr->user_ID);
+   pthread_mutex_unlock(&cb->write_lock);
+
+   return ob_journal_wait(cb,ticket);
+}
+
+/******************************************************************************
+ * Function:      ob_compact
+ *
+ * Description:   Squeeze the removed BFFs out of every BFF list, and the
+ *                deleted users out of the prefix index.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - lists compacted
+ *                              USER_NO_MEM - some lists could not be copied.
+ *
+ * Notes:         Lists compact themselves once half of them is dead, this
+ *                gets rid of the rest, for example before a traversal heavy
+ *                stretch.  Runs on all the threads, readers keep reading.
+ *
+ *****************************************************************************/
+user_ret_code ob_compact(obsess_book_cb *cb)
+{
+   compact_pass pass;
+
+   if(cb == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   pass.cb = cb;
+   pass.failed = 0;
+   pthread_mutex_lock(&cb->write_lock);
+   ob_parallel_for(cb,ob_user_count(cb),1024,adj_compact_range,&pass);
+   if(ob_prefix_compact(cb) != USER_SUCCESS)
+   {
+      pass.failed = 1;
+   }
+   pthread_mutex_unlock(&cb->write_lock);
+
+   return pass.failed ? -USER_NO_MEM : USER_SUCCESS;
+}
+
 /******************************************************************************
  * Function:      ob_find_user
  *
@@ -313,23 +774,34 @@ user_ret_code ob_add_BFF(user *who, user *bff)
  *
  * Returns:       user* - pointer to the user structure.
  *
- * Notes:         None.
+ * Notes:         Never takes a lock, nodes are published after they are
+ *                filled in.  Names the name filter turns away are not looked
+ *                for and not reported, see ob_name_filter.
  *
  *****************************************************************************/
 user* ob_find_user(obsess_book_cb *cb,char *name)
 {
-   int hashVal = generate_hash(name,strlen(name));
+   int name_size = strlen(name);
+   unsigned int name_hash = ob_name_hash(name,name_size);
+   int hashVal = generate_hash(cb,name_hash);
    user_list_node *ul;
+   user *usr;
 
-   ul = cb->user_list[hashVal];
+   if(!ob_bloom_maybe(cb,name_hash))
+   {//Surely not in the book.
+      return NULL;
+   }
+   ul = __atomic_load_n(&cb->user_list[hashVal],__ATOMIC_ACQUIRE);
 
    while(ul != NULL)
    {
-      if(strcmp(name,ul->data->name) == 0)
+      usr = ul->data;
+      if(ul->hash == name_hash && usr->name_len == name_size &&
+         memcmp(name,ob_user_name(usr),name_size) == 0)
       {//found it, return
-         return ul->data;
+         return usr;
       }
-      ul = ul->next;
+      ul = __atomic_load_n(&ul->next,__ATOMIC_ACQUIRE);
    }
    printf("could not find user\n");
 
@@ -337,6 +809,122 @@ user* ob_find_user(obsess_book_cb *cb,char *name)
    return NULL;
 }
 
+/******************************************************************************
+ * Function:      ob_find_users
+ *
+ * Description:   Find a batch of users by name.
+ *
+ * Params:        obsess_book_cb* - pointer to the obsess_book control block.
+ *                char **names - the names to look for, NULL entries are
+ *                               skipped.
+ *                int n - number of names.
+ *                user **out - gets the user of each name, NULL if there is
+ *                             none.
+ *
+ * Returns:       int - number of names found.
+ *
+ * Notes:         Same answers as calling ob_find_user for every name, without
+ *                the message for the names that are not found.  The names
+ *                are hashed and checked against the name filter FIND_CHUNK
+ *                at a time, and FIND_INFLIGHT bucket walks are interleaved,
+ *                every walk prefetches its next node and moves aside for the
+ *                others while the node comes in.
+ *
+ *****************************************************************************/
+int ob_find_users(obsess_book_cb *cb, char **names, int n, user **out)
+{
+   find_probe chunk[FIND_CHUNK];    //Lookups of the chunk of names.
+   find_probe *ring[FIND_INFLIGHT]; //Lookups being walked.
+   find_probe *p;
+   user_list_node *ul;
+   user *usr;
+   int found = 0;
+   int base;
+   int active;
+   int next;
+   int m;
+   int j;
+
+   for(base = 0; base < n; base += FIND_CHUNK)
+   {
+      m = n - base < FIND_CHUNK ? n - base : FIND_CHUNK;
+
+      //Hash every name of the chunk and prefetch its bucket.
+      for(j = 0; j < m; j++)
+      {
+         p = &chunk[j];
+         p->i = base + j;
+         p->ul = NULL;
+         p->bucket = -1;
+         out[p->i] = NULL;
+         if(names[p->i] == NULL)
+         {
+            continue;
+         }
+         p->len = strlen(names[p->i]);
+         p->hash = ob_name_hash(names[p->i],p->len);
+         if(!ob_bloom_maybe(cb,p->hash))
+         {//Surely not in the book.
+            continue;
+         }
+         p->bucket = generate_hash(cb,p->hash);
+         __builtin_prefetch(&cb->user_list[p->bucket]);
+      }
+
+      //Load the head of every bucket and prefetch it.
+      for(j = 0; j < m; j++)
+      {
+         p = &chunk[j];
+         if(p->bucket >= 0)
+         {
+            p->ul = __atomic_load_n(&cb->user_list[p->bucket],__ATOMIC_ACQUIRE);
+            __builtin_prefetch(p->ul);
+         }
+      }
+
+      //Walk the buckets a node at a time, round robin.  A finished walk hands
+      //its place to the next name of the chunk.
+      active = 0;
+      for(next = 0; next < m && active < FIND_INFLIGHT; next++)
+      {
+         ring[active++] = &chunk[next];
+      }
+      j = 0;
+      while(active > 0)
+      {
+         p = ring[j];
+         ul = p->ul;
+         if(ul != NULL)
+         {
+            usr = ul->data;
+            if(ul->hash != p->hash || usr->name_len != p->len ||
+               memcmp(names[p->i],ob_user_name(usr),p->len) != 0)
+            {//Not this one, move to the next node while the others walk.
+               p->ul = __atomic_load_n(&ul->next,__ATOMIC_ACQUIRE);
+               __builtin_prefetch(p->ul);
+               j = j + 1 < active ? j + 1 : 0;
+               continue;
+            }
+            out[p->i] = usr;
+            found++;
+         }
+
+         //The walk is done.
+         if(next < m)
+         {
+            ring[j] = &chunk[next++];
+         }
+         else
+         {
+            ring[j] = ring[--active];
+         }
+         j = j + 1 < active ? j + 1 : 0;
+      }
+   }
+
+   return found;
+}
+
 
 /******************************************************************************
  * Function:      DERPCON
@@ -346,17 +934,21 @@ user* ob_find_user(obsess_book_cb *cb,char *name)
  * Params:        user *x - ptr to user to whom to evaluate the DERPCON
  *                user *y - ptr to user to whom to evaluate the DERPCON
  *
- * Returns:       0-6 the DERPCON value of the BFFs or
- *                >0  Error.
+ * Returns:       0 - max_derpcon the DERPCON value of the BFFs or
+ *                <0  Error.
  *
  * Notes:         Small change to contest rules, i defined this with pointers to
  *                the structures instead of passing the structures though the stack.
- *                Also, i made the DERPCON 0 based so 0 means BFF, 6 means no link.
+ *                Also, i made the DERPCON 0 based so 0 means BFF, max_derpcon
+ *                means no link.  Runs the bounded search, see
+ *                ob_derpcon_bounded.  A user is 0 from itself, like
+ *                OB_QUERY_DERPCON and ob_shard_derpcon.
  *
  *****************************************************************************/
 int DERPCON(user *x, user *y)
 {
    int derpcon_ret;
+   int rc;
 
    //check the parameters.
    if (CHECK_USER_PARAM_X)
@@ -369,9 +961,16 @@ int DERPCON(user *x, user *y)
       return -USER_INVALID_Y;
    }
 
-   // call the recursive helper function.
-   derpcon_ret = DERPCON_helper(x,y, 0);
-   printf("%s -> %s derpcon = %d\n",x->name,y->name,derpcon_ret);
+   //Users farther apart than max_derpcon - 1 have no link.
+   rc = ob_derpcon_bounded(x,y,x->cb->max_derpcon - 1,NULL,&derpcon_ret);
+   if(rc == OB_DERPCON_BEYOND)
+   {
+      derpcon_ret = x->cb->max_derpcon;
+   }
+   else if(rc != OB_DERPCON_WITHIN)
+   {
+      derpcon_ret = rc;
+   }
    return derpcon_ret;
 }
 
@@ -392,9 +991,10 @@ void ob_dump_data(obsess_book_cb *cb)
    int i;
 
    printf("-- Dumping Data --\n");
-   for(i = 0; i < BUCKET_LEN;i++)
+   ob_epoch_enter(cb);
+   for(i = 0; i < cb->buckets;i++)
    {
-      user_list_node *ul = cb->user_list[i];
+      user_list_node *ul = __atomic_load_n(&cb->user_list[i],__ATOMIC_ACQUIRE);
       printf("\n***********************************\n");
       printf("***********************************\n");
       printf("printing bucket %d\n",i);
@@ -403,145 +1003,477 @@ void ob_dump_data(obsess_book_cb *cb)
       printf("***********************************\n");
       printf("***********************************\n");
    }
+   ob_epoch_exit(cb);
 }
 
 //_____________________________________________________________________________
 //                                                            Private Functions
 
 /******************************************************************************
- * Function:      DERPCON_helper
+ * Function:      ob_add_BFF_helper
  *
- * Description:   Recursive helper function used to calculate the DERPCON of the
- *                two BFFs.
+ * Description:   function to do the work of creating BFFs.
  *
- * Params:        user *x - pointer to the user to calculate the DERPCON.
- *                user *y - pointer to the user to calculate the DERPCON.
- *                int depth - Current depth of the recursive dive.
+ * Params:        user *who - pointer to the user to whom the BFF is to be added.
+ *                user *bff - pointer to the user who is to be the BFF.
  *
- * Returns:       int 0 - 6 the DERPCON level between the BFFs.
+ * Returns:       user_ret_code USER_SUCCESS - bff added
+ *                              USER_ALREADY_BFF - bff already a bff.
  *
- * Notes:         Algorithm:
- *                Want to return the lowest possible DERPCON.  Use recursion to 
- *                Search the friends of x or reuturn the max depth if not found
- *                or return the current depth if the user is in the BFF list.
+ * Notes:         The BFF list was specificed by the Contest as an array, it
+ *                grows by doubling.  Readers may be walking the list, so the
+ *                BFF is written past the count before the count is bumped,
+ *                and a full list is copied to a bigger one that replaces it
+ *                while the old one is retired.  The copy leaves the dead
+ *                entries behind and keeps the packed BFFs.  Caller holds the
+ *                write lock.
  *
  *****************************************************************************/
-static int DERPCON_helper(user *x, user *y, int depth)
+static user_ret_code ob_add_BFF_helper(user *who, user *bff)
 {
-   int derpcon = MAX_DREPCON;       //Return derpcon of the friend.
-   int derpcon_ret = MAX_DREPCON;   //The lowest derpcon returned by the friend.   
+   ob_adj *bffs = *ob_adj_slot(who);     //Only writers change it and we hold the lock.
+   ob_adj *grown;
+   int number_of_BFFs = ob_adj_count(bffs);
+   int live;
    int i;
+   
+   //Look for duplicate
+   for(i =0;i<number_of_BFFs;i++)
+   {
+      if(bffs->bff[i] == bff->user_ID)
+      {//oops already a user
+         printf("ERROR - Already a BFF.\n");
+         return -USER_ALREADY_BFF;
+      }
+   }
+   if(bffs != NULL && ob_pack_find(bffs->pack,bff->user_ID))
+   {//Already a packed BFF.
+      printf("ERROR - Already a BFF.\n");
+      return -USER_ALREADY_BFF;
+   }
+   ob_snap_touch(who->cb,who->user_ID);
+   
+   //Add the BFF to the list of the user's bffs.
+   if(bffs == NULL || number_of_BFFs == bffs->cap)
+   {//Full, move to a list twice the size.
+      live = bffs ? number_of_BFFs - bffs->dead : 0;
+      grown = adj_copy(bffs,live ? live * 2 : who->cb->adj_first);
+      if(grown == NULL)
+      {
+         return -USER_NO_MEM;
+      }
+      __atomic_store_n(ob_adj_slot(who),grown,__ATOMIC_RELEASE);
+      ob_epoch_retire(who->cb,bffs);
+      bffs = grown;
+      number_of_BFFs = grown->count;
+   }
+
+   //Inser the BFF at the end of the array.
+   bffs->bff[number_of_BFFs] = bff->user_ID; 
+   __atomic_store_n(&bffs->count,number_of_BFFs + 1,__ATOMIC_RELEASE);
 
-   //More than 6 edges seperates, return a 6.
-   if(depth == MAX_DREPCON)
-   {//Maximum depth reached, return the MAX.
-      derpcon_ret = depth;
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      ob_remove_BFF_helper
+ *
+ * Description:   function to do the work of removing BFFs.
+ *
+ * Params:        user *who - pointer to the user to whom the BFF is to be removed.
+ *                user *bff - pointer to the user who is no longer a BFF.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - bff removed
+ *                              USER_NOT_BFF - bff was not a bff.
+ *
+ * Notes:         The entry is marked dead where it is, entries never move
+ *                under a reader.  Once half the list is dead it is copied
+ *                without the dead entries.  A packed BFF is removed by
+ *                packing the list again without it.  Caller holds the write
+ *                lock.
+ *
+ *****************************************************************************/
+static user_ret_code ob_remove_BFF_helper(user *who, user *bff)
+{
+   ob_adj *bffs = *ob_adj_slot(who);     //Only writers change it and we hold the lock.
+   int number_of_BFFs = ob_adj_count(bffs);
+   int i;
+
+   //Look for the BFF.
+   for(i = 0; i < number_of_BFFs; i++)
+   {
+      if(bffs->bff[i] == bff->user_ID)
+      {
+         break;
+      }
    }
-   else
+   if(i == number_of_BFFs &&
+      (bffs == NULL || !ob_pack_find(bffs->pack,bff->user_ID)))
+   {
+      return -USER_NOT_BFF;
+   }
+   ob_snap_touch(who->cb,who->user_ID);
+   if(i == number_of_BFFs)
+   {
+      return adj_repack(who,bff->user_ID);
+   }
+
+   __atomic_store_n(&bffs->bff[i],OB_ADJ_DEAD,__ATOMIC_RELAXED);
+   bffs->dead++;
+   if(bffs->dead * 2 >= number_of_BFFs)
+   {//Half dead, a failed copy only means the list stays as it is.
+      adj_compact(who);
+   }
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      adj_copy
+ *
+ * Description:   Copy the BFFs of a list that are not dead into a new list.
+ *
+ * Params:        ob_adj *bffs - the list, may be NULL.
+ *                int cap - number of BFFs the new list has room for, at
+ *                          least the number that are not dead.
+ *
+ * Returns:       ob_adj* - the new list or NULL if there is no memory.
+ *
+ * Notes:         The new list shares the packed BFFs of the old one.
+ *
+ *****************************************************************************/
+static ob_adj *adj_copy(ob_adj *bffs, int cap)
+{
+   ob_adj *copy;
+   int number_of_BFFs = ob_adj_count(bffs);
+   int i;
+
+   copy = malloc(sizeof(ob_adj) + sizeof(int) * cap);
+   if(copy == NULL)
    {
-      //For each friend, x and y are either friends and the current depth is returned
-      //if the current friend is not a bff, search the friends list of BFFS.
-      for(i = 0; i < x->number_of_BFFs;i++)
+      return NULL;
+   }
+   copy->cap = cap;
+   copy->count = 0;
+   copy->dead = 0;
+   copy->pack = bffs != NULL ? bffs->pack : NULL;
+   for(i = 0; i < number_of_BFFs; i++)
+   {
+      if(bffs->bff[i] != OB_ADJ_DEAD)
       {
-         if(x->BFF_list[i]->user_ID == y->user_ID)
-         {//found BFF return depth i.e. DREPCON.
-            derpcon_ret = depth;
-            break; 
-         }
-         else
-         {//not a BFF, check friend's friends.
-            derpcon = DERPCON_helper(x->BFF_list[i],y,depth+1);
+         copy->bff[copy->count++] = bffs->bff[i];
+      }
+   }
+   return copy;
+}
 
-            //Check the returned derpcon to see if it is a new low.
-            if(derpcon < derpcon_ret)
-            {//derpcon is less than the lowest derpcon, so it is the new derpcon.
-               derpcon_ret = derpcon;
-            }
-         }
+/******************************************************************************
+ * Function:      adj_compact
+ *
+ * Description:   Replace the BFF list of a user with one without dead entries.
+ *
+ * Params:        user *usr - pointer to the user.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - list compacted
+ *                              USER_NO_MEM - not enough memory.
+ *
+ * Notes:         A list with nothing left in it is dropped.  Caller holds
+ *                the write lock.
+ *
+ *****************************************************************************/
+static user_ret_code adj_compact(user *usr)
+{
+   ob_adj *bffs = *ob_adj_slot(usr);
+   ob_adj *copy = NULL;
+   int live;
+
+   if(bffs == NULL || bffs->dead == 0)
+   {
+      return USER_SUCCESS;
+   }
+   live = bffs->count - bffs->dead;
+   if(live > 0 || bffs->pack != NULL)
+   {
+      copy = adj_copy(bffs,live + live / 2 + 1);
+      if(copy == NULL)
+      {
+         return -USER_NO_MEM;
       }
    }
-   //Return the found derpcon.
-   return derpcon_ret;
+   __atomic_store_n(ob_adj_slot(usr),copy,__ATOMIC_RELEASE);
+   ob_epoch_retire(usr->cb,bffs);
+
+   return USER_SUCCESS;
 }
 
 /******************************************************************************
- * Function:      ob_add_BFF_helper
+ * Function:      adj_repack
  *
- * Description:   function to do the work of creating BFFs.
+ * Description:   Replace the BFF list of a user with one whose packed BFFs
+ *                leave one out.
  *
- * Params:        user *who - pointer to the user to whom the BFF is to be added.
- *                user *bff - pointer to the user who is to be the BFF.
+ * Params:        user *usr - pointer to the user.
+ *                int id - user_ID of the packed BFF to leave out.
  *
- * Returns:       user_ret_code USER_SUCCESS - bff added
- *                              USER_ALREADY_BFF - bff already a bff.
+ * Returns:       user_ret_code USER_SUCCESS - BFF removed
+ *                              USER_NO_MEM - not enough memory.
  *
- * Notes:         Uses realloc as the BFF list was specificed by the Contest,
- *                I would use a linked list with a free list.
+ * Notes:         Packed lists never change, so the list and its packed BFFs
+ *                are copied and the old ones retired.  Caller holds the
+ *                write lock.
  *
  *****************************************************************************/
-static user_ret_code ob_add_BFF_helper(user *who, user *bff)
+static user_ret_code adj_repack(user *usr, int id)
 {
+   ob_adj *bffs = *ob_adj_slot(usr);
+   ob_pack *old = bffs->pack;
+   ob_pack *pack = NULL;
+   ob_adj *copy = NULL;
+   int buf[OB_PACK_BLOCK];
+   int *ids;
+   int n = 0;
+   int got;
+   int b;
    int i;
-   
-   //Look for duplicate
-   for(i =0;i<who->number_of_BFFs;i++)
+
+   ids = malloc(sizeof(int) * old->count);
+   if(ids == NULL)
    {
-      if(who->BFF_list[i]->user_ID == bff->user_ID)
-      {//oops already a user
-         printf("ERROR - Already a BFF.\n");
-         return -USER_ALREADY_BFF;
+      return -USER_NO_MEM;
+   }
+   for(b = 0; b < old->blocks; b++)
+   {
+      got = ob_pack_unpack(old,b,buf);
+      for(i = 0; i < got; i++)
+      {
+         if(buf[i] != id)
+         {
+            ids[n++] = buf[i];
+         }
       }
    }
-   
-   //Add the BFF to the list of the user's bffs.
-   who->number_of_BFFs++;
-   who->BFF_list = realloc(who->BFF_list,sizeof(user*) * who->number_of_BFFs);
+   if(n > 0)
+   {
+      pack = ob_pack_build(ids,n);
+   }
+   free(ids);
+   if(n > 0 && pack == NULL)
+   {
+      return -USER_NO_MEM;
+   }
 
-   //Inser the BFF at the end of the array.
-   who->BFF_list[who->number_of_BFFs-1] = bff; 
+   if(pack != NULL || bffs->count - bffs->dead > 0)
+   {
+      copy = adj_copy(bffs,bffs->count - bffs->dead);
+      if(copy == NULL)
+      {
+         free(pack);
+         return -USER_NO_MEM;
+      }
+      copy->pack = pack;
+   }
+   __atomic_store_n(ob_adj_slot(usr),copy,__ATOMIC_RELEASE);
+   ob_pack_retire(usr->cb,old);
+   ob_epoch_retire(usr->cb,bffs);
 
    return USER_SUCCESS;
 }
 
 /******************************************************************************
- * Function:      generate_hash.
+ * Function:      adj_compact_range
  *
- * Description:   Generate the hash value to put each user into the correct list
- *                of users.
+ * Description:   Compact the BFF lists of a range of user_IDs.
  *
- * Params:        char *name - the name of the user.
- *                int   name_size - number of characters in the user's name.
+ * Params:        void *ctx - the compact_pass.
+ *                long begin - first user_ID.
+ *                long end - one past the last user_ID.
  *
- * Returns:       int - the hash value generated.
+ * Returns:       None.
  *
- * Notes:         Hash values are not unique per user.
+ * Notes:         Body of the ob_compact loop.
  *
  *****************************************************************************/
-static int generate_hash(char *name, int name_size)
+static void adj_compact_range(void *ctx, long begin, long end)
 {
-   int hash_val;
-   int i;
-   int id=0;
+   compact_pass *pass = ctx;
+   user *usr;
+   long id;
 
-   //add up all the characters int the user's name to seed the hash.
-   for(i = 0; i < name_size;i++)
+   for(id = begin; id < end; id++)
    {
-      id += name[i];
+      usr = ob_user_at(pass->cb,id);
+      if(usr != NULL && adj_compact(usr) != USER_SUCCESS)
+      {
+         __atomic_store_n(&pass->failed,1,__ATOMIC_RELAXED);
+      }
    }
+}
 
-   //Hash function will put each name into a bucket for easy searching.
-   //Each bucket will be a list of users.  Hash function designed to give a 
-   //large distrabution of hash values.
-   hash_val = ((id * HASH_FILTER % BUCKET_LEN) * HASH_PRIME) / HASH_FILTER;
-   
-   //incase any are out of bounds (should never happen)
-   if(hash_val > BUCKET_LEN + 1)
+/******************************************************************************
+ * Function:      ob_user_dir_add
+ *
+ * Description:   Put a user into the user directory at the slot of its user_ID.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                user *usr - pointer to the user to add.
+ *
+ * Returns:       user_ret_code USER_SUCCESS - user added
+ *                              USER_NO_MEM - no memory to grow.
+ *
+ * Notes:         Pages of the directory never move, a new page is published
+ *                once it is zeroed.  Every user_ID has its own slot, so
+ *                threads adding users need no lock.
+ *
+ *****************************************************************************/
+user_ret_code ob_user_dir_add(obsess_book_cb *cb, user *usr)
+{
+   ob_dir_page *page;
+   ob_dir_page *fresh;
+   long p = (long)usr->user_ID >> OB_DIR_SHIFT;
+
+   if(p >= OB_DIR_PAGES)
+   {//Directory is full.
+      return -USER_NO_MEM;
+   }
+   page = __atomic_load_n(&cb->user_dir[p],__ATOMIC_ACQUIRE);
+   if(page == NULL)
+   {//First user of the page, threads race to put it in.
+      fresh = calloc(1,sizeof(ob_dir_page));
+      if(fresh == NULL)
+      {
+         return -USER_NO_MEM;
+      }
+      if(__sync_bool_compare_and_swap(&cb->user_dir[p],NULL,fresh))
+      {
+         page = fresh;
+      }
+      else
+      {//Lost the race, use the winner's page.
+         free(fresh);
+         page = __atomic_load_n(&cb->user_dir[p],__ATOMIC_ACQUIRE);
+      }
+   }
+   __atomic_store_n(&page->user[usr->user_ID & OB_DIR_MASK],usr,__ATOMIC_RELEASE);
+
+   return USER_SUCCESS;
+}
+
+/******************************************************************************
+ * Function:      user_id_take
+ *
+ * Description:   Get a user_ID for a new user.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *
+ * Returns:       int - the user_ID.
+ *
+ * Notes:         The oldest user_ID of a deleted user is reused once no reader
+ *                can still be looking at the deleted user, so the directory
+ *                and everything indexed by user_ID stays dense.  Otherwise a
+ *                new user_ID is handed out.  The landmark tables still hold
+ *                the distances of the deleted user, the user_ID is marked so
+ *                they are not used for the new one.
+ *
+ *****************************************************************************/
+static int user_id_take(obsess_book_cb *cb)
+{
+   ob_id_queue *q = &cb->free_ids;
+   int id = -1;
+
+   if(__atomic_load_n(&q->head,__ATOMIC_ACQUIRE) !=
+      __atomic_load_n(&q->tail,__ATOMIC_ACQUIRE))
    {
-      hash_val %= BUCKET_LEN;
+      pthread_mutex_lock(&q->lock);
+      if(q->head < q->tail && ob_epoch_passed(cb,q->epoch[q->head]))
+      {
+         id = q->id[q->head];
+         __atomic_store_n(&q->head,q->head + 1,__ATOMIC_RELEASE);
+      }
+      pthread_mutex_unlock(&q->lock);
+   }
+   if(id < 0)
+   {
+      id = (int)__atomic_fetch_add(&cb->static_id,1,__ATOMIC_ACQ_REL);
+   }
+   else if(__atomic_load_n(&cb->oracle,__ATOMIC_ACQUIRE) != NULL)
+   {
+      ob_landmark_touch(cb,id);
+   }
+   return id;
+}
+
+/******************************************************************************
+ * Function:      user_id_free
+ *
+ * Description:   Put the user_ID of a deleted user up for reuse.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the obsess book control block.
+ *                int id - the user_ID.
+ *
+ * Returns:       None.
+ *
+ * Notes:         If there is no memory to remember it the user_ID is simply
+ *                never reused.
+ *
+ *****************************************************************************/
+static void user_id_free(obsess_book_cb *cb, int id)
+{
+   ob_id_queue *q = &cb->free_ids;
+   unsigned long *epoch;
+   int *ids;
+   long cap;
+
+   pthread_mutex_lock(&q->lock);
+   if(q->tail == q->cap && q->head > 0)
+   {//Slide the waiting user_IDs down to the front.
+      memmove(q->id,q->id + q->head,sizeof(int) * (q->tail - q->head));
+      memmove(q->epoch,q->epoch + q->head,sizeof(unsigned long) * (q->tail - q->head));
+      __atomic_store_n(&q->tail,q->tail - q->head,__ATOMIC_RELEASE);
+      __atomic_store_n(&q->head,0,__ATOMIC_RELEASE);
+   }
+   if(q->tail == q->cap)
+   {//Full, grow.
+      cap = q->cap ? q->cap * 2 : 64;
+      ids = realloc(q->id,sizeof(int) * cap);
+      if(ids != NULL)
+      {
+         q->id = ids;
+      }
+      epoch = realloc(q->epoch,sizeof(unsigned long) * cap);
+      if(epoch != NULL)
+      {
+         q->epoch = epoch;
+      }
+      if(ids == NULL || epoch == NULL)
+      {
+         pthread_mutex_unlock(&q->lock);
+         return;
+      }
+      q->cap = cap;
    }
+   q->id[q->tail] = id;
+   q->epoch[q->tail] = ob_epoch_now(cb);
+   __atomic_store_n(&q->tail,q->tail + 1,__ATOMIC_RELEASE);
+   pthread_mutex_unlock(&q->lock);
+}
 
-   // Return the hash value generated.
-   return hash_val;
+/******************************************************************************
+ * Function:      generate_hash.
+ *
+ * Description:   Generate the hash value to put each user into the correct list
+ *                of users.
+ *
+ * Params:        obsess_book_cb *cb - pointer to the Obsess book cb.
+ *                unsigned int name_hash - ob_name_hash of the user's name.
+ *
+ * Returns:       int - the bucket of the name.
+ *
+ * Notes:         Hash values are not unique per user.  The bucket count is
+ *                set by ob_init_ex and never changes.
+ *
+ *****************************************************************************/
+static int generate_hash(obsess_book_cb *cb, unsigned int name_hash)
+{
+   return (int)(name_hash % (unsigned long)cb->buckets);
 }
 
 /******************************************************************************
@@ -554,26 +1486,26 @@ static int generate_hash(char *name, int name_size)
  *
  * Returns:       None.
  *
- * Notes:         When the function returns, usr is no longer valid.
+ * Notes:         The user and its strings live in an arena and go with it,
+ *                only the BFF list is freed here.
  *
  *****************************************************************************/
 static void delete_user(user *usr)
 {
+   ob_adj **bffs;
+
    if(usr != NULL)
    {//Delete user
-      if(usr->name != NULL)
-      {//Delete Name
-         free(usr->name);
-      }
-      if(usr->account_handle != NULL)
-      {//Delete account Handle
-         free(usr->account_handle);
-      }
-      if(usr->BFF_list != NULL)
-      {//Delete BFF list
-         free(usr->BFF_list);
+      bffs = ob_adj_slot(usr);
+      if(*bffs != NULL)
+      {//Delete BFF list, packed BFFs in the cold tier stay in its file.
+         if(!ob_tier_holds(usr->cb,(*bffs)->pack))
+         {
+            free((*bffs)->pack);
+         }
+         free(*bffs);
+         *bffs = NULL;
       }
-      free(usr);
    }
 }
 /******************************************************************************
@@ -590,7 +1522,11 @@ static void delete_user(user *usr)
  *****************************************************************************/
 static void print_bucket(user_list_node *ul)
 {
-   int i;
+   ob_adj *bffs;
+   ob_adj_iter it;
+   user *bff;
+   int number_of_BFFs;
+   int id;
 
    while(ul != NULL)
    {
@@ -600,16 +1536,27 @@ static void print_bucket(user_list_node *ul)
       printf("next = %p\n",ul->next);
       printf("node = %p\n",ul->data);
       printf("node->id = %d\n",ul->data->user_ID); 
-      printf("node->name = %s\n",ul->data->name);
-      printf("node->account_handle = %s\n",ul->data->account_handle);
-      printf("note->number_of_BFFs = %d\n",ul->data->number_of_BFFs);
-      printf("node->BFF_list = %p\n",ul->data->BFF_list);
-      for(i = 0; i < ul->data->number_of_BFFs;i++)
+      printf("node->name = %s\n",ob_user_name(ul->data));
+      printf("node->account_handle = %s\n",ob_user_handle(ul->data));
+      bffs = ob_adj_get(ul->data);
+      number_of_BFFs = ob_adj_count(bffs);
+      if(bffs != NULL && bffs->pack != NULL)
       {
-         printf("bff %p name = %s\n",ul->data->BFF_list[i],ul->data->BFF_list[i]->name);
+         number_of_BFFs += bffs->pack->count;
+      }
+      printf("note->number_of_BFFs = %d\n",number_of_BFFs);
+      printf("node->BFFs = %p\n",bffs);
+      ob_adj_begin(&it,bffs);
+      while((id = ob_adj_next(&it)) >= 0)
+      {
+         bff = ob_user_at(ul->data->cb,id);
+         if(bff != NULL)
+         {
+            printf("bff %d name = %s\n",id,ob_user_name(bff));
+         }
       }
       printf("node->scratch = %d\n",ul->data->scratch);
-      ul = ul->next;
+      ul = __atomic_load_n(&ul->next,__ATOMIC_ACQUIRE);
    }
 }
 
@@ -15,6 +15,8 @@
 //                                                                     Includes
 //_____________________________________________________________________________
 //                                                                      Defines
+//Highest DERPCON of strangers ob_init_ex takes.
+#define OB_DERPCON_LIMIT 64
 //_____________________________________________________________________________
 //                                                                        Types
 //Forward declaration of obsess_book_cb;
@@ -32,7 +34,103 @@ typedef enum _user_ret_code
    USER_INVALID_PARAMER,
    USER_ALREADY_BFF,
    USER_SUCCESS,
+   USER_NO_MEM,
+   USER_NOT_READY,
+   USER_NOT_BFF,
+   USER_IO_ERROR,
 }user_ret_code;
+
+//How the landmarks of the DERPCON estimate are picked.
+typedef enum _ob_landmark_pick
+{
+   OB_LANDMARK_DEGREE,
+   OB_LANDMARK_RANDOM,
+}ob_landmark_pick;
+
+//Outcome of a bounded DERPCON search.
+typedef enum _ob_derpcon_status
+{
+   OB_DERPCON_WITHIN,
+   OB_DERPCON_BEYOND,
+   OB_DERPCON_UNKNOWN,
+}ob_derpcon_status;
+
+//Budget of a bounded DERPCON search, 0 means no limit.
+typedef struct _ob_search_budget
+{
+   long max_edges;            //Most BFF links to look at.
+   long max_usec;             //Most microseconds to take.
+}ob_search_budget;
+
+//Direction the BFS searches expand their frontiers in.
+typedef enum _ob_search_dir
+{
+   OB_SEARCH_HYBRID,          //Bottom up while the frontier is big.
+   OB_SEARCH_TOP_DOWN,        //Always from the frontier out.
+}ob_search_dir;
+
+//Callback of ob_foreach_within, gets n users and the DERPCON of each.
+//Return non zero to stop.
+typedef int (*ob_within_fn)(void *ctx, user **users, int *levels, int n);
+
+//Callback of ob_triangles, gets n users, the triangles each is in and the
+//clustering coefficient of each.  Return non zero to stop.
+typedef int (*ob_triangle_fn)(void *ctx, user **users, long *triangles,
+                              double *coef, int n);
+
+//User of a bulk load.
+typedef struct _ob_bulk_user
+{
+   char *name;
+   char *account_handle;
+}ob_bulk_user;
+
+//BFF pair of a bulk load, the users are given by name.
+typedef struct _ob_bulk_edge
+{
+   char *who;
+   char *bff;
+}ob_bulk_edge;
+
+//Kinds of read only requests of ob_query_batch.
+typedef enum _ob_query_op
+{
+   OB_QUERY_FIND,             //Account handle of x.
+   OB_QUERY_DERPCON,          //DERPCON between x and y.
+   OB_QUERY_MUTUAL,           //Mutual BFFs of x and y.
+}ob_query_op;
+
+//Read only request of a batch, see ob_query_batch.
+typedef struct _ob_query
+{
+   ob_query_op  op;
+   char        *x;            //Names of the users.
+   char        *y;
+   const char **out;          //Gets the names the request returns.
+   int          max_len;      //Number of entries in out.
+   int          result;       //Set by ob_query_batch.
+}ob_query;
+
+//How ob_reorder hands out user_IDs.
+typedef enum _ob_order
+{
+   OB_ORDER_RCM,              //Reverse Cuthill-McKee, BFS order reversed.
+   OB_ORDER_DEGREE,           //Most BFFs first.
+   OB_ORDER_COMMUNITY,        //Groups of users that are BFFs of each other.
+}ob_order;
+
+//What a new book is sized for, see ob_init_ex.  0 for the defaults.
+typedef struct _ob_init_opts
+{
+   long users;                //Users expected.
+   long pairs;                //BFF pairs expected.
+   int  max_derpcon;          //DERPCON of strangers, 1 to OB_DERPCON_LIMIT.
+   int  threads;              //Threads of the parallel kernels.
+   long arena_chunk;          //Bytes the user arenas take from malloc at a time.
+}ob_init_opts;
+
+//Worker processes a book is split over, see ob_shard_start.
+typedef struct _ob_shards ob_shards;
 //_____________________________________________________________________________
 //                                                                       Static
 //_____________________________________________________________________________
@@ -43,8 +141,60 @@ typedef enum _user_ret_code
 //                                                             Public Functions 
 user*             ob_new_user(obsess_book_cb *cb,char *name, char *ah);
 user*             ob_find_user(obsess_book_cb *cb,char *name);
+int               ob_find_users(obsess_book_cb *cb, char **names, int n,
+                                user **out);
+int               ob_find_prefix(obsess_book_cb *cb, const char *prefix,
+                                 user **out, int max);
+user_ret_code     ob_name_filter(obsess_book_cb *cb, double rate);
+double            ob_name_filter_rate(obsess_book_cb *cb);
 user_ret_code     ob_add_BFF(user *who, user *bff);
+user_ret_code     ob_remove_BFF(user *who, user *bff);
+user_ret_code     ob_delete_user(user *usr);
+user_ret_code     ob_compact(obsess_book_cb *cb);
+user_ret_code     ob_pack_BFFs(obsess_book_cb *cb, long *before, long *after);
 int               DERPCON(user *x, user *y);
 void              ob_dump_data(obsess_book_cb *cb);
+user_ret_code     ob_reach_build(obsess_book_cb *cb);
+long              ob_reach_estimate(user *x, int k);
+double            ob_reach_error(void);
+user_ret_code     ob_landmark_build(obsess_book_cb *cb, int count,
+                                    ob_landmark_pick pick, long churn);
+int               ob_derpcon_estimate(user *x, user *y, int *lower, int *upper);
+int               ob_derpcon_within(user *x, user *y, int k);
+int               ob_derpcon_bounded(user *x, user *y, int k,
+                                     const ob_search_budget *budget,
+                                     int *derpcon);
+int               ob_derpcon_path(user *x, user *y, user **out_users,
+                                  int max_len);
+int               ob_mutual_BFFs(user *x, user *y, user **out_users,
+                                 int max_len);
+user_ret_code     ob_query_batch(obsess_book_cb *cb, ob_query *q, int n);
+long              ob_foreach_within(obsess_book_cb *cb, user *x, int k,
+                                    ob_within_fn fn, void *ctx);
+user_ret_code     ob_search_direction(obsess_book_cb *cb, ob_search_dir dir);
+long              ob_triangles(obsess_book_cb *cb, ob_triangle_fn fn,
+                               void *ctx);
+long              ob_bulk_load(obsess_book_cb *cb, const ob_bulk_user *users,
+                               long n_users, const ob_bulk_edge *edges,
+                               long n_edges);
+user_ret_code     ob_reorder(obsess_book_cb *cb, ob_order order);
+user_ret_code     ob_journal_open(obsess_book_cb *cb, const char *path,
+                                  long delay_usec, int wait);
+user_ret_code     ob_journal_sync(obsess_book_cb *cb);
+user_ret_code     ob_journal_close(obsess_book_cb *cb);
+user_ret_code     ob_snapshot(obsess_book_cb *cb, const char *path);
+user_ret_code     ob_snapshot_start(obsess_book_cb *cb, const char *path);
+user_ret_code     ob_snapshot_wait(obsess_book_cb *cb);
+long              ob_recover(obsess_book_cb *cb, const char *snapshot,
+                             const char *journal);
+user_ret_code     ob_tier_open(obsess_book_cb *cb, const char *path);
+user_ret_code     ob_tier_sweep(obsess_book_cb *cb, long *cold, long *hot);
+ob_shards*        ob_shard_start(obsess_book_cb *cb, int n);
+int               ob_shard_derpcon(ob_shards *sh, user *x, user *y);
+void              ob_shard_traffic(ob_shards *sh, long *sent, long *kept,
+                                   long *bytes);
+void              ob_shard_stop(ob_shards *sh);
+int               ob_original_ID(user *usr);
 obsess_book_cb*   ob_init(void);
+obsess_book_cb*   ob_init_ex(const ob_init_opts *opts);
 void              ob_exit(obsess_book_cb *cb);
@@ -0,0 +1,548 @@
+/*****************************************************************************
+ *
+ *       obsess_book_bench.c
+ *
+ *   Description: Benchmarks for the obsess book.  Builds a book of users in
+ *                communities, signed up in random order, and times DERPCON
+ *                searches and the users visited per second streaming
+ *                neighborhoods, before and after each ob_reorder and after
+ *                the BFF lists are packed.  Times name lookups one at a time
+ *                and batched.
+ *                Times DERPCON split over 1 to BENCH_SHARDS worker processes.
+ *                Times triangle counting against mutual BFFs of every BFF.
+ *                Builds a second book where a few celebrities have most of
+ *                the BFFs and times the searches bottom up and top down.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:  4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "obsess_book.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Number of users in the book.
+#define BENCH_USERS 200000
+
+//Number of users in a community.
+#define BENCH_COMMUNITY 500
+
+//BFF pairs each user starts.
+#define BENCH_BFFS 5
+
+//Percent of the BFF pairs inside the community.
+#define BENCH_LOCAL 80
+
+//Number of DERPCON searches per run.
+#define BENCH_PAIRS 20000
+
+//Number of users to stream the neighborhood of per run.
+#define BENCH_WITHIN 2000
+
+//Number of names looked up one at a time.
+#define BENCH_LOOKUPS 2000
+
+//Number of DERPCON searches per run over the workers.
+#define BENCH_SHARD_PAIRS 2000
+
+//Most worker processes to split the book over.
+#define BENCH_SHARDS 8
+
+//Name buffer size.
+#define BENCH_NAME 16
+
+//Power of the uniform draw that picks the users of a celebrity BFF pair, the
+//higher the more of the pairs go to the first users.
+#define BENCH_SKEW 4
+
+//Number of users to stream the neighborhood of per run on the celebrity book.
+#define BENCH_POWER_WITHIN 200
+
+//Highest DERPCON streamed on the celebrity book.
+#define BENCH_POWER_K 3
+//_____________________________________________________________________________
+//                                                                       Static
+static ob_bulk_user bench_users[BENCH_USERS];
+static ob_bulk_edge bench_edges[BENCH_USERS * BENCH_BFFS];
+static char bench_names[BENCH_USERS][BENCH_NAME];
+static char *bench_name_at[BENCH_USERS];
+static user *bench_by_name[BENCH_USERS];
+static int bench_order[BENCH_USERS];
+//_____________________________________________________________________________
+//                                                            Private Functions
+static double bench_now(void);
+static void bench_run(const char *label);
+static void bench_shards(void);
+static void bench_triangles(void);
+static void bench_power(void);
+static long bench_skewed(unsigned int *seed);
+static int bench_count(void *ctx, user **users, int *levels, int n);
+static int bench_coef(void *ctx, user **users, long *triangles, double *coef,
+                      int n);
+//_____________________________________________________________________________
+//                                                                      Globals
+static obsess_book_cb *cb;
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:     main
+ *
+ * Description:  entry point of the benchmark.
+ *
+ * Params:       argv, argc - not used.
+ *
+ * Returns:      0 on success, 1 on error.
+ *
+ * Notes:        User i is in community i / BENCH_COMMUNITY, the users are
+ *               signed up in a shuffled order so their user_IDs say nothing
+ *               about who their BFFs are.
+ *
+ *****************************************************************************/
+int main(int argc, char *argv[])
+{
+   unsigned int seed = 4102013;
+   ob_init_opts opts;
+   long community;
+   long i;
+   long j;
+   long t;
+   long before;
+   long after;
+   double start;
+   double one;
+   double batched;
+   int tmp;
+
+   memset(&opts,0,sizeof(opts));
+   opts.users = BENCH_USERS;
+   opts.pairs = BENCH_USERS * BENCH_BFFS;
+   cb = ob_init_ex(&opts);
+   if(cb == NULL)
+   {
+      return 1;
+   }
+
+   for(i = 0; i < BENCH_USERS; i++)
+   {
+      snprintf(bench_names[i],BENCH_NAME,"u%ld",i);
+      bench_name_at[i] = bench_names[i];
+      bench_order[i] = (int)i;
+   }
+   for(i = BENCH_USERS - 1; i > 0; i--)
+   {
+      j = rand_r(&seed) % (i + 1);
+      tmp = bench_order[i];
+      bench_order[i] = bench_order[j];
+      bench_order[j] = tmp;
+   }
+   for(i = 0; i < BENCH_USERS; i++)
+   {
+      bench_users[i].name = bench_names[bench_order[i]];
+      bench_users[i].account_handle = bench_names[bench_order[i]];
+   }
+
+   for(i = 0; i < BENCH_USERS; i++)
+   {
+      community = i / BENCH_COMMUNITY;
+      for(j = 0; j < BENCH_BFFS; j++)
+      {
+         if(rand_r(&seed) % 100 < BENCH_LOCAL)
+         {
+            t = community * BENCH_COMMUNITY + rand_r(&seed) % BENCH_COMMUNITY;
+         }
+         else
+         {
+            t = rand_r(&seed) % BENCH_USERS;
+         }
+         bench_edges[i * BENCH_BFFS + j].who = bench_names[i];
+         bench_edges[i * BENCH_BFFS + j].bff = bench_names[t];
+      }
+   }
+   if(ob_bulk_load(cb,bench_users,BENCH_USERS,bench_edges,
+                   (long)BENCH_USERS * BENCH_BFFS) < 0)
+   {
+      return 1;
+   }
+   start = bench_now();
+   for(i = 0; i < BENCH_LOOKUPS; i++)
+   {
+      ob_find_user(cb,bench_names[rand_r(&seed) % BENCH_USERS]);
+   }
+   one = bench_now() - start;
+   start = bench_now();
+   if(ob_find_users(cb,bench_name_at,BENCH_USERS,bench_by_name) != BENCH_USERS)
+   {
+      return 1;
+   }
+   batched = bench_now() - start;
+   printf("name lookups   %9.0f/s one at a time  %9.0f/s batched\n",
+          BENCH_LOOKUPS / one,BENCH_USERS / batched);
+
+   bench_run("signup order");
+   if(ob_reorder(cb,OB_ORDER_DEGREE) != USER_SUCCESS)
+   {
+      return 1;
+   }
+   bench_run("degree");
+   if(ob_reorder(cb,OB_ORDER_RCM) != USER_SUCCESS)
+   {
+      return 1;
+   }
+   bench_run("rcm");
+   if(ob_reorder(cb,OB_ORDER_COMMUNITY) != USER_SUCCESS)
+   {
+      return 1;
+   }
+   bench_run("community");
+   if(ob_pack_BFFs(cb,&before,&after) != USER_SUCCESS)
+   {
+      return 1;
+   }
+   printf("BFF lists packed, %ld bytes -> %ld bytes\n",before,after);
+   bench_run("packed");
+   bench_triangles();
+   bench_shards();
+
+   ob_exit(cb);
+   bench_power();
+   return 0;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:     bench_now
+ *
+ * Description:  Wall clock in seconds.
+ *
+ * Params:       None.
+ *
+ * Returns:      double - seconds.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static double bench_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/******************************************************************************
+ * Function:     bench_run
+ *
+ * Description:  Time DERPCON searches and neighborhood streams.
+ *
+ * Params:       const char *label - name of the order being timed.
+ *
+ * Returns:      None.
+ *
+ * Notes:        The same pairs and users are used for every order.
+ *
+ *****************************************************************************/
+static void bench_run(const char *label)
+{
+   unsigned int seed = 1;
+   double start;
+   double pairs;
+   double within;
+   long found = 0;
+   long streamed = 0;
+   long i;
+   int derpcon;
+   user *x;
+   user *y;
+
+   start = bench_now();
+   for(i = 0; i < BENCH_PAIRS; i++)
+   {
+      x = bench_by_name[rand_r(&seed) % BENCH_USERS];
+      y = bench_by_name[rand_r(&seed) % BENCH_USERS];
+      if(ob_derpcon_bounded(x,y,5,NULL,&derpcon) == OB_DERPCON_WITHIN)
+      {
+         found += derpcon;
+      }
+   }
+   pairs = bench_now() - start;
+
+   start = bench_now();
+   for(i = 0; i < BENCH_WITHIN; i++)
+   {
+      x = bench_by_name[rand_r(&seed) % BENCH_USERS];
+      streamed += ob_foreach_within(cb,x,2,bench_count,NULL);
+   }
+   within = bench_now() - start;
+
+   printf("%-14s DERPCON %9.0f pairs/s  within 2 %10.0f visited/s  (%ld %ld)\n",
+          label,BENCH_PAIRS / pairs,streamed / within,found,streamed);
+}
+
+/******************************************************************************
+ * Function:     bench_shards
+ *
+ * Description:  Time DERPCON searches split over more and more workers.
+ *
+ * Params:       None.
+ *
+ * Returns:      None.
+ *
+ * Notes:        Also prints how many of the user_IDs the workers sent were
+ *               left once merged, and the bytes each took on the wire.
+ *
+ *****************************************************************************/
+static void bench_shards(void)
+{
+   unsigned int seed;
+   ob_shards *sh;
+   double start;
+   double pairs;
+   long found;
+   long sent;
+   long kept;
+   long bytes;
+   long i;
+   int derpcon;
+   int n;
+
+   for(n = 1; n <= BENCH_SHARDS; n *= 2)
+   {
+      sh = ob_shard_start(cb,n);
+      if(sh == NULL)
+      {
+         return;
+      }
+      seed = 1;
+      found = 0;
+      start = bench_now();
+      for(i = 0; i < BENCH_SHARD_PAIRS; i++)
+      {
+         derpcon = ob_shard_derpcon(sh,bench_by_name[rand_r(&seed) % BENCH_USERS],
+                                    bench_by_name[rand_r(&seed) % BENCH_USERS]);
+         if(derpcon >= 0 && derpcon <= 5)
+         {
+            found += derpcon;
+         }
+      }
+      pairs = bench_now() - start;
+      ob_shard_traffic(sh,&sent,&kept,&bytes);
+      ob_shard_stop(sh);
+      printf("%d shards       DERPCON %9.0f pairs/s  %5.1f%% kept %4.2f bytes each  (%ld)\n",
+             n,BENCH_SHARD_PAIRS / pairs,sent ? 100.0 * kept / sent : 100.0,
+             kept ? (double)bytes / kept : 0.0,found);
+   }
+}
+
+/******************************************************************************
+ * Function:     bench_triangles
+ *
+ * Description:  Time triangle counting over the whole book.
+ *
+ * Params:       None.
+ *
+ * Returns:      None.
+ *
+ * Notes:        The other way is ob_mutual_BFFs of each user and each BFF,
+ *               timed over BENCH_LOOKUPS users.
+ *
+ *****************************************************************************/
+static void bench_triangles(void)
+{
+   unsigned int seed = 1;
+   user *bffs[BENCH_LOCAL];
+   double sum = 0.0;
+   double start;
+   double kernel;
+   double mutual;
+   long total;
+   long pairs = 0;
+   long i;
+   int n;
+   int j;
+
+   start = bench_now();
+   total = ob_triangles(cb,bench_coef,&sum);
+   kernel = bench_now() - start;
+
+   start = bench_now();
+   for(i = 0; i < BENCH_LOOKUPS; i++)
+   {
+      bffs[0] = bench_by_name[rand_r(&seed) % BENCH_USERS];
+      n = ob_mutual_BFFs(bffs[0],bffs[0],bffs + 1,BENCH_LOCAL - 1);
+      for(j = 1; j <= n && j < BENCH_LOCAL; j++)
+      {
+         pairs += ob_mutual_BFFs(bffs[0],bffs[j],NULL,0);
+      }
+   }
+   mutual = bench_now() - start;
+
+   printf("triangles      %9.0f users/s  mutual BFFs %9.0f users/s  (%ld %.4f %ld)\n",
+          BENCH_USERS / kernel,BENCH_LOOKUPS / mutual,total,
+          sum / BENCH_USERS,pairs);
+}
+
+/******************************************************************************
+ * Function:     bench_power
+ *
+ * Description:  Time DERPCON searches and neighborhood streams on a book
+ *               where a few celebrities have most of the BFFs, bottom up
+ *               and top down.
+ *
+ * Params:       None.
+ *
+ * Returns:      None.
+ *
+ * Notes:        Every user starts one BFF pair with a user picked by
+ *               bench_skewed, the rest of the pairs are between two users
+ *               picked by it.
+ *
+ *****************************************************************************/
+static void bench_power(void)
+{
+   unsigned int seed = 4102013;
+   ob_init_opts opts;
+   ob_search_dir dir;
+   double start;
+   double pairs;
+   double within;
+   long found;
+   long streamed;
+   long i;
+   int derpcon;
+   user *x;
+   user *y;
+
+   memset(&opts,0,sizeof(opts));
+   opts.users = BENCH_USERS;
+   opts.pairs = BENCH_USERS * BENCH_BFFS;
+   cb = ob_init_ex(&opts);
+   if(cb == NULL)
+   {
+      return;
+   }
+   for(i = 0; i < BENCH_USERS * BENCH_BFFS; i++)
+   {
+      bench_edges[i].who = bench_names[i < BENCH_USERS ? i : bench_skewed(&seed)];
+      bench_edges[i].bff = bench_names[bench_skewed(&seed)];
+   }
+   if(ob_bulk_load(cb,bench_users,BENCH_USERS,bench_edges,
+                   (long)BENCH_USERS * BENCH_BFFS) < 0 ||
+      ob_find_users(cb,bench_name_at,BENCH_USERS,bench_by_name) != BENCH_USERS)
+   {
+      ob_exit(cb);
+      return;
+   }
+
+   for(dir = OB_SEARCH_HYBRID; dir <= OB_SEARCH_TOP_DOWN; dir++)
+   {
+      ob_search_direction(cb,dir);
+      seed = 1;
+      found = 0;
+      streamed = 0;
+      start = bench_now();
+      for(i = 0; i < BENCH_PAIRS; i++)
+      {
+         x = bench_by_name[rand_r(&seed) % BENCH_USERS];
+         y = bench_by_name[rand_r(&seed) % BENCH_USERS];
+         if(ob_derpcon_bounded(x,y,5,NULL,&derpcon) == OB_DERPCON_WITHIN)
+         {
+            found += derpcon;
+         }
+      }
+      pairs = bench_now() - start;
+
+      start = bench_now();
+      for(i = 0; i < BENCH_POWER_WITHIN; i++)
+      {
+         x = bench_by_name[rand_r(&seed) % BENCH_USERS];
+         streamed += ob_foreach_within(cb,x,BENCH_POWER_K,bench_count,NULL);
+      }
+      within = bench_now() - start;
+
+      printf("celebs %-7s DERPCON %9.0f pairs/s  within %d %10.0f visited/s  (%ld %ld)\n",
+             dir == OB_SEARCH_HYBRID ? "hybrid" : "top",BENCH_PAIRS / pairs,
+             BENCH_POWER_K,streamed / within,found,streamed);
+   }
+   ob_exit(cb);
+}
+
+/******************************************************************************
+ * Function:     bench_skewed
+ *
+ * Description:  Pick a user of a celebrity BFF pair.
+ *
+ * Params:       unsigned int *seed - seed of rand_r.
+ *
+ * Returns:      long - index of the user, 0 to BENCH_USERS - 1.
+ *
+ * Notes:        A uniform draw raised to BENCH_SKEW, so user i is picked
+ *               about i ^ (1 / BENCH_SKEW - 1) times as often as the others,
+ *               a power law.
+ *
+ *****************************************************************************/
+static long bench_skewed(unsigned int *seed)
+{
+   double u = rand_r(seed) / (RAND_MAX + 1.0);
+   double p = 1.0;
+   int i;
+
+   for(i = 0; i < BENCH_SKEW; i++)
+   {
+      p *= u;
+   }
+   return (long)(BENCH_USERS * p);
+}
+
+/******************************************************************************
+ * Function:     bench_count
+ *
+ * Description:  ob_foreach_within callback that only counts.
+ *
+ * Params:       ctx, users, levels, n - see ob_within_fn.
+ *
+ * Returns:      0 to keep going.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static int bench_count(void *ctx, user **users, int *levels, int n)
+{
+   return 0;
+}
+
+/******************************************************************************
+ * Function:     bench_coef
+ *
+ * Description:  ob_triangles callback that adds up the clustering
+ *               coefficients.
+ *
+ * Params:       ctx - the double to add to.
+ *               users, triangles, coef, n - see ob_triangle_fn.
+ *
+ * Returns:      0 to keep going.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static int bench_coef(void *ctx, user **users, long *triangles, double *coef,
+                      int n)
+{
+   double *sum = ctx;
+   int i;
+
+   for(i = 0; i < n; i++)
+   {
+      *sum += coef[i];
+   }
+   return 0;
+}
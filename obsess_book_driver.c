@@ -13,6 +13,7 @@
 //_____________________________________________________________________________
 //                                                                     Includes
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
 #include "obsess_book.h"
 //_____________________________________________________________________________
@@ -45,7 +46,14 @@ td user_data_list[] = {
 //_____________________________________________________________________________
 //                                                            Private Functions
 static int load_test_data();
+static int count_within(void *ctx, user **users, int *levels, int n);
+static int check_reorder(void);
+static int check_estimate(void);
+static int estimate_holds(user **users, int n);
+static int check_derpcon_apis(void);
 static obsess_book_cb *cb;
+static ob_bulk_user bulk_users[td_size];
+static ob_bulk_edge bulk_edges[td_size * 25];
 //_____________________________________________________________________________
 //                                                             Public Functions 
 
@@ -56,7 +64,7 @@ static obsess_book_cb *cb;
  *
  * Params:       argv, argc - not used.
  * 
- * Returns:      int 0.
+ * Returns:      int number of checks that failed.
  *
  * Notes:        None.
  *
@@ -64,12 +72,17 @@ static obsess_book_cb *cb;
 int main (int argv, char **argc)
 {
    BOOLEAN exit = FALSE;
+   int failed = 0;
 
    cb = ob_init();
    load_test_data();
    exit_obsess_book();
 
-   return 0;
+   failed += check_reorder();
+   failed += check_estimate();
+   failed += check_derpcon_apis();
+
+   return failed;
 }
 
 
@@ -90,7 +103,8 @@ int load_test_data()
 {
    int i;
    int j;
-   user *my_new_user;
+   int k;
+   long n_edges = 0;
    user *me;
    user *bff;
    time_t t;
@@ -99,8 +113,8 @@ int load_test_data()
    //Create a list of users.
    for(i = 0; i < td_size;i++)
    {
-      printf("creating new user %s, %s\n",user_data_list[i].name,user_data_list[i].account_handle);
-      my_new_user = ob_new_user(cb,user_data_list[i].name,user_data_list[i].account_handle);
+      bulk_users[i].name = user_data_list[i].name;
+      bulk_users[i].account_handle = user_data_list[i].account_handle;
    }
 
 
@@ -109,15 +123,19 @@ int load_test_data()
 
    for(i = 0; i < td_size;i++)
    {
-      me = ob_find_user(cb,user_data_list[i].name);
       //Everyone can have from 1 to 25 BFFs.
       for(j = 0;j < (rand() % 24) + 1;j++)
       {
-         bff = ob_find_user(cb,user_data_list[(rand() % td_size)].name);
-         ob_add_BFF(me,bff);
+         bulk_edges[n_edges].who = user_data_list[i].name;
+         bulk_edges[n_edges].bff = user_data_list[(rand() % td_size)].name;
+         n_edges++;
       }
    }
 
+   //Load the users and the BFFs in one go.
+   printf("loaded %d users and %ld BFF pairs\n",(int)td_size,
+          ob_bulk_load(cb,bulk_users,td_size,bulk_edges,n_edges));
+
    //Dump the data inserted into the obsess book.
    ob_dump_data(cb);
 
@@ -126,10 +144,16 @@ int load_test_data()
    for(i = 0;i < td_size; i++)
    {
       printf("--------\n");
-      me = ob_find_user(cb,user_data_list[rand() % td_size].name);
-      bff = ob_find_user(cb,user_data_list[(rand() % td_size)].name);
+      j = rand() % td_size;
+      k = rand() % td_size;
+      me = ob_find_user(cb,user_data_list[j].name);
+      bff = ob_find_user(cb,user_data_list[k].name);
       derpcon = DERPCON(me,bff);
+      printf("%s -> %s derpcon = %d\n",user_data_list[j].name,
+             user_data_list[k].name,derpcon);
       derpcon = DERPCON(bff,me);
+      printf("%s -> %s derpcon = %d\n",user_data_list[k].name,
+             user_data_list[j].name,derpcon);
    }
 
    //Look at every user and me.
@@ -144,9 +168,314 @@ int load_test_data()
       printf("derpcon of bff -> me = %d\n",derpcon);
    }
 
+   //Check who can see my profile, i.e. is within DERPCON 2 of me.
+   printf("Users within DERPCON 2 of me.\n");
+   for(i = 0;i < 10; i++)
+   {
+      j = rand() % td_size;
+      bff = ob_find_user(cb,user_data_list[j].name);
+      printf("%s within 2 = %d\n",user_data_list[j].name,ob_derpcon_within(me,bff,2));
+   }
+
+   //Find how I am connected to some random users.
+   printf("BFF chains from me.\n");
+   for(i = 0;i < 10; i++)
+   {
+      user *chain[8];
+
+      j = rand() % td_size;
+      bff = ob_find_user(cb,user_data_list[j].name);
+      printf("%s chain of %d users\n",user_data_list[j].name,ob_derpcon_path(me,bff,chain,8));
+   }
+
+   //Count the users within DERPCON 2 of me.
+   derpcon = 0;
+   ob_foreach_within(cb,me,2,count_within,&derpcon);
+   printf("%d users within DERPCON 2 of me\n",derpcon);
+
+   //Estimate how many users I can reach at each level.
+   printf("Reach of me, error +/- %.0f%%\n",ob_reach_error() * 100.0);
+   ob_reach_build(cb);
+   me = ob_find_user(cb,"O\'Ryan Anderson");
+   for(i = 0;i < 5; i++)
+   {
+      printf("derpcon <= %d reaches ~%ld users\n",i,ob_reach_estimate(me,i));
+   }
+
+   //Estimate DERPCONs from landmarks.
+   printf("Estimated DERPCON of me and random users.\n");
+   ob_landmark_build(cb,32,OB_LANDMARK_DEGREE,td_size);
+   for(i = 0;i < 10; i++)
+   {
+      int lower;
+      int upper;
+
+      j = rand() % td_size;
+      bff = ob_find_user(cb,user_data_list[j].name);
+      derpcon = ob_derpcon_estimate(me,bff,&lower,&upper);
+      printf("%s estimate = %d (%d - %d)\n",user_data_list[j].name,derpcon,lower,upper);
+   }
+
+   //Unfriend my first BFF and leave the book.
+   for(i = 0;i < td_size; i++)
+   {
+      bff = ob_find_user(cb,user_data_list[i].name);
+      if(bff != me && ob_remove_BFF(me,bff) == USER_SUCCESS)
+      {
+         printf("unfriended %s\n",user_data_list[i].name);
+         break;
+      }
+   }
+   printf("deleting me = %d\n",ob_delete_user(me));
+
    return 1;
 }
 
+/******************************************************************************
+ * Function:      count_within
+ *
+ * Description:   ob_foreach_within callback that counts the users.
+ *
+ * Params:        void *ctx - pointer to the int count.
+ *                user **users - batch of users.
+ *                int *levels - DERPCON of each user.
+ *                int n - number of users in the batch.
+ *
+ * Returns:       int 0 to keep going.
+ *
+ * Notes:         None
+ *
+ *****************************************************************************/
+static int count_within(void *ctx, user **users, int *levels, int n)
+{
+   //Only the number of users counts.
+   (void)users;
+   (void)levels;
+   *(int*)ctx += n;
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      check_reorder
+ *
+ * Description:   Deletes landmark users between reorders and checks the
+ *                estimates still box in the DERPCON.
+ *
+ * Params:        None.
+ *
+ * Returns:       int 0 if the check passed, 1 if it failed.
+ *
+ * Notes:         The second reorder moves landmark slots the first one
+ *                already dropped.
+ *
+ *****************************************************************************/
+static int check_reorder(void)
+{
+   obsess_book_cb *book;
+   user *users[32];
+   char name[16];
+   int failed;
+   int i;
+
+   book = ob_init();
+   for(i = 0;i < 32; i++)
+   {
+      sprintf(name,"r%d",i);
+      users[i] = ob_new_user(book,name,name);
+   }
+   //A ring with two hubs, the hubs are the landmarks.
+   for(i = 0;i < 32; i++)
+   {
+      ob_add_BFF(users[i],users[(i + 1) % 32]);
+      if(i >= 2)
+      {
+         ob_add_BFF(users[i % 2],users[i]);
+      }
+   }
+   ob_landmark_build(book,2,OB_LANDMARK_DEGREE,0);
+
+   ob_delete_user(users[0]);
+   users[0] = NULL;
+   ob_reorder(book,OB_ORDER_RCM);
+   ob_delete_user(users[1]);
+   users[1] = NULL;
+   ob_reorder(book,OB_ORDER_DEGREE);
+
+   failed = estimate_holds(users + 2,30);
+   ob_exit(book);
+
+   printf("reorder after deletes: %s\n",failed ? "FAILED" : "ok");
+   return failed;
+}
+
+/******************************************************************************
+ * Function:      check_estimate
+ *
+ * Description:   Removes and adds BFFs after the landmark tables are built
+ *                and checks the estimates still box in the DERPCON.
+ *
+ * Params:        None.
+ *
+ * Returns:       int 0 if the check passed, 1 if it failed.
+ *
+ * Notes:         The tables are never rebuilt, two rings that are joined
+ *                later start out as strangers.
+ *
+ *****************************************************************************/
+static int check_estimate(void)
+{
+   obsess_book_cb *book;
+   user *users[32];
+   char name[16];
+   int failed = 0;
+   int i;
+
+   book = ob_init();
+   for(i = 0;i < 32; i++)
+   {
+      sprintf(name,"e%d",i);
+      users[i] = ob_new_user(book,name,name);
+   }
+   for(i = 0;i < 32; i++)
+   {
+      ob_add_BFF(users[i],users[i < 16 ? (i + 1) % 16 : 16 + (i - 15) % 16]);
+   }
+   ob_landmark_build(book,4,OB_LANDMARK_DEGREE,0);
+   failed |= estimate_holds(users,32);
+
+   //The ring gets longer, paths through the cut pair are gone.
+   ob_remove_BFF(users[0],users[1]);
+   failed |= estimate_holds(users,32);
+
+   //The strangers get linked.
+   ob_add_BFF(users[8],users[24]);
+   failed |= estimate_holds(users,32);
+   ob_exit(book);
+
+   printf("estimate after removes and adds: %s\n",failed ? "FAILED" : "ok");
+   return failed;
+}
+
+/******************************************************************************
+ * Function:      estimate_holds
+ *
+ * Description:   Checks the landmark estimate of every pair of users.
+ *
+ * Params:        user **users - the users.
+ *                int n - number of users.
+ *
+ * Returns:       int 0 if the DERPCON of every pair is within the bounds,
+ *                1 otherwise.
+ *
+ * Notes:         None.
+ *
+ *****************************************************************************/
+static int estimate_holds(user **users, int n)
+{
+   int derpcon;
+   int lower;
+   int upper;
+   int i;
+   int j;
+
+   for(i = 0;i < n; i++)
+   {
+      for(j = 0;j < n; j++)
+      {
+         if(i == j)
+         {
+            continue;
+         }
+         derpcon = DERPCON(users[i],users[j]);
+         ob_derpcon_estimate(users[i],users[j],&lower,&upper);
+         if(derpcon < lower || derpcon > upper)
+         {
+            return 1;
+         }
+      }
+   }
+   return 0;
+}
+
+/******************************************************************************
+ * Function:      check_derpcon_apis
+ *
+ * Description:   Checks DERPCON, ob_query_batch and a sharded book give the
+ *                same DERPCON for every pair of users.
+ *
+ * Params:        None.
+ *
+ * Returns:       int 0 if the check passed, 1 if it failed.
+ *
+ * Notes:         A chain longer than max_derpcon and a pair of strangers to
+ *                it, so every DERPCON from 0 up to no link shows up.  The
+ *                server answers with ob_query_batch.  A user is 0 from
+ *                itself, with BFFs or without.
+ *
+ *****************************************************************************/
+static int check_derpcon_apis(void)
+{
+   obsess_book_cb *book;
+   ob_init_opts opts = {0};
+   ob_shards *sh;
+   ob_query q;
+   user *users[11];
+   char names[10][16];
+   int failed = 0;
+   int derpcon;
+   int i;
+   int j;
+
+   opts.max_derpcon = 3;
+   book = ob_init_ex(&opts);
+   for(i = 0;i < 10; i++)
+   {
+      sprintf(names[i],"d%d",i);
+      users[i] = ob_new_user(book,names[i],names[i]);
+   }
+   for(i = 0;i < 7; i++)
+   {
+      ob_add_BFF(users[i],users[i + 1]);
+   }
+   ob_add_BFF(users[8],users[9]);
+   users[10] = ob_new_user(book,"d10","d10");
+   if(DERPCON(users[0],users[0]) != 0 || DERPCON(users[10],users[10]) != 0)
+   {
+      failed = 1;
+   }
+
+   sh = ob_shard_start(book,2);
+   if(sh == NULL)
+   {
+      failed = 1;
+   }
+   for(i = 0;i < 10 && !failed; i++)
+   {
+      for(j = 0;j < 10 && !failed; j++)
+      {
+         derpcon = DERPCON(users[i],users[j]);
+         memset(&q,0,sizeof(q));
+         q.op = OB_QUERY_DERPCON;
+         q.x = names[i];
+         q.y = names[j];
+         if(ob_query_batch(book,&q,1) != USER_SUCCESS ||
+            q.result != derpcon ||
+            ob_shard_derpcon(sh,users[i],users[j]) != derpcon)
+         {
+            failed = 1;
+         }
+      }
+   }
+   if(sh != NULL)
+   {
+      ob_shard_stop(sh);
+   }
+   ob_exit(book);
+
+   printf("DERPCON, query and shards agree: %s\n",failed ? "FAILED" : "ok");
+   return failed;
+}
+
 /******************************************************************************
  * Function:    exit_obsess_book
  *
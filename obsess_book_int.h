@@ -0,0 +1,948 @@
+
+/*****************************************************************************
+ *
+ *       obsess_book_int.h
+ *
+ *   Description: Internal header for the obsess_book.  Holds the structures
+ *                shared between the obsess book modules.  Nothing outside of
+ *                the library should include this file.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:   4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <pthread.h>
+#include "obsess_book.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Number of buckets to put users into unless ob_init_ex is told more users.
+#define BUCKET_LEN 575
+
+//Most buckets a book can have.
+#define OB_BUCKETS_MAX (1L << 30)
+
+//Maximum number of edges that can seperate BFFs until users are considerd
+//strangers, unless ob_init_ex is told otherwise.  The reach sketches always
+//keep this many levels.
+#define MAX_DREPCON 5
+
+//Room of the first BFF list of a user, and the most ob_init_ex will give it.
+#define OB_ADJ_FIRST 4
+#define OB_ADJ_FIRST_MAX 1024
+
+//Number of index bits of a reach sketch, the sketch has 2^bits registers.
+#define OB_REACH_BITS 6
+
+//Number of registers in a reach sketch.
+#define OB_REACH_REGS (1 << OB_REACH_BITS)
+
+//Each page of the user directory holds 2^shift users.
+#define OB_DIR_SHIFT 14
+#define OB_DIR_MASK  ((1L << OB_DIR_SHIFT) - 1)
+
+//Number of pages the user directory can have.
+#define OB_DIR_PAGES (1L << 16)
+
+//Number of locks guarding the buckets, bucket b takes lock b % OB_BUCKET_LOCKS.
+#define OB_BUCKET_LOCKS 64
+
+//Number of bytes an arena gets from malloc at a time.
+#define OB_ARENA_CHUNK (64L * 1024)
+
+//BFF list entry of a BFF that was removed.
+#define OB_ADJ_DEAD (-1)
+
+//Number of user_IDs in a block of a packed BFF list.
+#define OB_PACK_BLOCK 64
+
+//Longest name or account handle a user can have.
+#define OB_NAME_MAX 65534
+
+//Words and bits of a block of the name filter, a block is one cache line.
+#define OB_BLOOM_WORDS 8
+#define OB_BLOOM_BITS  (OB_BLOOM_WORDS * 64)
+
+//False positive rate of the name filter until ob_name_filter changes it.
+#define OB_BLOOM_RATE 0.01
+
+//Types of the records of the journal, see ob_journal.c.
+#define OB_JOURNAL_USER   'U'
+#define OB_JOURNAL_ADD    'A'
+#define OB_JOURNAL_REMOVE 'R'
+#define OB_JOURNAL_DELETE 'D'
+
+//State of each user_ID while a snapshot is taken, see ob_snapshot.c.
+#define OB_SNAP_TODO 0        //Not copied yet.
+#define OB_SNAP_BUSY 1        //Being copied.
+#define OB_SNAP_DONE 2        //Copied, writers change it freely.
+
+//Levels of sorted arrays in the prefix index.
+#define OB_PREFIX_LEVELS 12
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Start of a block of a packed BFF list.
+typedef struct _ob_pack_block
+{
+   int          first;        //First user_ID of the block.
+   unsigned int off;          //Offset of the gaps of the block.
+}ob_pack_block;
+
+//BFFs of a user packed by ob_pack_BFFs, see ob_pack.c.  The user_IDs are
+//sorted and cut into blocks of OB_PACK_BLOCK.  A block holds the gaps from
+//each user_ID to the next, 4 gaps behind a control byte giving the number of
+//bytes of each.  The gaps of all blocks follow the block index.  A packed
+//list never changes, it is replaced.
+typedef struct _ob_pack
+{
+   int           count;       //Number of BFFs.
+   int           blocks;      //Number of blocks.
+   unsigned int  size;        //Bytes of gaps.
+   ob_pack_block block[];     //Index of the blocks, the gaps come after it.
+}ob_pack;
+
+//List of BFFs of a user.  Readers load the list and the count once and only
+//look at the first count entries.  Writers append in place past count and
+//then publish the new count, a list that is full is copied into a bigger one
+//that replaces it and the old one is retired.  A removed BFF is overwritten
+//with OB_ADJ_DEAD where it is, readers skip it, and the list is copied without
+//the dead entries once half of it is dead.  The BFFs that were packed hang off
+//the list, copies of the list share them.
+typedef struct _ob_adj
+{
+   int count;                 //Number of entries, dead ones included.
+   int cap;                   //Number of entries the list has room for.
+   int dead;                  //Number of dead entries.
+   ob_pack *pack;             //Packed BFFs, NULL if there are none.
+   int bff[];                 //user_ID of each BFF.
+}ob_adj;
+
+//Walk over the BFFs of a list, the packed ones are unpacked a block at a time.
+typedef struct _ob_adj_iter
+{
+   ob_adj    *adj;
+   int        n;              //Entries of the list.
+   int        block;          //Next block to unpack, blocks when it is done.
+   const int *cur;            //Next entry.
+   const int *end;            //End of the entries at hand.
+   int        buf[OB_PACK_BLOCK];
+}ob_adj_iter;
+
+//Structure to define a user. Explicitly part of the contest, i would use a linked
+//list for the BFFs so as to not do so many reallocs.  Probably implement a free list.
+struct user_struct {
+  int user_ID;
+  //user_ID the user was created with, ob_reorder does not change it.
+  int orig_ID;
+  //Length of the name, the name follows the bucket node of the user, see
+  //ob_user_name.
+  unsigned short name_len;
+  //Offset of the account handle from the name, 0 when the two are the same.
+  unsigned short handle_off;
+  int scratch;
+  //The obsess book the user belongs to.
+  obsess_book_cb *cb;
+  //Node of the user in its bucket.
+  struct _user_list_node *node;
+};
+
+//Filter of the names in the book, see ob_bloom.c.
+typedef struct _ob_bloom
+{
+   struct _ob_bloom   *old;      //Filter this one replaced, freed with the book.
+   unsigned long long *bits;     //OB_BLOOM_WORDS words per block.
+   unsigned long       blocks;   //Number of blocks.
+   long                cap;      //Names the filter is sized for.
+   long                names;    //Names added.
+   int                 k;        //Bits set per name.
+}ob_bloom;
+
+//Page of the user directory.  The BFF lists are kept apart from the users,
+//a search goes from user_ID to BFF list without loading the user.
+typedef struct _ob_dir_page
+{
+   user   *user[OB_DIR_MASK + 1];
+   ob_adj *adj[OB_DIR_MASK + 1];     //BFFs of the user, NULL if there are none.
+   //Heat of the user while the book has a cold tier, see ob_tier.c.
+   unsigned char heat[OB_DIR_MASK + 1];
+}ob_dir_page;
+
+//Structure used to define a user node.
+typedef struct _user_list_node
+{
+   struct _user_list_node *prev;
+   struct _user_list_node *next;
+   user                   *data;
+   //Hash of the name, a lookup only loads the users whose hash matches.
+   unsigned int            hash;
+}user_list_node;
+
+//Estimates of the reach sketches, readers load them without a lock.
+typedef struct _ob_reach_view
+{
+   //Number of users with an estimate.
+   long   users;
+   //Estimate of every sketch, MAX_DREPCON per user.
+   float *estimate;
+}ob_reach_view;
+
+//Reach sketches of every user, see ob_reach.c.
+typedef struct _ob_reach
+{
+   //Guards the sketches, held while they are brought up to date.
+   pthread_mutex_t lock;
+   //Non zero once the estimates can be read.
+   int            ready;
+   //Number of users that have sketches.
+   long           users;
+   //Number of users the estimates have room for.
+   long           cap;
+   //Registers, MAX_DREPCON sketches of OB_REACH_REGS registers per user.
+   unsigned char *regs;
+   //Published estimates, NULL until the sketches are built.
+   ob_reach_view *view;
+   //BFF pairs changed since the estimates were last brought up to date,
+   //changed under the write lock.
+   long           churn;
+   //Guards the pending pairs.
+   pthread_mutex_t pending_lock;
+   //BFF pairs added since the sketches were last brought up to date, the
+   //length is -1 once a pair was lost.
+   int           *pending;
+   long           pending_len;
+   long           pending_cap;
+}ob_reach;
+
+//Landmark distance oracle, see ob_landmark.c.
+typedef struct _ob_oracle ob_oracle;
+
+//Cold tier of the BFF lists, see ob_tier.c.
+typedef struct _ob_tier ob_tier;
+
+//Name or account handle of a user in the prefix index.
+typedef struct _ob_prefix_key
+{
+   unsigned long head;        //First 8 characters, the first one on top.
+   const char   *key;
+   user         *usr;
+}ob_prefix_key;
+
+//Array of keys of the prefix index.
+typedef struct _ob_prefix_run
+{
+   long           n;
+   long          *first;      //Offsets of the first characters, or NULL.
+   ob_prefix_key  key[];
+}ob_prefix_run;
+
+//Prefix index, see ob_prefix.c.
+typedef struct _ob_prefix
+{
+   //Keys of the newest users as they came, n grows under the prefix lock.
+   ob_prefix_run *delta;
+   //Sorted arrays never changed once published, level i holds fewer than
+   //256 * 8^(i + 1) keys.
+   ob_prefix_run *run[OB_PREFIX_LEVELS];
+}ob_prefix;
+
+//Compact copy of the BFF graph, see ob_csr.c.
+typedef struct _ob_csr
+{
+   //Number of users.
+   long  users;
+   //BFFs of user v are adj[off[v]] to adj[off[v + 1] - 1].
+   long *off;
+   int  *adj;
+}ob_csr;
+
+//Scratch space of one search, see ob_traverse.c.
+typedef struct _ob_scratch
+{
+   //Next free scratch in the pool.
+   struct _ob_scratch *next;
+   //Number of users the arrays hold.
+   long                cap;
+   //Stamp of the search that last found each user.
+   unsigned int       *mark;
+   //Last stamp handed out.
+   unsigned int        stamp;
+   //Users found by the search.
+   int                *queue;
+   //User each user was found from.
+   int                *parent;
+   //Frontier of a bottom up level, one bit per user.
+   unsigned long      *front;
+   //The BFF link where the two sides of a search met, x side first.
+   int                 meet[2];
+}ob_scratch;
+
+//Reader of a book, one per thread, see ob_epoch.c.
+typedef struct _ob_epoch_rec
+{
+   //Next reader of the book.
+   struct _ob_epoch_rec *next;
+   //Epoch the thread is reading in, 0 when it is not reading.
+   unsigned long         epoch;
+   //Number of nested reads.
+   int                   depth;
+   //Non zero once the thread that owned it has exited.
+   int                   idle;
+}ob_epoch_rec;
+
+//Memory waiting for the readers that might still see it.
+typedef struct _ob_limbo
+{
+   struct _ob_limbo *next;
+   void             *ptr;
+}ob_limbo;
+
+//Chunk of memory an arena carves pieces out of.
+typedef struct _ob_chunk
+{
+   struct _ob_chunk *next;
+   size_t            size;
+   char              data[];
+}ob_chunk;
+
+//Memory of the users created by one thread, see ob_arena.c.
+typedef struct _ob_arena
+{
+   //Next arena of the book.
+   struct _ob_arena *next;
+   //Chunks of the arena, the newest one first.
+   ob_chunk         *chunks;
+   //Free part of the newest chunk.
+   char             *pos;
+   char             *end;
+   //Non zero once the thread that owned it has exited.
+   int               idle;
+}ob_arena;
+
+//user_IDs of deleted users, oldest first, waiting to be handed out again.
+typedef struct _ob_id_queue
+{
+   pthread_mutex_t lock;
+   int            *id;
+   unsigned long  *epoch;     //Epoch each user_ID was freed in.
+   long            head;      //First user_ID waiting.
+   long            tail;      //One past the last user_ID waiting.
+   long            cap;
+}ob_id_queue;
+
+//Journal of the changes to a book, see ob_journal.c.  Positions count the
+//bytes of records logged since the book was empty.
+typedef struct _ob_journal
+{
+   int             fd;
+   pthread_t       flusher;
+   pthread_mutex_t lock;
+   pthread_cond_t  wake;      //Signals the flusher there are records.
+   pthread_cond_t  flushed;   //Signals the writers a frame is on disk.
+   char           *buf;       //Records the flusher has not taken yet.
+   size_t          len;
+   size_t          cap;
+   char           *spare;     //Buffer the flusher writes out.
+   size_t          spare_cap;
+   unsigned long   logged;    //Position after the last record logged.
+   unsigned long   durable;   //Position after the last record on disk.
+   long            delay;     //Microseconds the flusher waits for more records.
+   int             wait;      //Non zero if writers wait for their records.
+   int             stop;
+   int             failed;    //Non zero once a record was lost.
+}ob_journal;
+
+//User a writer saved for a snapshot, see ob_snapshot.c.
+typedef struct _ob_snap_user ob_snap_user;
+
+//Snapshot being taken, see ob_snapshot.c.
+typedef struct _ob_snap
+{
+   obsess_book_cb *cb;
+   char           *path;
+   pthread_t       thread;
+   unsigned long   pos;       //Journal position of the snapshot.
+   long            users;     //user_IDs handed out when it was taken.
+   unsigned char  *state;     //OB_SNAP_TODO, BUSY or DONE for each user_ID.
+   ob_snap_user  **saved;     //Users saved by the writers, NULL for no user.
+   int             failed;    //Non zero if a writer could not save a user.
+   user_ret_code   rc;        //Outcome of the snapshot.
+}ob_snap;
+
+//control block structure used to hold all the special data of the obsess book app.
+struct _obsess_book_cb
+{
+   //unique id to give to each user.
+   long static_id;
+   //Array of bucket Lists to put each user into.  The list the user is put into
+   //is determined by a hash function.
+   user_list_node **user_list;
+   //Number of buckets, set when the book is made.
+   long buckets;
+   //DERPCON of users too far apart to search, set when the book is made.
+   int max_derpcon;
+   //Room of the first BFF list of a user.
+   int adj_first;
+   //Bytes the arenas take from malloc at a time.
+   size_t arena_chunk;
+   //Directory of users indexed by user_ID, OB_DIR_PAGES pages that never move.
+   ob_dir_page **user_dir;
+   //Number of threads used by the parallel kernels.
+   int    threads;
+   //Reach sketches, NULL until ob_reach_build is called.
+   ob_reach *reach;
+   //Landmark oracle, NULL until ob_landmark_build is called.
+   ob_oracle *oracle;
+   //Pool of search scratch space.
+   pthread_mutex_t scratch_lock;
+   ob_scratch     *scratch_pool;
+   //BFF pairs in the book, changed under the write lock.
+   long            bff_pairs;
+   //ob_search_dir of the searches.
+   int             search_dir;
+   //Serializes the writers of BFFs, readers never take it.
+   pthread_mutex_t write_lock;
+   //Serializes the inserts into each stripe of buckets.
+   pthread_mutex_t bucket_lock[OB_BUCKET_LOCKS];
+   //Arenas new users are carved out of, one per thread.
+   ob_arena       *arenas;
+   pthread_key_t   arena_key;
+   //user_IDs of deleted users.
+   ob_id_queue     free_ids;
+   //Current epoch and the readers of the book.
+   unsigned long   epoch;
+   ob_epoch_rec   *readers;
+   pthread_key_t   reader_key;
+   //Memory retired in each of the last 3 epochs.
+   pthread_mutex_t limbo_lock;
+   ob_limbo       *limbo[3];
+   //Filter of the names in the book, replaced under every bucket lock.
+   ob_bloom       *bloom;
+   double          bloom_rate;
+   pthread_mutex_t bloom_lock;
+   //Journal, NULL when the changes are not logged.
+   ob_journal     *journal;
+   //Journal position the book is at while there is no journal.
+   unsigned long   journal_pos;
+   //Snapshot the writers save users for, NULL once it is copied.  Set and
+   //cleared under the write lock and every bucket lock.
+   ob_snap        *snap;
+   //Snapshot being written, and the lock of starting and waiting for one.
+   ob_snap        *snap_job;
+   pthread_mutex_t snap_lock;
+   //Cold tier of the BFF lists, NULL until ob_tier_open is called.
+   ob_tier        *tier;
+   //Index of the names and account handles, replaced under the prefix lock.
+   ob_prefix      *prefix;
+   pthread_mutex_t prefix_lock;
+};
+
+//Body of a parallel loop, called with a range of indexes [begin, end).
+typedef void (*ob_range_fn)(void *ctx, long begin, long end);
+//_____________________________________________________________________________
+//                                                            Private Functions
+void              ob_parallel_for(obsess_book_cb *cb, long n, long grain,
+                                  ob_range_fn fn, void *ctx);
+void              ob_reach_add_BFF(obsess_book_cb *cb, user *who, user *bff);
+void              ob_reach_invalidate(obsess_book_cb *cb, long pairs);
+void              ob_reach_sync(obsess_book_cb *cb);
+void              ob_reach_free(obsess_book_cb *cb);
+void              ob_landmark_add_BFF(obsess_book_cb *cb, long pairs,
+                                      int removed);
+void              ob_landmark_touch(obsess_book_cb *cb, int id);
+void              ob_landmark_renumber(obsess_book_cb *cb, const int *new_id,
+                                       long users);
+void              ob_landmark_free(obsess_book_cb *cb);
+ob_scratch*       ob_scratch_get(obsess_book_cb *cb);
+void              ob_scratch_put(obsess_book_cb *cb, ob_scratch *s);
+int               ob_scratch_reserve(obsess_book_cb *cb, int n, long users);
+void              ob_scratch_free(obsess_book_cb *cb);
+ob_csr*           ob_csr_build(obsess_book_cb *cb);
+void              ob_csr_free(ob_csr *g);
+int               ob_epoch_init(obsess_book_cb *cb);
+void              ob_epoch_free(obsess_book_cb *cb);
+void              ob_epoch_enter(obsess_book_cb *cb);
+void              ob_epoch_exit(obsess_book_cb *cb);
+void              ob_epoch_retire(obsess_book_cb *cb, void *ptr);
+unsigned long     ob_epoch_now(obsess_book_cb *cb);
+int               ob_epoch_passed(obsess_book_cb *cb, unsigned long epoch);
+int               ob_arena_init(obsess_book_cb *cb);
+void              ob_arena_free(obsess_book_cb *cb);
+void*             ob_arena_alloc(obsess_book_cb *cb, size_t size);
+user_ret_code     ob_user_dir_add(obsess_book_cb *cb, user *usr);
+ob_pack*          ob_pack_build(const int *id, int n);
+int               ob_pack_unpack(const ob_pack *pack, int block, int *out);
+int               ob_pack_find(const ob_pack *pack, int id);
+void              ob_pack_retire(obsess_book_cb *cb, ob_pack *pack);
+int               ob_adj_fill(ob_adj_iter *it);
+long              ob_adj_bytes(ob_adj *adj);
+int               ob_bloom_init(obsess_book_cb *cb, long names);
+void              ob_bloom_free(obsess_book_cb *cb);
+int               ob_bloom_add(obsess_book_cb *cb, unsigned int hash);
+void              ob_bloom_grow(obsess_book_cb *cb);
+user*             ob_user_create(obsess_book_cb *cb, char *name, char *ah,
+                                 unsigned long *ticket, user_ret_code *rc);
+unsigned long     ob_journal_log(obsess_book_cb *cb, int type, const char *a,
+                                 int a_len, const char *b, int b_len);
+unsigned long     ob_journal_log_edges(obsess_book_cb *cb,
+                                       const ob_bulk_edge *edges,
+                                       const int *pair, long n);
+user_ret_code     ob_journal_wait(obsess_book_cb *cb, unsigned long ticket);
+unsigned long     ob_journal_position(obsess_book_cb *cb);
+user_ret_code     ob_journal_durable(obsess_book_cb *cb, unsigned long pos);
+const unsigned char* ob_get_name(const unsigned char *p,
+                                 const unsigned char *end, int optional,
+                                 char **pool, char **out);
+int               ob_file_read(int fd, void *buf, size_t len, long off);
+int               ob_file_write(int fd, const void *buf, size_t len);
+int               ob_sync_dir(const char *path);
+long              ob_snapshot_load(obsess_book_cb *cb, const char *path,
+                                   unsigned long *pos);
+void              ob_snap_save(ob_snap *s, long id);
+int               ob_tier_holds(obsess_book_cb *cb, const ob_pack *pack);
+void              ob_tier_free(obsess_book_cb *cb);
+user_ret_code     ob_prefix_add(obsess_book_cb *cb, user *usr);
+user_ret_code     ob_prefix_compact(obsess_book_cb *cb);
+void              ob_prefix_free(obsess_book_cb *cb);
+
+/******************************************************************************
+ * Function:      ob_user_count
+ *
+ * Description:   Number of user_IDs handed out.
+ *
+ * Notes:         A user_ID below the count may still have no user in the
+ *                directory, readers have to check.
+ *
+ *****************************************************************************/
+static inline long ob_user_count(obsess_book_cb *cb)
+{
+   return __atomic_load_n(&cb->static_id,__ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+ * Function:      ob_user_at
+ *
+ * Description:   Look a user up in the directory by user_ID.
+ *
+ * Notes:         Returns NULL for a user_ID that has no user, a deleted
+ *                user or OB_ADJ_DEAD.
+ *
+ *****************************************************************************/
+static inline user *ob_user_at(obsess_book_cb *cb, long id)
+{
+   ob_dir_page *page;
+
+   if(id < 0)
+   {//Dead BFF list entry.
+      return NULL;
+   }
+   page = __atomic_load_n(&cb->user_dir[id >> OB_DIR_SHIFT],__ATOMIC_ACQUIRE);
+   if(page == NULL)
+   {
+      return NULL;
+   }
+   return __atomic_load_n(&page->user[id & OB_DIR_MASK],__ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+ * Function:      ob_adj_of
+ *
+ * Description:   Load the BFF list of a user by user_ID.
+ *
+ * Notes:         Same as ob_adj_get, without loading the user.  A user_ID
+ *                that has no user has no BFFs.
+ *
+ *****************************************************************************/
+static inline ob_adj *ob_adj_of(obsess_book_cb *cb, long id)
+{
+   ob_dir_page *page;
+
+   if(id < 0)
+   {//Dead BFF list entry.
+      return NULL;
+   }
+   page = __atomic_load_n(&cb->user_dir[id >> OB_DIR_SHIFT],__ATOMIC_ACQUIRE);
+   if(page == NULL)
+   {
+      return NULL;
+   }
+   return __atomic_load_n(&page->adj[id & OB_DIR_MASK],__ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+ * Function:      ob_adj_slot
+ *
+ * Description:   Slot of the BFF list of a user in the directory.
+ *
+ * Notes:         For writers, the user has to be in the directory.  Publish a
+ *                new list with a release store into the slot.
+ *
+ *****************************************************************************/
+static inline ob_adj **ob_adj_slot(user *usr)
+{
+   return &usr->cb->user_dir[usr->user_ID >> OB_DIR_SHIFT]->
+              adj[usr->user_ID & OB_DIR_MASK];
+}
+
+/******************************************************************************
+ * Function:      ob_adj_get
+ *
+ * Description:   Load the BFF list of a user.
+ *
+ * Notes:         Read the count with ob_adj_count once and use it for the
+ *                whole walk of the list.  A NULL user has no BFFs.
+ *
+ *****************************************************************************/
+static inline ob_adj *ob_adj_get(user *usr)
+{
+   return usr == NULL ? NULL : ob_adj_of(usr->cb,usr->user_ID);
+}
+
+/******************************************************************************
+ * Function:      ob_adj_count
+ *
+ * Description:   Number of BFFs in a list loaded with ob_adj_get.
+ *
+ * Notes:         A NULL list has no BFFs.
+ *
+ *****************************************************************************/
+static inline int ob_adj_count(ob_adj *adj)
+{
+   return adj == NULL ? 0 : __atomic_load_n(&adj->count,__ATOMIC_ACQUIRE);
+}
+
+/******************************************************************************
+ * Function:      ob_adj_at
+ *
+ * Description:   Read entry i of a list loaded with ob_adj_get.
+ *
+ * Notes:         The entry is OB_ADJ_DEAD if the BFF was removed, skip it.
+ *
+ *****************************************************************************/
+static inline int ob_adj_at(ob_adj *adj, int i)
+{
+   return __atomic_load_n(&adj->bff[i],__ATOMIC_RELAXED);
+}
+
+/******************************************************************************
+ * Function:      ob_adj_live
+ *
+ * Description:   Number of BFFs in a list, packed ones included.
+ *
+ * Notes:         Only good for as long as the caller holds the write lock.
+ *
+ *****************************************************************************/
+static inline int ob_adj_live(ob_adj *adj)
+{
+   if(adj == NULL)
+   {
+      return 0;
+   }
+   return adj->count - adj->dead + (adj->pack ? adj->pack->count : 0);
+}
+
+/******************************************************************************
+ * Function:      ob_adj_begin
+ *
+ * Description:   Start a walk over the BFFs of a list loaded with ob_adj_get.
+ *
+ * Notes:         The packed BFFs come first, in user_ID order.
+ *
+ *****************************************************************************/
+static inline void ob_adj_begin(ob_adj_iter *it, ob_adj *adj)
+{
+   it->adj = adj;
+   it->n = ob_adj_count(adj);
+   it->block = 0;
+   it->cur = it->end = NULL;
+}
+
+/******************************************************************************
+ * Function:      ob_adj_next
+ *
+ * Description:   Get the next BFF of a walk.
+ *
+ * Notes:         Returns the user_ID, -1 once the walk is done.  Dead entries
+ *                are skipped.
+ *
+ *****************************************************************************/
+static inline int ob_adj_next(ob_adj_iter *it)
+{
+   int id;
+
+   for(;;)
+   {
+      while(it->cur < it->end)
+      {
+         id = __atomic_load_n(it->cur++,__ATOMIC_RELAXED);
+         if(id >= 0)
+         {
+            return id;
+         }
+      }
+      if(!ob_adj_fill(it))
+      {
+         return -1;
+      }
+   }
+}
+
+/******************************************************************************
+ * Function:      ob_name_hash
+ *
+ * Description:   Hash of a name, FNV-1a over its characters.
+ *
+ * Notes:         Kept in the bucket node so a lookup only compares the
+ *                characters of names with the same hash and length.
+ *
+ *****************************************************************************/
+static inline unsigned int ob_name_hash(const char *name, int len)
+{
+   unsigned int hash = 2166136261u;
+   int i;
+
+   for(i = 0; i < len; i++)
+   {
+      hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+   }
+   return hash;
+}
+
+/******************************************************************************
+ * Function:      ob_checksum
+ *
+ * Description:   Carry an FNV-1a checksum over some bytes.
+ *
+ * Notes:         Start with 2166136261, the journal and snapshot files check
+ *                what they read back with it.
+ *
+ *****************************************************************************/
+static inline unsigned int ob_checksum(unsigned int sum, const void *buf,
+                                       size_t len)
+{
+   const unsigned char *p = buf;
+   size_t i;
+
+   for(i = 0; i < len; i++)
+   {
+      sum = (sum ^ p[i]) * 16777619u;
+   }
+   return sum;
+}
+
+/******************************************************************************
+ * Function:      ob_put_varint
+ *
+ * Description:   Write a number 7 bits a byte, low bits first.
+ *
+ * Notes:         Returns the bytes written, at most 10.
+ *
+ *****************************************************************************/
+static inline int ob_put_varint(char *p, unsigned long v)
+{
+   int n = 0;
+
+   while(v >= 0x80)
+   {
+      p[n++] = (char)(v | 0x80);
+      v >>= 7;
+   }
+   p[n++] = (char)v;
+   return n;
+}
+
+/******************************************************************************
+ * Function:      ob_get_varint
+ *
+ * Description:   Read a number written by ob_put_varint.
+ *
+ * Notes:         Returns the byte after the number, NULL if it runs past end.
+ *
+ *****************************************************************************/
+static inline const unsigned char *ob_get_varint(const unsigned char *p,
+                                                 const unsigned char *end,
+                                                 unsigned long *v)
+{
+   unsigned long x = 0;
+   int shift;
+
+   for(shift = 0; p < end && shift < 64; shift += 7)
+   {
+      x |= (unsigned long)(*p & 0x7F) << shift;
+      if(!(*p++ & 0x80))
+      {
+         *v = x;
+         return p;
+      }
+   }
+   return NULL;
+}
+
+/******************************************************************************
+ * Function:      ob_bloom_mix
+ *
+ * Description:   Spread the bits of a name hash over 64 bits for the filter.
+ *
+ * Notes:         The high half picks the block, ob_bloom_bit the bits.
+ *
+ *****************************************************************************/
+static inline unsigned long long ob_bloom_mix(unsigned int hash)
+{
+   unsigned long long h = hash + 0x9E3779B97F4A7C15ULL;
+
+   h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   h = (h ^ (h >> 27)) * 0x94D049BB133111EBULL;
+   return h ^ (h >> 31);
+}
+
+/******************************************************************************
+ * Function:      ob_bloom_block
+ *
+ * Description:   Block of the filter a mixed hash falls in.
+ *
+ * Notes:         Multiply and shift instead of a modulo.
+ *
+ *****************************************************************************/
+static inline unsigned long ob_bloom_block(const ob_bloom *f,
+                                           unsigned long long h)
+{
+   return (unsigned long)(((h >> 32) * f->blocks) >> 32);
+}
+
+/******************************************************************************
+ * Function:      ob_bloom_bit
+ *
+ * Description:   Next bit of a name inside its block.
+ *
+ * Notes:         Every call multiplies the mixed hash again and takes the
+ *                top bits, so the bits of two names only match if the whole
+ *                64 bit hashes do.
+ *
+ *****************************************************************************/
+static inline unsigned int ob_bloom_bit(unsigned long long *h)
+{
+   *h *= 0xD6E8FEB86659FD93ULL;
+   return (unsigned int)(((*h >> 32) * OB_BLOOM_BITS) >> 32);
+}
+
+/******************************************************************************
+ * Function:      ob_bloom_maybe
+ *
+ * Description:   Check the name filter for a name.
+ *
+ * Notes:         Returns 0 if the name is surely not in the book.  Reads one
+ *                cache line of the filter.
+ *
+ *****************************************************************************/
+static inline int ob_bloom_maybe(obsess_book_cb *cb, unsigned int hash)
+{
+   const ob_bloom *f = __atomic_load_n(&cb->bloom,__ATOMIC_ACQUIRE);
+   const unsigned long long *block;
+   unsigned long long h = ob_bloom_mix(hash);
+   unsigned int bit;
+   int i;
+
+   block = f->bits + ob_bloom_block(f,h) * OB_BLOOM_WORDS;
+   for(i = 0; i < f->k; i++)
+   {
+      bit = ob_bloom_bit(&h);
+      if(!(__atomic_load_n(&block[bit / 64],__ATOMIC_RELAXED) &
+           (1ULL << (bit % 64))))
+      {
+         return 0;
+      }
+   }
+   return 1;
+}
+
+/******************************************************************************
+ * Function:      ob_user_name
+ *
+ * Description:   Name of a user.
+ *
+ * Notes:         The name is kept in the same arena block as the user, right
+ *                after its bucket node.
+ *
+ *****************************************************************************/
+static inline const char *ob_user_name(const user *usr)
+{
+   return (const char*)(usr->node + 1);
+}
+
+/******************************************************************************
+ * Function:      ob_user_handle
+ *
+ * Description:   Account handle of a user.
+ *
+ * Notes:         Shares the characters of the name when the two are the same.
+ *
+ *****************************************************************************/
+static inline const char *ob_user_handle(const user *usr)
+{
+   return ob_user_name(usr) + usr->handle_off;
+}
+
+/******************************************************************************
+ * Function:      ob_user_live
+ *
+ * Description:   Check that a user has not been deleted.
+ *
+ * Notes:         Only good for as long as the caller holds the write lock.
+ *
+ *****************************************************************************/
+static inline int ob_user_live(user *usr)
+{
+   return ob_user_at(usr->cb,usr->user_ID) == usr;
+}
+
+/******************************************************************************
+ * Function:      ob_snap_touch
+ *
+ * Description:   Save a user for the snapshot being taken before it changes.
+ *
+ * Notes:         Call before changing the user or its BFF list, holding the
+ *                write lock, or the bucket lock for a new user.  Costs a load
+ *                and a test unless a snapshot is still being copied.
+ *
+ *****************************************************************************/
+static inline void ob_snap_touch(obsess_book_cb *cb, long id)
+{
+   ob_snap *s = __atomic_load_n(&cb->snap,__ATOMIC_ACQUIRE);
+
+   if(s != NULL && id < s->users &&
+      __atomic_load_n(&s->state[id],__ATOMIC_ACQUIRE) != OB_SNAP_DONE)
+   {
+      ob_snap_save(s,id);
+   }
+}
+
+/******************************************************************************
+ * Function:      ob_tier_touch
+ *
+ * Description:   Count a use of a user for the cold tier.
+ *
+ * Notes:         Costs a load and a test unless the book has a cold tier.
+ *                Racing counts may be lost, the heat only has to be about
+ *                right.
+ *
+ *****************************************************************************/
+static inline void ob_tier_touch(user *usr)
+{
+   unsigned char *heat;
+   unsigned char h;
+
+   if(__atomic_load_n(&usr->cb->tier,__ATOMIC_RELAXED) == NULL)
+   {
+      return;
+   }
+   heat = &usr->cb->user_dir[usr->user_ID >> OB_DIR_SHIFT]->
+             heat[usr->user_ID & OB_DIR_MASK];
+   h = __atomic_load_n(heat,__ATOMIC_RELAXED);
+   if(h < 255)
+   {
+      __atomic_store_n(heat,(unsigned char)(h + 1),__ATOMIC_RELAXED);
+   }
+}
@@ -0,0 +1,679 @@
+/*****************************************************************************
+ *
+ *       obsess_book_loadgen.c
+ *
+ *   Description: Load generator for the obsess book server.  Opens a number
+ *                of connections, keeps a number of requests in flight on
+ *                each, and reports the requests per second and the
+ *                latencies.  First signs up users and makes them BFFs, then
+ *                sends a mix of lookups, DERPCONs, mutual BFFs and BFF
+ *                changes for a while.
+ *                Usage: obsess_book_loadgen [-s socket] [-c connections]
+ *                          [-d depth] [-n users] [-b bffs] [-r read percent]
+ *                          [-t seconds]
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:  4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+#include "obsess_book.h"
+#include "obsess_book_proto.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Most connections.
+#define LG_CONNS 256
+
+//Most requests in flight on a connection.
+#define LG_DEPTH 4096
+
+//Bytes of the longest request.
+#define LG_REQUEST 128
+
+//Bytes read at a time.
+#define LG_READ (64 * 1024)
+
+//Most names asked for by a mutual BFF request.
+#define LG_MUTUAL 16
+
+//Kinds of requests the latencies are kept for.
+#define LG_READS  0
+#define LG_WRITES 1
+#define LG_KINDS  2
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Bytes going in or out of a connection, [off, len) are not used up yet.
+typedef struct _lg_buf
+{
+   char  *data;
+   size_t off;
+   size_t len;
+   size_t cap;
+}lg_buf;
+
+//Request in flight.
+typedef struct _lg_sent
+{
+   double at;                 //Time it was queued.
+   int    kind;
+}lg_sent;
+
+//Connection to the server.
+typedef struct _lg_conn
+{
+   int     fd;
+   lg_buf  in;
+   lg_buf  out;
+   lg_sent sent[LG_DEPTH];    //Requests in flight, oldest at head.
+   int     head;
+   int     count;
+}lg_conn;
+
+//Latencies of a kind of request, in microseconds.
+typedef struct _lg_lat
+{
+   float *usec;
+   long   n;
+   long   cap;
+}lg_lat;
+//_____________________________________________________________________________
+//                                                                       Static
+static lg_conn *lg_conns;
+static lg_lat lg_lats[LG_KINDS];
+static long lg_errors;
+static int lg_n_conns = 8;
+static int lg_depth = 32;
+static long lg_users = 20000;
+static int lg_bffs = 5;
+static int lg_read_pct = 90;
+static unsigned int lg_seed = 4102013;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static double lg_now(void);
+static int lg_connect(const char *path);
+static double lg_phase(int ep, int phase, long count, double seconds);
+static int lg_request(char *buf, int phase, long i);
+static int lg_put_name(char *p, const char *name);
+static int lg_send(lg_conn *c);
+static int lg_recv(lg_conn *c);
+static void lg_record(int kind, double usec);
+static void lg_report(const char *label, long done, double seconds);
+static int lg_cmp(const void *a, const void *b);
+static char *lg_reserve(lg_buf *buf, size_t need);
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:     main
+ *
+ * Description:  entry point of the load generator.
+ *
+ * Params:       argv, argc - the options, see the usage above.
+ *
+ * Returns:      0 on success, 1 on error.
+ *
+ * Notes:        The users are named lg0 to lgN-1, a second run against the
+ *               same server finds them signed up already.
+ *
+ *****************************************************************************/
+int main(int argc, char *argv[])
+{
+   const char *path = OB_PROTO_SOCKET;
+   struct epoll_event ev;
+   double seconds = 5.0;
+   double took;
+   long done;
+   int ep;
+   int opt;
+   int i;
+
+   while((opt = getopt(argc,argv,"s:c:d:n:b:r:t:")) != -1)
+   {
+      switch(opt)
+      {
+      case 's':
+         path = optarg;
+         break;
+      case 'c':
+         lg_n_conns = atoi(optarg);
+         break;
+      case 'd':
+         lg_depth = atoi(optarg);
+         break;
+      case 'n':
+         lg_users = atol(optarg);
+         break;
+      case 'b':
+         lg_bffs = atoi(optarg);
+         break;
+      case 'r':
+         lg_read_pct = atoi(optarg);
+         break;
+      case 't':
+         seconds = atof(optarg);
+         break;
+      default:
+         lg_n_conns = 0;
+         break;
+      }
+   }
+   if(lg_n_conns < 1 || lg_n_conns > LG_CONNS || lg_depth < 1 ||
+      lg_depth > LG_DEPTH || lg_users < 2 || lg_bffs < 0 ||
+      lg_read_pct < 0 || lg_read_pct > 100 || seconds <= 0)
+   {
+      fprintf(stderr,"usage: %s [-s socket] [-c connections] [-d depth] "
+              "[-n users] [-b bffs] [-r read percent] [-t seconds]\n",argv[0]);
+      return 1;
+   }
+
+   ep = epoll_create1(0);
+   lg_conns = calloc(lg_n_conns,sizeof(lg_conn));
+   if(ep < 0 || lg_conns == NULL)
+   {
+      return 1;
+   }
+   for(i = 0; i < lg_n_conns; i++)
+   {
+      lg_conns[i].fd = lg_connect(path);
+      if(lg_conns[i].fd < 0)
+      {
+         fprintf(stderr,"cannot connect to %s\n",path);
+         return 1;
+      }
+      ev.events = EPOLLIN;
+      ev.data.ptr = &lg_conns[i];
+      epoll_ctl(ep,EPOLL_CTL_ADD,lg_conns[i].fd,&ev);
+   }
+
+   //Users first, the BFF pairs need both users there.
+   took = lg_phase(ep,OB_PROTO_NEW_USER,lg_users,0);
+   lg_report("sign up",lg_users,took);
+   took = lg_phase(ep,OB_PROTO_ADD_BFF,lg_users * lg_bffs,0);
+   lg_report("add BFFs",lg_users * lg_bffs,took);
+   took = lg_phase(ep,0,-1,seconds);
+   done = 0;
+   for(i = 0; i < LG_KINDS; i++)
+   {
+      done += lg_lats[i].n;
+   }
+   lg_report("mixed",done,took);
+
+   for(i = 0; i < lg_n_conns; i++)
+   {
+      close(lg_conns[i].fd);
+   }
+   return 0;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:     lg_now
+ *
+ * Description:  Wall clock in seconds.
+ *
+ * Params:       None.
+ *
+ * Returns:      double - seconds.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static double lg_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC,&ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/******************************************************************************
+ * Function:     lg_connect
+ *
+ * Description:  Connect to the server.
+ *
+ * Params:       const char *path - the socket of the server.
+ *
+ * Returns:      int - the connection, -1 on error.
+ *
+ * Notes:        The connection blocks, a connection never has more than its
+ *               depth of requests to write so the server always takes them.
+ *
+ *****************************************************************************/
+static int lg_connect(const char *path)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if(strlen(path) >= sizeof(addr.sun_path))
+   {
+      return -1;
+   }
+   fd = socket(AF_UNIX,SOCK_STREAM,0);
+   if(fd < 0)
+   {
+      return -1;
+   }
+   memset(&addr,0,sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path,path);
+   if(connect(fd,(struct sockaddr*)&addr,sizeof(addr)) != 0)
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/******************************************************************************
+ * Function:     lg_phase
+ *
+ * Description:  Keep every connection full of requests for a while.
+ *
+ * Params:       int ep - the epoll of the connections.
+ *               int phase - OB_PROTO_NEW_USER, OB_PROTO_ADD_BFF, or 0 for
+ *                           the mix.
+ *               long count - number of requests to send, -1 for no limit.
+ *               double seconds - time to send for, 0 for no limit.
+ *
+ * Returns:      double - seconds until the last reply came in.
+ *
+ * Notes:        The requests are written as a whole, the server reads what
+ *               it can of them, so a connection never holds more than its
+ *               depth in flight.
+ *
+ *****************************************************************************/
+static double lg_phase(int ep, int phase, long count, double seconds)
+{
+   struct epoll_event ev[LG_CONNS];
+   double start = lg_now();
+   double now;
+   long next = 0;
+   long flight = 0;
+   lg_conn *c;
+   char *p;
+   int more = 1;
+   int got;
+   int n;
+   int i;
+
+   while(more || flight > 0)
+   {
+      now = lg_now();
+      if((count >= 0 && next >= count) ||
+         (seconds > 0 && now - start >= seconds))
+      {
+         more = 0;
+      }
+      if(!more && flight == 0)
+      {
+         break;
+      }
+      for(i = 0; i < lg_n_conns; i++)
+      {
+         c = &lg_conns[i];
+         while(more && c->count < lg_depth && (count < 0 || next < count))
+         {
+            p = lg_reserve(&c->out,LG_REQUEST);
+            if(p == NULL)
+            {
+               exit(1);
+            }
+            c->out.len += lg_request(p,phase,next);
+            c->sent[(c->head + c->count) % LG_DEPTH].at = now;
+            c->sent[(c->head + c->count) % LG_DEPTH].kind =
+               p[OB_PROTO_HEAD] <= OB_PROTO_MUTUAL ? LG_READS : LG_WRITES;
+            c->count++;
+            flight++;
+            next++;
+         }
+         if(lg_send(c) != 0)
+         {
+            exit(1);
+         }
+      }
+
+      n = epoll_wait(ep,ev,LG_CONNS,-1);
+      for(i = 0; i < n; i++)
+      {
+         c = ev[i].data.ptr;
+         got = lg_recv(c);
+         if(got < 0)
+         {
+            fprintf(stderr,"server went away\n");
+            exit(1);
+         }
+         flight -= got;
+      }
+   }
+   return lg_now() - start;
+}
+
+/******************************************************************************
+ * Function:     lg_request
+ *
+ * Description:  Write a request.
+ *
+ * Params:       char *buf - room for LG_REQUEST bytes.
+ *               int phase - see lg_phase.
+ *               long i - number of the request in the phase.
+ *
+ * Returns:      int - bytes written.
+ *
+ * Notes:        Users and BFFs are picked at random, in the mix half the
+ *               changes add a BFF and half remove one.
+ *
+ *****************************************************************************/
+static int lg_request(char *buf, int phase, long i)
+{
+   char name[32];
+   char handle[64];
+   unsigned int len;
+   char *p = buf + OB_PROTO_HEAD;
+   int op = phase;
+   int r;
+
+   if(phase == 0)
+   {
+      r = rand_r(&lg_seed) % 100;
+      if(r < lg_read_pct)
+      {
+         r = rand_r(&lg_seed) % 5;
+         op = r < 2 ? OB_PROTO_FIND : r < 4 ? OB_PROTO_DERPCON : OB_PROTO_MUTUAL;
+      }
+      else
+      {
+         op = r % 2 ? OB_PROTO_ADD_BFF : OB_PROTO_REMOVE_BFF;
+      }
+   }
+   *p++ = (char)op;
+   switch(op)
+   {
+   case OB_PROTO_NEW_USER:
+      snprintf(name,sizeof(name),"lg%ld",i);
+      snprintf(handle,sizeof(handle),"%s@obsess_book_mail.com",name);
+      p += lg_put_name(p,name);
+      p += lg_put_name(p,handle);
+      break;
+   case OB_PROTO_FIND:
+      snprintf(name,sizeof(name),"lg%ld",rand_r(&lg_seed) % lg_users);
+      p += lg_put_name(p,name);
+      break;
+   default:
+      snprintf(name,sizeof(name),"lg%ld",
+               phase == OB_PROTO_ADD_BFF ? i / (lg_bffs ? lg_bffs : 1) :
+                                           rand_r(&lg_seed) % lg_users);
+      p += lg_put_name(p,name);
+      snprintf(name,sizeof(name),"lg%ld",rand_r(&lg_seed) % lg_users);
+      p += lg_put_name(p,name);
+      if(op == OB_PROTO_MUTUAL)
+      {
+         p[0] = LG_MUTUAL;
+         p[1] = 0;
+         p += 2;
+      }
+      break;
+   }
+
+   len = p - buf - sizeof(len);
+   memcpy(buf,&len,sizeof(len));
+   memcpy(buf + sizeof(len),&i,sizeof(unsigned int));
+   return p - buf;
+}
+
+/******************************************************************************
+ * Function:     lg_put_name
+ *
+ * Description:  Write a name of a request.
+ *
+ * Params:       char *p - where to write.
+ *               const char *name - the name.
+ *
+ * Returns:      int - bytes written.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static int lg_put_name(char *p, const char *name)
+{
+   int len = strlen(name);
+
+   p[0] = (char)(len & 0xff);
+   p[1] = (char)(len >> 8);
+   memcpy(p + 2,name,len);
+   return len + 2;
+}
+
+/******************************************************************************
+ * Function:     lg_send
+ *
+ * Description:  Write the requests queued on a connection.
+ *
+ * Params:       lg_conn *c - the connection.
+ *
+ * Returns:      int 0 - sent, non zero on an error.
+ *
+ * Notes:        Blocks until all of them are in the socket.
+ *
+ *****************************************************************************/
+static int lg_send(lg_conn *c)
+{
+   ssize_t put;
+
+   while(c->out.off < c->out.len)
+   {
+      put = send(c->fd,c->out.data + c->out.off,c->out.len - c->out.off,
+                 MSG_NOSIGNAL);
+      if(put < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      if(put <= 0)
+      {
+         return 1;
+      }
+      c->out.off += put;
+   }
+   c->out.off = c->out.len = 0;
+   return 0;
+}
+
+/******************************************************************************
+ * Function:     lg_recv
+ *
+ * Description:  Read the replies that came in on a connection.
+ *
+ * Params:       lg_conn *c - the connection.
+ *
+ * Returns:      int - number of replies, -1 if the server went away.
+ *
+ * Notes:        Each reply settles the oldest request in flight.
+ *
+ *****************************************************************************/
+static int lg_recv(lg_conn *c)
+{
+   unsigned int len;
+   ssize_t got;
+   double now;
+   lg_sent *s;
+   char *p;
+   int result;
+   int n = 0;
+
+   p = lg_reserve(&c->in,LG_READ);
+   if(p == NULL)
+   {
+      return -1;
+   }
+   got = read(c->fd,p,LG_READ);
+   if(got <= 0)
+   {
+      return got < 0 && errno == EINTR ? 0 : -1;
+   }
+   c->in.len += got;
+
+   now = lg_now();
+   while(c->in.len - c->in.off >= OB_PROTO_HEAD)
+   {
+      memcpy(&len,c->in.data + c->in.off,sizeof(len));
+      if(c->in.len - c->in.off < sizeof(len) + len)
+      {
+         break;
+      }
+      memcpy(&result,c->in.data + c->in.off + OB_PROTO_HEAD,sizeof(result));
+      c->in.off += sizeof(len) + len;
+      if(c->count == 0)
+      {
+         return -1;
+      }
+      s = &c->sent[c->head];
+      c->head = (c->head + 1) % LG_DEPTH;
+      c->count--;
+      lg_record(s->kind,(now - s->at) * 1e6);
+      lg_errors += result < 0;
+      n++;
+   }
+   memmove(c->in.data,c->in.data + c->in.off,c->in.len - c->in.off);
+   c->in.len -= c->in.off;
+   c->in.off = 0;
+   return n;
+}
+
+/******************************************************************************
+ * Function:     lg_record
+ *
+ * Description:  Keep the latency of a request.
+ *
+ * Params:       int kind - LG_READS or LG_WRITES.
+ *               double usec - the latency.
+ *
+ * Returns:      None.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static void lg_record(int kind, double usec)
+{
+   lg_lat *l = &lg_lats[kind];
+   float *grown;
+
+   if(l->n == l->cap)
+   {
+      grown = realloc(l->usec,sizeof(float) * (l->cap ? l->cap * 2 : 65536));
+      if(grown == NULL)
+      {
+         return;
+      }
+      l->usec = grown;
+      l->cap = l->cap ? l->cap * 2 : 65536;
+   }
+   l->usec[l->n++] = (float)usec;
+}
+
+/******************************************************************************
+ * Function:     lg_report
+ *
+ * Description:  Print the requests per second and the latencies of a phase.
+ *
+ * Params:       const char *label - name of the phase.
+ *               long done - requests of the phase.
+ *               double seconds - time the phase took.
+ *
+ * Returns:      None.
+ *
+ * Notes:        The latencies kept are dropped.
+ *
+ *****************************************************************************/
+static void lg_report(const char *label, long done, double seconds)
+{
+   static const char *kinds[LG_KINDS] = {"reads","writes"};
+   lg_lat *l;
+   int i;
+
+   printf("%-9s %9ld requests %8.3fs %10.0f/s  errors %ld\n",label,done,
+          seconds,done / seconds,lg_errors);
+   for(i = 0; i < LG_KINDS; i++)
+   {
+      l = &lg_lats[i];
+      if(l->n == 0)
+      {
+         continue;
+      }
+      qsort(l->usec,l->n,sizeof(float),lg_cmp);
+      printf("   %-6s usec p50 %8.1f p90 %8.1f p99 %8.1f p99.9 %8.1f "
+             "max %8.1f\n",kinds[i],l->usec[l->n / 2],
+             l->usec[l->n * 9 / 10],l->usec[l->n * 99 / 100],
+             l->usec[l->n * 999 / 1000],l->usec[l->n - 1]);
+      l->n = 0;
+   }
+   lg_errors = 0;
+}
+
+/******************************************************************************
+ * Function:     lg_cmp
+ *
+ * Description:  qsort compare of latencies.
+ *
+ * Params:       a, b - the latencies.
+ *
+ * Returns:      int - <0, 0, >0.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static int lg_cmp(const void *a, const void *b)
+{
+   float x = *(const float*)a;
+   float y = *(const float*)b;
+
+   return (x > y) - (x < y);
+}
+
+/******************************************************************************
+ * Function:     lg_reserve
+ *
+ * Description:  Make room at the end of a buffer.
+ *
+ * Params:       lg_buf *buf - the buffer.
+ *               size_t need - bytes needed.
+ *
+ * Returns:      char* - where to write, NULL if there is no memory.
+ *
+ * Notes:        The caller moves len past what it wrote.
+ *
+ *****************************************************************************/
+static char *lg_reserve(lg_buf *buf, size_t need)
+{
+   size_t cap;
+   char *grown;
+
+   if(buf->len + need > buf->cap)
+   {
+      for(cap = buf->cap ? buf->cap * 2 : LG_READ; cap < buf->len + need;
+          cap *= 2)
+      {
+      }
+      grown = realloc(buf->data,cap);
+      if(grown == NULL)
+      {
+         return NULL;
+      }
+      buf->data = grown;
+      buf->cap = cap;
+   }
+   return buf->data + buf->len;
+}
@@ -0,0 +1,51 @@
+/*****************************************************************************
+ *
+ *     obsess_book_proto.h
+ *
+ *   Description: Protocol of the obsess book server.  Clients talk to the
+ *                server over a Unix domain socket in frames, and may send
+ *                any number of requests before reading the replies.  The
+ *                replies of a connection come back in the order of its
+ *                requests.  Numbers are in the byte order of the machine.
+ *                Request:  u32 length of the rest, u32 tag, u8 op, fields.
+ *                Reply:    u32 length of the rest, u32 tag of the request,
+ *                          i32 result, names.
+ *                A name is a u16 length and its characters.  A negative
+ *                result is a user_ret_code error, naming a user that is not
+ *                in the book gives -USER_INVALID_PARAMER.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:        4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+//_____________________________________________________________________________
+//                                                                      Defines
+//Socket the server listens on unless told otherwise.
+#define OB_PROTO_SOCKET "/tmp/obsess_book.sock"
+
+//Ops of the requests, the fields follow the op.
+//Name -> 1 and the account handle, 0 if there is no such user.
+#define OB_PROTO_FIND       1
+//Name, name -> the DERPCON, max_derpcon of the server's book if they have no
+//link, same as DERPCON.
+#define OB_PROTO_DERPCON    2
+//Name, name, u16 most names -> number of mutual BFFs and their names.
+#define OB_PROTO_MUTUAL     3
+//Name, account handle -> user_ret_code.
+#define OB_PROTO_NEW_USER   4
+//Name, name -> user_ret_code.
+#define OB_PROTO_ADD_BFF    5
+//Name, name -> user_ret_code.
+#define OB_PROTO_REMOVE_BFF 6
+//Name -> user_ret_code.
+#define OB_PROTO_DELETE     7
+
+//Bytes of the length and tag that start every frame.
+#define OB_PROTO_HEAD 8
+
+//Most bytes of a frame after its length, longer ones drop the connection.
+#define OB_PROTO_FRAME_MAX (1 << 20)
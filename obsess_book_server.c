@@ -0,0 +1,981 @@
+/*****************************************************************************
+ *
+ *       obsess_book_server.c
+ *
+ *   Description: Query server for the obsess book.  One process owns the
+ *                book and serves lookups, DERPCONs, mutual BFFs and changes
+ *                to any number of clients over a Unix domain socket, see
+ *                obsess_book_proto.h.  An epoll loop reads whatever the
+ *                clients sent and runs all the complete requests as one
+ *                batch: the reads go to ob_query_batch together and run on
+ *                the threads of the book, the changes run one after the
+ *                other and share one journal sync.  The requests of each
+ *                connection keep their order, a read sent after a change
+ *                sees it.
+ *                Usage: obsess_book_server [-s socket] [-j journal]
+ *                                          [-r snapshot]
+ *                With a journal the book is recovered from the snapshot and
+ *                the journal at start, and a change is only answered once
+ *                it is on disk.  SIGUSR1 writes a snapshot, SIGINT or
+ *                SIGTERM stop the server.
+ *
+ *   Author: O'Ryan Anderson
+ *
+ *   Date:  4/10/2013
+ *
+ *****************************************************************************/
+
+//_____________________________________________________________________________
+//                                                                     Includes
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include "obsess_book.h"
+#include "obsess_book_proto.h"
+//_____________________________________________________________________________
+//                                                                      Defines
+//Most events taken from epoll at a time.
+#define SRV_EVENTS 256
+
+//Most requests run as one batch.
+#define SRV_BATCH 4096
+
+//Bytes read from a connection at a time.
+#define SRV_READ (64 * 1024)
+
+//Bytes of requests a connection may have waiting before it is not read.
+#define SRV_IN_MAX (4 << 20)
+
+//Bytes of replies a connection may have waiting before its requests are
+//left unread.
+#define SRV_OUT_MAX (4 << 20)
+
+//Most names in the reply of a mutual BFF request.
+#define SRV_MUTUAL_MAX 1024
+
+//Bytes of the result of a reply, after the length and tag.
+#define SRV_RESULT 4
+
+//Kinds of requests, the requests of a batch run in phases of one kind.
+#define SRV_READS  0
+#define SRV_WRITES 1
+//_____________________________________________________________________________
+//                                                                        Types
+
+//Bytes going in or out of a connection, [off, len) are not used up yet.
+typedef struct _srv_buf
+{
+   char  *data;
+   size_t off;
+   size_t len;
+   size_t cap;
+}srv_buf;
+
+//Connection of a client.
+typedef struct _srv_conn
+{
+   int       fd;
+   srv_buf   in;
+   srv_buf   out;
+   int       eof;             //Non zero once the client is done sending.
+   int       dead;            //Non zero once the connection is to be closed.
+   unsigned int events;       //Events epoll waits for.
+   int       phase;           //Phase of the last request in the batch.
+   int       listed;          //Non zero while on the list of connections.
+   struct _srv_conn *next;    //Next connection with requests to read.
+}srv_conn;
+
+//Request of a batch.
+typedef struct _srv_req
+{
+   srv_conn    *conn;
+   unsigned int tag;
+   int          op;
+   int          phase;
+   char        *a;            //Names, put in place in the input buffer.
+   char        *b;
+   int          most;         //Most names to return.
+   int          result;
+   long         out;          //First of the names to return in the batch.
+}srv_req;
+
+//Batch of requests.
+typedef struct _srv_batch
+{
+   srv_req      req[SRV_BATCH];
+   ob_query     q[SRV_BATCH];
+   const char **names;        //Names returned by the reads.
+   long         names_cap;
+   int          n;
+   int          phases;
+}srv_batch;
+//_____________________________________________________________________________
+//                                                                       Static
+static volatile sig_atomic_t srv_stop;
+static volatile sig_atomic_t srv_snap;
+static srv_batch srv_b;
+//_____________________________________________________________________________
+//                                                            Private Functions
+static void srv_signal(int sig);
+static int srv_listen(const char *path);
+static void srv_accept(int ep, int lfd);
+static void srv_read(srv_conn *c);
+static void srv_flush(int ep, srv_conn *c);
+static void srv_poll(int ep, srv_conn *c);
+static int srv_parse(srv_batch *b, srv_conn *c);
+static char *srv_name(char **p, char *end);
+static void srv_run(obsess_book_cb *cb, srv_batch *b);
+static int srv_write(obsess_book_cb *cb, srv_req *r);
+static void srv_reply(srv_req *r, const char **names, int n);
+static char *srv_reserve(srv_buf *buf, size_t need);
+static void srv_close(int ep, srv_conn *c);
+//_____________________________________________________________________________
+//                                                                      Globals
+static obsess_book_cb *cb;
+//_____________________________________________________________________________
+//                                                             Public Functions
+
+/******************************************************************************
+ * Function:     main
+ *
+ * Description:  entry point of the server.
+ *
+ * Params:       argv, argc - the options, see the usage above.
+ *
+ * Returns:      0 on success, 1 on error.
+ *
+ * Notes:        Algorithm:
+ *               Wait for events, read all that is there from every readable
+ *               connection, then run batches until no connection has a
+ *               complete request left, and write the replies out.  Clients
+ *               that send while a batch runs get into the next one, so the
+ *               busier the server the bigger the batches.
+ *
+ *****************************************************************************/
+int main(int argc, char *argv[])
+{
+   const char *path = OB_PROTO_SOCKET;
+   const char *journal = NULL;
+   const char *snapshot = NULL;
+   struct epoll_event ev[SRV_EVENTS];
+   struct sigaction sa;
+   sigset_t block;
+   sigset_t wait;
+   srv_conn *ready;
+   srv_conn *c;
+   srv_conn **link;
+   long recovered;
+   int lfd;
+   int ep;
+   int n;
+   int i;
+   int opt;
+
+   while((opt = getopt(argc,argv,"s:j:r:")) != -1)
+   {
+      switch(opt)
+      {
+      case 's':
+         path = optarg;
+         break;
+      case 'j':
+         journal = optarg;
+         break;
+      case 'r':
+         snapshot = optarg;
+         break;
+      default:
+         fprintf(stderr,"usage: %s [-s socket] [-j journal] [-r snapshot]\n",
+                 argv[0]);
+         return 1;
+      }
+   }
+
+   //The book prints what it does, a server has nobody to print it to.
+   if(freopen("/dev/null","w",stdout) == NULL)
+   {
+      return 1;
+   }
+   cb = ob_init();
+   if(cb == NULL)
+   {
+      return 1;
+   }
+   if(journal != NULL)
+   {
+      //No snapshot was written yet on the first start.
+      recovered = ob_recover(cb,snapshot != NULL && access(snapshot,F_OK) == 0 ?
+                                snapshot : NULL,journal);
+      if(recovered < 0 || ob_journal_open(cb,journal,0,0) != USER_SUCCESS)
+      {
+         fprintf(stderr,"cannot recover from %s\n",journal);
+         return 1;
+      }
+      fprintf(stderr,"replayed %ld journal records\n",recovered);
+   }
+
+   //The signals only get through while the loop waits.
+   memset(&sa,0,sizeof(sa));
+   sa.sa_handler = srv_signal;
+   sigaction(SIGINT,&sa,NULL);
+   sigaction(SIGTERM,&sa,NULL);
+   sigaction(SIGUSR1,&sa,NULL);
+   signal(SIGPIPE,SIG_IGN);
+   sigemptyset(&block);
+   sigaddset(&block,SIGINT);
+   sigaddset(&block,SIGTERM);
+   sigaddset(&block,SIGUSR1);
+   sigprocmask(SIG_BLOCK,&block,&wait);
+   sigdelset(&wait,SIGINT);
+   sigdelset(&wait,SIGTERM);
+   sigdelset(&wait,SIGUSR1);
+
+   lfd = srv_listen(path);
+   ep = epoll_create1(0);
+   if(lfd < 0 || ep < 0)
+   {
+      fprintf(stderr,"cannot listen on %s\n",path);
+      return 1;
+   }
+   ev[0].events = EPOLLIN;
+   ev[0].data.ptr = NULL;
+   epoll_ctl(ep,EPOLL_CTL_ADD,lfd,&ev[0]);
+
+   ready = NULL;
+   while(!srv_stop)
+   {
+      n = epoll_pwait(ep,ev,SRV_EVENTS,-1,&wait);
+      if(srv_snap && snapshot != NULL)
+      {
+         srv_snap = 0;
+         ob_snapshot_wait(cb);
+         ob_snapshot_start(cb,snapshot);
+      }
+      for(i = 0; i < n; i++)
+      {
+         c = ev[i].data.ptr;
+         if(c == NULL)
+         {
+            srv_accept(ep,lfd);
+            continue;
+         }
+         if(ev[i].events & EPOLLOUT)
+         {
+            srv_flush(ep,c);
+         }
+         if(ev[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+         {
+            srv_read(c);
+         }
+         if(!c->listed)
+         {
+            c->listed = 1;
+            c->next = ready;
+            ready = c;
+         }
+      }
+
+      //Batches until nobody has a complete request left.
+      do
+      {
+         srv_b.n = 0;
+         srv_b.phases = 0;
+         for(c = ready; c != NULL; c = c->next)
+         {
+            c->phase = -1;
+            if(!c->dead && c->out.len - c->out.off < SRV_OUT_MAX)
+            {
+               srv_parse(&srv_b,c);
+            }
+         }
+         srv_run(cb,&srv_b);
+      }while(srv_b.n == SRV_BATCH);
+
+      //Write the replies, drop the connections that are done.
+      link = &ready;
+      while((c = *link) != NULL)
+      {
+         memmove(c->in.data,c->in.data + c->in.off,c->in.len - c->in.off);
+         c->in.len -= c->in.off;
+         c->in.off = 0;
+         srv_flush(ep,c);
+         if(c->dead || (c->eof && c->out.len == c->out.off))
+         {
+            *link = c->next;
+            srv_close(ep,c);
+         }
+         else if(c->in.len >= OB_PROTO_HEAD && c->out.len - c->out.off <
+                                               SRV_OUT_MAX)
+         {//Still has requests, may be left over from a full batch.
+            link = &c->next;
+         }
+         else
+         {
+            *link = c->next;
+            c->listed = 0;
+         }
+      }
+   }
+
+   close(lfd);
+   unlink(path);
+   ob_exit(cb);
+   return 0;
+}
+
+//_____________________________________________________________________________
+//                                                            Private Functions
+
+/******************************************************************************
+ * Function:     srv_signal
+ *
+ * Description:  Note a signal for the loop.
+ *
+ * Params:       int sig - the signal.
+ *
+ * Returns:      None.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static void srv_signal(int sig)
+{
+   if(sig == SIGUSR1)
+   {
+      srv_snap = 1;
+   }
+   else
+   {
+      srv_stop = 1;
+   }
+}
+
+/******************************************************************************
+ * Function:     srv_listen
+ *
+ * Description:  Listen on a Unix domain socket.
+ *
+ * Params:       const char *path - the socket, replaced if it is there.
+ *
+ * Returns:      int - the socket, -1 on error.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static int srv_listen(const char *path)
+{
+   struct sockaddr_un addr;
+   int fd;
+
+   if(strlen(path) >= sizeof(addr.sun_path))
+   {
+      return -1;
+   }
+   fd = socket(AF_UNIX,SOCK_STREAM | SOCK_NONBLOCK,0);
+   if(fd < 0)
+   {
+      return -1;
+   }
+   memset(&addr,0,sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path,path);
+   unlink(path);
+   if(bind(fd,(struct sockaddr*)&addr,sizeof(addr)) != 0 ||
+      listen(fd,SOMAXCONN) != 0)
+   {
+      close(fd);
+      return -1;
+   }
+   return fd;
+}
+
+/******************************************************************************
+ * Function:     srv_accept
+ *
+ * Description:  Take every connection waiting.
+ *
+ * Params:       int ep - the epoll.
+ *               int lfd - the listening socket.
+ *
+ * Returns:      None.
+ *
+ * Notes:        Without memory for a connection it is closed.
+ *
+ *****************************************************************************/
+static void srv_accept(int ep, int lfd)
+{
+   struct epoll_event ev;
+   srv_conn *c;
+   int fd;
+
+   while((fd = accept(lfd,NULL,NULL)) >= 0)
+   {
+      c = calloc(1,sizeof(srv_conn));
+      if(c == NULL || fcntl(fd,F_SETFL,O_NONBLOCK) != 0)
+      {
+         free(c);
+         close(fd);
+         continue;
+      }
+      c->fd = fd;
+      c->events = EPOLLIN;
+      ev.events = EPOLLIN;
+      ev.data.ptr = c;
+      if(epoll_ctl(ep,EPOLL_CTL_ADD,fd,&ev) != 0)
+      {
+         close(fd);
+         free(c);
+      }
+   }
+}
+
+/******************************************************************************
+ * Function:     srv_read
+ *
+ * Description:  Read what a client sent.
+ *
+ * Params:       srv_conn *c - the connection.
+ *
+ * Returns:      None.
+ *
+ * Notes:        Reads until the socket is empty or the connection has
+ *               SRV_IN_MAX of requests, the rest waits for the next round.
+ *
+ *****************************************************************************/
+static void srv_read(srv_conn *c)
+{
+   ssize_t got;
+   char *p;
+
+   while(!c->eof && !c->dead && c->in.len < SRV_IN_MAX)
+   {
+      p = srv_reserve(&c->in,SRV_READ);
+      if(p == NULL)
+      {
+         c->dead = 1;
+         break;
+      }
+      got = read(c->fd,p,SRV_READ);
+      if(got > 0)
+      {
+         c->in.len += got;
+      }
+      else if(got == 0)
+      {
+         c->eof = 1;
+      }
+      else if(errno != EINTR)
+      {
+         c->dead = errno != EAGAIN && errno != EWOULDBLOCK;
+         break;
+      }
+   }
+}
+
+/******************************************************************************
+ * Function:     srv_flush
+ *
+ * Description:  Write the replies of a connection.
+ *
+ * Params:       int ep - the epoll.
+ *               srv_conn *c - the connection.
+ *
+ * Returns:      None.
+ *
+ * Notes:        What does not fit in the socket waits for epoll to say
+ *               there is room.
+ *
+ *****************************************************************************/
+static void srv_flush(int ep, srv_conn *c)
+{
+   ssize_t put;
+
+   while(!c->dead && c->out.off < c->out.len)
+   {
+      put = send(c->fd,c->out.data + c->out.off,c->out.len - c->out.off,
+                 MSG_NOSIGNAL);
+      if(put > 0)
+      {
+         c->out.off += put;
+      }
+      else if(put < 0 && errno == EINTR)
+      {
+         continue;
+      }
+      else
+      {
+         c->dead = put < 0 && errno != EAGAIN && errno != EWOULDBLOCK;
+         break;
+      }
+   }
+   if(c->out.off == c->out.len)
+   {
+      c->out.off = c->out.len = 0;
+   }
+   srv_poll(ep,c);
+}
+
+/******************************************************************************
+ * Function:     srv_poll
+ *
+ * Description:  Tell epoll what to wait for on a connection.
+ *
+ * Params:       int ep - the epoll.
+ *               srv_conn *c - the connection.
+ *
+ * Returns:      None.
+ *
+ * Notes:        A connection with too many replies waiting, or too many
+ *               requests waiting for them, is not read until they go out.
+ *
+ *****************************************************************************/
+static void srv_poll(int ep, srv_conn *c)
+{
+   struct epoll_event ev;
+   unsigned int events = 0;
+
+   if(!c->dead && !c->eof && c->in.len < SRV_IN_MAX &&
+      c->out.len - c->out.off < SRV_OUT_MAX)
+   {
+      events |= EPOLLIN;
+   }
+   if(!c->dead && c->out.off < c->out.len)
+   {
+      events |= EPOLLOUT;
+   }
+   if(events != c->events)
+   {
+      c->events = events;
+      ev.events = events;
+      ev.data.ptr = c;
+      epoll_ctl(ep,EPOLL_CTL_MOD,c->fd,&ev);
+   }
+}
+
+/******************************************************************************
+ * Function:     srv_parse
+ *
+ * Description:  Put the complete requests of a connection in the batch.
+ *
+ * Params:       srv_batch *b - the batch.
+ *               srv_conn *c - the connection.
+ *
+ * Returns:      int - number of requests put in.
+ *
+ * Notes:        The names are turned into strings where they are in the
+ *               input buffer, which is not touched until the batch is run.
+ *               Each request goes in the first phase of its kind that is not
+ *               before the last request of the connection, the reads in the
+ *               even phases and the writes in the odd ones.  A bad frame
+ *               drops the connection.
+ *
+ *****************************************************************************/
+static int srv_parse(srv_batch *b, srv_conn *c)
+{
+   unsigned int len;
+   srv_req *r;
+   char *p;
+   char *end;
+   int kind;
+   int put = 0;
+   int phase;
+
+   while(b->n < SRV_BATCH && c->in.len - c->in.off >= OB_PROTO_HEAD)
+   {
+      memcpy(&len,c->in.data + c->in.off,sizeof(len));
+      if(len < OB_PROTO_HEAD - sizeof(len) + 1 || len > OB_PROTO_FRAME_MAX)
+      {
+         c->dead = 1;
+         break;
+      }
+      if(c->in.len - c->in.off < sizeof(len) + len)
+      {
+         break;
+      }
+      p = c->in.data + c->in.off + sizeof(len);
+      end = p + len;
+      c->in.off += sizeof(len) + len;
+
+      r = &b->req[b->n];
+      memset(r,0,sizeof(srv_req));
+      r->conn = c;
+      memcpy(&r->tag,p,sizeof(r->tag));
+      p += sizeof(r->tag);
+      r->op = (unsigned char)*p++;
+      switch(r->op)
+      {
+      case OB_PROTO_FIND:
+      case OB_PROTO_DELETE:
+         r->a = srv_name(&p,end);
+         r->b = r->a;
+         break;
+      case OB_PROTO_MUTUAL:
+         r->a = srv_name(&p,end);
+         r->b = srv_name(&p,end);
+         if(p == NULL || end - p < 2)
+         {
+            p = NULL;
+            break;
+         }
+         r->most = (unsigned char)p[0] | (unsigned char)p[1] << 8;
+         p += 2;
+         if(r->most > SRV_MUTUAL_MAX)
+         {
+            r->most = SRV_MUTUAL_MAX;
+         }
+         break;
+      case OB_PROTO_DERPCON:
+      case OB_PROTO_NEW_USER:
+      case OB_PROTO_ADD_BFF:
+      case OB_PROTO_REMOVE_BFF:
+         r->a = srv_name(&p,end);
+         r->b = srv_name(&p,end);
+         break;
+      default:
+         p = NULL;
+         break;
+      }
+      if(p != end || r->a == NULL || r->b == NULL)
+      {
+         c->dead = 1;
+         break;
+      }
+
+      kind = r->op == OB_PROTO_FIND || r->op == OB_PROTO_DERPCON ||
+             r->op == OB_PROTO_MUTUAL ? SRV_READS : SRV_WRITES;
+      phase = c->phase < 0 ? kind : c->phase + ((c->phase & 1) != kind);
+      r->phase = c->phase = phase;
+      if(phase >= b->phases)
+      {
+         b->phases = phase + 1;
+      }
+      b->n++;
+      put++;
+   }
+   return put;
+}
+
+/******************************************************************************
+ * Function:     srv_name
+ *
+ * Description:  Turn the next name of a request into a string.
+ *
+ * Params:       char **p - where the name starts, moved past it, set to
+ *                          NULL if the request is short.
+ *               char *end - end of the request.
+ *
+ * Returns:      char* - the name, NULL if the request is short.
+ *
+ * Notes:        The characters are moved over the length so the string
+ *               ends where the length of the next field starts.
+ *
+ *****************************************************************************/
+static char *srv_name(char **p, char *end)
+{
+   char *name = *p;
+   int len;
+
+   if(name == NULL || end - name < 2)
+   {
+      *p = NULL;
+      return NULL;
+   }
+   len = (unsigned char)name[0] | (unsigned char)name[1] << 8;
+   if(end - name - 2 < len)
+   {
+      *p = NULL;
+      return NULL;
+   }
+   memmove(name,name + 2,len);
+   name[len] = '\0';
+   *p = name + 2 + len;
+   return name;
+}
+
+/******************************************************************************
+ * Function:     srv_run
+ *
+ * Description:  Run a batch and queue the replies.
+ *
+ * Params:       obsess_book_cb *cb - pointer to the obsess book control block.
+ *               srv_batch *b - the batch.
+ *
+ * Returns:      None.
+ *
+ * Notes:        The reads of a phase go to ob_query_batch as one batch, the
+ *               writes of a phase run in order and wait for the journal
+ *               once, after the last of them.
+ *
+ *****************************************************************************/
+static void srv_run(obsess_book_cb *cb, srv_batch *b)
+{
+   const char **grown;
+   user_ret_code rc;
+   srv_req *r;
+   long names;
+   long cap;
+   int phase;
+   int n;
+   int i;
+
+   //Room for the names the reads return.
+   names = 0;
+   for(i = 0; i < b->n; i++)
+   {
+      b->req[i].out = names;
+      names += b->req[i].op == OB_PROTO_MUTUAL ? b->req[i].most : 1;
+   }
+   if(names > b->names_cap)
+   {
+      for(cap = b->names_cap ? b->names_cap : 1024; cap < names; cap *= 2)
+      {
+      }
+      grown = realloc(b->names,sizeof(char*) * cap);
+      if(grown == NULL)
+      {//Drop every connection of the batch.
+         for(i = 0; i < b->n; i++)
+         {
+            b->req[i].conn->dead = 1;
+         }
+         return;
+      }
+      b->names = grown;
+      b->names_cap = cap;
+   }
+
+   for(phase = 0; phase < b->phases; phase++)
+   {
+      if(phase % 2 == SRV_READS)
+      {
+         n = 0;
+         for(i = 0; i < b->n; i++)
+         {
+            r = &b->req[i];
+            if(r->phase == phase)
+            {
+               b->q[n].op = r->op == OB_PROTO_FIND ? OB_QUERY_FIND :
+                            r->op == OB_PROTO_DERPCON ? OB_QUERY_DERPCON :
+                                                        OB_QUERY_MUTUAL;
+               b->q[n].x = r->a;
+               b->q[n].y = r->op == OB_PROTO_FIND ? NULL : r->b;
+               b->q[n].out = b->names + r->out;
+               b->q[n].max_len = r->op == OB_PROTO_MUTUAL ? r->most : 1;
+               b->q[n].result = 0;
+               n++;
+            }
+         }
+         rc = ob_query_batch(cb,b->q,n);
+         n = 0;
+         for(i = 0; i < b->n; i++)
+         {
+            r = &b->req[i];
+            if(r->phase == phase)
+            {
+               r->result = rc == USER_SUCCESS ? b->q[n].result : rc;
+               srv_reply(r,b->names + r->out,
+                         r->op == OB_PROTO_DERPCON || r->result <= 0 ? 0 :
+                         r->result < b->q[n].max_len ? r->result :
+                                                       b->q[n].max_len);
+               n++;
+            }
+         }
+      }
+      else
+      {
+         for(i = 0; i < b->n; i++)
+         {
+            r = &b->req[i];
+            if(r->phase == phase)
+            {
+               r->result = srv_write(cb,r);
+            }
+         }
+
+         //One sync for all the changes of the phase.
+         rc = ob_journal_sync(cb);
+         for(i = 0; i < b->n; i++)
+         {
+            r = &b->req[i];
+            if(r->phase == phase)
+            {
+               if(rc != USER_SUCCESS && r->result == USER_SUCCESS)
+               {
+                  r->result = rc;
+               }
+               srv_reply(r,NULL,0);
+            }
+         }
+      }
+   }
+}
+
+/******************************************************************************
+ * Function:     srv_write
+ *
+ * Description:  Make the change a request asks for.
+ *
+ * Params:       obsess_book_cb *cb - pointer to the obsess book control block.
+ *               srv_req *r - the request.
+ *
+ * Returns:      int - user_ret_code of the change.
+ *
+ * Notes:        Only this thread changes the book, so a name looked up is
+ *               still there when it is used.  A name that is taken is
+ *               refused.
+ *
+ *****************************************************************************/
+static int srv_write(obsess_book_cb *cb, srv_req *r)
+{
+   user *x;
+   user *y = NULL;
+
+   x = ob_find_user(cb,r->a);
+   if(r->op == OB_PROTO_NEW_USER)
+   {
+      if(x != NULL || ob_new_user(cb,r->a,r->b) == NULL)
+      {
+         return -USER_INVALID_PARAMER;
+      }
+      return USER_SUCCESS;
+   }
+   if(x == NULL)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   if(r->op == OB_PROTO_DELETE)
+   {
+      return ob_delete_user(x);
+   }
+   y = ob_find_user(cb,r->b);
+   if(y == NULL || y == x)
+   {
+      return -USER_INVALID_PARAMER;
+   }
+   if(r->op == OB_PROTO_ADD_BFF)
+   {
+      return ob_add_BFF(x,y);
+   }
+   return ob_remove_BFF(x,y);
+}
+
+/******************************************************************************
+ * Function:     srv_reply
+ *
+ * Description:  Queue the reply of a request.
+ *
+ * Params:       srv_req *r - the request, with its result.
+ *               const char **names - names to return.
+ *               int n - number of names.
+ *
+ * Returns:      None.
+ *
+ * Notes:        Names that would make the reply longer than a frame are
+ *               left off.  Without memory the connection is dropped.
+ *
+ *****************************************************************************/
+static void srv_reply(srv_req *r, const char **names, int n)
+{
+   srv_conn *c = r->conn;
+   unsigned int len = sizeof(r->tag) + SRV_RESULT;
+   size_t name;
+   char *p;
+   int i;
+
+   if(c->dead)
+   {
+      return;
+   }
+   for(i = 0; i < n; i++)
+   {
+      name = strlen(names[i]);
+      if(len + 2 + name > OB_PROTO_FRAME_MAX)
+      {
+         n = i;
+         break;
+      }
+      len += 2 + name;
+   }
+   p = srv_reserve(&c->out,sizeof(len) + len);
+   if(p == NULL)
+   {
+      c->dead = 1;
+      return;
+   }
+   memcpy(p,&len,sizeof(len));
+   memcpy(p + sizeof(len),&r->tag,sizeof(r->tag));
+   memcpy(p + sizeof(len) + sizeof(r->tag),&r->result,SRV_RESULT);
+   p += sizeof(len) + sizeof(r->tag) + SRV_RESULT;
+   for(i = 0; i < n; i++)
+   {
+      name = strlen(names[i]);
+      p[0] = (char)(name & 0xff);
+      p[1] = (char)(name >> 8);
+      memcpy(p + 2,names[i],name);
+      p += 2 + name;
+   }
+   c->out.len += sizeof(len) + len;
+}
+
+/******************************************************************************
+ * Function:     srv_reserve
+ *
+ * Description:  Make room at the end of a buffer.
+ *
+ * Params:       srv_buf *buf - the buffer.
+ *               size_t need - bytes needed.
+ *
+ * Returns:      char* - where to write, NULL if there is no memory.
+ *
+ * Notes:        The caller moves len past what it wrote.
+ *
+ *****************************************************************************/
+static char *srv_reserve(srv_buf *buf, size_t need)
+{
+   size_t cap;
+   char *grown;
+
+   if(buf->len + need > buf->cap)
+   {
+      for(cap = buf->cap ? buf->cap * 2 : SRV_READ; cap < buf->len + need;
+          cap *= 2)
+      {
+      }
+      grown = realloc(buf->data,cap);
+      if(grown == NULL)
+      {
+         return NULL;
+      }
+      buf->data = grown;
+      buf->cap = cap;
+   }
+   return buf->data + buf->len;
+}
+
+/******************************************************************************
+ * Function:     srv_close
+ *
+ * Description:  Close a connection.
+ *
+ * Params:       int ep - the epoll.
+ *               srv_conn *c - the connection.
+ *
+ * Returns:      None.
+ *
+ * Notes:        None.
+ *
+ *****************************************************************************/
+static void srv_close(int ep, srv_conn *c)
+{
+   epoll_ctl(ep,EPOLL_CTL_DEL,c->fd,NULL);
+   close(c->fd);
+   free(c->in.data);
+   free(c->out.data);
+   free(c);
+}